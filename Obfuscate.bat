@@ -8,15 +8,15 @@ set SourceMinifier=.\tools\SourceMinifier\SourceMinifier\bin\SourceMinifier
 
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\fluid_depth_smoothing.fs   .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\fluid_final_render.fs      .\src\code_resource.inc
-%SourceMinifier%   SwapSet.txt   .\assets\shaders\grid_build.cms             .\src\code_resource.inc
-%SourceMinifier%   SwapSet.txt   .\assets\shaders\grid_chain_reset.cms       .\src\code_resource.inc
-%SourceMinifier%   SwapSet.txt   .\assets\shaders\grid_reset.cms             .\src\code_resource.inc
+%SourceMinifier%   SwapSet.txt   .\assets\shaders\fluid_smooth_filter.fs     .\src\code_resource.inc
+%SourceMinifier%   SwapSet.txt   .\assets\shaders\fluid_upsample.fs          .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\particles.vs               .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\particles_color.fs         .\src\code_resource.inc
+%SourceMinifier%   SwapSet.txt   .\assets\shaders\particles_cull.cms         .\src\code_resource.inc
+%SourceMinifier%   SwapSet.txt   .\assets\shaders\particles_thickness.fs     .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\standard.vs                .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\standard_color.fs          .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\shaders\standard_copy.fs           .\src\code_resource.inc
-%SourceMinifier%   SwapSet.txt   .\assets\shaders\vis_scan.cms               .\src\code_resource.inc
 
 %SourceMinifier%   SwapSet.txt   .\assets\kernels\hesp.hpp                   .\src\code_resource.inc
 %SourceMinifier%   SwapSet.txt   .\assets\kernels\parameters.hpp             .\src\code_resource.inc
@@ -0,0 +1,110 @@
+#ifndef __OPENCL_VERSION__
+    #pragma once
+#endif
+
+#define MAX_PARTICLE_BLOCKS 8
+
+// Initial fluid block (lattice of particles, filled along y, then x, then z)
+struct ParticleBlock
+{
+    float         originX;
+    float         originY;
+    float         originZ;
+    unsigned int  sizeX;    // Particles per axis
+    unsigned int  sizeY;
+    unsigned int  sizeZ;
+    unsigned int  count;    // Particles in the block (the last layer might be partial)
+    float         jitter;   // Random offset amplitude [spacing]
+};
+
+// Host and kernels layout (kernels take it as "__constant struct Parameters *Params": with ENABLE_RUNTIME_PARAMS the
+// utilities.cl macros MAX_PARTICLES_COUNT, GRID_BUF_SIZE... read "Params->", so the argument must keep that name).
+// Fields before the Enable* bools are 4 bytes wide (no padding, see ClassifyParameterChanges).
+struct Parameters
+{
+    // Runner related
+    int  resetSimOnChange;
+
+    // Scene related
+    unsigned int  particleCount;    // Particles created on reset
+    unsigned int  particleCapacity; // Particles buffers size (live particles never exceed it)
+    float xMin;
+    float xMax;
+    float yMin;
+    float yMax;
+    float zMin;
+    float zMax;
+
+    float waveGenAmp;
+    float waveGenFreq;
+    float waveGenDuty;
+
+    // Emitter (layers of emitterSize x emitterSize particles, disabled if 0), sink box (disabled if empty) and
+    // domain exit (particles leaving the xMin..zMax domain are killed if killOutsideDomain is set)
+    unsigned int emitterSize;
+    float emitterX;
+    float emitterY;
+    float emitterZ;
+    float emitterVelX;
+    float emitterVelY;
+    float emitterVelZ;
+    float sinkXMin;
+    float sinkXMax;
+    float sinkYMin;
+    float sinkYMax;
+    float sinkZMin;
+    float sinkZMax;
+    unsigned int killOutsideDomain;
+
+    // Initial fluid blocks (computed from the "FluidBlock" lines, particleCount is their total)
+    unsigned int         blocksCount;
+    struct ParticleBlock blocks[MAX_PARTICLE_BLOCKS];
+
+    // Simulation consts
+    float timeStep;
+    unsigned int   simIterations;
+    unsigned int   subSteps;
+    float h;
+    float restDensity;
+    float epsilon;
+    float garvity;
+    float vorticityFactor;
+    float viscosityFactor;
+    float surfaceTenstionK;
+    float surfaceTenstionDist;
+
+    // Grid and friends list
+    unsigned int  friendsCircles;
+    unsigned int  particlesPerCircle;
+    unsigned int  gridBufSize;
+    unsigned int  cellCurve;            // Cells order (SFC_MORTON, SFC_HILBERT)
+    unsigned int  cellCurveGranularity; // log2 of the curve block size [cells per axis]
+
+    // Setup related
+    float setupSpacing;
+
+    // Sorting
+    unsigned int segmentSize;
+    unsigned int sortIterations;
+
+    // Boundary related
+    float sdfCellSize;
+
+    // Rendering related
+    float particleRenderSize;
+    float fluidRenderScale;   // Fraction of the frame size the fluid surface is smoothed at
+
+    // Computed fields
+    float h_2;
+    float poly6Factor;
+    float gradSpikyFactor;
+
+    // Kernel setup related
+    bool EnableCachedBuffers;
+    bool EnableRuntimeParams;
+    bool EnableSDFBoundary;
+    bool EnableKernelLogging;
+    bool EnableAutotune;
+    bool EnableCellBinning;
+    bool EnableStableBinning;
+};
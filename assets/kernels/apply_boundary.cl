@@ -0,0 +1,31 @@
+__constant sampler_t sdfSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR;
+
+__kernel void applyBoundary(__constant struct Parameters *Params,
+                            const __global float4 *positions,
+                            cbufferf_readonly imgPredictedSrc,
+                            cbufferf_writeonly imgPredictedDst,
+                            __read_only image3d_t boundarySDF, // xyz=gradient, w=signed distance
+                            const float4 sdfOrigin,            // xyz=origin, w=1/cell size
+                            const uint N)
+{
+    const uint i = get_global_id(0);
+    if (i >= N) return;
+
+    float4 predicted = cbufferf_read(imgPredictedSrc, i);
+
+    // Trilinear fetch (voxel centers are at texel coordinate + 0.5)
+    const float4 coord = (float4)((predicted.xyz - sdfOrigin.xyz) * sdfOrigin.w + 0.5f, 0.0f);
+    const float4 sdf   = read_imagef(boundarySDF, sdfSampler, coord);
+    const float3 norm  = normalize(sdf.xyz);
+
+    // Compute edge offset (same as the force plane quads)
+    float3 noisePos = predicted.xyz * 5 / Params->h;
+    float edgeOffset = 1.0+(3 + sin(noisePos.x)+sin(noisePos.y)+sin(noisePos.z)) * Params->h * 0.03f;
+
+    // Check predicted is within force zone (thin walls: particles far behind the surface are left alone)
+    const float normal_velocity = dot(norm, positions[i].xyz - predicted.xyz);
+    if ((sdf.w < edgeOffset) && (-sdf.w <= normal_velocity))
+        predicted.xyz += norm * (edgeOffset - sdf.w);
+
+    cbufferf_write(imgPredictedDst, i, predicted);
+}
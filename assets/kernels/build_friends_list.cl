@@ -47,7 +47,7 @@ __kernel void buildFriendsList(__constant struct Parameters *Params,
         {
             for (int z = -1; z <= 1; ++z)
             {
-                uint cell_index = calcGridHash(current_cell + (int3)(x, y, z));
+                uint cell_index = calcGridHash(current_cell + (int3)(x, y, z), GRID_BUF_SIZE);
 
                 // find first and last particle in this cell
                 uint2 cell_boundary = (uint2)(cells[cell_index*2+0], cells[cell_index*2+1]);
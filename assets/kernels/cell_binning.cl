@@ -0,0 +1,223 @@
+// Counting sort of the particles by cell (alternative to radix sort + updateCells)
+//   1. countCells:      cell key per particle and its rank inside the cell (atomic), live/dead counters
+//   2. scanCells*:      exclusive prefix sum of the cell counts => cell starts (cellsCount + 1 entries)
+//   3. scatterCells:    permutation, sorted keys and cells start/end pairs
+//   4. stabilizeCells:  (optional) order each cell by the original particle index
+
+#define BINNING_DEAD_KEY (2147483647 - 1)
+
+__kernel void countCells(__constant struct Parameters *Params,
+                         cbufferf_readonly imgPositions,
+                         __global int *keys,
+                         __global uint *ranks,
+                         volatile __global uint *cellCounts,
+                         volatile __global uint *liveCount, // [0]=live, [1]=dead
+                         const uint N)
+{
+    const uint i = get_global_id(0);
+    if (i >= N) return;
+
+    // Sink box and domain exit kill particles (see isParticleAlive)
+    float3 position = cbufferf_read(imgPositions, i).xyz;
+    const bool alive = isParticleAlive(Params, position);
+
+    if (alive)
+    {
+        int3 current_cell = convert_int3(position / Params->h);
+        const uint key = calcGridHash(current_cell, GRID_BUF_SIZE);
+        keys[i]  = key;
+        ranks[i] = atomic_inc(&cellCounts[key]);
+        atomic_inc(&liveCount[0]);
+    }
+    else
+    {
+        // Killed particles are placed after the live ones
+        keys[i]  = BINNING_DEAD_KEY;
+        ranks[i] = atomic_inc(&liveCount[1]);
+    }
+}
+
+// Exclusive scan of 2 * local size values per work-group (Blelloch 1990), block totals go to blockSums
+__kernel void scanCellsBlocks(__global uint *data,
+                              __global uint *blockSums,
+                              __local uint *temp)
+{
+    const int it = get_local_id(0);
+    const int ig = get_global_id(0);
+    const int n  = get_local_size(0) * 2;
+    int decale = 1;
+
+    // load input into local memory
+    temp[2 * it]     = data[2 * ig];
+    temp[2 * it + 1] = data[2 * ig + 1];
+
+    // up sweep phase
+    for (int d = n >> 1; d > 0; d >>= 1)
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (it < d)
+        {
+            int ai = decale * (2 * it + 1) - 1;
+            int bi = decale * (2 * it + 2) - 1;
+            temp[bi] += temp[ai];
+        }
+        decale *= 2;
+    }
+
+    // store the block total and clear the last element
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (it == 0)
+    {
+        blockSums[get_group_id(0)] = temp[n - 1];
+        temp[n - 1] = 0;
+    }
+
+    // down sweep phase
+    for (int d = 1; d < n; d *= 2)
+    {
+        decale >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (it < d)
+        {
+            int ai = decale * (2 * it + 1) - 1;
+            int bi = decale * (2 * it + 2) - 1;
+            uint t = temp[ai];
+            temp[ai] = temp[bi];
+            temp[bi] += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // write results to device memory
+    data[2 * ig]     = temp[2 * it];
+    data[2 * ig + 1] = temp[2 * it + 1];
+}
+
+// Exclusive scan of the block totals by a single work-group (chunks of 2 * local size carry the running sum)
+__kernel void scanCellsSums(__global uint *blockSums,
+                            __local uint *temp,
+                            const uint blocksCount)
+{
+    const int it = get_local_id(0);
+    const int n  = get_local_size(0) * 2;
+    uint carry = 0;
+
+    for (uint base = 0; base < blocksCount; base += n)
+    {
+        // load chunk (zero padded)
+        temp[2 * it]     = (base + 2 * it     < blocksCount) ? blockSums[base + 2 * it]     : 0;
+        temp[2 * it + 1] = (base + 2 * it + 1 < blocksCount) ? blockSums[base + 2 * it + 1] : 0;
+
+        // up sweep phase
+        int decale = 1;
+        for (int d = n >> 1; d > 0; d >>= 1)
+        {
+            barrier(CLK_LOCAL_MEM_FENCE);
+            if (it < d)
+            {
+                int ai = decale * (2 * it + 1) - 1;
+                int bi = decale * (2 * it + 2) - 1;
+                temp[bi] += temp[ai];
+            }
+            decale *= 2;
+        }
+
+        // chunk total (read by all items before it is cleared)
+        barrier(CLK_LOCAL_MEM_FENCE);
+        const uint total = temp[n - 1];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (it == 0)
+            temp[n - 1] = 0;
+
+        // down sweep phase
+        for (int d = 1; d < n; d *= 2)
+        {
+            decale >>= 1;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            if (it < d)
+            {
+                int ai = decale * (2 * it + 1) - 1;
+                int bi = decale * (2 * it + 2) - 1;
+                uint t = temp[ai];
+                temp[ai] = temp[bi];
+                temp[bi] += t;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // write back with the previous chunks total
+        if (base + 2 * it     < blocksCount) blockSums[base + 2 * it]     = temp[2 * it]     + carry;
+        if (base + 2 * it + 1 < blocksCount) blockSums[base + 2 * it + 1] = temp[2 * it + 1] + carry;
+        carry += total;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Add the scanned block totals (each work item updates two values)
+__kernel void addCellsOffsets(__global uint *data,
+                              const __global uint *blockSums)
+{
+    const int ig = get_global_id(0);
+    const uint s = blockSums[get_group_id(0)];
+
+    data[2 * ig]     += s;
+    data[2 * ig + 1] += s;
+}
+
+__kernel void scatterCells(const __global int *keys,
+                           const __global uint *ranks,
+                           const __global uint *cellStarts,
+                           const __global uint *liveCount,
+                           __global int *sortedKeys,
+                           __global int *permutation,
+                           __global uint *cells,
+                           const uint N)
+{
+    const uint i = get_global_id(0);
+    if (i >= N) return;
+
+    const int key = keys[i];
+    uint dst;
+    if (key == BINNING_DEAD_KEY)
+    {
+        dst = liveCount[0] + ranks[i];
+    }
+    else
+    {
+        const uint start = cellStarts[key];
+        dst = start + ranks[i];
+
+        // First particle of the cell writes the cell boundaries
+        if (ranks[i] == 0)
+        {
+            cells[key * 2 + 0] = start;
+            cells[key * 2 + 1] = cellStarts[key + 1] - 1;
+        }
+    }
+
+    sortedKeys[dst]  = key;
+    permutation[dst] = i;
+}
+
+__kernel void stabilizeCells(const __global uint *cellStarts,
+                             __global int *permutation,
+                             const uint cellsCount)
+{
+    const uint c = get_global_id(0);
+    if (c >= cellsCount) return;
+
+    // Insertion sort by original index (cells hold a few particles)
+    const uint start = cellStarts[c];
+    const uint end   = cellStarts[c + 1];
+    for (uint a = start + 1; a < end; a++)
+    {
+        const int value = permutation[a];
+        uint b = a;
+        while ((b > start) && (permutation[b - 1] > value))
+        {
+            permutation[b] = permutation[b - 1];
+            b--;
+        }
+        permutation[b] = value;
+    }
+}
@@ -1,54 +1,68 @@
-float3 BouncePointQuad(/*volatile __global int *debugBuf, */float3 PrevPos, float3 NextPos, float3 B, float3 E0, float3 E1, __read_only image2d_t surfacesMask, int maskYOffset, int maskHeight, float EdgeOffset)
+float3 BouncePointQuad(float3 PrevPos, float3 NextPos, const __global float4 *collider, const __global uint *surfacesMask, float EdgeOffset)
 {
-    // Quad Precalc
-    const float a = dot(E0, E0); 
-    const float b = dot(E0, E1); 
-    const float c = dot(E1, E1); 
-    const float invdet = 1.0 / (a * c - b * b);    
-    const float3 planeNorm  = normalize(cross(E0, E1)); 
+    // Quad Precalc (done on host, see Simulation::LoadColliders)
+    const float3 B         = collider[0].xyz;
+    const float  invdet    = collider[0].w;
+    const float3 E0        = collider[1].xyz;
+    const float  a         = collider[1].w;
+    const float3 E1        = collider[2].xyz;
+    const float  c         = collider[2].w;
+    const float3 planeNorm = collider[3].xyz;
+    const float  b         = collider[3].w;
     const float3 randOffset = planeNorm * EdgeOffset;
 
-    // Compute factors
-    const float3 D = B - NextPos;
+    // Signed distances to the offset plane (positive on the fluid side)
+    const float prevDist = dot(planeNorm, PrevPos - (B + randOffset));
+    const float nextDist = dot(planeNorm, NextPos - (B + randOffset));
+
+    // Check NextPos if cull (should be "inside")
+    if (nextDist > 0)
+        return NextPos;
+
+    // Crossed the plane during this step (segment parameter in [0, 1]), or within the fixed thickness force zone
+    float3 hitPos = NextPos;
+    if (prevDist >= 0)
+        hitPos = PrevPos + (NextPos - PrevPos) * (prevDist / max(prevDist - nextDist, 1e-12f));
+    else if (-nextDist > EdgeOffset)
+        return NextPos;
+
+    // Compute factors (of the point where the plane is reached)
+    const float3 D = B - hitPos;
     const float e = dot(E1, D);
     const float d = dot(E0, D);
 
-    // Check if NextPos is in quad
+    // Check if the hit point is in quad
     const float s = invdet * (b * e - c * d);
     const float t = invdet * (b * d - a * e);
     if ((s < 0) || (s > 1) || (t < 0) || (t > 1) /*|| (s + t > 1)*/)
         return NextPos;
 
-    // Check NextPos if cull (should be "inside")
-    const float3 planePos = B + E0 * s + E1 * t + randOffset;
-    const float3 deltaP   = NextPos - planePos;
-    if (dot(planeNorm, deltaP) > 0)
+    // Check against mask (quad region: rows [maskYOffset, maskYOffset + maskHeight), maskWidth texels each)
+    const int  maskWidth = (int)collider[4].z;
+    const int2 coord = (int2)(min((int)(t * maskWidth), maskWidth - 1), (int)collider[4].x + min((int)(s * collider[4].y), (int)collider[4].y - 1));
+    const uint bit   = coord.y * maskWidth + coord.x;
+    if ((surfacesMask[bit >> 5] & (1u << (bit & 31))) == 0)
         return NextPos;
 
-    // Check NextPos thickness (should be within force zone)
-    float normal_velocity = dot(planeNorm, PrevPos - NextPos);
-    if (length(deltaP) > EdgeOffset + normal_velocity)
-        return NextPos;
-        
-    // Check against mask
-    const int2 coord = (int2)(t * 512.0, maskYOffset + s * maskHeight);
-    const int4 mask = read_imagei(surfacesMask, simpleSampler, coord);
-    //logPrintf4(debugBuf, TextToID(Data=), mask.x, mask.y, mask.z, mask.w); 
-    if (mask.x == 0)
-        return NextPos;
-        
-    // Move point surface
-    return planePos;
+    // Move point to the surface (NextPos projected on the offset plane, the tangential motion is kept)
+    return NextPos - planeNorm * nextDist;
 }
 
 __kernel void computeDelta(__constant struct Parameters *Params,
+#ifdef ENABLE_LOGGING
                            volatile __global int *debugBuf,
+#endif
                            __global float4 *delta,
                            const __global float4 *positions,
                            cbufferf_readonly imgPredicted, // xyz=predicted, w=scaling
                            const __global int *friends_list,
                            const float wave_generator,
-                           __read_only image2d_t surfacesMask,
+                           const __global uint *surfacesMask,
+                           const __global float4 *colliders,
+                           const __global uint2 *collidersCells,
+                           const __global uint *collidersIndex,
+                           const float4 collidersGridMin, // xyz=grid origin, w=1/cell size
+                           const int4 collidersGridRes,
                            const int N)
 {
     const int i = get_global_id(0);
@@ -161,25 +175,25 @@ __kernel void computeDelta(__constant struct Parameters *Params,
     float3 delta_p = (-GRAD_SPIKY_FACTOR*sum) / Params->restDensity;
     float3 future = particle_i.xyz + delta_p;
 
+#ifndef ENABLE_SDF_BOUNDARY
     // Compute edge offset
     float3 noisePos = future * 5 / Params->h;
     float edgeOffset = 1.0+(3 + sin(noisePos.x)+sin(noisePos.y)+sin(noisePos.z)) * Params->h * 0.03f;
 
-    // Force plats (copy paste this section)
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -165.8,   -106.4,    28.32), (float3)(  -15.39,    41.82,        0), (float3)(   52.28,    19.23,        0), surfacesMask, 0, 409, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -158.5,   -126.3,   -37.11), (float3)(  -7.638,    20.76,     66.1), (float3)(   52.05,    19.15,        0), surfacesMask, 409, 643, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -21.79,   -23.62,   -34.55), (float3)(   89.42,    39.44,        0), (float3)(  -27.26,    61.81,        0), surfacesMask, 1052, 740, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -39.96,   -11.55,    29.95), (float3)(  -8.877,    49.84,        0), (float3)(   103.3,     18.4,        0), surfacesMask, 1792, 247, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -180.5,    -64.4,   -37.25), (float3)(-0.0009671, -0.0003558,    66.38), (float3)(   22.87,   -62.17,        0), surfacesMask, 2039, 512, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(    35.5,    2.278,   -35.25), (float3)(       0,        0,    65.91), (float3)(   21.74,    36.07,        0), surfacesMask, 2551, 801, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -31.54,    1.768,   -8.499), (float3)(       0,        0,    15.86), (float3)(  -15.69,   -32.17,        0), surfacesMask, 3352, 226, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -67.22,   -41.65,    7.364), (float3)(   11.45,        0,        0), (float3)(       0,        0,   -15.86), surfacesMask, 3578, 369, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -65.91,   -42.02,    7.364), (float3)(       0,        0,   -15.87), (float3)(  -7.275,    4.603,        0), surfacesMask, 3947, 943, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(   -9.05,   -4.783,   -8.792), (float3)(  -47.98,    -37.3,        0), (float3)(       0,        0,    16.45), surfacesMask, 4890, 1891, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -53.98,   -25.37,    6.656), (float3)(   27.86,    34.59,        0), (float3)(   17.42,   -14.03,        0), surfacesMask, 6781, 1016, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -48.37,   -30.96,   -7.792), (float3)(   21.75,   -10.61,        0), (float3)(   17.92,    36.76,        0), surfacesMask, 7797, 303, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(  -48.28,    38.39,   -35.25), (float3)(       0,        0,    65.91), (float3)(   20.93,   -47.46,        0), surfacesMask, 8100, 650, edgeOffset);
-    future = BouncePointQuad(positions[i].xyz, future, (float3)(   36.56,    3.007,    30.66), (float3)(       0,        0,   -65.91), (float3)(  -64.89,   -11.56,        0), surfacesMask, 8750, 512, edgeOffset);
+    // Force plats (only the quads binned into the colliders cells overlapped by the particle's path this step, a quad
+    // binned into several of them is tested again, which leaves a bounced position in place)
+    const float3 prevPos  = positions[i].xyz;
+    const int3   cellMin  = max(convert_int3(floor((fmin(prevPos, future) - collidersGridMin.xyz) * collidersGridMin.w)), (int3)0);
+    const int3   cellMax  = min(convert_int3(floor((fmax(prevPos, future) - collidersGridMin.xyz) * collidersGridMin.w)), collidersGridRes.xyz - 1);
+    for (int z = cellMin.z; z <= cellMax.z; z++)
+    for (int y = cellMin.y; y <= cellMax.y; y++)
+    for (int x = cellMin.x; x <= cellMax.x; x++)
+    {
+        const uint2 range = collidersCells[(z * collidersGridRes.y + y) * collidersGridRes.x + x];
+        for (uint k = range.x; k < range.x + range.y; k++)
+            future = BouncePointQuad(prevPos, future, colliders + 5 * collidersIndex[k], surfacesMask, edgeOffset);
+    }
+#endif
 
     // Compute delta
     delta[i].xyz = future - particle_i.xyz;
@@ -0,0 +1,30 @@
+__kernel void emitParticles(__constant struct Parameters *Params,
+                            __global float4 *positions,
+                            __global float4 *velocities,
+                            const uint firstSlot,
+                            const uint seed,
+                            const uint count)
+{
+    const uint i = get_global_id(0);
+    if (i >= count) return;
+
+    // Emitter layer is perpendicular to the emission velocity
+    const float3 velocity = (float3)(Params->emitterVelX, Params->emitterVelY, Params->emitterVelZ);
+    const float3 dir      = normalize(velocity);
+    const float3 up       = (fabs(dir.y) < 0.9f) ? (float3)(0.0f, 1.0f, 0.0f) : (float3)(1.0f, 0.0f, 0.0f);
+    const float3 u        = normalize(cross(dir, up));
+    const float3 v        = cross(dir, u);
+
+    // Slightly jittered square lattice (avoids perfectly stacked layers)
+    const uint  side = Params->emitterSize;
+    const float d    = Params->h * Params->setupSpacing;
+    uint2 randSeed   = (uint2)(seed * 7919 + i, 1);
+    const float ju   = (frand(&randSeed) - 0.5f) * 0.1f * d;
+    const float jv   = (frand(&randSeed) - 0.5f) * 0.1f * d;
+    const float3 pos = (float3)(Params->emitterX, Params->emitterY, Params->emitterZ) +
+                       u * (((float)(i % side) - 0.5f * (side - 1)) * d + ju) +
+                       v * (((float)(i / side) - 0.5f * (side - 1)) * d + jv);
+
+    positions[firstSlot + i]  = (float4)(pos, 0.0f);
+    velocities[firstSlot + i] = (float4)(velocity, 0.0f);
+}
@@ -0,0 +1,51 @@
+// Initial particles: the fluid blocks of the scenario (Params->blocks), stored one after the other
+__kernel void initParticles(__constant struct Parameters *Params,
+                            __global float4 *positions,
+                            __global float4 *velocities,
+                            const uint seed,
+                            const uint N)
+{
+    const uint i = get_global_id(0);
+    if (i >= N) return;
+
+    // Find the particle block
+    uint b = 0;
+    uint first = 0;
+    while ((b + 1 < Params->blocksCount) && (i >= first + Params->blocks[b].count))
+    {
+        first += Params->blocks[b].count;
+        b++;
+    }
+
+    // Lattice position inside the block (filled along y, then x, then z)
+    const uint  local = i - first;
+    const uint  sizeX = Params->blocks[b].sizeX;
+    const uint  sizeY = Params->blocks[b].sizeY;
+    const float d     = Params->h * Params->setupSpacing;
+    float3 position = (float3)(Params->blocks[b].originX, Params->blocks[b].originY, Params->blocks[b].originZ) +
+                      convert_float3((uint3)((local / sizeY) % sizeX, local % sizeY, local / (sizeX * sizeY))) * d;
+
+    // Jittered blocks (amplitude in spacing units)
+    if (Params->blocks[b].jitter > 0.0f)
+    {
+        uint2 randSeed = (uint2)(seed * 7919 + i, 1);
+        const float jx = frand(&randSeed) - 0.5f;
+        const float jy = frand(&randSeed) - 0.5f;
+        const float jz = frand(&randSeed) - 0.5f;
+        position += (float3)(jx, jy, jz) * Params->blocks[b].jitter * d;
+    }
+
+    positions[i]  = (float4)(position, 0.0f);
+    velocities[i] = (float4)(0.0f);
+}
+
+// Device side buffer fill (Simulation::FillBuffer without OpenCL 1.2)
+__kernel void fillBuffer(__global uint *buffer,
+                         const uint value,
+                         const uint count)
+{
+    const uint i = get_global_id(0);
+    if (i >= count) return;
+
+    buffer[i] = value;
+}
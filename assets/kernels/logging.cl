@@ -1,3 +1,5 @@
+#ifdef ENABLE_LOGGING
+
 typedef struct tag_log_writer
 {
     volatile __global int* pDebugBuffer; 
@@ -6,6 +8,8 @@ typedef struct tag_log_writer
 } log_writer;
 
 // debug buffer structure:
+//   int32       write counter (in words, wraps around the ring)
+//   ring of LOG_RING_SIZE (power of 2) words holding messages:
 //   int32       msgLength  message total length (including header)
 //   int32       msgCoding  message formatting code
 //   int32/float data0
@@ -27,8 +31,8 @@ log_writer logStart(volatile __global int* debugBuf, int msgCoding, int valueCou
     ret.WriteIdx = atomic_add(debugBuf, msgLength);
     
     // Write msgLength and msgCoding
-    ret.pDebugBuffer[1 + (ret.WriteIdx++ % (LOG_SIZE - 1))] = msgLength;
-    ret.pDebugBuffer[1 + (ret.WriteIdx++ % (LOG_SIZE - 1))] = msgCoding;
+    ret.pDebugBuffer[1 + (ret.WriteIdx++ & (LOG_RING_SIZE - 1))] = msgLength;
+    ret.pDebugBuffer[1 + (ret.WriteIdx++ & (LOG_RING_SIZE - 1))] = msgCoding;
     
     return ret;
 }
@@ -43,7 +47,7 @@ void logValue(log_writer* writer, float value)
     writer->valuesToWrite--;
     
     // Write value
-    writer->pDebugBuffer[1 + (writer->WriteIdx++ % (LOG_SIZE - 1))] = as_int(value);
+    writer->pDebugBuffer[1 + (writer->WriteIdx++ & (LOG_RING_SIZE - 1))] = as_int(value);
 }
 
 void logPrint(volatile __global int *debugBuf, int msgCode)
@@ -91,5 +95,16 @@ void logPrintf5(volatile __global int *debugBuf, int msgCode, float param1, floa
     logValue(&w, param5);
 }
 
-#define TextToID(a) (a)
+#else
+
+// Logging is compiled out (kernels don't get a debug buffer argument)
+#define logPrint(debugBuf, msgCode)
+#define logPrintf1(debugBuf, msgCode, p1)
+#define logPrintf2(debugBuf, msgCode, p1, p2)
+#define logPrintf3(debugBuf, msgCode, p1, p2, p3)
+#define logPrintf4(debugBuf, msgCode, p1, p2, p3, p4)
+#define logPrintf5(debugBuf, msgCode, p1, p2, p3, p4, p5)
 
+#endif // ENABLE_LOGGING
+
+#define TextToID(a) (a)
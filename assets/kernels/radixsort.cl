@@ -2,17 +2,28 @@ __kernel void computeKeys(__constant struct Parameters *Params,
                          cbufferf_readonly imgPositions,
                           __global int *keys,
                           __global int *permutation,
+                          volatile __global uint *liveCount,
                           const uint numParticles)
 {
     const uint i = get_global_id(0);
 
+    // Sink box and domain exit kill particles (see isParticleAlive)
+    bool alive = false;
     if (i < numParticles)
     {
         float3 position = cbufferf_read(imgPositions, i).xyz;
-        int3 current_cell = convert_int3(position / Params->h);
-        keys[i] = calcGridHash(current_cell);
+        alive = isParticleAlive(Params, position);
+
+        if (alive)
+        {
+            int3 current_cell = convert_int3(position / Params->h);
+            keys[i] = calcGridHash(current_cell, GRID_BUF_SIZE);
+            atomic_inc(liveCount);
+        }
     }
-    else
+
+    // Killed particles and padding are sorted to the end
+    if (!alive)
     {
         keys[i] = 2147483647 - 1; //max_int
     }
@@ -3,9 +3,8 @@ uint rand(uint2 *state);
 float frand(uint2 *state);
 float frand3(float3 co);
 float rand_3d(float3 pos);
-int expandBits(int x);
-int mortonNumber(int3 gridPos);
-uint calcGridHash(int3 gridPos);
+uint calcGridHash(int3 gridPos, uint gridBufSize);
+bool isParticleAlive(__constant struct Parameters *Params, float3 position);
 
 uint rand(uint2 *state)
 {
@@ -66,24 +65,23 @@ float rand_3d(float3 pos)
     return nxyz;
 }
 
-int expandBits(int x)
+// Cells are ordered along the selected space filling curve (see SpaceCurves.hpp)
+uint calcGridHash(int3 gridPos, uint gridBufSize)
 {
-    x = (x | (x << 16)) & 0x030000FF;
-    x = (x | (x <<  8)) & 0x0300F00F;
-    x = (x | (x <<  4)) & 0x030C30C3;
-    x = (x | (x <<  2)) & 0x09249249;
-
-    return x;
-}
-
-int mortonNumber(int3 gridPos)
-{
-    return expandBits(gridPos.x) | (expandBits(gridPos.y) << 1) | (expandBits(gridPos.z) << 2);
+    return sfcCellIndex(gridPos.x, gridPos.y, gridPos.z, CELL_CURVE, CELL_CURVE_GRANULARITY) % gridBufSize;
 }
 
-uint calcGridHash(int3 gridPos)
+// Particles inside the sink box (an empty box disables it) or out of the domain (killOutsideDomain) are killed
+bool isParticleAlive(__constant struct Parameters *Params, float3 position)
 {
-    return mortonNumber(gridPos) % GRID_BUF_SIZE;
+    const float3 sinkMin = (float3)(Params->sinkXMin, Params->sinkYMin, Params->sinkZMin);
+    const float3 sinkMax = (float3)(Params->sinkXMax, Params->sinkYMax, Params->sinkZMax);
+    if (all(position >= sinkMin) && all(position < sinkMax))
+        return false;
+
+    const float3 domainMin = (float3)(Params->xMin, Params->yMin, Params->zMin);
+    const float3 domainMax = (float3)(Params->xMax, Params->yMax, Params->zMax);
+    return !Params->killOutsideDomain || (all(position >= domainMin) && all(position <= domainMax));
 }
 
 __constant sampler_t simpleSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
@@ -112,3 +110,13 @@ void imgWriteui1(image2d_t img, int index, uint value)
     #define cbufferf_read(obj, index)           obj[index]
     #define cbufferf_write(obj, index, data)    obj[index]=data
 #endif
+
+// Runtime parameters: values that otherwise are compiled in are read from the "Params" kernel argument
+// (requires that the kernel argument is named "Params")
+#ifdef ENABLE_RUNTIME_PARAMS
+    #define MAX_PARTICLES_COUNT                 (Params->particleCapacity)
+    #define FRIENDS_BLOCK_SIZE                  (Params->particleCapacity * MAX_FRIENDS_CIRCLES)
+    #define GRID_BUF_SIZE                       (Params->gridBufSize)
+    #define POLY6_FACTOR                        (Params->poly6Factor)
+    #define GRAD_SPIKY_FACTOR                   (Params->gradSpikyFactor)
+#endif
@@ -1,8 +1,7 @@
 #version 430
 
-uniform sampler2D depthTexture;
-uniform sampler2D particlesPos;
-uniform usampler2D visParticles;
+uniform sampler2D depthTexture;     // Front particles depth (reduced resolution, see particles_thickness.fs)
+uniform sampler2D thicknessTexture; // Particles thickness (same size)
 
 uniform mat4      MV_Matrix;
 uniform mat4      iMV_Matrix;
@@ -10,15 +9,28 @@ uniform mat4      Proj_Matrix;
 uniform vec2      depthRange;
 uniform vec2      invFocalLen; // See http://stackoverflow.com/questions/17647222/ssao-changing-dramatically-with-camera-angle
 
-layout(r32i) uniform iimage2D grid_chain;
-layout(r32i) uniform iimage2D grid;
+// Simulation particles (sorted by cell) and cells (x=first particle, y=last particle, shared with OpenCL)
+layout(std430, binding = 0) readonly buffer Positions
+{
+    vec4 positions[];
+};
+
+layout(std430, binding = 1) readonly buffer Cells
+{
+    uvec2 cells[];
+};
+
+#define END_OF_CELL_LIST 0xFFFFFFFFu
 
 // Particles related
 uniform float     smoothLength;
 //uniform float     poly6Factor;
 //uniform float     poly6GradFactor;
-uniform int       particlesCount;
-uniform uint      currentCycleID;
+
+// Cells hash (see SpaceCurves.hpp)
+uniform uint      gridBufSize;
+uniform uint      cellCurve;
+uniform uint      cellCurveGranularity;
 
 // outputs
 out vec4 result; 
@@ -54,29 +66,6 @@ vec4 uvToWorld(ivec2 texCoord)
     return ret ;
 }
 
-vec3 uvToViewSpace(ivec2 texCoord)
-{
-    // sample depth buffer
-    float z = texelFetch(depthTexture, texCoord, 0).x;
-    
-    // clipping
-    if(z == gl_DepthRange.far) discard;
-    
-    // Linearise "z"
-    float near = depthRange.x;
-    float far = depthRange.y;
-    float linearZ = near / (far - z * (far - near)) * far;
-    
-    // convert texture coordinate to -invFocalLen .. +invFocalLen
-    vec2 focal_uv = ((texCoord + vec2(0.5)) / frameSize * 2.0 - 1.0) * invFocalLen;
-
-    // homogeneous space coordinates
-    vec4 homoPos = vec4(focal_uv * linearZ, -linearZ, 1.0);
-    
-    // view space coords 
-    return homoPos.xyz / homoPos.w;
-}
-
 float ViewSpaceDepth_to_ZBufferDepth(vec3 viewSpacePos)
 {
     // convert to ClipSpace
@@ -93,66 +82,91 @@ float ViewSpaceDepth_to_ZBufferDepth(vec3 viewSpacePos)
     return (abs(far - near) * ndcDepth + near + far) / 2.0;
 }
 
-vec3 GetParticlePos(int index)
+vec3 GetParticlePos(uint index)
 {
-    // Compute texture location
-    ivec2 texSize = textureSize(particlesPos, 0);
-    ivec2 texCoord = ivec2(index % texSize.x, index / texSize.x);
-    
-    // Get position value
-    return texelFetch(particlesPos, texCoord, 0).xyz;
+    return positions[index].xyz;
 }
 
-float GetDensity(vec3 worldPos)
+// Space filling curves (GLSL port of SpaceCurves.hpp, must produce the same cell index)
+#define SFC_HILBERT         1u
+#define SFC_COORD_BITS      10u
+#define SFC_COORD_MASK      ((1u << SFC_COORD_BITS) - 1u)
+
+uint sfcExpandBits(uint x)
 {
-    int visMapWidth = textureSize(visParticles, 0).x;
-    
-    float h_2 = smoothLength*smoothLength;
-    
-    float density = 0.0;
-    for (int i = 0; i < particlesCount; i++)
-    {
-        // Check if we should skip this particle (not visible)
-        uint partCycleID = texelFetch(visParticles, ivec2(i % visMapWidth, i / visMapWidth), 0).x;
-        if (partCycleID != currentCycleID) continue;
-    
-        // Get particles position
-        vec3 partPos = GetParticlePos(i);
-        
-        // find distance^2 between pixel and particles
-        vec3 delta = partPos - worldPos;
-        float r_2 = dot(delta, delta);
+    x = (x | (x << 16)) & 0x030000FFu;
+    x = (x | (x <<  8)) & 0x0300F00Fu;
+    x = (x | (x <<  4)) & 0x030C30C3u;
+    x = (x | (x <<  2)) & 0x09249249u;
 
-        // Check if out of range
-        if (r_2 < h_2)
-        {
-            // append density
-            float h_2_r_2_diff = h_2 - r_2;
-            density += h_2_r_2_diff * h_2_r_2_diff * h_2_r_2_diff;    
-        }
-    }
-    
-    return density;
+    return x;
 }
 
-int expandBits(int x)
+uint sfcMortonIndex(uint x, uint y, uint z)
 {
-    x = (x | (x << 16)) & 0x030000FF;
-    x = (x | (x <<  8)) & 0x0300F00F;
-    x = (x | (x <<  4)) & 0x030C30C3;
-    x = (x | (x <<  2)) & 0x09249249;
-
-    return x;
+    return sfcExpandBits(x) | (sfcExpandBits(y) << 1) | (sfcExpandBits(z) << 2);
 }
 
-int mortonNumber(ivec3 gridPos)
+uint sfcHilbertIndex(uint x, uint y, uint z, uint bits)
 {
-    return expandBits(gridPos.x) | (expandBits(gridPos.y) << 1) | (expandBits(gridPos.z) << 2);
+    if (bits == 0u)
+        return 0u;
+
+    uint X[3] = uint[3](x, y, z);
+
+    // Inverse undo
+    uint M = 1u << (bits - 1u);
+    for (uint Q = M; Q > 1u; Q >>= 1)
+    {
+        uint P = Q - 1u;
+        for (int i = 0; i < 3; i++)
+        {
+            if ((X[i] & Q) != 0u)
+            {
+                X[0] ^= P;
+            }
+            else
+            {
+                uint t = (X[0] ^ X[i]) & P;
+                X[0] ^= t;
+                X[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    X[1] ^= X[0];
+    X[2] ^= X[1];
+    uint t = 0u;
+    for (uint Q = M; Q > 1u; Q >>= 1)
+        if ((X[2] & Q) != 0u)
+            t ^= Q - 1u;
+    X[0] ^= t;
+    X[1] ^= t;
+    X[2] ^= t;
+
+    return sfcMortonIndex(X[2], X[1], X[0]);
 }
 
 uint calcGridHash(ivec3 gridPos)
 {
-    return mortonNumber(gridPos) % /*GRID_BUF_SIZE*/ (2048*2048);
+    uvec3 cell = uvec3(gridPos) & SFC_COORD_MASK;
+
+    uint index;
+    if ((cellCurve != SFC_HILBERT) || (cellCurveGranularity >= SFC_COORD_BITS))
+    {
+        index = sfcMortonIndex(cell.x, cell.y, cell.z);
+    }
+    else
+    {
+        // Hilbert order of the blocks, Morton order inside them
+        uint blockMask = (1u << cellCurveGranularity) - 1u;
+        uint block = sfcHilbertIndex(cell.x >> cellCurveGranularity, cell.y >> cellCurveGranularity, cell.z >> cellCurveGranularity, SFC_COORD_BITS - cellCurveGranularity);
+        uint inner = sfcMortonIndex(cell.x & blockMask, cell.y & blockMask, cell.z & blockMask);
+        index = (block << (3u * cellCurveGranularity)) | inner;
+    }
+
+    return index % gridBufSize;
 }
 
 void SampleDensityAndGradient(vec3 worldPos, out float density, out vec3 gradient)
@@ -175,12 +189,13 @@ void SampleDensityAndGradient(vec3 worldPos, out float density, out vec3 gradien
         {
             for (int ix = -1; ix <= +1; ix++)
             {
-                // Find first cell particle
-                uint gridOffset = calcGridHash(gridCell + ivec3(ix, iy, iz));
-                int partIdx = imageLoad(grid, ivec2(gridOffset % 2048, gridOffset / 2048)).x;
+                // Find cell particles range (sorted, inclusive)
+                uvec2 cell = cells[calcGridHash(gridCell + ivec3(ix, iy, iz))];
+                if (cell.x == END_OF_CELL_LIST)
+                    continue;
                 
-                // Scan chain
-                while (partIdx != -1)
+                // Scan range
+                for (uint partIdx = cell.x; partIdx <= cell.y; partIdx++)
                 {
                     // Get particles position
                     vec3 partPos = GetParticlePos(partIdx);
@@ -202,9 +217,6 @@ void SampleDensityAndGradient(vec3 worldPos, out float density, out vec3 gradien
                         // append density
                         density += h_2_r_2_diff * h_2_r_2_diff * h_2_r_2_diff;    
                     }
-                    
-                    // Get next particle in chain
-                    partIdx = imageLoad(grid_chain, ivec2(partIdx % 2048, partIdx / 2048)).x;
                 }
             }
         }
@@ -253,18 +265,16 @@ void main()
         // Compute density delta 
         float densityDelta = density - TargetDensity;
 
-        // Check if we reached the sweet spot
-        //if (abs(densityDelta) < 0.000000000001)
-        //    break;
-
-        // Compute gradient along camera normal
+        // Compute gradient along camera normal (flat density, keep the current point)
         float gradientAlongCamNormal = dot(pixelCamNorm, gradient);
+        if (abs(gradientAlongCamNormal) < 1e-12)
+            break;
         
         // Compute step size
         float stepSize = densityDelta / gradientAlongCamNormal;
         
-        // update tp
-        tp += stepSize; 
+        // update tp (the shell is within a smoothing length of the particles surface)
+        tp = clamp(tp + stepSize, -smoothLength, smoothLength);
 
         // Compute shifted test point
         shellPos = modelPos + tp * pixelCamNorm;
@@ -276,7 +286,7 @@ void main()
     
     // Convert viewspace to z-buffer depth
     float zbufferDepth = ViewSpaceDepth_to_ZBufferDepth(viewSpaceDepth);
-    gl_FragDepth = zbufferDepth;
-    // Compose result
-    result = vec4(zbufferDepth, normalize(gradient));
-}
\ No newline at end of file
+
+    // Compose result (normals are taken from the filtered depth, see fluid_upsample.fs)
+    result = vec4(zbufferDepth, texelFetch(thicknessTexture, iuv, 0).x, 0.0, 0.0);
+}
@@ -1,12 +1,16 @@
 #version 150
 
 uniform sampler2D depthTexture;
+uniform sampler2D thicknessTexture; // Filtered surface (y=thickness, reduced resolution)
 uniform mat4      invProjectionMatrix;
 
 uniform mat4      iMV_Matrix;
 uniform vec2      depthRange;
 uniform vec2      invFocalLen; 
 
+// Thin fluid is lighter than deep fluid
+#define THICKNESS_ABSORPTION 0.1
+
 // outputs
 out vec4 result; 
 
@@ -60,11 +64,12 @@ vec3 uvToEye(ivec2 texCoord)
     return (viewPos.xyz / viewPos.w);
 }
 
-vec3 DoLight(vec3 normal, vec3 eyeDir, vec3 lightDir)
+vec3 DoLight(vec3 normal, vec3 eyeDir, vec3 lightDir, float thickness)
 {
     vec3 halfWay = normalize(lightDir+eyeDir); //Halfway vector
     
-    vec3 diffuseReflection  = vec3(0,0,0.5)*clamp(dot(lightDir, normal), 0, 1);
+    vec3 fluidColor = mix(vec3(0.2,0.4,0.7), vec3(0,0,0.5), 1.0 - exp(-thickness * THICKNESS_ABSORPTION));
+    vec3 diffuseReflection  = fluidColor*clamp(dot(lightDir, normal), 0, 1);
     vec3 specularReflection = vec3(1)*max(0.0,pow(dot(normal, halfWay), 50));
     
     //Fresnel approximation
@@ -104,6 +109,8 @@ void main()
     vec3 cameraPos = iMV_Matrix[3].xyz;    
     vec3 lightDir = normalize(vec3(0,1,0));
     
+    // Fluid thickness (filtered at reduced resolution)
+    float thickness = texture(thicknessTexture, (iuv + vec2(0.5)) / frameSize).y;
     
-    result = vec4(DoLight(normal, normalize(cameraPos - uvToWorld(iuv).xyz), lightDir), 1.0);
+    result = vec4(DoLight(normal, normalize(cameraPos - uvToWorld(iuv).xyz), lightDir, thickness), 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#version 150
+
+uniform sampler2D sourceTexture;    // x=depth (1.0 = no fluid), y=thickness
+uniform ivec2     filterDirection;  // (1,0) horizontal pass, (0,1) vertical pass
+uniform vec2      depthRange;
+uniform float     smoothLength;
+uniform float     pixelsPerUnit;    // Projected size of a world unit at distance 1 [pixels]
+
+// Filter support is a smoothing length on screen, capped so the cost only depends on the pixels count
+#define MAX_FILTER_RADIUS 16
+
+// outputs
+out vec4 result;
+
+float LinearDepth(float z)
+{
+    float near = depthRange.x;
+    float far = depthRange.y;
+    return near / (far - z * (far - near)) * far;
+}
+
+void main()
+{
+    ivec2 iuv = ivec2(gl_FragCoord.xy);
+    ivec2 frameSize = textureSize(sourceTexture, 0);
+    vec4 center = texelFetch(sourceTexture, iuv, 0);
+
+    // Background stays as is
+    if (center.x >= gl_DepthRange.far)
+    {
+        result = center;
+        return;
+    }
+
+    // Filter radius from the projected smoothing length
+    float linearZ = LinearDepth(center.x);
+    float radius  = clamp(pixelsPerUnit * smoothLength / linearZ, 1.0, float(MAX_FILTER_RADIUS));
+    float spatialScale = 2.0 / (radius * radius);
+    float rangeScale   = 1.0 / (2.0 * smoothLength * smoothLength);
+
+    // Depth: bilateral (samples across depth discontinuities are ignored), thickness: gaussian
+    float depthSum = 0.0;
+    float depthWeight = 0.0;
+    float thicknessSum = 0.0;
+    float thicknessWeight = 0.0;
+    int   r = int(ceil(radius));
+    for (int i = -r; i <= r; i++)
+    {
+        ivec2 coord = clamp(iuv + i * filterDirection, ivec2(0), frameSize - 1);
+        vec4  tap = texelFetch(sourceTexture, coord, 0);
+
+        float spatial = exp(-float(i * i) * spatialScale);
+        thicknessSum    += tap.y * spatial;
+        thicknessWeight += spatial;
+
+        if (tap.x >= gl_DepthRange.far)
+            continue;
+
+        float dz = LinearDepth(tap.x) - linearZ;
+        float weight = spatial * exp(-dz * dz * rangeScale);
+        depthSum    += tap.x * weight;
+        depthWeight += weight;
+    }
+
+    result = vec4(depthSum / depthWeight, thicknessSum / thicknessWeight, 0.0, 0.0);
+}
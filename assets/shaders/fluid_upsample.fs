@@ -0,0 +1,115 @@
+#version 150
+
+uniform sampler2D depthTexture;     // Full resolution depth (guides the upsampling)
+uniform sampler2D smoothTexture;    // Reduced resolution filtered surface (x=depth, 1.0 = no fluid)
+
+uniform mat4      iMV_Matrix;
+uniform vec2      depthRange;
+uniform vec2      invFocalLen;
+uniform float     smoothLength;
+
+// outputs
+out vec4 result;
+
+// Local variables
+ivec2 smoothSize;
+
+float LinearDepth(float z)
+{
+    float near = depthRange.x;
+    float far = depthRange.y;
+    return near / (far - z * (far - near)) * far;
+}
+
+bool IsFluid(ivec2 texCoord)
+{
+    return all(greaterThanEqual(texCoord, ivec2(0))) && all(lessThan(texCoord, smoothSize)) &&
+           (texelFetch(smoothTexture, texCoord, 0).x < gl_DepthRange.far);
+}
+
+vec3 SmoothToEye(ivec2 texCoord)
+{
+    // Linearise the filtered depth
+    float linearZ = LinearDepth(texelFetch(smoothTexture, texCoord, 0).x);
+
+    // convert texture coordinate to -invFocalLen .. +invFocalLen
+    vec2 focal_uv = ((texCoord + vec2(0.5)) / smoothSize * 2.0 - 1.0) * invFocalLen;
+
+    return vec3(focal_uv * linearZ, -linearZ);
+}
+
+// Pick the neighbour on the same surface (smaller depth step), none if both are background
+vec3 SurfaceDelta(ivec2 texCoord, vec3 eyePos, ivec2 offset)
+{
+    bool front = IsFluid(texCoord + offset);
+    bool back  = IsFluid(texCoord - offset);
+    vec3 d1 = front ? SmoothToEye(texCoord + offset) - eyePos : vec3(0);
+    vec3 d2 = back  ? eyePos - SmoothToEye(texCoord - offset) : vec3(0);
+
+    if (front && (!back || (abs(d1.z) <= abs(d2.z))))
+        return d1;
+    return d2;
+}
+
+void main()
+{
+    ivec2 iuv = ivec2(gl_FragCoord.xy);
+    ivec2 frameSize = textureSize(depthTexture, 0);
+    smoothSize = textureSize(smoothTexture, 0);
+
+    // Full resolution silhouette
+    float guideDepth = texelFetch(depthTexture, iuv, 0).x;
+    if (guideDepth == gl_DepthRange.far) discard;
+    float guideZ = LinearDepth(guideDepth);
+
+    // Bilinear footprint in the reduced resolution surface
+    vec2  p    = (iuv + vec2(0.5)) / frameSize * smoothSize - 0.5;
+    ivec2 base = ivec2(floor(p));
+    vec2  f    = p - floor(p);
+
+    // Depth aware weights (joint bilateral), nearest depth sample when no sample matches the guide
+    float rangeScale = 1.0 / (2.0 * smoothLength * smoothLength);
+    float depthSum = 0.0;
+    float weightSum = 0.0;
+    float nearestDepth = gl_DepthRange.far;
+    float nearestDelta = 1e30;
+    ivec2 nearestCoord = ivec2(-1);
+    for (int i = 0; i < 4; i++)
+    {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 coord = base + offset;
+        if (!IsFluid(coord))
+            continue;
+
+        float depth = texelFetch(smoothTexture, coord, 0).x;
+        float dz = LinearDepth(depth) - guideZ;
+        vec2  bilinear = mix(vec2(1.0) - f, f, vec2(offset));
+        float weight = bilinear.x * bilinear.y * exp(-dz * dz * rangeScale);
+        depthSum  += depth * weight;
+        weightSum += weight;
+
+        if (abs(dz) < nearestDelta)
+        {
+            nearestDelta = abs(dz);
+            nearestDepth = depth;
+            nearestCoord = coord;
+        }
+    }
+
+    // No fluid around
+    if (nearestCoord.x < 0) discard;
+    float depth = (weightSum > 1e-4) ? depthSum / weightSum : nearestDepth;
+
+    // Normal from the filtered depth (view space => model space)
+    vec3 eyePos = SmoothToEye(nearestCoord);
+    vec3 ddx = SurfaceDelta(nearestCoord, eyePos, ivec2(1, 0));
+    vec3 ddy = SurfaceDelta(nearestCoord, eyePos, ivec2(0, 1));
+    vec3 normal = cross(ddx, ddy);
+    normal = (dot(normal, normal) > 0.0) ? normalize(normal) : normalize(-eyePos);
+    if (dot(normal, eyePos) > 0.0) normal = -normal;
+    normal = normalize(mat3(iMV_Matrix) * normal);
+
+    // Compose result (depth, model space normal, see fluid_final_render.fs)
+    gl_FragDepth = depth;
+    result = vec4(depth, normal);
+}
@@ -0,0 +1,42 @@
+#version 330
+
+uniform mat4  projectionMatrix;
+uniform float pointSize;
+
+// inputs from vertex shader
+in vec3       frag_vsPosition; // View space position
+
+// outputs (thickness is summed, depth keeps the front most particle, see CVisual::renderFluidThickness)
+layout(location = 0) out float thicknessOut;
+layout(location = 1) out float depthOut;
+
+void main()
+{
+    // calculate normal from texture coordinates
+    vec3 n;
+    n.xy = gl_PointCoord.st*vec2(2.0, 2.0) + vec2(-1.0, -1.0);
+
+    // discard pixels outside circle
+    float mag = dot(n.xy, n.xy);
+    if (mag > 1.0) discard;
+    n.z = sqrt(1.0-mag);
+
+    // point on surface of sphere in eye space
+    vec4 spherePosEye = vec4(frag_vsPosition + n * pointSize, 1.0);
+
+    // convert to ClipSpace
+    vec4 clipSpacePos = projectionMatrix * spherePosEye;
+    float ndcDepth = clipSpacePos.z/clipSpacePos.w;
+
+    // Clip adjusted-z
+    if (ndcDepth < -1.0)
+        discard;
+
+    // Transform into window coordinates coordinates
+    float far = gl_DepthRange.far;
+    float near = gl_DepthRange.near;
+    depthOut = (abs(far - near) * ndcDepth + near + far) / 2.0;
+
+    // Sphere chord along the view ray
+    thicknessOut = 2.0 * n.z * pointSize;
+}
@@ -0,0 +1,322 @@
+#include "BatchSweep.hpp"
+#include "ParamUtils.hpp"
+#include "Resources.hpp"
+#include "hesp.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(_WINDOWS)
+#include <direct.h>
+#endif
+
+using namespace std;
+
+// Swept parameter and its values
+struct SweepAxis
+{
+    string         parameter;
+    vector<string> values;
+};
+
+// A single run of the sweep
+struct SweepRun
+{
+    vector<string> values;     // Value per axis
+    string         scenarioFile;
+    string         summaryFile;
+    string         surfaceFile; // Surface meshes of the frames (empty: not extracted)
+    double         cost;       // Estimated (particles x solver iterations x steps)
+    int            exitCode;
+    double         seconds;    // Wall time, including the kernels build
+};
+
+static bool MakeDirectory(const string &path)
+{
+#if defined(_WINDOWS)
+    return (_mkdir(path.c_str()) == 0) || (errno == EEXIST);
+#else
+    return (mkdir(path.c_str(), 0755) == 0) || (errno == EEXIST);
+#endif
+}
+
+// OpenCL devices in the order of SelectOpenCLDevice (the runs select them with "--device <index + 1>")
+static vector<cl::Device> ListDevices()
+{
+    vector<cl::Device> devices;
+    try
+    {
+        vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+        for (size_t p = 0; p < platforms.size(); p++)
+        {
+            vector<cl::Device> platformDevices;
+            platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &platformDevices);
+            devices.insert(devices.end(), platformDevices.begin(), platformDevices.end());
+        }
+    }
+    catch (const cl::Error &ecl)
+    {
+        cerr << "Unable to list the OpenCL devices (" << ecl.what() << "), runs select their device" << endl;
+        devices.clear();
+    }
+
+    return devices;
+}
+
+// Read a "key value" summary written by Runner::runHeadless
+static map<string, string> ReadSummary(const string &fileName)
+{
+    map<string, string> summary;
+    ifstream ifs(fileName.c_str());
+    string key, value;
+    while (ifs >> key && getline(ifs >> ws, value))
+        summary[key] = value;
+
+    return summary;
+}
+
+int RunBatchSweep(const string &sweepFile, const string &executable, unsigned int jobs)
+{
+    // Read the sweep description
+    ifstream ifs(sweepFile.c_str());
+    if (!ifs.is_open())
+    {
+        cerr << "Unable to open sweep file " << sweepFile << endl;
+        return -1;
+    }
+
+    string scenario = "dam_coarse.par";
+    string output   = "sweep";
+    unsigned int steps     = 500;
+    unsigned int fileJobs  = 0;
+    bool         surface   = false;
+    vector<unsigned int> deviceIndices;
+    vector<SweepAxis> axes;
+
+    string line;
+    while (getline(ifs, line))
+    {
+        // Remove comments
+        line.erase(find(line.begin(), line.end(), '#'), line.end());
+
+        istringstream ss(line);
+        string key;
+        if (!(ss >> key))
+            continue;
+        transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+        /**/ if (key == "scenario") ss >> scenario;
+        else if (key == "output")   ss >> output;
+        else if (key == "steps")    ss >> steps;
+        else if (key == "jobs")     ss >> fileJobs;
+        else if (key == "surface")  ss >> surface;
+        else if (key == "devices")
+        {
+            unsigned int index;
+            while (ss >> index)
+                deviceIndices.push_back(index);
+        }
+        else if (key == "sweep")
+        {
+            SweepAxis axis;
+            string value;
+            ss >> axis.parameter;
+            while (ss >> value)
+                axis.values.push_back(value);
+
+            if (axis.values.empty())
+                cerr << "Sweep of " << axis.parameter << " has no values, leaving it out." << endl;
+            else
+                axes.push_back(axis);
+        }
+        else
+            cerr << "Unknown sweep setting " << key << endl << "Leaving it out." << endl;
+    }
+
+    // Base scenario
+    string baseScenario;
+    try
+    {
+        baseScenario = getScenario(scenario);
+    }
+    catch (const exception &e)
+    {
+        cerr << "Unable to read scenario " << scenario << " (" << e.what() << ")" << endl;
+        return -1;
+    }
+
+    if (!MakeDirectory(output))
+    {
+        cerr << "Unable to create output folder " << output << endl;
+        return -1;
+    }
+
+    // Every combination of the swept values (the last axis changes fastest)
+    size_t runsCount = 1;
+    for (size_t a = 0; a < axes.size(); a++)
+        runsCount *= axes[a].values.size();
+
+    vector<SweepRun> runs(runsCount);
+    for (size_t r = 0; r < runsCount; r++)
+    {
+        SweepRun &run = runs[r];
+
+        // Overrides are appended to the base scenario (the last value of a parameter wins)
+        ostringstream text;
+        text << baseScenario << endl << "# Sweep overrides" << endl;
+        size_t index = r;
+        run.values.resize(axes.size());
+        for (size_t a = axes.size(); a-- > 0; )
+        {
+            run.values[a] = axes[a].values[index % axes[a].values.size()];
+            index /= axes[a].values.size();
+        }
+        for (size_t a = 0; a < axes.size(); a++)
+            text << axes[a].parameter << " " << run.values[a] << endl;
+
+        ostringstream name;
+        name << output << "/run_" << setw(4) << setfill('0') << r;
+        run.scenarioFile = name.str() + ".par";
+        run.summaryFile  = name.str() + ".summary";
+        run.surfaceFile  = surface ? name.str() + "_surface_%06d.pbfs" : "";
+        run.exitCode     = -1;
+        run.seconds      = 0.0;
+
+        ofstream ofs(run.scenarioFile.c_str(), ios::out | ios::trunc);
+        if (!(ofs << text.str()))
+        {
+            cerr << "Unable to write " << run.scenarioFile << endl;
+            return -1;
+        }
+
+        // Estimated cost (also validates the overrides, unknown parameters are reported here)
+        LoadParameters(text.str());
+        run.cost = (double)Params.particleCount * (Params.simIterations + 1) * steps;
+        remove(run.summaryFile.c_str());
+    }
+
+    // Longest runs first, so the slots finish together
+    vector<size_t> order(runsCount);
+    for (size_t r = 0; r < runsCount; r++)
+        order[r] = r;
+    stable_sort(order.begin(), order.end(), [&runs](size_t a, size_t b) { return runs[a].cost > runs[b].cost; });
+
+    if (jobs == 0)
+        jobs = (fileJobs != 0) ? fileJobs : max(thread::hardware_concurrency(), 1u);
+    jobs = (unsigned int)min((size_t)jobs, max(runsCount, (size_t)1));
+
+    cout << "Sweep " << sweepFile << ": " << runsCount << " runs of " << scenario << ", " << steps << " steps, " << jobs << " concurrent" << endl;
+
+    // Slots are spread over the devices (all of them unless listed), CPU devices shared by several slots are split
+    // into sub-devices so the runs don't compete for the same cores
+    const vector<cl::Device> devices = ListDevices();
+    if (deviceIndices.empty())
+        for (size_t d = 0; d < devices.size(); d++)
+            deviceIndices.push_back((unsigned int)d + 1);
+
+    vector<string> slotDevices(jobs);
+    for (unsigned int j = 0; j < jobs; j++)
+    {
+        if (deviceIndices.empty() || devices.empty())
+            break;
+
+        const unsigned int devicesCount = (unsigned int)deviceIndices.size();
+        const unsigned int index        = deviceIndices[j % devicesCount];
+        if ((index == 0) || (index > devices.size()))
+        {
+            cerr << "No device #" << index << ", slot " << j << " selects its device" << endl;
+            continue;
+        }
+
+        ostringstream args;
+        args << " --device " << index;
+        const unsigned int deviceSlots = (jobs - 1 - j % devicesCount) / devicesCount + 1;
+        if ((devices[index - 1].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) && (deviceSlots > 1))
+            args << " --device-part " << j / devicesCount << "/" << deviceSlots;
+        slotDevices[j] = args.str();
+
+        cout << "  Slot " << j << ":" << slotDevices[j] << " (" << devices[index - 1].getInfo<CL_DEVICE_NAME>() << ")" << endl;
+    }
+
+    // Each slot runs headless processes until the queue is empty
+    atomic<size_t> next(0);
+    atomic<size_t> done(0);
+    vector<thread> slots;
+    const auto start = chrono::high_resolution_clock::now();
+    for (unsigned int j = 0; j < jobs; j++)
+    {
+        slots.push_back(thread([&, j]()
+        {
+            for (size_t n = next++; n < order.size(); n = next++)
+            {
+                SweepRun &run = runs[order[n]];
+                ostringstream command;
+                command << "\"" << executable << "\" --headless" << slotDevices[j] << " --scenario \"" << run.scenarioFile << "\" --steps " << steps
+                        << " --summary \"" << run.summaryFile << "\"";
+                if (!run.surfaceFile.empty())
+                    command << " --surface \"" << run.surfaceFile << "\"";
+                command << " > \"" << run.scenarioFile << ".log\" 2>&1";
+
+                const auto runStart = chrono::high_resolution_clock::now();
+                run.exitCode = system(command.str().c_str());
+                run.seconds  = chrono::duration<double>(chrono::high_resolution_clock::now() - runStart).count();
+
+                ostringstream progress;
+                progress << "  [" << ++done << "/" << order.size() << "] " << run.scenarioFile
+                         << (run.exitCode == 0 ? "" : " FAILED") << " (" << run.seconds << " s)" << endl;
+                cout << progress.str();
+            }
+        }));
+    }
+    for (size_t j = 0; j < slots.size(); j++)
+        slots[j].join();
+    const double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+    // Collect the summaries (in sweep order)
+    static const char *SUMMARY_KEYS[] = {"particles", "stepsPerSecond", "densityError", "maxDensityError", "kineticEnergy", "potentialEnergy", "totalEnergy", "boundaryMsPerStep",
+                                         "stepMsPerFrame", "surfaceMsPerFrame", NULL};
+    const string csvFile = output + "/summary.csv";
+    ofstream csv(csvFile.c_str(), ios::out | ios::trunc);
+    csv << "run";
+    for (size_t a = 0; a < axes.size(); a++)
+        csv << "," << axes[a].parameter;
+    csv << ",status,wallSeconds";
+    for (int k = 0; SUMMARY_KEYS[k] != NULL; k++)
+        csv << "," << SUMMARY_KEYS[k];
+    csv << endl;
+
+    int failed = 0;
+    for (size_t r = 0; r < runsCount; r++)
+    {
+        map<string, string> summary = ReadSummary(runs[r].summaryFile);
+        const bool ok = (runs[r].exitCode == 0) && !summary.empty();
+        failed += ok ? 0 : 1;
+
+        csv << r;
+        for (size_t a = 0; a < axes.size(); a++)
+            csv << "," << runs[r].values[a];
+        csv << "," << (ok ? "ok" : "failed") << "," << runs[r].seconds;
+        for (int k = 0; SUMMARY_KEYS[k] != NULL; k++)
+            csv << "," << summary[SUMMARY_KEYS[k]];
+        csv << endl;
+    }
+
+    cout << "Sweep done in " << seconds << " s (" << runsCount / max(seconds, 1e-6) * 3600.0 << " runs/hour), "
+         << failed << " failed, results in " << csvFile << endl;
+
+    return (failed == 0) ? 0 : 1;
+}
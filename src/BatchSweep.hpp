@@ -0,0 +1,27 @@
+#ifndef __BATCH_SWEEP_HPP
+#define __BATCH_SWEEP_HPP
+
+#include <string>
+
+using std::string;
+
+// Batch parameter sweep
+//   The sweep file names a base scenario and the swept parameters, every combination of the swept values is
+//   written as a scenario and simulated by a headless process of "executable" (own OpenCL context and queue).
+//   Runs are started longest first (estimated cost) on "jobs" concurrent slots (0: sweep file / core count),
+//   their summaries are collected into <Output>/summary.csv. Slots are spread over the OpenCL devices (--device),
+//   a CPU device shared by several slots is split into sub-devices of equal compute units (--device-part).
+//
+//   Sweep file ('#' comments):
+//     Scenario  dam_coarse.par          Base scenario
+//     Steps     500                     Simulation steps per run
+//     Jobs      4                       Concurrent runs
+//     Devices   1 2                     Devices of the slots (as listed by the runs, default: all)
+//     Output    sweep                   Results folder
+//     Surface   1                       Extract the fluid surface of the frames (surfaceMsPerFrame, default: 0)
+//     Sweep     Epsilon 100 300 600     Swept parameter and its values (any scenario parameter, repeatable)
+//
+// Returns the process exit code (0 if all runs succeeded)
+int RunBatchSweep(const string &sweepFile, const string &executable, unsigned int jobs);
+
+#endif // __BATCH_SWEEP_HPP
@@ -0,0 +1,346 @@
+#include "BoundarySDF.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <cfloat>
+#include <cmath>
+
+using namespace std;
+
+// Cache file header
+struct SDFCacheHeader
+{
+    char               magic[4];
+    unsigned int       version;
+    unsigned long long sourceHash;
+    float              requestedCellSize;
+    float              cellSize;
+    float              origin[3];
+    int                res[3];
+};
+
+static const char         SDF_CACHE_MAGIC[4] = {'S', 'D', 'F', '1'};
+static const unsigned int SDF_CACHE_VERSION  = 2;
+
+// Largest allowed grid resolution per axis (cell size is increased if needed)
+static const int SDF_MAX_RES = 256;
+
+// Closest point features (sign from their angle weighted pseudo normal, Baerentzen & Aanaes 2005)
+enum { FEATURE_A, FEATURE_B, FEATURE_C, FEATURE_AB, FEATURE_AC, FEATURE_BC, FEATURE_FACE };
+
+// Closest point on triangle (a, b, c) to p and its feature (Ericson, Real-Time Collision Detection 5.1.5)
+static glm::vec3 ClosestPointOnTriangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, int &feature)
+{
+    const glm::vec3 ab = b - a, ac = c - a, ap = p - a;
+    const float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+    if (d1 <= 0.0f && d2 <= 0.0f) { feature = FEATURE_A; return a; }
+
+    const glm::vec3 bp = p - b;
+    const float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+    if (d3 >= 0.0f && d4 <= d3) { feature = FEATURE_B; return b; }
+
+    const float vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) { feature = FEATURE_AB; return a + ab * (d1 / (d1 - d3)); }
+
+    const glm::vec3 cp = p - c;
+    const float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+    if (d6 >= 0.0f && d5 <= d6) { feature = FEATURE_C; return c; }
+
+    const float vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) { feature = FEATURE_AC; return a + ac * (d2 / (d2 - d6)); }
+
+    const float va = d3 * d6 - d5 * d4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) { feature = FEATURE_BC; return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))); }
+
+    const float denom = 1.0f / (va + vb + vc);
+    feature = FEATURE_FACE;
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Position order (vertices welding)
+struct Vec3Less
+{
+    bool operator()(const glm::vec3 &a, const glm::vec3 &b) const
+    {
+        return (a.x != b.x) ? (a.x < b.x) : ((a.y != b.y) ? (a.y < b.y) : (a.z < b.z));
+    }
+};
+
+// Triangles bounding volume hierarchy node (leaf if count > 0, children at left and left + 1 otherwise)
+typedef struct {
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    int       left;  // First child or first triangle (in the BVH triangles order)
+    int       count; // Triangles of a leaf
+} SDF_BVH_NODE;
+
+static const int SDF_BVH_LEAF_SIZE = 4;
+
+// Split the triangles [first, first + count) at the centroids median of the longest axis
+static void BuildBVHNode(vector<SDF_BVH_NODE> &nodes, int nodeIndex, vector<int> &order, const vector<glm::vec3> &centroids,
+                         const vector<glm::vec3> &triangles, int first, int count)
+{
+    SDF_BVH_NODE node;
+    node.boundsMin = node.boundsMax = triangles[3 * order[first]];
+    for (int i = first; i < first + count; i++)
+        for (int k = 0; k < 3; k++)
+        {
+            node.boundsMin = glm::min(node.boundsMin, triangles[3 * order[i] + k]);
+            node.boundsMax = glm::max(node.boundsMax, triangles[3 * order[i] + k]);
+        }
+
+    if (count <= SDF_BVH_LEAF_SIZE)
+    {
+        node.left  = first;
+        node.count = count;
+        nodes[nodeIndex] = node;
+        return;
+    }
+
+    const glm::vec3 extent = node.boundsMax - node.boundsMin;
+    const int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : ((extent.y >= extent.z) ? 1 : 2);
+    const int half = count / 2;
+    nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+
+    node.left  = (int)nodes.size();
+    node.count = 0;
+    nodes[nodeIndex] = node;
+    nodes.resize(nodes.size() + 2);
+    BuildBVHNode(nodes, node.left,     order, centroids, triangles, first,        half);
+    BuildBVHNode(nodes, node.left + 1, order, centroids, triangles, first + half, count - half);
+}
+
+// Squared distance from p to a box (0 inside)
+static float BoxDistance2(const glm::vec3 &p, const glm::vec3 &boundsMin, const glm::vec3 &boundsMax)
+{
+    const glm::vec3 d = glm::max(glm::max(boundsMin - p, p - boundsMax), glm::vec3(0.0f));
+    return glm::dot(d, d);
+}
+
+BoundarySDF::BoundarySDF()
+    : origin(0.0f), cellSize(1.0f), res(0), requestedCellSize(1.0f), sourceHash(0), buildTime(0.0), fromCache(false)
+{
+}
+
+void BoundarySDF::Build(const vector<glm::vec3> &triangles, float cellSize, float padding, unsigned long long sourceHash)
+{
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+    const int trianglesCount = (int)triangles.size() / 3;
+
+    // Weld the vertices (pseudo normals need the triangles sharing a vertex or an edge)
+    map<glm::vec3, int, Vec3Less> vertexIndex;
+    vector<int> indices(triangles.size());
+    for (size_t v = 0; v < triangles.size(); v++)
+        indices[v] = vertexIndex.insert(make_pair(triangles[v], (int)vertexIndex.size())).first->second;
+
+    // Face normals (same winding as ProcessForcePlanes: cross(v2 - v0, v1 - v0) points to the fluid), vertices
+    // pseudo normals weighted by the triangle angle, edges pseudo normals summed over both sides
+    vector<glm::vec3> faceNormals(trianglesCount);
+    vector<glm::vec3> vertexNormals(vertexIndex.size(), glm::vec3(0.0f));
+    map<pair<int, int>, glm::vec3> edgeSums;
+    for (int t = 0; t < trianglesCount; t++)
+    {
+        const glm::vec3 n = glm::cross(triangles[3*t+2] - triangles[3*t], triangles[3*t+1] - triangles[3*t]);
+        faceNormals[t] = (glm::dot(n, n) > 0.0f) ? glm::normalize(n) : glm::vec3(0.0f);
+
+        for (int k = 0; k < 3; k++)
+        {
+            const glm::vec3 e1 = triangles[3*t + (k+1)%3] - triangles[3*t+k];
+            const glm::vec3 e2 = triangles[3*t + (k+2)%3] - triangles[3*t+k];
+            const float     l2 = glm::dot(e1, e1) * glm::dot(e2, e2);
+            const float angle = (l2 > 0.0f) ? acos(glm::clamp(glm::dot(e1, e2) / sqrt(l2), -1.0f, 1.0f)) : 0.0f;
+            vertexNormals[indices[3*t+k]] += angle * faceNormals[t];
+
+            const int i0 = indices[3*t+k], i1 = indices[3*t + (k+1)%3];
+            edgeSums[make_pair(min(i0, i1), max(i0, i1))] += faceNormals[t];
+        }
+    }
+
+    // Pseudo normals of every triangle feature (see FEATURE_*, only the sign matters: not normalized)
+    vector<glm::vec3> featureNormals(trianglesCount * FEATURE_FACE);
+    static const int EDGE_VERTICES[3][2] = {{0, 1}, {0, 2}, {1, 2}};
+    for (int t = 0; t < trianglesCount; t++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            featureNormals[t * FEATURE_FACE + FEATURE_A + k] = vertexNormals[indices[3*t+k]];
+
+            const int i0 = indices[3*t + EDGE_VERTICES[k][0]], i1 = indices[3*t + EDGE_VERTICES[k][1]];
+            featureNormals[t * FEATURE_FACE + FEATURE_AB + k] = edgeSums[make_pair(min(i0, i1), max(i0, i1))];
+        }
+    }
+
+    // Triangles hierarchy (the closest triangle search visits the boxes closer than the best distance only)
+    vector<SDF_BVH_NODE> nodes(1);
+    vector<int>          order(trianglesCount);
+    vector<glm::vec3>    centroids(trianglesCount);
+    for (int t = 0; t < trianglesCount; t++)
+    {
+        order[t]     = t;
+        centroids[t] = (triangles[3*t] + triangles[3*t+1] + triangles[3*t+2]) / 3.0f;
+    }
+    if (trianglesCount > 0)
+        BuildBVHNode(nodes, 0, order, centroids, triangles, 0, trianglesCount);
+
+    // Grid bounds
+    glm::vec3 boundsMin(0.0f), boundsMax(0.0f);
+    for (size_t v = 0; v < triangles.size(); v++)
+    {
+        boundsMin = (v == 0) ? triangles[v] : glm::min(boundsMin, triangles[v]);
+        boundsMax = (v == 0) ? triangles[v] : glm::max(boundsMax, triangles[v]);
+    }
+    boundsMin -= padding;
+    boundsMax += padding;
+
+    // Limit grid resolution
+    this->requestedCellSize = cellSize;
+    const glm::vec3 extent = boundsMax - boundsMin;
+    cellSize = max(cellSize, max(max(extent.x, extent.y), extent.z) / (SDF_MAX_RES - 1));
+
+    this->cellSize   = cellSize;
+    this->sourceHash = sourceHash;
+    this->origin     = boundsMin;
+    this->res        = glm::ivec3(glm::ceil(extent / cellSize)) + 1;
+    this->fromCache  = false;
+    voxels.assign(res.x * res.y * res.z, glm::vec4(0.0f, 0.0f, 0.0f, FLT_MAX));
+
+    // Voxelize slices on all cores
+    const glm::ivec3 gridRes = res;
+    const glm::vec3  gridOrigin = origin;
+    glm::vec4 *pVoxels = &voxels[0];
+    auto buildSlices = [&](int firstSlice, int sliceStep)
+    {
+        for (int z = firstSlice; z < gridRes.z; z += sliceStep)
+        for (int y = 0; y < gridRes.y; y++)
+        for (int x = 0; x < gridRes.x; x++)
+        {
+            const glm::vec3 p = gridOrigin + glm::vec3(x, y, z) * cellSize;
+
+            // Find closest triangle (nearest boxes first)
+            float     minDist2 = FLT_MAX;
+            glm::vec3 closest(0.0f);
+            int       closestTri = -1, closestFeature = FEATURE_FACE;
+            int       stack[64];
+            int       stackSize = (trianglesCount > 0) ? 1 : 0;
+            stack[0] = 0;
+            while (stackSize > 0)
+            {
+                const SDF_BVH_NODE &node = nodes[stack[--stackSize]];
+                if (BoxDistance2(p, node.boundsMin, node.boundsMax) >= minDist2)
+                    continue;
+
+                if (node.count == 0)
+                {
+                    const float d0 = BoxDistance2(p, nodes[node.left].boundsMin,     nodes[node.left].boundsMax);
+                    const float d1 = BoxDistance2(p, nodes[node.left + 1].boundsMin, nodes[node.left + 1].boundsMax);
+                    stack[stackSize++] = (d0 < d1) ? node.left + 1 : node.left;
+                    stack[stackSize++] = (d0 < d1) ? node.left     : node.left + 1;
+                    continue;
+                }
+
+                for (int i = node.left; i < node.left + node.count; i++)
+                {
+                    const int t = order[i];
+                    int feature;
+                    const glm::vec3 q = ClosestPointOnTriangle(p, triangles[3*t], triangles[3*t+1], triangles[3*t+2], feature);
+                    const float dist2 = glm::dot(p - q, p - q);
+                    if (dist2 < minDist2)
+                    {
+                        minDist2 = dist2;
+                        closest = q;
+                        closestTri = t;
+                        closestFeature = feature;
+                    }
+                }
+            }
+
+            if (closestTri < 0)
+                continue;
+
+            // Sign from the pseudo normal of the closest feature (any triangle sharing an edge or a vertex gives the
+            // same one), gradient points away from the surface
+            const glm::vec3 &pseudoNormal = (closestFeature == FEATURE_FACE) ? faceNormals[closestTri] : featureNormals[closestTri * FEATURE_FACE + closestFeature];
+            const float     dist = sqrt(minDist2);
+            const float     side = (glm::dot(p - closest, pseudoNormal) >= 0.0f) ? 1.0f : -1.0f;
+            const glm::vec3 grad = (dist > 1e-5f) ? (p - closest) * (side / dist) : faceNormals[closestTri];
+
+            pVoxels[(z * gridRes.y + y) * gridRes.x + x] = glm::vec4(grad, side * dist);
+        }
+    };
+
+    const int threadsCount = max(1, (int)thread::hardware_concurrency());
+    vector<thread> workers;
+    for (int i = 1; i < threadsCount; i++)
+        workers.push_back(thread(buildSlices, i, threadsCount));
+    buildSlices(0, threadsCount);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    buildTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+bool BoundarySDF::Load(const string &cacheFile, float cellSize, unsigned long long sourceHash)
+{
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+
+    ifstream ifs(cacheFile.c_str(), ios::binary);
+    if (!ifs.is_open())
+        return false;
+
+    // Validate header
+    SDFCacheHeader header;
+    if (!ifs.read((char*)&header, sizeof(header)) ||
+        !equal(SDF_CACHE_MAGIC, SDF_CACHE_MAGIC + 4, header.magic) ||
+        (header.version != SDF_CACHE_VERSION) ||
+        (header.sourceHash != sourceHash) ||
+        (header.requestedCellSize != cellSize) ||
+        (header.res[0] <= 0) || (header.res[1] <= 0) || (header.res[2] <= 0))
+        return false;
+
+    // Read voxels
+    vector<glm::vec4> data(header.res[0] * header.res[1] * header.res[2]);
+    if (!ifs.read((char*)&data[0], data.size() * sizeof(glm::vec4)))
+        return false;
+
+    this->requestedCellSize = header.requestedCellSize;
+    this->cellSize   = header.cellSize;
+    this->sourceHash = header.sourceHash;
+    this->origin     = glm::vec3(header.origin[0], header.origin[1], header.origin[2]);
+    this->res        = glm::ivec3(header.res[0], header.res[1], header.res[2]);
+    this->fromCache  = true;
+    voxels.swap(data);
+
+    buildTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+    return true;
+}
+
+bool BoundarySDF::Save(const string &cacheFile) const
+{
+    ofstream ofs(cacheFile.c_str(), ios::binary | ios::trunc);
+    if (!ofs.is_open())
+        return false;
+
+    SDFCacheHeader header;
+    copy(SDF_CACHE_MAGIC, SDF_CACHE_MAGIC + 4, header.magic);
+    header.version    = SDF_CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.requestedCellSize = requestedCellSize;
+    header.cellSize   = cellSize;
+    header.origin[0]  = origin.x; header.origin[1] = origin.y; header.origin[2] = origin.z;
+    header.res[0]     = res.x;    header.res[1]    = res.y;    header.res[2]    = res.z;
+
+    ofs.write((const char*)&header, sizeof(header));
+    ofs.write((const char*)&voxels[0], voxels.size() * sizeof(glm::vec4));
+    return ofs.good();
+}
+
+size_t BoundarySDF::GetMemorySize() const
+{
+    return voxels.size() * sizeof(glm::vec4);
+}
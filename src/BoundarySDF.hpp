@@ -0,0 +1,47 @@
+#ifndef __BOUNDARY_SDF_HPP
+#define __BOUNDARY_SDF_HPP
+
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Signed distance field of the scene boundary, voxelized from a triangle list.
+// Positive distances are on the fluid side of the triangles.
+class BoundarySDF
+{
+public:
+    // Grid description (origin is the center of voxel (0,0,0))
+    glm::vec3  origin;
+    float      cellSize;
+    glm::ivec3 res;
+
+    // Voxel data: xyz = gradient, w = signed distance
+    vector<glm::vec4> voxels;
+
+    // Source identification (used to validate the disk cache)
+    float              requestedCellSize;
+    unsigned long long sourceHash;
+
+    // Statistics
+    double buildTime; // [millisec]
+    bool   fromCache;
+
+public:
+    BoundarySDF();
+
+    // Voxelize triangles (3 vertices per triangle), the grid covers the triangles bounds plus padding
+    void Build(const vector<glm::vec3> &triangles, float cellSize, float padding, unsigned long long sourceHash);
+
+    // Disk cache, Load fails if the cache does not match sourceHash/cellSize
+    bool Load(const string &cacheFile, float cellSize, unsigned long long sourceHash);
+    bool Save(const string &cacheFile) const;
+
+    // Size of the voxel data [bytes]
+    size_t GetMemorySize() const;
+};
+
+#endif // __BOUNDARY_SDF_HPP
@@ -0,0 +1,31 @@
+#include "CLGLSync.hpp"
+
+using namespace std;
+
+void CLGLSync::Init(const cl::Context &context, const cl::Device &device)
+{
+    mContext = context;
+    mCreateEventFromGLsync = NULL;
+
+    const string extensions = " " + device.getInfo<CL_DEVICE_EXTENSIONS>() + " ";
+    if (extensions.find(" cl_khr_gl_event ") == string::npos)
+        return;
+
+#if defined(CL_VERSION_1_2)
+    cl_platform_id platform = device.getInfo<CL_DEVICE_PLATFORM>();
+    mCreateEventFromGLsync = (CREATE_EVENT_FROM_GLSYNC)clGetExtensionFunctionAddressForPlatform(platform, "clCreateEventFromGLsyncKHR");
+#else
+    mCreateEventFromGLsync = (CREATE_EVENT_FROM_GLSYNC)clGetExtensionFunctionAddress("clCreateEventFromGLsyncKHR");
+#endif
+}
+
+cl::Event CLGLSync::CreateEvent(GLsync fence) const
+{
+    cl_int error = CL_SUCCESS;
+    cl_event event = mCreateEventFromGLsync(mContext(), (cl_GLsync)fence, &error);
+    if (error != CL_SUCCESS)
+        throw cl::Error(error, "clCreateEventFromGLsyncKHR");
+
+    // The wrapper takes the reference
+    return cl::Event(event);
+}
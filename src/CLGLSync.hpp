@@ -0,0 +1,34 @@
+#ifndef __CLGL_SYNC_HPP
+#define __CLGL_SYNC_HPP
+
+#include "Precomp_OpenGL.h"
+#include "hesp.hpp"
+
+// OpenCL / OpenGL shared objects synchronization
+//   OpenGL has to be done with shared objects before OpenCL acquires them, and OpenCL done with them once released.
+//   The only shared objects are the frame snapshots, acquired on the simulation thread (see SimulationThread).
+//   With cl_khr_gl_event (OpenGL fences are core since 3.2, GL_ARB_sync) the waits happen on the devices: OpenCL
+//   waits for an OpenGL fence turned into an event (see CreateEvent), OpenGL uses the objects once the release
+//   event completed. Without it the pipelines are drained: glFinish before the acquire, clFinish after the release.
+class CLGLSync
+{
+private:
+    typedef cl_event (CL_API_CALL *CREATE_EVENT_FROM_GLSYNC)(cl_context context, cl_GLsync sync, cl_int *errcode_ret);
+
+    cl::Context              mContext;
+    CREATE_EVENT_FROM_GLSYNC mCreateEventFromGLsync; // NULL: not supported
+
+public:
+    CLGLSync() : mCreateEventFromGLsync(NULL) { }
+
+    // Look up cl_khr_gl_event on the device
+    void Init(const cl::Context &context, const cl::Device &device);
+
+    // Device side synchronization (otherwise glFinish / clFinish)
+    bool IsSupported() const { return mCreateEventFromGLsync != NULL; }
+
+    // Event completed when the OpenGL fence is signalled (the fence has to outlive the event)
+    cl::Event CreateEvent(GLsync fence) const;
+};
+
+#endif // __CLGL_SYNC_HPP
@@ -0,0 +1,283 @@
+#include "FrameCapture.hpp"
+#include "OGL_Utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+#if defined(_WINDOWS)
+#define popen  _popen
+#define pclose _pclose
+#define PIPE_WRITE_MODE "wb"
+#else
+#define PIPE_WRITE_MODE "w"
+#endif
+
+// Encoded video frame rate (frames are captured once per rendered frame)
+#define CAPTURE_FRAME_RATE 60
+
+FrameCapture::FrameCapture()
+    : mWidth(0), mHeight(0), mNextSlot(0), mFrameCount(0), mDroppedCount(0), mLossless(false),
+      mSequence(false), mPipe(NULL), mFramesAllocated(0), mMaxQueued(0), mStopping(false), mWriteFailed(false)
+{
+}
+
+FrameCapture::~FrameCapture()
+{
+    Stop();
+}
+
+bool FrameCapture::Start(const string &output, int width, int height, bool lossless, unsigned int ringSize, unsigned int maxQueued)
+{
+    Stop();
+
+    mWidth         = width;
+    mHeight        = height;
+    mOutput        = output;
+    mSequence      = (output.find('%') != string::npos);
+    mNextSlot      = 0;
+    mFrameCount    = 0;
+    mDroppedCount  = 0;
+    mLossless      = lossless;
+    mMaxQueued     = max(maxQueued, 1u);
+    mStopping      = false;
+    mWriteFailed   = false;
+
+    // Video: raw frames piped to ffmpeg (rows are bottom-up)
+    if (!mSequence)
+    {
+        ostringstream command;
+        command << "ffmpeg -loglevel error -y -f rawvideo -pix_fmt rgba -s " << width << "x" << height
+                << " -r " << CAPTURE_FRAME_RATE << " -i - -vf vflip -c:v libx264 -preset veryfast -pix_fmt yuv420p \"" << output << "\"";
+        mPipe = popen(command.str().c_str(), PIPE_WRITE_MODE);
+        if (mPipe == NULL)
+        {
+            cerr << "Unable to start " << command.str() << endl;
+            return false;
+        }
+    }
+
+    // Read back ring
+    const GLsizeiptr frameSize = (GLsizeiptr)width * height * 4;
+    mSlots.resize(max(ringSize, 1u));
+    for (size_t i = 0; i < mSlots.size(); i++)
+    {
+        glGenBuffers(1, &mSlots[i].bufferID);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, mSlots[i].bufferID);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ);
+        mSlots[i].fence = 0;
+        mSlots[i].frame = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // Start the writer
+    mWorker = thread(&FrameCapture::writerLoop, this);
+
+    cout << "Capturing " << width << "x" << height << " frames to " << output << endl;
+    return true;
+}
+
+void FrameCapture::Capture()
+{
+    Capture(mFrameCount);
+}
+
+void FrameCapture::Capture(unsigned int frame)
+{
+    if (!IsCapturing())
+        return;
+
+    // Collect the slots already read back (oldest first, frames are queued in order)
+    for (size_t i = 0; i < mSlots.size(); i++)
+    {
+        SLOT &slot = mSlots[(mNextSlot + i) % mSlots.size()];
+        if (slot.fence == 0)
+            continue;
+
+        const GLenum status = glClientWaitSync(slot.fence, 0, 0);
+        if ((status != GL_ALREADY_SIGNALED) && (status != GL_CONDITION_SATISFIED))
+            break;
+
+        collectSlot(slot);
+    }
+
+    // The ring wrapped before the oldest read back completed: wait for it
+    SLOT &slot = mSlots[mNextSlot];
+    if (slot.fence != 0)
+    {
+        glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+        collectSlot(slot);
+    }
+
+    // Asynchronous read back of the final frame (window back buffer, or the offscreen frame target)
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, g_ScreenFBO.ID);
+    glReadBuffer((g_ScreenFBO.ID == 0) ? GL_BACK : GL_COLOR_ATTACHMENT0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.bufferID);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, mWidth, mHeight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frame = frame;
+    mFrameCount++;
+    mNextSlot  = (mNextSlot + 1) % mSlots.size();
+}
+
+void FrameCapture::collectSlot(SLOT &slot)
+{
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+
+    // Host buffer (recycled, drop the frame if the worker is behind or wait for it when lossless)
+    FRAME *pFrame = NULL;
+    {
+        unique_lock<mutex> lock(mMutex);
+        if (mLossless)
+            mFrameFreed.wait(lock, [this]() { return !mFreeFrames.empty() || (mFramesAllocated < mMaxQueued); });
+
+        if (!mFreeFrames.empty())
+        {
+            pFrame = mFreeFrames.back();
+            mFreeFrames.pop_back();
+        }
+        else if (mFramesAllocated < mMaxQueued)
+        {
+            pFrame = new FRAME;
+            pFrame->pixels.resize((size_t)mWidth * mHeight * 4);
+            mFramesAllocated++;
+        }
+    }
+    if (pFrame == NULL)
+    {
+        mDroppedCount++;
+        return;
+    }
+
+    // Copy out of the mapped buffer
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.bufferID);
+    const void *pPixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, pFrame->pixels.size(), GL_MAP_READ_BIT);
+    if (pPixels != NULL)
+    {
+        memcpy(pFrame->pixels.data(), pPixels, pFrame->pixels.size());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    pFrame->frame = slot.frame;
+
+    // Hand over to the worker
+    lock_guard<mutex> lock(mMutex);
+    if (pPixels != NULL)
+        mQueue.push_back(pFrame);
+    else
+    {
+        mFreeFrames.push_back(pFrame);
+        mDroppedCount++;
+    }
+    mQueueChanged.notify_one();
+}
+
+void FrameCapture::writerLoop()
+{
+    vector<unsigned char> scratch;
+    unique_lock<mutex> lock(mMutex);
+    for (;;)
+    {
+        mQueueChanged.wait(lock, [this]() { return !mQueue.empty() || mStopping; });
+        if (mQueue.empty())
+            break;
+
+        FRAME *pFrame = mQueue.front();
+        mQueue.pop_front();
+
+        // Write outside of the lock
+        lock.unlock();
+        const bool ok = writeFrame(*pFrame, scratch);
+        lock.lock();
+
+        if (!ok && !mWriteFailed)
+        {
+            cerr << "Unable to write captured frame " << pFrame->frame << " to " << mOutput << endl;
+            mWriteFailed = true;
+        }
+        mFreeFrames.push_back(pFrame);
+        mFrameFreed.notify_one();
+    }
+}
+
+bool FrameCapture::writeFrame(const FRAME &frame, vector<unsigned char> &scratch)
+{
+    // Video
+    if (!mSequence)
+        return fwrite(frame.pixels.data(), 1, frame.pixels.size(), mPipe) == frame.pixels.size();
+
+    // Image sequence (binary PPM: RGB, top-down rows)
+    vector<char> fileName(mOutput.size() + 32);
+    snprintf(fileName.data(), fileName.size(), mOutput.c_str(), frame.frame);
+
+    scratch.resize((size_t)mWidth * mHeight * 3);
+    for (int y = 0; y < mHeight; y++)
+    {
+        const unsigned char *pSrc = &frame.pixels[(size_t)(mHeight - 1 - y) * mWidth * 4];
+        unsigned char *pDst = &scratch[(size_t)y * mWidth * 3];
+        for (int x = 0; x < mWidth; x++, pSrc += 4, pDst += 3)
+        {
+            pDst[0] = pSrc[0];
+            pDst[1] = pSrc[1];
+            pDst[2] = pSrc[2];
+        }
+    }
+
+    FILE *pFile = fopen(fileName.data(), "wb");
+    if (pFile == NULL)
+        return false;
+
+    fprintf(pFile, "P6\n%d %d\n255\n", mWidth, mHeight);
+    const bool ok = (fwrite(scratch.data(), 1, scratch.size(), pFile) == scratch.size());
+    return (fclose(pFile) == 0) && ok;
+}
+
+void FrameCapture::Stop()
+{
+    if (!IsCapturing())
+        return;
+
+    // Flush the frames in flight (oldest first)
+    for (size_t i = 0; i < mSlots.size(); i++)
+    {
+        SLOT &slot = mSlots[(mNextSlot + i) % mSlots.size()];
+        if (slot.fence == 0)
+            continue;
+
+        glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+        collectSlot(slot);
+    }
+
+    for (size_t i = 0; i < mSlots.size(); i++)
+        glDeleteBuffers(1, &mSlots[i].bufferID);
+    mSlots.clear();
+
+    // Let the worker write the queued frames
+    {
+        lock_guard<mutex> lock(mMutex);
+        mStopping = true;
+        mQueueChanged.notify_one();
+    }
+    mWorker.join();
+
+    if (mPipe != NULL)
+    {
+        pclose(mPipe);
+        mPipe = NULL;
+    }
+
+    for (size_t i = 0; i < mFreeFrames.size(); i++)
+        delete mFreeFrames[i];
+    mFreeFrames.clear();
+    mFramesAllocated = 0;
+
+    cout << "Captured " << mFrameCount - mDroppedCount << " frames to " << mOutput
+         << " (" << mDroppedCount << " dropped)" << endl;
+}
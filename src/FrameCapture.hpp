@@ -0,0 +1,92 @@
+#ifndef __FRAME_CAPTURE_HPP
+#define __FRAME_CAPTURE_HPP
+
+#include "Precomp_OpenGL.h"
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+
+// Asynchronous frame capture
+//   Each captured frame is read back into a ring of pixel pack buffers (glReadPixels returns at once) and fenced,
+//   a slot is mapped when its fence is signalled (at the latest when the ring wraps, a few frames later).
+//   The pixels are handed to a worker thread which writes them:
+//     - "frames/frame_%06d.ppm" (printf pattern): image sequence
+//     - anything else ("capture.mp4"): encoded by an ffmpeg process (raw frames piped to its input)
+//   When the worker falls behind, frames are dropped (and counted) rather than stalling the render loop, unless
+//   capturing losslessly (batch rendering: every frame is written, the render loop waits for a free host buffer).
+class FrameCapture
+{
+private:
+    // Read back slots
+    typedef struct {
+        GLuint       bufferID;
+        GLsync       fence;  // 0: free
+        unsigned int frame;
+    } SLOT;
+
+    // Pixels on their way to the worker
+    typedef struct {
+        std::vector<unsigned char> pixels;
+        unsigned int               frame;
+    } FRAME;
+
+    // Frame size (RGBA8, bottom-up rows)
+    int                 mWidth;
+    int                 mHeight;
+
+    // Read back ring
+    std::vector<SLOT>   mSlots;
+    unsigned int        mNextSlot;
+    unsigned int        mFrameCount;
+    unsigned int        mDroppedCount;
+    bool                mLossless;
+
+    // Output
+    string              mOutput;
+    bool                mSequence;
+    FILE               *mPipe;
+
+    // Worker
+    std::thread              mWorker;
+    std::mutex               mMutex;
+    std::condition_variable  mQueueChanged;
+    std::condition_variable  mFrameFreed;  // Lossless capture waits for it
+    std::deque<FRAME*>       mQueue;      // To be written
+    std::vector<FRAME*>      mFreeFrames; // Recycled host buffers
+    unsigned int             mFramesAllocated;
+    unsigned int             mMaxQueued;
+    bool                     mStopping;
+    bool                     mWriteFailed;
+
+    void collectSlot(SLOT &slot);
+    void writerLoop();
+    bool writeFrame(const FRAME &frame, std::vector<unsigned char> &scratch);
+
+public:
+    FrameCapture();
+    ~FrameCapture();
+
+    // Start capturing frames of the given size (ringSize frames in flight, maxQueued frames waiting for the worker,
+    // lossless: wait for the worker instead of dropping frames)
+    bool Start(const string &output, int width, int height, bool lossless = false, unsigned int ringSize = 3, unsigned int maxQueued = 8);
+
+    // Read back the final frame (screen frame buffer, call before swapping)
+    void Capture();
+
+    // Same, numbered (image sequences: frame is the file number)
+    void Capture(unsigned int frame);
+
+    // Flush the frames in flight and stop the worker
+    void Stop();
+
+    bool IsCapturing() const { return !mSlots.empty(); }
+};
+
+#endif // __FRAME_CAPTURE_HPP
@@ -0,0 +1,309 @@
+#include "KernelTuner.hpp"
+#include "Simulation.hpp"
+#include "Resources.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cfloat>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+using namespace std;
+
+// Benchmark length (per candidate)
+static const int TUNER_WARMUP_STEPS  = 5;
+static const int TUNER_MEASURE_STEPS = 20;
+
+// Candidate local sizes (0 = NullRange, the driver decides), must divide the global ranges (see SetLiveCount)
+static const size_t TUNER_LOCAL_SIZES[] = {0, 32, 64, 128, 256};
+
+// Candidate radix geometries
+static const unsigned int TUNER_RADIX_ITEMS[]  = {64, 128, 256};
+static const unsigned int TUNER_RADIX_GROUPS[] = {8, 16, 32, 64};
+
+// Tuned kernels and the tracker that measures them
+static const char *TUNER_KERNELS[][2] =
+{
+    {"predictPositions", "predictPositions"},
+    {"computeKeys",      "computeKeys"},
+    {"countCells",       "countCells"},
+    {"scatterCells",     "scatterCells"},
+    {"sortParticles",    "sortParticles"},
+    {"updateCells",      "updateCells"},
+    {"buildFriendsList", "buildFriendsList"},
+    {"resetGrid",        "resetPartList"},
+    {"computeScaling",   "computeScaling"},
+    {"packData",         "packData"},
+    {"computeDelta",     "computeDelta"},
+    {"updatePredicted",  "updatePredicted"},
+    {"applyBoundary",    "applyBoundary"},
+    {"updateVelocities", "updateVelocities"},
+    {"applyViscosity",   "applyViscosity"},
+    {"applyVorticity",   "applyVorticity"},
+};
+
+// Radix sort trackers (geometry dependent)
+static const char *TUNER_RADIX_TRACKERS[] = {"computeKeys", "histogram", "scanhistograms1", "scanhistograms2", "pastehistograms", "reorder"};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+// Strip the iteration index ("computeDelta_2" => "computeDelta")
+static string TrackerBaseName(const string &trackerName)
+{
+    size_t pos = trackerName.rfind('_');
+    if ((pos == string::npos) || (pos + 1 == trackerName.length()))
+        return trackerName;
+
+    for (size_t i = pos + 1; i < trackerName.length(); i++)
+        if (!isdigit((unsigned char)trackerName[i]))
+            return trackerName;
+
+    return trackerName.substr(0, pos);
+}
+
+TuningConfig::TuningConfig()
+    : valid(false), cachedBuffers(true), radixItems(_ITEMS), radixGroups(_GROUPS)
+{
+}
+
+bool TuningConfig::Load(const string &fileName)
+{
+    ifstream ifs(fileName.c_str());
+    if (!ifs.is_open())
+        return false;
+
+    TuningConfig config;
+    string line;
+    while (getline(ifs, line))
+    {
+        // Skip comments and empty lines
+        istringstream ss(line);
+        string key;
+        if (!(ss >> key) || (key[0] == '#'))
+            continue;
+
+        if      (key == "CachedBuffers") ss >> config.cachedBuffers;
+        else if (key == "RadixItems")    ss >> config.radixItems;
+        else if (key == "RadixGroups")   ss >> config.radixGroups;
+        else if (key == "LocalSize")
+        {
+            string kernel;
+            size_t size = 0;
+            if (ss >> kernel >> size)
+                config.localSizes[kernel] = size;
+        }
+        else
+            cerr << "Unknown tuning key " << key << " in " << fileName << endl;
+    }
+
+    config.valid = true;
+    *this = config;
+    return true;
+}
+
+bool TuningConfig::Save(const string &fileName, const string &header) const
+{
+    ofstream ofs(fileName.c_str(), ios::out | ios::trunc);
+    if (!ofs.is_open())
+        return false;
+
+    ofs << header;
+    ofs << "CachedBuffers " << cachedBuffers << endl;
+    ofs << "RadixItems "    << radixItems    << endl;
+    ofs << "RadixGroups "   << radixGroups   << endl;
+    for (map<string, size_t>::const_iterator it = localSizes.begin(); it != localSizes.end(); it++)
+        ofs << "LocalSize " << it->first << " " << it->second << endl;
+
+    return ofs.good();
+}
+
+KernelTuner::KernelTuner(Simulation &simulation)
+    : mSim(simulation)
+{
+}
+
+string KernelTuner::TuningFileName(const cl::Device &device)
+{
+    // Device name and driver version, reduced to file name safe characters
+    string name = device.getInfo<CL_DEVICE_NAME>() + "_" + device.getInfo<CL_DRIVER_VERSION>();
+    string safeName;
+    for (size_t i = 0; i < name.length(); i++)
+    {
+        if (name[i] == '\0')
+            break;
+        safeName += isalnum((unsigned char)name[i]) ? name[i] : '_';
+    }
+
+    return getRootPath() + "/" + safeName + ".tuning";
+}
+
+double KernelTuner::MeasureSteps(map<string, double> &kernelTimes)
+{
+    // Warm-up (first runs include lazy allocations and caches fill)
+    for (int i = 0; i < TUNER_WARMUP_STEPS; i++)
+        mSim.Step();
+    mSim.mQueue.finish();
+    mSim.PerfData.UpdateTimings();
+
+    // Trackers that didn't run in a step keep their last event, skip them
+    map<string, cl_ulong> lastEnd;
+    for (size_t t = 0; t < mSim.PerfData.Trackers.size(); t++)
+        lastEnd[mSim.PerfData.Trackers[t]->eventName] = mSim.PerfData.Trackers[t]->time_end;
+
+    kernelTimes.clear();
+    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+    for (int i = 0; i < TUNER_MEASURE_STEPS; i++)
+    {
+        // Step doesn't wait for the device, finish so every kernel timing of this step is collected
+        mSim.Step();
+        mSim.mQueue.finish();
+        mSim.PerfData.UpdateTimings();
+
+        for (size_t t = 0; t < mSim.PerfData.Trackers.size(); t++)
+        {
+            const PM_PERFORMANCE_TRACKER *pTracker = mSim.PerfData.Trackers[t];
+            if (lastEnd[pTracker->eventName] == pTracker->time_end)
+                continue;
+
+            lastEnd[pTracker->eventName] = pTracker->time_end;
+            kernelTimes[TrackerBaseName(pTracker->eventName)] += (pTracker->time_end - pTracker->time_start) / 1000000.0;
+        }
+    }
+
+    return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / TUNER_MEASURE_STEPS;
+}
+
+bool KernelTuner::IsRadixGeometryValid(unsigned int items, unsigned int groups) const
+{
+    const size_t   maxWorkGroup = mSim.mCLDevice.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+    const cl_ulong localMem     = mSim.mCLDevice.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+    // histogram/reorder: one work-group of "items" with a local histogram per item
+    if ((items > maxWorkGroup) || (sizeof(cl_uint) * _RADIX * items > localMem))
+        return false;
+
+    // scanhistograms: _HISTOSPLIT work-groups, each scanning 2 values per item (power of 2)
+    const size_t scanItems = _RADIX * groups * items / 2 / _HISTOSPLIT;
+    const size_t scanCache = max((size_t)_HISTOSPLIT, (size_t)items * groups * _RADIX / _HISTOSPLIT);
+    return (scanItems >= 1) && (scanItems <= maxWorkGroup) && (sizeof(cl_uint) * scanCache <= localMem);
+}
+
+TuningConfig KernelTuner::Run()
+{
+    cout << "Autotuning kernels for " << mSim.mCLDevice.getInfo<CL_DEVICE_NAME>() << " (" << Params.particleCount << " particles)..." << endl;
+
+    // Tuning runs the simulation (restored by the caller)
+    const bool prevPause  = mSim.bPauseSim;
+    const bool prevCached = Params.EnableCachedBuffers;
+    mSim.bPauseSim = false;
+
+    TuningConfig best;
+    best.valid = true;
+    map<string, double> kernelTimes;
+
+    // Storage: image vs buffer (needs buffers and kernels to be recreated)
+    double bestTime = DBL_MAX;
+    for (int cached = 0; cached <= 1; cached++)
+    {
+        if (cached && !mSim.mCLDevice.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
+            continue;
+
+        Params.EnableCachedBuffers = (cached != 0);
+        mSim.mTuning = best;
+        if (!mSim.InitKernels())
+            continue;
+        mSim.InitBuffers();
+        mSim.InitCells();
+
+        const double time = MeasureSteps(kernelTimes);
+        cout << "  storage " << (cached ? "image " : "buffer") << ": " << time << " ms/step" << endl;
+        if (time < bestTime)
+        {
+            bestTime = time;
+            best.cachedBuffers = (cached != 0);
+        }
+    }
+
+    // Rebuild with the winning storage
+    Params.EnableCachedBuffers = best.cachedBuffers;
+    mSim.mTuning = best;
+    mSim.InitKernels();
+    mSim.InitBuffers();
+    mSim.InitCells();
+
+    // Radix geometry (buffers sizes depend on it)
+    bestTime = DBL_MAX;
+    for (size_t i = 0; i < ARRAY_SIZE(TUNER_RADIX_ITEMS); i++)
+    for (size_t g = 0; g < ARRAY_SIZE(TUNER_RADIX_GROUPS); g++)
+    {
+        if (!IsRadixGeometryValid(TUNER_RADIX_ITEMS[i], TUNER_RADIX_GROUPS[g]))
+            continue;
+
+        mSim.mTuning.radixItems  = TUNER_RADIX_ITEMS[i];
+        mSim.mTuning.radixGroups = TUNER_RADIX_GROUPS[g];
+        mSim.InitBuffers();
+        mSim.InitCells();
+        MeasureSteps(kernelTimes);
+
+        double time = 0.0;
+        for (size_t t = 0; t < ARRAY_SIZE(TUNER_RADIX_TRACKERS); t++)
+            time += kernelTimes[TUNER_RADIX_TRACKERS[t]];
+        time /= TUNER_MEASURE_STEPS;
+
+        cout << "  radix " << TUNER_RADIX_ITEMS[i] << "x" << TUNER_RADIX_GROUPS[g] << ": " << time << " ms/step" << endl;
+        if (time < bestTime)
+        {
+            bestTime = time;
+            best.radixItems  = TUNER_RADIX_ITEMS[i];
+            best.radixGroups = TUNER_RADIX_GROUPS[g];
+        }
+    }
+
+    // Local sizes (all kernels are measured together, each keeps its own winner)
+    mSim.mTuning = best;
+    mSim.InitBuffers();
+    mSim.InitCells();
+    map<string, double> bestKernelTimes;
+    for (size_t l = 0; l < ARRAY_SIZE(TUNER_LOCAL_SIZES); l++)
+    {
+        // Kernels that can't run with this local size stay on NullRange (and are not measured)
+        const size_t localSize = TUNER_LOCAL_SIZES[l];
+        mSim.mTuning.localSizes.clear();
+        for (size_t k = 0; k < ARRAY_SIZE(TUNER_KERNELS); k++)
+        {
+            map<string, cl::Kernel>::iterator kernel = mSim.mKernels.find(TUNER_KERNELS[k][0]);
+            if ((kernel != mSim.mKernels.end()) && (localSize <= kernel->second.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(mSim.mCLDevice)))
+                mSim.mTuning.localSizes[TUNER_KERNELS[k][0]] = localSize;
+        }
+
+        mSim.ResetParticles();
+        MeasureSteps(kernelTimes);
+
+        for (size_t k = 0; k < ARRAY_SIZE(TUNER_KERNELS); k++)
+        {
+            const string kernelName  = TUNER_KERNELS[k][0];
+            const string trackerName = TUNER_KERNELS[k][1];
+            if ((mSim.mTuning.localSizes.count(kernelName) == 0) || (kernelTimes.count(trackerName) == 0))
+                continue;
+
+            if ((bestKernelTimes.count(kernelName) == 0) || (kernelTimes[trackerName] < bestKernelTimes[kernelName]))
+            {
+                bestKernelTimes[kernelName] = kernelTimes[trackerName];
+                best.localSizes[kernelName] = localSize;
+            }
+        }
+    }
+
+    // Report
+    for (map<string, size_t>::const_iterator it = best.localSizes.begin(); it != best.localSizes.end(); it++)
+        cout << "  " << it->first << ": local size " << it->second << " (" << bestKernelTimes[it->first] / TUNER_MEASURE_STEPS << " ms/step)" << endl;
+    cout << "  storage " << (best.cachedBuffers ? "image" : "buffer") << ", radix " << best.radixItems << "x" << best.radixGroups << endl;
+
+    // Restore state
+    mSim.bPauseSim = prevPause;
+    Params.EnableCachedBuffers = prevCached;
+    mSim.mTuning = best;
+    return best;
+}
@@ -0,0 +1,57 @@
+#ifndef __KERNEL_TUNER_HPP
+#define __KERNEL_TUNER_HPP
+
+#include "hesp.hpp"
+
+#include <map>
+#include <string>
+
+using std::map;
+using std::string;
+
+class Simulation;
+
+// Per-device kernels configuration (persisted in a tuning file)
+struct TuningConfig
+{
+    bool                valid;         // Loaded from a tuning file or produced by the tuner
+    bool                cachedBuffers; // cbufferf storage: image (true) or buffer (false)
+    unsigned int        radixItems;    // Radix sort work-group size
+    unsigned int        radixGroups;   // Radix sort work-groups count
+    map<string, size_t> localSizes;    // Kernel name => local size (missing = NullRange)
+
+    TuningConfig();
+
+    bool Load(const string &fileName);
+    bool Save(const string &fileName, const string &header) const;
+};
+
+// Kernels autotuner
+//   Benchmarks image vs buffer storage, radix sort geometry and per-kernel local sizes on the active
+//   device with the current scenario. Each candidate is timed over a few steps after a warm-up.
+class KernelTuner
+{
+private:
+    // Avoid copy
+    KernelTuner &operator=(const KernelTuner &other);
+    KernelTuner (const KernelTuner &other);
+
+    Simulation &mSim;
+
+    // Run warm-up and measured steps, returns the wall clock time [ms/step] and the kernels times [ms] (by tracker name)
+    double MeasureSteps(map<string, double> &kernelTimes);
+
+    // Check that a radix geometry fits the device limits
+    bool IsRadixGeometryValid(unsigned int items, unsigned int groups) const;
+
+public:
+    explicit KernelTuner(Simulation &simulation);
+
+    // Tune the initialized simulation (buffers, kernels and particles are recreated while tuning)
+    TuningConfig Run();
+
+    // Tuning file of a device (device name and driver version)
+    static string TuningFileName(const cl::Device &device);
+};
+
+#endif // __KERNEL_TUNER_HPP
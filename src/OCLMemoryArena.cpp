@@ -0,0 +1,183 @@
+#include "OCLMemoryArena.h"
+#include "ocl/OCLUtils.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+OCLMemoryArena::OCLMemoryArena()
+    : mAlignment(256), Generation(0)
+{
+    const cl_mem_flags flags[OCL_ARENA_POOLS] = { CL_MEM_READ_ONLY, CL_MEM_READ_WRITE };
+    for (int i = 0; i < OCL_ARENA_POOLS; i++)
+    {
+        mPools[i].flags  = flags[i];
+        mPools[i].size   = 0;
+        mPools[i].used   = 0;
+        mPools[i].reused = false;
+    }
+}
+
+void OCLMemoryArena::Begin()
+{
+    // Release previous sub-buffers (the arenas themselves are kept for reuse)
+    Entries.clear();
+    for (int i = 0; i < OCL_ARENA_POOLS; i++)
+        mPools[i].used = 0;
+}
+
+void OCLMemoryArena::Reserve(const string &name, size_t size, bool perParticle, int pool)
+{
+    OCL_ARENA_ENTRY entry;
+    entry.name        = name;
+    entry.offset      = 0;
+    entry.size        = size;
+    entry.perParticle = perParticle;
+    entry.external    = false;
+    entry.pool        = pool;
+    Entries.push_back(entry);
+}
+
+void OCLMemoryArena::Commit(const cl::Context &context, const cl::Device &device)
+{
+    // Sub-buffers origin must be aligned to the device base address alignment (reported in bits)
+    mAlignment = max((size_t)device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8, (size_t)4);
+
+    // Layout
+    for (int p = 0; p < OCL_ARENA_POOLS; p++)
+        mPools[p].used = 0;
+    for (size_t i = 0; i < Entries.size(); i++)
+    {
+        if (Entries[i].external)
+            continue;
+
+        OCL_ARENA_POOL &pool = mPools[Entries[i].pool];
+        Entries[i].offset = pool.used;
+        pool.used += IntCeil(max(Entries[i].size, (size_t)1), mAlignment);
+    }
+
+    // Reuse the arenas if the layout fits, grow them otherwise (the previous one is released first)
+    for (int p = 0; p < OCL_ARENA_POOLS; p++)
+    {
+        OCL_ARENA_POOL &pool = mPools[p];
+        pool.reused = (pool.used <= pool.size) && (pool.buffer() != NULL);
+        if (!pool.reused)
+        {
+            pool.buffer = cl::Buffer();
+            pool.size   = pool.used;
+            if (pool.size > 0)
+                pool.buffer = cl::Buffer(context, pool.flags, pool.size);
+        }
+    }
+
+    // Carve sub-buffers
+    for (size_t i = 0; i < Entries.size(); i++)
+    {
+        if (Entries[i].external)
+            continue;
+
+        OCL_ARENA_POOL &pool = mPools[Entries[i].pool];
+        cl_buffer_region region;
+        region.origin = Entries[i].offset;
+        region.size   = max(Entries[i].size, (size_t)1);
+        Entries[i].memory = pool.buffer.createSubBuffer(pool.flags, CL_BUFFER_CREATE_TYPE_REGION, &region);
+    }
+
+    Generation++;
+}
+
+cl::Buffer OCLMemoryArena::Get(const string &name) const
+{
+    for (size_t i = 0; i < Entries.size(); i++)
+        if (!Entries[i].external && (Entries[i].name == name))
+            return *((const cl::Buffer*)&Entries[i].memory);
+
+    throw runtime_error("Memory arena has no buffer named " + name);
+}
+
+void OCLMemoryArena::Track(const string &name, const cl::Memory &memory, bool perParticle)
+{
+    // Replace if already tracked
+    for (size_t i = 0; i < Entries.size(); i++)
+    {
+        if (Entries[i].external && (Entries[i].name == name))
+        {
+            Entries[i].memory = memory;
+            Entries[i].size   = memory.getInfo<CL_MEM_SIZE>();
+            Generation++;
+            return;
+        }
+    }
+
+    OCL_ARENA_ENTRY entry;
+    entry.name        = name;
+    entry.offset      = 0;
+    entry.size        = memory.getInfo<CL_MEM_SIZE>();
+    entry.perParticle = perParticle;
+    entry.external    = true;
+    entry.pool        = -1;
+    entry.memory      = memory;
+    Entries.push_back(entry);
+    Generation++;
+}
+
+size_t OCLMemoryArena::GetArenaSize() const
+{
+    size_t size = 0;
+    for (int i = 0; i < OCL_ARENA_POOLS; i++)
+        size += mPools[i].size;
+
+    return size;
+}
+
+size_t OCLMemoryArena::GetTotalSize() const
+{
+    size_t total = GetArenaSize();
+    for (size_t i = 0; i < Entries.size(); i++)
+        if (Entries[i].external)
+            total += Entries[i].size;
+
+    return total;
+}
+
+cl_ulong OCLMemoryArena::EstimateMaxParticles(const cl::Device &device, unsigned int particleCapacity) const
+{
+    // Split sizes to fixed and per particle
+    size_t perParticleBytes = 0;
+    size_t fixedBytes = 0;
+    for (size_t i = 0; i < Entries.size(); i++)
+    {
+        if (Entries[i].perParticle)
+            perParticleBytes += Entries[i].size;
+        else
+            fixedBytes += Entries[i].size;
+    }
+
+    const cl_ulong globalMem = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    if ((particleCapacity == 0) || (perParticleBytes == 0) || (globalMem <= fixedBytes))
+        return 0;
+
+    return (cl_ulong)((globalMem - fixedBytes) / ((double)perParticleBytes / particleCapacity));
+}
+
+void OCLMemoryArena::PrintReport(ostream &os, const cl::Device &device, unsigned int particleCapacity) const
+{
+    static const char *poolNames[OCL_ARENA_POOLS] = { "read-only", "read/write" };
+
+    os << "Device memory report (alignment " << mAlignment << ")" << endl;
+    for (int p = 0; p < OCL_ARENA_POOLS; p++)
+        os << "  Arena " << left << setw(18) << poolNames[p] << right << setw(10) << mPools[p].size / 1024 << " KB, "
+           << mPools[p].used / 1024 << " KB used, " << (mPools[p].reused ? "reused" : "allocated") << endl;
+
+    for (size_t i = 0; i < Entries.size(); i++)
+    {
+        const OCL_ARENA_ENTRY &entry = Entries[i];
+        os << "  " << left << setw(24) << entry.name << right << setw(10) << entry.size / 1024 << " KB"
+           << (entry.perParticle ? "" : "  (fixed)") << (entry.external ? "  (external)" : "")
+           << (entry.pool == OCL_ARENA_READ_ONLY ? "  (read-only)" : "") << endl;
+    }
+
+    os << "  " << left << setw(24) << "Total" << right << setw(10) << GetTotalSize() / 1024 << " KB" << endl;
+    os << "  Capacity " << particleCapacity << " particles, max particles on device ~"
+       << EstimateMaxParticles(device, particleCapacity) << endl;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "hesp.hpp"
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+using namespace std;
+
+// Single memory arena entry (sub-buffer or tracked external object)
+typedef struct
+{
+    string     name;
+    size_t     offset;      // [bytes] inside the arena (external objects: 0)
+    size_t     size;        // [bytes]
+    bool       perParticle; // Size scales with the particles capacity
+    bool       external;    // Not carved from the arena (images, GL shared objects, ...)
+    int        pool;        // Backing buffer (see OCL_ARENA_POOLS)
+    cl::Memory memory;
+} OCL_ARENA_ENTRY;
+
+// Backing buffer of a memory kind
+typedef struct
+{
+    cl_mem_flags flags;
+    cl::Buffer   buffer;
+    size_t       size;
+    size_t       used;
+    bool         reused;
+} OCL_ARENA_POOL;
+
+// Memory kinds (device access)
+#define OCL_ARENA_READ_ONLY  0
+#define OCL_ARENA_READ_WRITE 1
+#define OCL_ARENA_POOLS      2
+
+
+// Device memory arena
+//   One large buffer per memory kind (read-only, read/write), typed sub-buffers are carved from it (aligned to
+//   CL_DEVICE_MEM_BASE_ADDR_ALIGN). Layout is rebuilt on every Begin/Commit pair, a backing buffer is kept as long
+//   as the new layout fits. A buffer is only freed once all its sub-buffers are: the owners have to drop their
+//   sub-buffer references before Begin, a grown arena doesn't then coexist with the previous one.
+class OCLMemoryArena
+{
+private:
+    // Avoid copy
+    OCLMemoryArena &operator=(const OCLMemoryArena &other);
+    OCLMemoryArena (const OCLMemoryArena &other);
+
+    OCL_ARENA_POOL mPools[OCL_ARENA_POOLS];
+    size_t         mAlignment;
+
+public:
+    // Current layout
+    vector<OCL_ARENA_ENTRY> Entries;
+
+    // Incremented each time the layout changes (allows UI to rebuild its rows)
+    unsigned int Generation;
+
+public:
+    OCLMemoryArena();
+
+    // Start a new layout (previous sub-buffers are released)
+    void Begin();
+
+    // Reserve a region in the new layout
+    void Reserve(const string &name, size_t size, bool perParticle = true, int pool = OCL_ARENA_READ_WRITE);
+
+    // Allocate (or reuse) the backing buffers and create all sub-buffers
+    void Commit(const cl::Context &context, const cl::Device &device);
+
+    // Get a committed sub-buffer
+    cl::Buffer Get(const string &name) const;
+
+    // Add an object that is allocated outside of the arena to the report
+    void Track(const string &name, const cl::Memory &memory, bool perParticle = true);
+
+    // Estimate the max particles count the device can hold (per particle sizes are assumed to be linear)
+    cl_ulong EstimateMaxParticles(const cl::Device &device, unsigned int particleCapacity) const;
+
+    // Print a per-buffer report
+    void PrintReport(ostream &os, const cl::Device &device, unsigned int particleCapacity) const;
+
+    size_t GetArenaSize() const;
+    size_t GetTotalSize() const;
+};
@@ -22,6 +22,7 @@ cl::Event *OCLPerfMon::GetTrackerEvent(string trackerName, int iterationIndex)
         pTracker->eventName = trackerName;
 
         // Add to map & vector
+        lock_guard<mutex> lock(m_Mutex);
         m_TrackerMap[trackerName] = Trackers.size();
         Trackers.push_back(pTracker);
 
@@ -35,17 +36,47 @@ cl::Event *OCLPerfMon::GetTrackerEvent(string trackerName, int iterationIndex)
 
 void OCLPerfMon::UpdateTimings()
 {
+    lock_guard<mutex> lock(m_Mutex);
     for (size_t i = 0; i < Trackers.size(); i++)
     {
-        // get start and stop times
-        Trackers[i]->time_start = Trackers[i]->event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-        Trackers[i]->time_end   = Trackers[i]->event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        // Skip events still queued or running (picked up by a later call) and trackers that never ran
+        PM_PERFORMANCE_TRACKER *pTracker = Trackers[i];
+        if ((pTracker->event() == NULL) || (pTracker->event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE))
+            continue;
+
+        // get start and stop times (the same event is only counted once)
+        const cl_ulong time_end = pTracker->event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+        if (time_end == pTracker->time_end)
+            continue;
+        pTracker->time_start = pTracker->event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        pTracker->time_end   = time_end;
 
         const float weight = 0.5;
-        double current_time = (Trackers[i]->time_end - Trackers[i]->time_start) / 1000000.0;
+        double current_time = (pTracker->time_end - pTracker->time_start) / 1000000.0;
 
         // Compute total time
-        Trackers[i]->total_time = current_time * (1.0 - weight) + Trackers[i]->last_time * weight;
-        Trackers[i]->last_time = Trackers[i]->total_time;
+        pTracker->total_time = current_time * (1.0 - weight) + pTracker->last_time * weight;
+        pTracker->last_time = pTracker->total_time;
+        pTracker->sum_time += current_time;
+        pTracker->samples++;
     }
 }
+
+void OCLPerfMon::GetTimings(vector<pair<string, double> > &timings) const
+{
+    lock_guard<mutex> lock(m_Mutex);
+    timings.resize(Trackers.size());
+    for (size_t i = 0; i < Trackers.size(); i++)
+        timings[i] = make_pair(Trackers[i]->eventName, Trackers[i]->total_time);
+}
+
+double OCLPerfMon::GetAverageTime(const string &prefix) const
+{
+    lock_guard<mutex> lock(m_Mutex);
+    double time = 0.0;
+    for (size_t i = 0; i < Trackers.size(); i++)
+        if ((Trackers[i]->samples > 0) && (Trackers[i]->eventName.compare(0, prefix.length(), prefix) == 0))
+            time += Trackers[i]->sum_time / Trackers[i]->samples;
+
+    return time;
+}
@@ -4,6 +4,8 @@
 
 #include <map>
 #include <map>
+#include <mutex>
+#include <utility>
 #include <string.h>
 
 using namespace std;
@@ -21,6 +23,10 @@ typedef struct
     double total_time;   // [millisec]
     double last_time;    // [millisec]
 
+    // all collected measurements
+    double       sum_time; // [millisec]
+    unsigned int samples;
+
     // User define type
     int Tag;
 
@@ -34,6 +40,9 @@ private:
     // Map to translate trackerName to event index inside "Trackers" vector
     map<string, int> m_TrackerMap;
 
+    // Guards the trackers list and times (the simulation may step on another thread, see GetTimings)
+    mutable std::mutex m_Mutex;
+
 public:
     // A list of all existing measurement events
     vector<PM_PERFORMANCE_TRACKER *> Trackers;
@@ -41,6 +50,12 @@ public:
     // use to get the event
     cl::Event *GetTrackerEvent(string trackerName, int iterationIndex = -1);
 
-    // A method to compute execution time for each tracker (needs to be called after clFinish)
+    // A method to compute execution time for each completed tracker (non blocking, running events are skipped)
     void UpdateTimings();
+
+    // Sum of the average times of the trackers whose name starts with prefix (e.g. all "computeDelta_N") [millisec]
+    double GetAverageTime(const string &prefix) const;
+
+    // Copy of the trackers names and times [millisec] (safe from any thread)
+    void GetTimings(vector<pair<string, double> > &timings) const;
 };
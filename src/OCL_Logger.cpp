@@ -3,38 +3,58 @@
 #include <iostream>
 #include <sstream>
 #include <regex>
+#include <algorithm>
 
 OCL_Logger::OCL_Logger() : 
-    m_bufferSize(0),
+    m_enabled(false),
+    m_ringSize(0),
     m_lastReportIndex(0),
+    m_counter(0),
+    m_overflowCount(0),
     m_debugBuf(),
-    m_localBuf(NULL),
+    m_snapshotBuf(),
+    m_localBuf(),
+    m_readState(LOG_READ_IDLE),
+    m_readEvent(),
     m_msgMap()
 {
 }
 
-void OCL_Logger::StartKernelProcessing(cl::Context context, cl::Device device, int bufferSize)
+void OCL_Logger::StartKernelProcessing(cl::Context context, bool enabled, unsigned int ringSize)
 {
-    // Save buffer size
-    m_bufferSize = bufferSize;
-
-    // Reset report index
+    // Drop previous state
+    Flush();
+    m_enabled         = enabled;
     m_lastReportIndex = 0;
+    m_counter         = 0;
+    m_overflowCount   = 0;
+    m_readState       = LOG_READ_IDLE;
+    m_debugBuf        = cl::Buffer();
+    m_snapshotBuf     = cl::Buffer();
+    m_localBuf.clear();
 
-    // Allocate local buffer
-    delete[] m_localBuf; m_localBuf = new int[bufferSize / 4];
-    memset(m_localBuf, 0, bufferSize);
+    // Reset message map
+    m_msgMap.clear();
 
-    // Allocate GPU buffer
-    m_debugBuf = cl::Buffer(context, CL_MEM_READ_WRITE, bufferSize); 
+    if (!m_enabled)
+    {
+        m_ringSize = 0;
+        return;
+    }
 
-    // Reset buffer
-    cl::CommandQueue queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
-    queue.enqueueWriteBuffer(m_debugBuf, CL_TRUE, 0, bufferSize, m_localBuf);
-    queue.finish();
+    // Ring size is a power of 2 (counter wrapping stays consistent)
+    m_ringSize = 1;
+    while (m_ringSize < ringSize)
+        m_ringSize <<= 1;
 
-    // Reset message map
-    m_msgMap.clear();
+    // Allocate local buffer (counter + ring)
+    m_localBuf.assign(1 + m_ringSize, 0);
+
+    // Allocate GPU buffer (initialized from the zeroed local buffer)
+    m_debugBuf = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, m_localBuf.size() * sizeof(int), &m_localBuf[0]);
+
+    // Snapshot the host reads (counter and payload of the same poll)
+    m_snapshotBuf = cl::Buffer(context, CL_MEM_READ_WRITE, m_localBuf.size() * sizeof(int));
 }
 
 string OCL_Logger::PatchKernel(string kernelSource)
@@ -79,38 +99,90 @@ cl::Buffer& OCL_Logger::GetDebugBuffer()
 
 void OCL_Logger::CycleExecute(cl::CommandQueue queue)
 {
-    // Read debug buffer
-    queue.enqueueReadBuffer(m_debugBuf, CL_TRUE, 0, m_bufferSize, m_localBuf);
-    queue.finish();
+    if (!m_enabled)
+        return;
 
-    // Update report index
-    int reportIndex = m_localBuf[0];
-    int prevReportIndex = m_lastReportIndex;
-    m_lastReportIndex = reportIndex;
+    // Wait (without blocking) for the outstanding read
+    if ((m_readState != LOG_READ_IDLE) && (m_readEvent.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE))
+        return;
 
-    // Check if there was an buffer warping
-    int queueSize = m_bufferSize / 4 - 1;
-    if (reportIndex - prevReportIndex >= queueSize)
+    switch (m_readState)
     {
-        cout << "Logger Error: buffer is too small" << endl;
-        return ;
+        case LOG_READ_IDLE:
+            // Snapshot the buffer after the enqueued kernels (in-order queue), read its counter only (4 bytes)
+            queue.enqueueCopyBuffer(m_debugBuf, m_snapshotBuf, 0, 0, m_localBuf.size() * sizeof(int));
+            queue.enqueueReadBuffer(m_snapshotBuf, CL_FALSE, 0, sizeof(int), &m_counter, NULL, &m_readEvent);
+            m_readState = LOG_READ_COUNTER;
+            break;
+
+        case LOG_READ_COUNTER:
+        {
+            // Nothing was logged
+            const unsigned int pending = m_counter - m_lastReportIndex;
+            if (pending == 0)
+            {
+                m_readState = LOG_READ_IDLE;
+                break;
+            }
+
+            // Ring wrapped before we read it: messages boundaries are lost, skip them
+            if (pending > m_ringSize)
+            {
+                m_overflowCount  += pending;
+                m_lastReportIndex = m_counter;
+                cout << "Logger: ring overflow, " << pending << " words lost (" << m_overflowCount << " total)" << endl;
+                m_readState = LOG_READ_IDLE;
+                break;
+            }
+
+            // Read the new words only from the snapshot (two reads if they wrap)
+            const unsigned int first = m_lastReportIndex & (m_ringSize - 1);
+            const unsigned int count1 = min(pending, m_ringSize - first);
+            const unsigned int count2 = pending - count1;
+            if (count2 > 0)
+                queue.enqueueReadBuffer(m_snapshotBuf, CL_FALSE, sizeof(int), count2 * sizeof(int), &m_localBuf[1]);
+            queue.enqueueReadBuffer(m_snapshotBuf, CL_FALSE, (1 + first) * sizeof(int), count1 * sizeof(int), &m_localBuf[1 + first], NULL, &m_readEvent);
+            m_readState = LOG_READ_PAYLOAD;
+            break;
+        }
+
+        case LOG_READ_PAYLOAD:
+            // Counter and payload come from the same snapshot, process up to it
+            ProcessReports(m_counter);
+            m_readState = LOG_READ_IDLE;
+            break;
     }
+}
+
+void OCL_Logger::ProcessReports(unsigned int reportIndex)
+{
+    unsigned int prevReportIndex = m_lastReportIndex;
+    m_lastReportIndex = reportIndex;
 
-    // Process reports
-    while (prevReportIndex != reportIndex)
+    // Process reports (signed distance guards against a corrupted size)
+    const unsigned int mask = m_ringSize - 1;
+    while ((int)(reportIndex - prevReportIndex) > 0)
     {
         // get report size & code
-        int reportSize = m_localBuf[1 + (prevReportIndex++ % queueSize)];
-        int reportCode = m_localBuf[1 + (prevReportIndex++ % queueSize)];
+        int reportSize = m_localBuf[1 + (prevReportIndex++ & mask)];
+        int reportCode = m_localBuf[1 + (prevReportIndex++ & mask)];
 
         // print header
         cout << m_msgMap[reportCode] << " ";
 
         // print values
         for (int i = 0; i < reportSize - 2; i++)
-            cout << *((float*)(&m_localBuf[1 + (prevReportIndex++ % queueSize)])) << " ";
+            cout << *((float*)(&m_localBuf[1 + (prevReportIndex++ & mask)])) << " ";
 
         // end line
         cout << endl;
     }
 }
+
+void OCL_Logger::Flush()
+{
+    if (m_readState != LOG_READ_IDLE)
+        m_readEvent.wait();
+
+    m_readState = LOG_READ_IDLE;
+}
@@ -5,26 +5,55 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 using namespace std;
 
+// Debug buffer layout: [0] = write counter (in words), [1..ringSize] = messages ring
+// The host polls the counter asynchronously and reads the payload only when it moved. Both are read from a device
+// side snapshot of the buffer (copied at the counter poll), so later kernels can't overwrite the payload in between.
 class OCL_Logger
 {
 private:
-    int        m_bufferSize;
-    int        m_lastReportIndex;
-    cl::Buffer m_debugBuf;
-    int*       m_localBuf;
+    // Async read states
+    enum ReadState
+    {
+        LOG_READ_IDLE,
+        LOG_READ_COUNTER,
+        LOG_READ_PAYLOAD,
+    };
+
+    bool         m_enabled;
+    unsigned int m_ringSize;        // [words] power of 2
+    unsigned int m_lastReportIndex; // [words] counter value that was already processed
+    unsigned int m_counter;         // async counter read destination
+    unsigned int m_overflowCount;   // [words] lost because the ring wrapped before it was read
+    cl::Buffer   m_debugBuf;
+    cl::Buffer   m_snapshotBuf;     // debug buffer copy read by the host
+    vector<int>  m_localBuf;        // ring copy
+    ReadState    m_readState;
+    cl::Event    m_readEvent;
     map<int/*msgID*/, string/*message*/> m_msgMap;
 
+    void ProcessReports(unsigned int reportIndex);
+
 public:
     OCL_Logger();
 
-    void StartKernelProcessing(cl::Context context, cl::Device device, int bufferSize);
+    // Setup for a new program (ringSize is rounded up to a power of 2, disabled loggers allocate nothing)
+    void StartKernelProcessing(cl::Context context, bool enabled, unsigned int ringSize);
 
     string PatchKernel(string kernelSource);
 
     cl::Buffer& GetDebugBuffer();
 
+    bool IsEnabled() const { return m_enabled; }
+
+    unsigned int GetOverflowCount() const { return m_overflowCount; }
+
+    // Non blocking, call once per step
     void CycleExecute(cl::CommandQueue queue);
+
+    // Wait for outstanding reads (needed before the logger is replaced)
+    void Flush();
 };
@@ -18,51 +18,83 @@ using namespace std;
 //
 // OpenGL timing
 //
-string CurrentTimingSection;
-map<string, OGLU_PERFORMANCE_TRACKER> TimingsMap;
 list<OGLU_PERFORMANCE_TRACKER*> g_OGL_Timings;
 
-void OGLU_StartTimingSection(const char* szSectionTitle)
+#if OGLU_TIMING_LEVEL > 0
+
+typedef struct
 {
-    // Check if we need to close last section
-    if (CurrentTimingSection.length())
-        OGLU_EndTimingSection();
+    OGLU_PERFORMANCE_TRACKER* pTracker;
+    int                       queryIndex; // -1: not measured (queries in flight)
+} OGLU_OPEN_SECTION;
+
+map<string, OGLU_PERFORMANCE_TRACKER> TimingsMap;
+vector<OGLU_OPEN_SECTION> OpenTimingSections;
+unsigned long long TimingFrame = 0;
 
+void OGLU_StartTimingSection(const char* szSectionTitle)
+{
     // Check if needs to create section
-    CurrentTimingSection = szSectionTitle;
-    if (!TimingsMap.count(CurrentTimingSection))
+    string sectionName = szSectionTitle;
+    if (!TimingsMap.count(sectionName))
     {
         // Create new tracker object
         OGLU_PERFORMANCE_TRACKER tracker;
-        memset(&tracker, 0, sizeof(tracker));
-        glGenQueries(TIMING_HISTORY_DEPTH, tracker.queryObject);
-        tracker.sectionName = CurrentTimingSection;
+        tracker.sectionName = sectionName;
+        tracker.depth = (int)OpenTimingSections.size();
+        glGenQueries(TIMING_HISTORY_DEPTH * 2, &tracker.queryObject[0][0]);
+        memset(tracker.queryFrame, 0, sizeof(tracker.queryFrame));
+        tracker.queryNext = 0;
+        tracker.queryPending = 0;
+        tracker.queryIssued = false;
+        memset(tracker.history, 0, sizeof(tracker.history));
+        tracker.historyCount = 0;
+        tracker.historyNext = 0;
+        tracker.total_time_ms = tracker.min_time_ms = tracker.avg_time_ms = tracker.max_time_ms = 0.0;
+        tracker.latency = tracker.maxLatency = tracker.dropped = 0;
+        tracker.tag = 0;
 
         // Add new map entry
-        TimingsMap[CurrentTimingSection] = tracker;
+        TimingsMap[sectionName] = tracker;
 
         // Add list entry
-        g_OGL_Timings.push_back(&TimingsMap[CurrentTimingSection]);
+        g_OGL_Timings.push_back(&TimingsMap[sectionName]);
+    }
+
+    OGLU_OPEN_SECTION section;
+    section.pTracker = &TimingsMap[sectionName];
+    section.pTracker->queryIssued = true;
+
+    // All queries in flight: skip this frame rather than waiting for a result
+    if (section.pTracker->queryPending == TIMING_HISTORY_DEPTH)
+    {
+        section.pTracker->dropped++;
+        section.queryIndex = -1;
+    }
+    else
+    {
+        section.queryIndex = section.pTracker->queryNext;
+        section.pTracker->queryNext = (section.pTracker->queryNext + 1) % TIMING_HISTORY_DEPTH;
+        section.pTracker->queryPending++;
+        section.pTracker->queryFrame[section.queryIndex] = TimingFrame;
+        glQueryCounter(section.pTracker->queryObject[section.queryIndex][0], GL_TIMESTAMP);
     }
 
-    // Setup query
-    OGLU_PERFORMANCE_TRACKER* pTracker = &TimingsMap[CurrentTimingSection];
-    pTracker->queryInprogress = true;
-    pTracker->currentQOIndex = (pTracker->currentQOIndex + 1) % TIMING_HISTORY_DEPTH;
-    glBeginQuery(GL_TIME_ELAPSED, pTracker->queryObject[pTracker->currentQOIndex]);
+    OpenTimingSections.push_back(section);
 }
 
 void OGLU_EndTimingSection()
 {
-    // Do nothign if we're out of section
-    if (CurrentTimingSection.length() == 0)
+    // Do nothing if we're out of section
+    if (OpenTimingSections.empty())
         return;
 
-    // End timing
-    glEndQuery (GL_TIME_ELAPSED);
+    // End timing of the innermost section
+    const OGLU_OPEN_SECTION &section = OpenTimingSections.back();
+    if (section.queryIndex >= 0)
+        glQueryCounter(section.pTracker->queryObject[section.queryIndex][1], GL_TIMESTAMP);
 
-    // Clear current section
-    CurrentTimingSection.clear();
+    OpenTimingSections.pop_back();
 }
 
 void OGLU_CollectTimings()
@@ -70,29 +102,73 @@ void OGLU_CollectTimings()
     list<OGLU_PERFORMANCE_TRACKER*>::iterator iter;
     for (iter = g_OGL_Timings.begin(); iter != g_OGL_Timings.end(); ++iter)
     {
-        // Skip if query was not started
-        if (!(*iter)->queryInprogress)
+        OGLU_PERFORMANCE_TRACKER* pTracker = *iter;
+
+        // Read the available results, oldest first (an open section's end timestamp is not issued yet)
+        while (pTracker->queryPending > 0)
         {
-            (*iter)->total_time_nano = 0;
-            (*iter)->total_time_ms = 0;
-            continue;
+            int oldestIndex = (pTracker->queryNext + TIMING_HISTORY_DEPTH - pTracker->queryPending) % TIMING_HISTORY_DEPTH;
+            bool bOpen = false;
+            for (size_t i = 0; i < OpenTimingSections.size(); i++)
+                bOpen |= (OpenTimingSections[i].pTracker == pTracker) && (OpenTimingSections[i].queryIndex == oldestIndex);
+            if (bOpen)
+                break;
+
+            // Timestamps complete in order: the start is available with the end
+            GLint available = GL_FALSE;
+            glGetQueryObjectiv(pTracker->queryObject[oldestIndex][1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+
+            GLuint64 startTime, endTime;
+            glGetQueryObjectui64v(pTracker->queryObject[oldestIndex][0], GL_QUERY_RESULT, &startTime);
+            glGetQueryObjectui64v(pTracker->queryObject[oldestIndex][1], GL_QUERY_RESULT, &endTime);
+            pTracker->queryPending--;
+
+            // Convert to millisec
+            pTracker->total_time_ms = (endTime - startTime) / 1000000.0;
+            pTracker->history[pTracker->historyNext] = pTracker->total_time_ms;
+            pTracker->historyNext = (pTracker->historyNext + 1) % TIMING_STATS_DEPTH;
+            pTracker->historyCount = min(pTracker->historyCount + 1, TIMING_STATS_DEPTH);
+
+            // Frames until the result was available
+            pTracker->latency = (unsigned int)(TimingFrame - pTracker->queryFrame[oldestIndex]);
+            pTracker->maxLatency = max(pTracker->maxLatency, pTracker->latency);
         }
 
-        // Compute the index of the oldest item
-        int oldestIndex = ((*iter)->currentQOIndex + TIMING_HISTORY_DEPTH - 1) % TIMING_HISTORY_DEPTH;
+        // Section no longer measured (e.g. render mode change): clear its results
+        if (!pTracker->queryIssued && (pTracker->queryPending == 0))
+        {
+            pTracker->historyCount = 0;
+            pTracker->total_time_ms = 0.0;
+        }
+        pTracker->queryIssued = false;
 
-        // Skip non-valid queries
-        if (!glIsQuery((*iter)->queryObject[oldestIndex]))
-            continue;
+        // Statistics over the history
+        pTracker->min_time_ms = pTracker->avg_time_ms = pTracker->max_time_ms = 0.0;
+        for (int i = 0; i < pTracker->historyCount; i++)
+        {
+            double time = pTracker->history[i];
+            pTracker->min_time_ms  = (i == 0) ? time : min(pTracker->min_time_ms, time);
+            pTracker->max_time_ms  = max(pTracker->max_time_ms, time);
+            pTracker->avg_time_ms += time / pTracker->historyCount;
+        }
+    }
 
-        // Get result
-        glGetQueryObjecti64v ((*iter)->queryObject[oldestIndex], GL_QUERY_RESULT, &(*iter)->total_time_nano);
+    TimingFrame++;
+}
 
-        // Convert to millisec
-        (*iter)->total_time_ms = (*iter)->total_time_nano / 1000000.0;
+#endif // OGLU_TIMING_LEVEL > 0
 
-        // Reset QueryInprogress
-        (*iter)->queryInprogress = false;
+void OGLU_ReportTimings(ostream &out)
+{
+    list<OGLU_PERFORMANCE_TRACKER*>::iterator iter;
+    for (iter = g_OGL_Timings.begin(); iter != g_OGL_Timings.end(); ++iter)
+    {
+        const OGLU_PERFORMANCE_TRACKER* pTracker = *iter;
+        out << string(2 * (pTracker->depth + 1), ' ') << pTracker->sectionName << ": "
+            << pTracker->min_time_ms << " / " << pTracker->avg_time_ms << " / " << pTracker->max_time_ms << " ms (min/avg/max), "
+            << "latency " << pTracker->maxLatency << " frames, " << pTracker->dropped << " dropped" << endl;
     }
 }
 
@@ -662,7 +738,13 @@ void Mesh::LoadObj(const string objFile)
     ifstream in(objFile, ios::in);
     if (!in) 
         throw "Error opening obj file";
- 
+
+    // Reloading replaces the previous mesh
+    vertices.clear();
+    normals.clear();
+    uvs.clear();
+    elements.clear();
+
     vector<glm::vec4> obj_vertices;
     vector<glm::vec3> obj_normals;
     vector<glm::vec2> obj_uvs;
@@ -737,8 +819,18 @@ void Mesh::LoadObj(const string objFile)
     }
 }
 
+Mesh::Mesh()
+    : VBO_vertices_handle(0), VBO_elements_handle(0), VBO_vertex_size(0),
+      VBO_offset_vertex(-1), VBO_offset_normal(-1), VBO_offset_uv(-1)
+{
+}
+
 void Mesh::CreateVBO()
 {
+    // Release previous VBOs (glDeleteBuffers ignores 0)
+    glDeleteBuffers(1, &VBO_vertices_handle);
+    glDeleteBuffers(1, &VBO_elements_handle);
+
     // Compute VBO object size and offsets
     VBO_vertex_size = 0;
     VBO_offset_vertex = VBO_offset_normal = VBO_offset_uv = -1;
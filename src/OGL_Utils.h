@@ -4,6 +4,7 @@
 #include <glm/glm.hpp>
 
 #include <list>
+#include <ostream>
 #include <string>
 #include <vector>
 using namespace std;
@@ -34,25 +35,86 @@ void OGLU_CheckCoreError(const char* szTitle);
 
 //
 // Timing related
+//   A section measures the GPU time of the commands issued between its start and end with a pair of timestamp
+//   queries, so sections nest (the innermost open section is ended first, see OGLU_TimingScope). Results are
+//   read once available only: a frame never waits for the queries of the previous ones, the frames it took for
+//   a result to be available are tracked as its latency. When all queries of a section are still in flight the
+//   section is not measured on that frame (dropped) rather than stalling it.
 //
-#define TIMING_HISTORY_DEPTH 4
+//   OGLU_TIMING_LEVEL selects the sections compiled in: 0 none (timing compiled out), 1 frame stages, 2 the
+//   passes within the stages too.
+//
+#ifndef OGLU_TIMING_LEVEL
+#define OGLU_TIMING_LEVEL 2
+#endif
+
+#define TIMING_HISTORY_DEPTH 4  // Queries in flight per section
+#define TIMING_STATS_DEPTH   64 // Results kept for min/avg/max
 
 typedef struct
 {
     string  sectionName;
-    GLuint  queryObject[TIMING_HISTORY_DEPTH];
-    GLuint  queryInprogress;
-    int     currentQOIndex;
-    GLint64 total_time_nano;   
-    double  total_time_ms;
+    int     depth;                                  // Nesting level of its first start (0: top level)
+    GLuint  queryObject[TIMING_HISTORY_DEPTH][2];   // Start and end timestamps
+    unsigned long long queryFrame[TIMING_HISTORY_DEPTH];
+    int     queryNext;
+    int     queryPending;
+    bool    queryIssued;                            // Started since the last collection
+
+    // Results (ms)
+    double  history[TIMING_STATS_DEPTH];
+    int     historyCount;
+    int     historyNext;
+    double  total_time_ms;                          // Latest result
+    double  min_time_ms;
+    double  avg_time_ms;
+    double  max_time_ms;
+
+    // Latency (frames between the query and its result) and frames not measured
+    unsigned int latency;
+    unsigned int maxLatency;
+    unsigned int dropped;
+
     int     tag;
 } OGLU_PERFORMANCE_TRACKER;
 
 extern list<OGLU_PERFORMANCE_TRACKER*> g_OGL_Timings;
 
+#if OGLU_TIMING_LEVEL > 0
 void OGLU_StartTimingSection(const char* szSectionTitle);
 void OGLU_EndTimingSection();
 void OGLU_CollectTimings();
+#else
+inline void OGLU_StartTimingSection(const char*) { }
+inline void OGLU_EndTimingSection() { }
+inline void OGLU_CollectTimings() { }
+#endif
+
+// Per section min/avg/max and latency
+void OGLU_ReportTimings(ostream &out);
+
+// Section lasting for the enclosing scope
+class OGLU_TimingScope
+{
+public:
+    explicit OGLU_TimingScope(const char* szSectionTitle) { OGLU_StartTimingSection(szSectionTitle); }
+    ~OGLU_TimingScope() { OGLU_EndTimingSection(); }
+};
+
+#define OGLU_TIMING_SCOPE_ID2(line) timingScope##line
+#define OGLU_TIMING_SCOPE_ID(line)  OGLU_TIMING_SCOPE_ID2(line)
+
+#if OGLU_TIMING_LEVEL >= 1
+#define OGLU_TIMING_SCOPE(szSectionTitle) OGLU_TimingScope OGLU_TIMING_SCOPE_ID(__LINE__)(szSectionTitle)
+#else
+#define OGLU_TIMING_SCOPE(szSectionTitle)
+#endif
+
+#if OGLU_TIMING_LEVEL >= 2
+#define OGLU_TIMING_DETAIL_SCOPE(szSectionTitle) OGLU_TimingScope OGLU_TIMING_SCOPE_ID(__LINE__)(szSectionTitle)
+#else
+#define OGLU_TIMING_DETAIL_SCOPE(szSectionTitle)
+#endif
 
 //
 // Help classes
@@ -123,6 +185,8 @@ public:
     GLint VBO_offset_normal;
     GLint VBO_offset_uv;
 
+    Mesh();
+
     void CreateVBO();
     void Draw(int nInstances);
     void LoadObj(const string objFile);
@@ -1,4 +1,6 @@
 #include "ParamUtils.hpp"
+#include "ParticlesFile.hpp"
+#include "Resources.hpp"
 
 #include <algorithm>
 #include <iostream>
@@ -6,8 +8,15 @@
 #include <sstream>
 #include <stdexcept>
 #include <cassert>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
 
 using std::string;
+using std::vector;
 using std::istringstream;
 using std::ifstream;
 using std::cout;
@@ -21,11 +30,67 @@ Parameters Params;
 // A variable that indicates a change in the paramaters
 bool ParametersChanged;
 
+// Initial particles file of the scenario (empty: fluid blocks)
+string ParticlesFileName;
+
+// Fluid block as written in the scenario file
+struct FluidBlockDesc
+{
+    float min[3];
+    float max[3];
+    float jitter;
+};
+
+static void ComputeParticleBlocks(const vector<FluidBlockDesc> &fluidBlocks)
+{
+    const float d = Params.h * Params.setupSpacing;
+    memset(Params.blocks, 0, sizeof(Params.blocks));
+
+    // No blocks: a single cube of particleCount particles (the original setup)
+    if (fluidBlocks.empty())
+    {
+        unsigned int perAxis = std::max((unsigned int)floor(cbrt((double)Params.particleCount)), 1u);
+        while (perAxis * perAxis * perAxis < Params.particleCount)
+            perAxis++;
+
+        ParticleBlock &block = Params.blocks[0];
+        block.originX = (1.0f - perAxis * d) / 2.0f;
+        block.originY = 0.3f;
+        block.originZ = (1.0f - perAxis * d) / 2.0f;
+        block.sizeX   = block.sizeY = block.sizeZ = perAxis;
+        block.count   = Params.particleCount;
+        Params.blocksCount = 1;
+        return;
+    }
+
+    // Lattice that fits inside each block
+    Params.blocksCount   = (unsigned int)fluidBlocks.size();
+    Params.particleCount = 0;
+    for (size_t b = 0; b < fluidBlocks.size(); b++)
+    {
+        const FluidBlockDesc &desc = fluidBlocks[b];
+        ParticleBlock &block = Params.blocks[b];
+        block.originX = desc.min[0];
+        block.originY = desc.min[1];
+        block.originZ = desc.min[2];
+        block.sizeX   = (unsigned int)std::max(floorf((desc.max[0] - desc.min[0]) / d) + 1.0f, 1.0f);
+        block.sizeY   = (unsigned int)std::max(floorf((desc.max[1] - desc.min[1]) / d) + 1.0f, 1.0f);
+        block.sizeZ   = (unsigned int)std::max(floorf((desc.max[2] - desc.min[2]) / d) + 1.0f, 1.0f);
+        block.count   = block.sizeX * block.sizeY * block.sizeZ;
+        block.jitter  = desc.jitter;
+        Params.particleCount += block.count;
+    }
+}
+
 void LoadParameters(string parameters)
 {
     // Open file
     istringstream ss(parameters);
 
+    // Fluid blocks are collected from the file (not kept between loads)
+    vector<FluidBlockDesc> fluidBlocks;
+    ParticlesFileName = "";
+
     // Scan all lines
     string line; 
     string parameter;
@@ -45,7 +110,8 @@ void LoadParameters(string parameters)
         if (line.size() == 0)
             continue;
 
-        // Convert line to lower case
+        // Convert line to lower case (file names are read from the original line)
+        const string originalLine = line;
         transform(line.begin(), line.end(), line.begin(), ::tolower);
 
         // Extract parameter name
@@ -59,6 +125,7 @@ void LoadParameters(string parameters)
         // Store value into relevent parameter
         /**/ if (parameter == "resetsimonchange")    ss >> Params.resetSimOnChange;
         else if (parameter == "particlecount")       ss >> Params.particleCount;
+        else if (parameter == "particlecapacity")    ss >> Params.particleCapacity;
         else if (parameter == "xmin")                ss >> Params.xMin;
         else if (parameter == "xmax")                ss >> Params.xMax;
         else if (parameter == "ymin")                ss >> Params.yMin;
@@ -68,12 +135,28 @@ void LoadParameters(string parameters)
         else if (parameter == "wavegenamp")          ss >> Params.waveGenAmp;
         else if (parameter == "wavegenfreq")         ss >> Params.waveGenFreq;
         else if (parameter == "wavegenduty")         ss >> Params.waveGenDuty;
+        else if (parameter == "emittersize")         ss >> Params.emitterSize;
+        else if (parameter == "emitterx")            ss >> Params.emitterX;
+        else if (parameter == "emittery")            ss >> Params.emitterY;
+        else if (parameter == "emitterz")            ss >> Params.emitterZ;
+        else if (parameter == "emittervelx")         ss >> Params.emitterVelX;
+        else if (parameter == "emittervely")         ss >> Params.emitterVelY;
+        else if (parameter == "emittervelz")         ss >> Params.emitterVelZ;
+        else if (parameter == "sinkxmin")            ss >> Params.sinkXMin;
+        else if (parameter == "sinkxmax")            ss >> Params.sinkXMax;
+        else if (parameter == "sinkymin")            ss >> Params.sinkYMin;
+        else if (parameter == "sinkymax")            ss >> Params.sinkYMax;
+        else if (parameter == "sinkzmin")            ss >> Params.sinkZMin;
+        else if (parameter == "sinkzmax")            ss >> Params.sinkZMax;
+        else if (parameter == "killoutsidedomain")   ss >> Params.killOutsideDomain;
         else if (parameter == "timestep")            ss >> Params.timeStep;
         else if (parameter == "simiterations")       ss >> Params.simIterations;
         else if (parameter == "substeps")            ss >> Params.subSteps;
 
         else if (parameter == "smoothlen")           ss >> Params.h;
         else if (parameter == "gridbuffersize")      ss >> Params.gridBufSize;
+        else if (parameter == "cellcurve")           ss >> Params.cellCurve;
+        else if (parameter == "cellcurvegranularity") ss >> Params.cellCurveGranularity;
         else if (parameter == "restdensity")         ss >> Params.restDensity;
         else if (parameter == "epsilon")             ss >> Params.epsilon;
         else if (parameter == "garvity")             ss >> Params.garvity;
@@ -85,16 +168,130 @@ void LoadParameters(string parameters)
         else if (parameter == "segmentsize")         ss >> Params.segmentSize;
         else if (parameter == "sortiterations")      ss >> Params.sortIterations;
 
+        else if (parameter == "sdfcellsize")         ss >> Params.sdfCellSize;
+
         else if (parameter == "particlerendersize")  ss >> Params.particleRenderSize;
+        else if (parameter == "fluidrenderscale")    ss >> Params.fluidRenderScale;
 
         else if (parameter == "enablecachedbuffers") ss >> Params.EnableCachedBuffers;
+        else if (parameter == "enableruntimeparams") ss >> Params.EnableRuntimeParams;
+        else if (parameter == "enablesdfboundary")   ss >> Params.EnableSDFBoundary;
+        else if (parameter == "enablekernellogging") ss >> Params.EnableKernelLogging;
+        else if (parameter == "enableautotune")      ss >> Params.EnableAutotune;
+        else if (parameter == "enablecellbinning")   ss >> Params.EnableCellBinning;
+        else if (parameter == "enablestablebinning") ss >> Params.EnableStableBinning;
+
+        else if (parameter == "fluidblock")
+        {
+            FluidBlockDesc block;
+            block.jitter = 0.0f;
+            if ((ss >> block.min[0] >> block.min[1] >> block.min[2] >> block.max[0] >> block.max[1] >> block.max[2]) &&
+                (fluidBlocks.size() < MAX_PARTICLE_BLOCKS))
+            {
+                ss >> block.jitter;
+                fluidBlocks.push_back(block);
+            }
+            else
+            {
+                cerr << "Invalid fluid block (or more than " << MAX_PARTICLE_BLOCKS << " blocks): " << line << endl;
+            }
+        }
+
+        else if (parameter == "particlesfile")
+        {
+            string key;
+            istringstream(originalLine) >> key >> ParticlesFileName;
+        }
 
         else
             cerr << "Unknown parameter " << parameter << endl << "Leaving it out." << endl;
     }
 
+    // Particles file overrides the particles count and the fluid blocks
+    cl_uint fileCount = 0;
+    if (!ParticlesFileName.empty() && !ParticlesFile::ReadCount(getPathForScenario(ParticlesFileName), fileCount))
+    {
+        cerr << "Unable to read particles file " << ParticlesFileName << ", using the fluid blocks" << endl;
+        ParticlesFileName = "";
+    }
+
     // Compute fields
+    if (!ParticlesFileName.empty())
+    {
+        Params.particleCount = fileCount;
+        Params.blocksCount   = 0;
+        memset(Params.blocks, 0, sizeof(Params.blocks));
+    }
+    else
+    {
+        ComputeParticleBlocks(fluidBlocks);
+    }
+    Params.particleCapacity   = std::max(Params.particleCapacity, Params.particleCount);
     Params.h_2 = Params.h * Params.h;
+    Params.poly6Factor        = (float)(315.0f / (64.0f * M_PI * pow(Params.h, 9)));
+    Params.gradSpikyFactor    = (float)(45.0f / (M_PI * pow(Params.h, 6)));
     Params.friendsCircles     = 5;
     Params.particlesPerCircle = 50;
 }
+
+// Parameters are equal (the 4 bytes fields are compared as memory, the trailing bools one by one: the padding
+// after them is indeterminate)
+static bool SameParameters(const Parameters &a, const Parameters &b)
+{
+    return (memcmp(&a, &b, offsetof(Parameters, EnableCachedBuffers)) == 0) &&
+           (a.EnableCachedBuffers == b.EnableCachedBuffers) &&
+           (a.EnableRuntimeParams == b.EnableRuntimeParams) &&
+           (a.EnableSDFBoundary   == b.EnableSDFBoundary)   &&
+           (a.EnableKernelLogging == b.EnableKernelLogging) &&
+           (a.EnableAutotune      == b.EnableAutotune)      &&
+           (a.EnableCellBinning   == b.EnableCellBinning)   &&
+           (a.EnableStableBinning == b.EnableStableBinning);
+}
+
+unsigned int ClassifyParameterChanges(const Parameters &prev, const Parameters &next)
+{
+    // Nothing to do if parameters are identical
+    if (SameParameters(prev, next))
+        return PARAM_CHANGE_NONE;
+
+    // Any change requires the device copy to be updated
+    unsigned int changes = PARAM_CHANGE_UPLOAD;
+
+    // Buffer sizes and storage type (image vs buffer) are structural
+    if ((prev.particleCapacity    != next.particleCapacity)   ||
+        (prev.gridBufSize         != next.gridBufSize)        ||
+        (prev.friendsCircles      != next.friendsCircles)     ||
+        (prev.particlesPerCircle  != next.particlesPerCircle) ||
+        (prev.EnableCachedBuffers != next.EnableCachedBuffers) ||
+        (prev.EnableSDFBoundary   != next.EnableSDFBoundary)   ||
+        (prev.EnableAutotune      != next.EnableAutotune)      ||
+        (prev.sdfCellSize         != next.sdfCellSize))
+        changes |= PARAM_CHANGE_BUFFERS;
+
+    // Values that are always compiled into the kernels
+    if ((prev.friendsCircles      != next.friendsCircles)     ||
+        (prev.particlesPerCircle  != next.particlesPerCircle) ||
+        (prev.cellCurve           != next.cellCurve)          ||
+        (prev.cellCurveGranularity != next.cellCurveGranularity) ||
+        (prev.EnableCachedBuffers != next.EnableCachedBuffers) ||
+        (prev.EnableRuntimeParams != next.EnableRuntimeParams) ||
+        (prev.EnableSDFBoundary   != next.EnableSDFBoundary)   ||
+        (prev.EnableKernelLogging != next.EnableKernelLogging))
+        changes |= PARAM_CHANGE_PROGRAM;
+
+    // Values that are compiled into the kernels only when runtime parameters are disabled
+    if (!next.EnableRuntimeParams &&
+        ((prev.particleCapacity != next.particleCapacity) ||
+         (prev.gridBufSize      != next.gridBufSize)      ||
+         (prev.h                != next.h)))
+        changes |= PARAM_CHANGE_PROGRAM;
+
+    // Initial particles (fit in the existing buffers)
+    if ((prev.particleCount != next.particleCount) ||
+        (prev.setupSpacing  != next.setupSpacing)  ||
+        (prev.blocksCount   != next.blocksCount)   ||
+        (memcmp(prev.blocks, next.blocks, sizeof(prev.blocks)) != 0))
+        changes |= PARAM_CHANGE_PARTICLES;
+
+    return changes;
+}
@@ -1,7 +1,7 @@
 #pragma once
 
 #include "hesp.hpp"
-#include "parameters.hpp"
+#include "Parameters.hpp"
 
 #include <string>
 using std::string;
@@ -9,8 +9,24 @@ using std::string;
 // A function to load parameters from file
 void LoadParameters(string InputFile);
 
+// Parameter change classification (bit flags)
+enum ParamChangeFlags
+{
+    PARAM_CHANGE_NONE    = 0,
+    PARAM_CHANGE_UPLOAD  = 1, // Only the device copy of "Params" needs a refresh
+    PARAM_CHANGE_BUFFERS = 2, // Device buffers needs to be reallocated (implies particles reset)
+    PARAM_CHANGE_PROGRAM = 4, // Kernels needs to be rebuilt
+    PARAM_CHANGE_PARTICLES = 8, // Particles needs to be recreated (buffers are kept)
+};
+
+// A function to decide what needs to be refreshed when moving from "prev" to "next" parameters
+unsigned int ClassifyParameterChanges(const Parameters &prev, const Parameters &next);
+
 // A global parameter object
 extern Parameters Params;
 
 // A variable that indicates a change in the paramaters
 extern bool ParametersChanged;
+
+// Initial particles file of the scenario (empty: particles are generated from the fluid blocks)
+extern string ParticlesFileName;
@@ -0,0 +1,49 @@
+#include "ParticleCells.hpp"
+#include "Simulation.hpp"
+#include "SpaceCurves.hpp"
+
+int ParticleCells::Cell(float coordinate)
+{
+    return (int)(coordinate / Params.h);
+}
+
+cl_uint ParticleCells::Hash(int cellX, int cellY, int cellZ)
+{
+    return sfcCellIndex(cellX, cellY, cellZ, Params.cellCurve, Params.cellCurveGranularity) % Params.gridBufSize;
+}
+
+void ParticleCells::Build(const cl_float4 *particles, cl_uint count)
+{
+    // Count the particles per hash
+    const cl_uint gridBufSize = Params.gridBufSize;
+    mKeys.resize(count);
+    mStarts.assign(gridBufSize + 1, 0);
+    for (cl_uint i = 0; i < count; i++)
+    {
+        const cl_float *p = particles[i].s;
+        mKeys[i] = Hash(Cell(p[0]), Cell(p[1]), Cell(p[2]));
+        mStarts[mKeys[i] + 1]++;
+    }
+    for (cl_uint c = 0; c < gridBufSize; c++)
+        mStarts[c + 1] += mStarts[c];
+
+    // Scatter (starts become the cells ends)
+    positions.resize(count);
+    for (cl_uint i = 0; i < count; i++)
+        positions[mStarts[mKeys[i]]++] = particles[i];
+
+    // Inclusive ranges
+    cells.resize(gridBufSize * 2);
+    for (cl_uint c = 0, first = 0; c < gridBufSize; first = mStarts[c++])
+    {
+        const bool empty = (first == mStarts[c]);
+        cells[c * 2 + 0] = empty ? (cl_uint)END_OF_CELL_LIST : first;
+        cells[c * 2 + 1] = empty ? (cl_uint)END_OF_CELL_LIST : mStarts[c] - 1;
+    }
+}
+
+void ParticleCells::Assign(vector<cl_float4> &sorted, vector<cl_uint> &sortedCells)
+{
+    positions.swap(sorted);
+    cells.swap(sortedCells);
+}
@@ -0,0 +1,34 @@
+#ifndef __PARTICLE_CELLS_HPP
+#define __PARTICLE_CELLS_HPP
+
+#include "hesp.hpp"
+
+#include <vector>
+
+using std::vector;
+
+// Particles sorted by cell on the host
+//   Same cells as the simulation (Params.h wide, hashed by calcGridHash into Params.gridBufSize entries), cells
+//   hold the inclusive range of their particles (END_OF_CELL_LIST if empty). Different cells may share a hash.
+class ParticleCells
+{
+private:
+    vector<cl_uint> mKeys;
+    vector<cl_uint> mStarts;
+
+public:
+    vector<cl_float4> positions; // Sorted by cell hash
+    vector<cl_uint>   cells;     // First, last particle per hash
+
+    // Sort the particles (counting sort)
+    void Build(const cl_float4 *particles, cl_uint count);
+
+    // Particles already sorted by the simulation and its cells (swapped in, see Simulation::ReadParticles)
+    void Assign(vector<cl_float4> &sorted, vector<cl_uint> &sortedCells);
+
+    // Cell of a position (truncated, as the kernels) and its hash
+    static int     Cell(float coordinate);
+    static cl_uint Hash(int cellX, int cellY, int cellZ);
+};
+
+#endif // __PARTICLE_CELLS_HPP
@@ -0,0 +1,316 @@
+#include "ParticlesFile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if !defined(_WINDOWS)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+// Binary file header (followed by count float4 positions, then count float4 velocities if flagged)
+struct ParticlesFileHeader
+{
+    char    magic[4];
+    cl_uint version;
+    cl_uint count;
+    cl_uint flags;
+};
+
+static const char    PARTICLES_FILE_MAGIC[4]    = {'P', 'B', 'F', 'P'};
+static const cl_uint PARTICLES_FILE_VERSION     = 1;
+static const cl_uint PARTICLES_FILE_VELOCITIES  = 1;
+
+static bool IsBinaryFile(const string &fileName)
+{
+    const size_t dot = fileName.find_last_of('.');
+    return (dot != string::npos) && (fileName.substr(dot) == ".bin");
+}
+
+static time_t ModificationTime(const string &fileName)
+{
+    struct stat st;
+    if (stat(fileName.c_str(), &st) != 0)
+        return 0;
+
+    return st.st_mtime;
+}
+
+// Parse the text lines starting in [begin, end) (the text is null terminated, numbers may run past end)
+static void ParseTextChunk(const char *text, size_t begin, size_t end, vector<cl_float4> *positions, vector<cl_float4> *velocities)
+{
+    const char *p        = text + begin;
+    const char *chunkEnd = text + end;
+    while (p < chunkEnd)
+    {
+        const char *lineEnd = (const char *)memchr(p, '\n', chunkEnd - p);
+        if (lineEnd == NULL)
+            lineEnd = chunkEnd;
+
+        // Read up to 7 values from the line
+        float values[7];
+        int   n = 0;
+        const char *q = p;
+        while (n < 7)
+        {
+            char *next;
+            const float value = strtof(q, &next);
+            if ((next == q) || (next > lineEnd))
+                break;
+            values[n++] = value;
+            q = next;
+        }
+
+        // Columns layout by values count
+        const float *pos = (n >= 7) ? &values[1] : &values[0];
+        const float *vel = (n >= 7) ? &values[4] : &values[3];
+        if (n >= 3)
+        {
+            cl_float4 position = {{pos[0], pos[1], pos[2], 0.0f}};
+            cl_float4 velocity = {{0.0f, 0.0f, 0.0f, 0.0f}};
+            if (n >= 6)
+            {
+                velocity.s[0] = vel[0];
+                velocity.s[1] = vel[1];
+                velocity.s[2] = vel[2];
+            }
+            positions->push_back(position);
+            velocities->push_back(velocity);
+        }
+
+        p = lineEnd + 1;
+    }
+}
+
+ParticlesFile::ParticlesFile()
+    : mMapping(NULL), mMappingSize(0), modified(0), count(0), positions(NULL), velocities(NULL), loadTime(0.0), mapped(false)
+{
+}
+
+ParticlesFile::~ParticlesFile()
+{
+    Unload();
+}
+
+void ParticlesFile::Unload()
+{
+#if !defined(_WINDOWS)
+    if (mMapping != NULL)
+        munmap(mMapping, mMappingSize);
+#endif
+    mMapping     = NULL;
+    mMappingSize = 0;
+    vector<char>().swap(mFileData);
+    vector<cl_float4>().swap(mPositions);
+    vector<cl_float4>().swap(mVelocities);
+
+    fileName   = "";
+    modified   = 0;
+    count      = 0;
+    positions  = NULL;
+    velocities = NULL;
+    mapped     = false;
+}
+
+bool ParticlesFile::IsCurrent(const string &fileName) const
+{
+    return (positions != NULL) && (this->fileName == fileName) && (modified == ModificationTime(fileName));
+}
+
+bool ParticlesFile::Load(const string &fileName)
+{
+    Unload();
+
+    const auto start = chrono::high_resolution_clock::now();
+    const bool ok = IsBinaryFile(fileName) ? LoadBinary(fileName) : LoadText(fileName);
+    loadTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+
+    if (!ok)
+    {
+        Unload();
+        return false;
+    }
+
+    this->fileName = fileName;
+    modified = ModificationTime(fileName);
+    return true;
+}
+
+bool ParticlesFile::LoadBinary(const string &fileName)
+{
+    const char *data = NULL;
+    size_t      size = 0;
+
+#if defined(_WINDOWS)
+    // Plain read
+    ifstream ifs(fileName.c_str(), ios::binary);
+    if (!ifs.is_open())
+        return false;
+    mFileData.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+    data = mFileData.empty() ? NULL : &mFileData[0];
+    size = mFileData.size();
+#else
+    // Map the file (the particles are uploaded straight from the mapping)
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0))
+    {
+        void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED)
+        {
+            mMapping     = mapping;
+            mMappingSize = (size_t)st.st_size;
+            data = (const char *)mapping;
+            size = mMappingSize;
+            mapped = true;
+        }
+    }
+    close(fd);
+#endif
+
+    // Validate header and size
+    ParticlesFileHeader header;
+    if ((data == NULL) || (size < sizeof(header)))
+        return false;
+    memcpy(&header, data, sizeof(header));
+
+    const bool   hasVelocities = (header.flags & PARTICLES_FILE_VELOCITIES) != 0;
+    const size_t dataSize      = (size_t)header.count * sizeof(cl_float4) * (hasVelocities ? 2 : 1);
+    if ((memcmp(header.magic, PARTICLES_FILE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.version != PARTICLES_FILE_VERSION) ||
+        (size < sizeof(header) + dataSize))
+    {
+        cerr << "Invalid particles file " << fileName << endl;
+        return false;
+    }
+
+    count      = header.count;
+    positions  = (const cl_float4 *)(data + sizeof(header));
+    velocities = hasVelocities ? positions + count : NULL;
+    return true;
+}
+
+bool ParticlesFile::LoadText(const string &fileName)
+{
+    ifstream ifs(fileName.c_str(), ios::binary);
+    if (!ifs.is_open())
+        return false;
+    const string text((istreambuf_iterator<char>(ifs)), istreambuf_iterator<char>());
+
+    // Split the text into a chunk per thread (chunks start at a line start)
+    const unsigned int threads = max(thread::hardware_concurrency(), 1u);
+    vector<size_t> bounds(threads + 1, text.size());
+    bounds[0] = 0;
+    for (unsigned int t = 1; t < threads; t++)
+    {
+        const size_t newLine = text.find('\n', max(text.size() * t / threads, bounds[t - 1]));
+        bounds[t] = (newLine == string::npos) ? text.size() : newLine + 1;
+    }
+
+    // Parse the chunks in parallel
+    vector<vector<cl_float4> > chunkPositions(threads);
+    vector<vector<cl_float4> > chunkVelocities(threads);
+    vector<thread> workers;
+    for (unsigned int t = 0; t < threads; t++)
+        workers.push_back(thread(ParseTextChunk, text.c_str(), bounds[t], bounds[t + 1], &chunkPositions[t], &chunkVelocities[t]));
+    for (unsigned int t = 0; t < threads; t++)
+        workers[t].join();
+
+    // Concatenate (in file order)
+    size_t total = 0;
+    for (unsigned int t = 0; t < threads; t++)
+        total += chunkPositions[t].size();
+    if (total == 0)
+        return false;
+
+    mPositions.reserve(total);
+    mVelocities.reserve(total);
+    for (unsigned int t = 0; t < threads; t++)
+    {
+        mPositions.insert(mPositions.end(), chunkPositions[t].begin(), chunkPositions[t].end());
+        mVelocities.insert(mVelocities.end(), chunkVelocities[t].begin(), chunkVelocities[t].end());
+    }
+
+    count      = (cl_uint)total;
+    positions  = &mPositions[0];
+    velocities = &mVelocities[0];
+    return true;
+}
+
+bool ParticlesFile::SaveBinary(const string &fileName, cl_uint count, const cl_float4 *positions, const cl_float4 *velocities)
+{
+    ofstream ofs(fileName.c_str(), ios::binary | ios::trunc);
+    if (!ofs.is_open())
+        return false;
+
+    ParticlesFileHeader header;
+    memcpy(header.magic, PARTICLES_FILE_MAGIC, sizeof(header.magic));
+    header.version = PARTICLES_FILE_VERSION;
+    header.count   = count;
+    header.flags   = (velocities != NULL) ? PARTICLES_FILE_VELOCITIES : 0;
+
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)positions, (streamsize)count * sizeof(cl_float4));
+    if (velocities != NULL)
+        ofs.write((const char *)velocities, (streamsize)count * sizeof(cl_float4));
+
+    return ofs.good();
+}
+
+bool ParticlesFile::ReadCount(const string &fileName, cl_uint &count)
+{
+    ifstream ifs(fileName.c_str(), ios::binary);
+    if (!ifs.is_open())
+        return false;
+
+    // Binary: header count
+    if (IsBinaryFile(fileName))
+    {
+        ParticlesFileHeader header;
+        if (!ifs.read((char *)&header, sizeof(header)) ||
+            (memcmp(header.magic, PARTICLES_FILE_MAGIC, sizeof(header.magic)) != 0))
+            return false;
+
+        count = header.count;
+        return true;
+    }
+
+    // Text: count line (tools/gen_grid.py), otherwise count the non-empty lines
+    string line;
+    if (!getline(ifs, line))
+        return false;
+
+    char *end;
+    const unsigned long value = strtoul(line.c_str(), &end, 10);
+    if ((end != line.c_str()) && (strtod(line.c_str(), NULL) == (double)value) &&
+        (line.find_first_not_of(" \t\r", end - line.c_str()) == string::npos))
+    {
+        count = (cl_uint)value;
+        return true;
+    }
+
+    // One particle per non-empty line (the last line normally ends with a newline)
+    count = 0;
+    do
+    {
+        if (line.find_first_not_of(" \t\r") != string::npos)
+            count++;
+    }
+    while (getline(ifs, line));
+    return true;
+}
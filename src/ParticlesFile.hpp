@@ -0,0 +1,68 @@
+#ifndef __PARTICLES_FILE_HPP
+#define __PARTICLES_FILE_HPP
+
+#include "hesp.hpp"
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Initial particles state read from a file (referenced by the scenario "ParticlesFile" key)
+//   Binary (".bin"): header followed by float4 positions [and float4 velocities], memory mapped and uploaded as is.
+//   Text (anything else): "m x y z vx vy vz" lines (tools/gen_grid.py), "x y z vx vy vz" or "x y z" lines.
+//                         A line holding a single value (particles count) is skipped. Parsed in parallel chunks.
+class ParticlesFile
+{
+private:
+    // Avoid copy
+    ParticlesFile &operator=(const ParticlesFile &other);
+    ParticlesFile (const ParticlesFile &other);
+
+    bool LoadBinary(const string &fileName);
+    bool LoadText(const string &fileName);
+
+    // Binary file mapping (or a plain copy of the file where mapping is not available)
+    void        *mMapping;
+    size_t       mMappingSize;
+    vector<char> mFileData;
+
+    // Parsed text file
+    vector<cl_float4> mPositions;
+    vector<cl_float4> mVelocities;
+
+public:
+    // Loaded file identification
+    string fileName;
+    time_t modified;
+
+    // Particles (velocities is NULL if the file has none)
+    cl_uint          count;
+    const cl_float4 *positions;
+    const cl_float4 *velocities;
+
+    // Statistics
+    double loadTime; // [millisec]
+    bool   mapped;
+
+public:
+    ParticlesFile();
+    ~ParticlesFile();
+
+    // Load a particles file (the format is decided by the extension)
+    bool Load(const string &fileName);
+    void Unload();
+
+    // Check if fileName is loaded and was not modified since
+    bool IsCurrent(const string &fileName) const;
+
+    // Particles count from the file header (without loading the particles)
+    static bool ReadCount(const string &fileName, cl_uint &count);
+
+    // Write a binary particles file (velocities may be NULL)
+    static bool SaveBinary(const string &fileName, cl_uint count, const cl_float4 *positions, const cl_float4 *velocities);
+};
+
+#endif // __PARTICLES_FILE_HPP
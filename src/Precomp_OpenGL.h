@@ -4,7 +4,9 @@
     #include <GL/glew.h>
     #include <GLFW/glfw3.h>
 #elif defined(UNIX)
+    #include <GL/glew.h>
     #include <GL/glx.h>
+    #include <GLFW/glfw3.h>
 #else // _WINDOWS
     #define GLEW_STATIC
     #include <GL\glew.h>
@@ -6,6 +6,8 @@
 #include <sstream>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <chrono>
 using namespace std;
 
 #include <limits.h>
@@ -20,11 +22,19 @@ using namespace std;
 #pragma comment(lib, "shlwapi.lib")
 #else
 #include <stdlib.h>
+#if defined(__APPLE__)
 #include <mach-o/dyld.h>
+#endif
 #include <libgen.h>
+#include <sys/file.h>
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
 //#define USE_INTERNAL_RESOURCES
 
 string rootDirectory;
@@ -51,7 +61,7 @@ void FindRootDirectory()
         bFolderFound = ((dwAttrib != INVALID_FILE_ATTRIBUTES) && (dwAttrib & FILE_ATTRIBUTE_DIRECTORY));
 
     } while (!bFolderFound);
-#else
+#elif defined(__APPLE__)
     char path[PATH_MAX + 1];
     char absolute_path[PATH_MAX + 1];
     uint32_t size = sizeof(path);
@@ -59,6 +69,15 @@ void FindRootDirectory()
         realpath(path, absolute_path);
 
     rootDirectory = dirname(absolute_path);
+#else
+    // Linux: the executable path is the /proc/self/exe link
+    char path[PATH_MAX + 1];
+    const ssize_t length = readlink("/proc/self/exe", path, PATH_MAX);
+    if (length <= 0)
+        throw runtime_error("Could not find the executable path");
+    path[length] = '\0';
+
+    rootDirectory = dirname(path);
 #endif
 }
 
@@ -75,6 +94,10 @@ void loadCodeResources()
 
 const string getPathForScenario(const string scenario)
 {
+    // Paths (e.g. from the command line) are used as is
+    if (scenario.find_first_of("/\\") != string::npos)
+        return scenario;
+
     return getRootPath() + "/scenarios/" + scenario;
 }
 
@@ -163,6 +186,19 @@ const string getKernelSource(const string kernel)
     #endif
 }
 
+unsigned long long HashFile(const string &fileName)
+{
+    ifstream ifs(fileName.c_str(), ios::binary);
+    if (!ifs.is_open())
+        return 0;
+
+    unsigned long long hash = 14695981039346656037ULL;
+    for (istreambuf_iterator<char> it(ifs), end; it != end; ++it)
+        hash = (hash ^ (unsigned char)*it) * 1099511628211ULL;
+
+    return hash;
+}
+
 bool DetectResourceChanges(list<pair<string, time_t> >& fileList)
 {
     #ifdef USE_INTERNAL_RESOURCES
@@ -237,3 +273,175 @@ bool DetectResourceChanges(list<pair<string, time_t> >& fileList)
     #endif
 }
 
+//
+// Resource watcher
+//
+
+// Time to wait for an editor write burst to settle down before reporting it
+static const int WATCHER_DEBOUNCE_MS = 150;
+
+// Watcher thread wake-up period (also used as the polling fallback interval)
+static const int WATCHER_PERIOD_MS   = 50;
+
+ResourceWatcher::ResourceWatcher() :
+    mQueueHead(0),
+    mQueueTail(0),
+    mPendingChanges(0),
+    mStop(false)
+{
+}
+
+ResourceWatcher::~ResourceWatcher()
+{
+    // Stop watcher thread
+    mStop = true;
+    if (mThread.joinable())
+        mThread.join();
+}
+
+int ResourceWatcher::AddGroup(const list<string> &files)
+{
+    // Create group list
+    time_t defaultTime = 0;
+    list<pair<string, time_t> > group;
+    for (list<string>::const_iterator iter = files.begin(); iter != files.end(); iter++)
+        group.push_back(make_pair(*iter, defaultTime));
+    mGroups.push_back(group);
+
+    // Report the new group as changed (initial load)
+    int groupID = mGroups.size() - 1;
+    mPendingChanges |= 1 << groupID;
+
+    return groupID;
+}
+
+void ResourceWatcher::Start()
+{
+    #ifndef USE_INTERNAL_RESOURCES
+        // Initial load is already pending, let the file lists store their current timestamps
+        for (size_t iGroup = 0; iGroup < mGroups.size(); iGroup++)
+            DetectResourceChanges(mGroups[iGroup]);
+
+        mThread = thread(&ResourceWatcher::WatcherThread, this);
+    #endif
+}
+
+bool ResourceWatcher::PostChanges(unsigned int changeSet)
+{
+    // Check for free space
+    unsigned int tail = mQueueTail.load(memory_order_relaxed);
+    if (tail - mQueueHead.load(memory_order_acquire) >= QUEUE_SIZE)
+        return false;
+
+    // Write item and publish it
+    mQueue[tail % QUEUE_SIZE] = changeSet;
+    mQueueTail.store(tail + 1, memory_order_release);
+    return true;
+}
+
+bool ResourceWatcher::HasChanged(int groupID)
+{
+    // Drain queue
+    unsigned int head = mQueueHead.load(memory_order_relaxed);
+    unsigned int tail = mQueueTail.load(memory_order_acquire);
+    while (head != tail)
+        mPendingChanges |= mQueue[head++ % QUEUE_SIZE];
+    mQueueHead.store(head, memory_order_release);
+
+    // Check and clear group indication
+    unsigned int groupMask = 1 << groupID;
+    bool bChanged = (mPendingChanges & groupMask) != 0;
+    mPendingChanges &= ~groupMask;
+
+    return bChanged;
+}
+
+void ResourceWatcher::WatcherThread()
+{
+    unsigned int changes = 0;
+    chrono::steady_clock::time_point lastEvent = chrono::steady_clock::now();
+
+#if defined(__linux__)
+    // Watch the folders (editors tend to save by renaming a temporary file over the original)
+    int fd = inotify_init1(IN_NONBLOCK);
+    map<int, string> watchedDirs;
+    for (size_t iGroup = 0; (fd >= 0) && (iGroup < mGroups.size()); iGroup++)
+    {
+        list<pair<string, time_t> >::iterator iter;
+        for (iter = mGroups[iGroup].begin(); iter != mGroups[iGroup].end(); iter++)
+        {
+            string dir = iter->first.substr(0, iter->first.find_last_of('/'));
+            int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            if (wd >= 0)
+                watchedDirs[wd] = dir;
+        }
+    }
+
+    // Fallback to polling if inotify is not available
+    if (fd < 0)
+        cerr << "inotify is not available, falling back to resource polling" << endl;
+#endif
+
+    while (!mStop)
+    {
+#if defined(__linux__)
+        if (fd >= 0)
+        {
+            // Wait for events
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (poll(&pfd, 1, WATCHER_PERIOD_MS) > 0)
+            {
+                // Read events
+                char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+                ssize_t len;
+                while ((len = read(fd, buf, sizeof(buf))) > 0)
+                {
+                    for (char *ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len)
+                    {
+                        const struct inotify_event *event = (const struct inotify_event *)ptr;
+                        if (event->len == 0)
+                            continue;
+
+                        // Find the groups holding the file
+                        string path = watchedDirs[event->wd] + "/" + event->name;
+                        for (size_t iGroup = 0; iGroup < mGroups.size(); iGroup++)
+                        {
+                            list<pair<string, time_t> >::iterator iter;
+                            for (iter = mGroups[iGroup].begin(); iter != mGroups[iGroup].end(); iter++)
+                                if (iter->first == path)
+                                    changes |= 1 << iGroup;
+                        }
+
+                        lastEvent = chrono::steady_clock::now();
+                    }
+                }
+            }
+        }
+        else
+#endif
+        {
+            // Polling fallback (the stat/lock scan stays off the main loop)
+            this_thread::sleep_for(chrono::milliseconds(WATCHER_PERIOD_MS));
+            for (size_t iGroup = 0; iGroup < mGroups.size(); iGroup++)
+            {
+                if (DetectResourceChanges(mGroups[iGroup]))
+                {
+                    changes |= 1 << iGroup;
+                    lastEvent = chrono::steady_clock::now();
+                }
+            }
+        }
+
+        // Post changes once the write burst is over
+        if ((changes != 0) && (chrono::steady_clock::now() - lastEvent >= chrono::milliseconds(WATCHER_DEBOUNCE_MS)))
+        {
+            if (PostChanges(changes))
+                changes = 0;
+        }
+    }
+
+#if defined(__linux__)
+    if (fd >= 0)
+        close(fd);
+#endif
+}
@@ -2,6 +2,9 @@
 
 #include <list>
 #include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
 using namespace std;
 
 const string getPathForScenario(const string scenario);
@@ -16,3 +19,53 @@ const string getShaderSource   (const string shader);
 const string getKernelSource   (const string kernel);
 
 bool DetectResourceChanges(list<pair<string, time_t> >& fileList);
+
+// FNV-1a hash of a file content (0 if the file can't be read), used to validate disk caches
+unsigned long long HashFile(const string &fileName);
+
+// Resource change watcher
+//   Runs on its own thread (inotify on Linux, stat polling elsewhere), debounces editor write bursts and
+//   posts change-sets (bitmask of groups) to the main loop through a lock-free single-producer/single-consumer queue.
+//   Disabled when USE_INTERNAL_RESOURCES is defined (every group is reported changed once).
+class ResourceWatcher
+{
+private:
+    // Avoid copy
+    ResourceWatcher &operator=(const ResourceWatcher &other);
+    ResourceWatcher (const ResourceWatcher &other);
+
+    // Watcher thread entry
+    void WatcherThread();
+
+    // Producer side: post change-set (returns false if queue is full)
+    bool PostChanges(unsigned int changeSet);
+
+    // Watched file groups (read-only once started)
+    vector<list<pair<string, time_t> > > mGroups;
+
+    // Change-sets queue (single producer: watcher thread, single consumer: main loop)
+    static const unsigned int QUEUE_SIZE = 64;
+    unsigned int          mQueue[QUEUE_SIZE];
+    atomic<unsigned int>  mQueueHead;
+    atomic<unsigned int>  mQueueTail;
+
+    // Main loop side accumulated changes
+    unsigned int mPendingChanges;
+
+    // Thread control
+    thread       mThread;
+    atomic<bool> mStop;
+
+public:
+    ResourceWatcher();
+    ~ResourceWatcher();
+
+    // Add a group of files to watch, returns group ID (call before Start)
+    int AddGroup(const list<string> &files);
+
+    // Start watching
+    void Start();
+
+    // Check (and clear) a group change indication (main loop only)
+    bool HasChanged(int groupID);
+};
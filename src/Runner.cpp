@@ -2,151 +2,499 @@
 #include "Runner.hpp"
 #include "ParamUtils.hpp"
 #include "UIManager.h"
+#include "FrameCapture.hpp"
+#include "ParticlesFile.hpp"
+#include "SurfaceExtractor.hpp"
+#include "SimulationThread.hpp"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <cstdio>
+#include <thread>
 
 #include <GLFW/glfw3.h>
 
 void Runner::run(Simulation &simulation, CVisual &renderer)
 {
     // Create resource tracking file list (Kernels)
-    time_t defaultTime = 0;
+    list<string> kernelFiles;
     const string *pKernels = simulation.KernelFileList();
     for (int iSrc = 0; pKernels[iSrc] != ""; iSrc++)
-        mKernelFilesTracker.push_back(make_pair(getPathForKernel(pKernels[iSrc]), defaultTime));
+        kernelFiles.push_back(getPathForKernel(pKernels[iSrc]));
+    mKernelFilesGroup = mResourceWatcher.AddGroup(kernelFiles);
 
-    // Append parameter file to resource tracking file list
-    mKernelFilesTracker.push_back(make_pair(getPathForScenario("dam_coarse.par"), defaultTime));
+    // Create scenario tracking list (parameter changes are classified, not always requiring a rebuild)
+    list<string> scenarioFiles;
+    scenarioFiles.push_back(getPathForScenario(mOptions.scenario));
+    mScenarioFilesGroup = mResourceWatcher.AddGroup(scenarioFiles);
 
     // Create shader tracking list
+    list<string> shaderFiles;
     const string *pShaders = renderer.ShaderFileList();
     for (int iSrc = 0; pShaders[iSrc] != ""; iSrc++)
-        mShaderFilesTracker.push_back(make_pair(getPathForShader(pShaders[iSrc]), defaultTime));
+        shaderFiles.push_back(getPathForShader(pShaders[iSrc]));
+    mShaderFilesGroup = mResourceWatcher.AddGroup(shaderFiles);
+
+    // Start watching for changes (in the background)
+    mResourceWatcher.Start();
 
     // Init render (background, camera etc...)
-    renderer.initSystemVisual(simulation);
+    renderer.initSystemVisual();
 
     // Init UIManager
     UIManager_Init(renderer.mWindow, &renderer, &simulation);
 
-    // Main loop
+    // Start the frame capture (window sized frames)
+    FrameCapture capture;
+    if (!mOptions.captureFile.empty())
+        capture.Start(mOptions.captureFile, g_ScreenFBO.Width, g_ScreenFBO.Height);
+
+    // Simulation steps on its own thread, frames are handed over through snapshots
+    SimulationThread simThread(simulation);
+    cout << "OpenCL/OpenGL synchronization: " << (simulation.mGLSync.IsSupported() ? "events (cl_khr_gl_event)" : "glFinish / clFinish") << endl;
+
+    // Main loop (render thread)
     bool KernelBuildOk = false;
-    cl_uint prevParticleCount = 0;
-    cl_float simTime = 0.0f;
-    cl_float waveTime = 0.0f;
-    cl_float wavePos  = 0.0f;
+    unsigned long long renderedFrames = 0;
+    const auto renderStart = chrono::high_resolution_clock::now();
+
+    // Last applied parameters (zeroed so the first load refreshes everything)
+    Parameters prevParams;
+    memset(&prevParams, 0, sizeof(prevParams));
+    string prevParticlesFile;
 
     do
     {
         // Check file changes
-        if (DetectResourceChanges(mKernelFilesTracker) || renderer.UICmd_ResetSimulation)
+        bool bKernelsChanged  = mResourceWatcher.HasChanged(mKernelFilesGroup);
+        bool bScenarioChanged = mResourceWatcher.HasChanged(mScenarioFilesGroup);
+        if (bKernelsChanged || bScenarioChanged || renderer.UICmd_ResetSimulation)
         {
-            // Reading the configuration file
-            LoadParameters(getScenario("dam_coarse.par"));
+            // The simulation is changed by this thread
+            simThread.Stop();
 
-            // Check if particle count changed
-            if ((prevParticleCount != Params.particleCount) || renderer.UICmd_ResetSimulation || Params.resetSimOnChange)
+            // Reading the configuration file
+            LoadParameters(getScenario(mOptions.scenario));
+            simulation.ApplyTuning();
+
+            // Decide what needs to be refreshed
+            unsigned int paramChanges = ClassifyParameterChanges(prevParams, Params);
+            unsigned int changes = paramChanges;
+            if (ParticlesFileName != prevParticlesFile)
+                changes |= PARAM_CHANGE_PARTICLES;
+            if (bKernelsChanged)
+                changes |= PARAM_CHANGE_PROGRAM;
+            if (renderer.UICmd_ResetSimulation || (Params.resetSimOnChange && (changes != PARAM_CHANGE_NONE)))
+                changes |= PARAM_CHANGE_PARTICLES;
+            prevParams = Params;
+            prevParticlesFile = ParticlesFileName;
+
+            // Init kernels (first, particles and buffers are initialized by kernels)
+            if (changes & PARAM_CHANGE_PROGRAM)
             {
-                // Store new particle count
-                prevParticleCount = Params.particleCount;
+                // Kernel source changes only: keep stepping on the running kernels while the new ones build
+                if (KernelBuildOk && !(paramChanges & PARAM_CHANGE_PROGRAM))
+                    simulation.StartKernelsBuild();
+                else
+                    KernelBuildOk = simulation.InitKernels();
+            }
 
+            // Check if buffers needs to be reallocated
+            if (changes & PARAM_CHANGE_BUFFERS)
+            {
                 // Notify renderer for parameter changed
                 renderer.parametersChanged();
 
-                // Generate shared buffer
-                simulation.mSharedPingBufferID = renderer.createSharingBuffer(Params.particleCount * sizeof(cl_float4));
-                simulation.mSharedPongBufferID = renderer.createSharingBuffer(Params.particleCount * sizeof(cl_float4));
-                simulation.mSharedParticlesPos = renderer.createSharingTexture(2048, (Params.particleCount + 2048 - 1) / 2048);
+                // Release previous shared objects
+                simulation.ReleaseGLObjects();
+
+                // Frames snapshots (the simulation buffers are not shared, see SimulationThread)
+                simThread.InitSnapshots(renderer);
 
                 // Generated friends list shared buffer
-                int nFriendListSize = Params.particleCount * Params.friendsCircles * (1 + Params.particlesPerCircle);
+                int nFriendListSize = Params.particleCapacity * Params.friendsCircles * (1 + Params.particlesPerCircle);
                 simulation.mSharedFriendsList   = OGLU_GenerateTexture(2048, (nFriendListSize + 2048 - 1) / 2048, GL_R32UI);
 
                 // Init buffers
                 simulation.InitBuffers();
-            }
 
-            // Reset grid
-            simulation.InitCells();
+                // Reset grid
+                simulation.InitCells();
 
-            // Reload force masks
-            simulation.LoadForceMasks();
+                // Reload force masks
+                simulation.LoadForceMasks();
 
-            // Init kernels
-            KernelBuildOk = simulation.InitKernels();
+                // Reload colliders
+                simulation.LoadColliders();
 
-            // Reset wavee
-            waveTime = 0.0f;
+                // Reload boundary SDF
+                simulation.LoadBoundarySDF();
 
-            // Load mesh
-            renderer.loadMesh();
+                // Load mesh
+                renderer.loadMesh();
+            }
+            else
+            {
+                if (changes & PARAM_CHANGE_UPLOAD)
+                {
+                    // Only refresh the device copy of the parameters
+                    simulation.UpdateParameters();
+
+                    // Colliders binning margin depends on h
+                    simulation.LoadColliders();
+                }
+
+                // Recreate particles in the existing buffers
+                if (changes & PARAM_CHANGE_PARTICLES)
+                    simulation.ResetParticles();
+            }
+
+            // Reset wavee
+            simThread.ResetWaves();
 
             // Turn off sim reset request
             renderer.UICmd_ResetSimulation = false;
+
+            // Memory report only (command line)
+            if (mOptions.memoryReportOnly)
+            {
+                simulation.PrintMemoryReport(cout);
+                break;
+            }
         }
 
         // Auto reload shaders
-        if (DetectResourceChanges(mShaderFilesTracker))
+        if (mResourceWatcher.HasChanged(mShaderFilesGroup))
         {
             renderer.initShaders();
         }
 
+        // Swap in kernels that were built in the background (polled by the simulation thread while it runs)
+        if (!simThread.IsRunning() && simulation.PollKernelsBuild())
+            KernelBuildOk = true;
+
         // Make sure that kernels are valid
         if (!KernelBuildOk)
             continue;
 
-        // Generate waves
-        if (renderer.UICmd_GenerateWaves)
+        // First run on this device: benchmark the kernels configuration and persist it
+        if (Params.EnableAutotune && !simulation.mTuning.valid)
         {
-            // Wave consts
-            const cl_float wave_push_length = Params.waveGenAmp * (Params.xMax - Params.xMin);
+            simThread.Stop();
+            KernelTuner tuner(simulation);
+            TuningConfig tuning = tuner.Run();
+
+            const string tuningFile = KernelTuner::TuningFileName(simulation.mCLDevice);
+            ostringstream header;
+            header << "# Kernels tuning for " << simulation.mCLDevice.getInfo<CL_DEVICE_NAME>() << " (" << Params.particleCount << " particles)" << endl;
+            if (!tuning.Save(tuningFile, header.str()))
+                cerr << "Unable to write tuning file " << tuningFile << endl;
+
+            // Reinitialize everything with the tuned configuration
+            memset(&prevParams, 0, sizeof(prevParams));
+            renderer.UICmd_ResetSimulation = true;
+            continue;
+        }
 
-            // Update the wave position
-            float t = Params.waveGenFreq * waveTime;
-            wavePos = (float)(1 - cos(2.0f * M_PI * pow(fmod(t, 1.0f), Params.waveGenDuty))) * wave_push_length / 2.0f;
+        // Cell binning benchmark only (command line)
+        if (mOptions.benchmarkBinningOnly)
+        {
+            simThread.Stop();
+            simulation.BenchmarkCellBinning(cout);
+            break;
+        }
 
-            // Update wave running time
-            if (!renderer.UICmd_PauseSimulation)
-                waveTime += Params.timeStep;
+        // Simulation controls (applied to the next simulated frame)
+        SIMULATION_CONTROLS controls;
+        controls.pause           = renderer.UICmd_PauseSimulation;
+        controls.generateWaves   = renderer.UICmd_GenerateWaves;
+        controls.readFriendsList = renderer.UICmd_FriendsHistogarm;
+        simThread.SetControls(controls);
+        simThread.Start();
+
+        // Visualize the latest simulated frame
+        GLuint positionsID, cellsID;
+        cl_uint count;
+        if (simThread.AcquireFrame(positionsID, cellsID, count))
+        {
+            renderer.setParticleBuffers(positionsID, cellsID, count);
+            renderer.renderParticles();
+            simThread.ReleaseFrame();
         }
-        else
+        renderedFrames++;
+
+        // Capture the frame (without the UI)
+        if (capture.IsCapturing())
+        {
+            OGLU_TIMING_SCOPE("Frame Capture");
+            capture.Capture();
+        }
+
+        // Draw UI
+        {
+            OGLU_TIMING_SCOPE("Draw UI");
+            UIManager_SetSimulationRate(simThread.StepsPerSecond());
+            UIManager_Draw();
+        }
+
+        // Transfer to screen
         {
-            waveTime = 0.0f;
+            OGLU_TIMING_SCOPE("Present-To-Screen");
+            renderer.presentToScreen();
         }
+    }
+    while (!UIManager_WindowShouldClose());
+
+    simThread.Stop();
+
+    // Write the frames still in flight
+    capture.Stop();
+
+    // Simulation and render rates are independent
+    const double renderSeconds = chrono::duration<double>(chrono::high_resolution_clock::now() - renderStart).count();
+    const double simSeconds    = simThread.Seconds();
+    cout << "Simulated " << simThread.Steps() << " steps (" << (simSeconds > 0.0 ? simThread.Steps() / simSeconds : 0.0) << " steps/s), "
+         << "rendered " << renderedFrames << " frames (" << (renderSeconds > 0.0 ? renderedFrames / renderSeconds : 0.0) << " fps)" << endl;
+
+    // OpenGL sections
+    OGLU_ReportTimings(cout);
+}
+
+// File name of a frame ("frames/frame_%06d.ppm")
+static string FrameFileName(const string &pattern, unsigned int frame)
+{
+    vector<char> fileName(pattern.size() + 32);
+    snprintf(&fileName[0], fileName.size(), pattern.c_str(), frame);
+    return &fileName[0];
+}
+
+// Recorded frames, numbered from 0 up to the first missing file
+static unsigned int CountFrameFiles(const string &pattern)
+{
+    unsigned int count = 0;
+    while (ifstream(FrameFileName(pattern, count).c_str(), ios::in | ios::binary).good())
+        count++;
+    return count;
+}
+
+bool Runner::initOffscreenRenderer(CVisual &renderer)
+{
+    renderer.initSystemVisual();
+    if (!renderer.initShaders())
+    {
+        cerr << "Shaders build failed" << endl;
+        return false;
+    }
+
+    renderer.parametersChanged();
+    renderer.loadMesh();
+    renderer.UICmd_RenderMode = mOptions.renderMode;
+
+    return true;
+}
+
+bool Runner::runHeadless(Simulation &simulation, CVisual *pRenderer)
+{
+    // Reading the configuration file
+    LoadParameters(getScenario(mOptions.scenario));
+    simulation.ApplyTuning();
 
-        // Load simulation settings
-        simulation.bPauseSim        = renderer.UICmd_PauseSimulation;
-        simulation.bReadFriendsList = renderer.UICmd_FriendsHistogarm;
-        simulation.fWavePos         = wavePos;
+    // Init kernels (first, particles and buffers are initialized by kernels)
+    if (!simulation.InitKernels())
+    {
+        cerr << "Kernels build failed (" << mOptions.scenario << ")" << endl;
+        return false;
+    }
+
+    // Init buffers (no OpenGL objects, see Simulation::InitBuffers) and the scene
+    simulation.InitBuffers();
+    simulation.InitCells();
+    simulation.LoadForceMasks();
+    simulation.LoadColliders();
+    simulation.LoadBoundarySDF();
+
+    // Simulate (no waves, no debug read backs)
+    simulation.bPauseSim        = false;
+    simulation.bReadFriendsList = false;
+    simulation.fWavePos         = 0.0f;
+
+    // Frames output (rendered frames are written by the capture worker, none dropped, surfaces extracted in the background)
+    FrameCapture capture;
+    SurfaceExtractor surface;
+    if ((pRenderer != NULL) && (!initOffscreenRenderer(*pRenderer) || !capture.Start(mOptions.renderFile, g_ScreenFBO.Width, g_ScreenFBO.Height, true)))
+        return false;
+
+    // Only the steps are timed
+    double seconds = 0.0;
+    unsigned int frame = 0;
+    vector<cl_float4> positions, velocities;
+    vector<cl_uint> cells;
+    const unsigned int subSteps = max(Params.subSteps, 1u);
+    chrono::high_resolution_clock::time_point start;
+    for (unsigned int step = 0; step < mOptions.headlessSteps; step++)
+    {
+        // Timed per frame, up to the device completing its last sub step (Step doesn't wait)
+        if (step % subSteps == 0)
+            start = chrono::high_resolution_clock::now();
+        simulation.Step();
+
+        const bool frameStep = ((step + 1) % subSteps == 0);
+        if (!frameStep && (step + 1 != mOptions.headlessSteps))
+            continue;
+        simulation.mQueue.finish();
+        seconds += chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
 
-        // Sub frames
-        for (cl_uint i = 0; i < Params.subSteps; i++)
+        // Kernel timings of the completed step (averaged into the summary)
+        simulation.PerfData.UpdateTimings();
+
+        // A frame every sub steps (as the window loop)
+        if (!frameStep || ((pRenderer == NULL) && mOptions.recordFile.empty() && mOptions.surfaceFile.empty()))
+            continue;
+
+        simulation.ReadParticles(positions, mOptions.recordFile.empty() ? NULL : &velocities, mOptions.surfaceFile.empty() ? NULL : &cells);
+        if (!mOptions.recordFile.empty() &&
+            !ParticlesFile::SaveBinary(FrameFileName(mOptions.recordFile, frame), (cl_uint)positions.size(), positions.data(), velocities.data()))
         {
-            // Execute simulation
-            simulation.Step();
+            cerr << "Unable to write frame " << FrameFileName(mOptions.recordFile, frame) << endl;
+            return false;
+        }
 
-            // Incremenent time
-            if (!renderer.UICmd_PauseSimulation)
-                simTime += Params.timeStep;
+        if (pRenderer != NULL)
+        {
+            pRenderer->setParticles(positions.data(), (cl_uint)positions.size());
+            pRenderer->renderParticles();
+            capture.Capture(frame);
         }
 
-        // Visualize particles
+        // Extracted while the next frame is simulated (positions and cells are swapped out)
+        if (!mOptions.surfaceFile.empty())
+            surface.Submit(positions, cells, FrameFileName(mOptions.surfaceFile, frame));
+        frame++;
+    }
+    capture.Stop();
+    if (!surface.Finish())
+        return false;
+
+    // Summary ("key value" lines, collected by the batch sweep)
+    SIMULATION_METRICS metrics;
+    simulation.MeasureMetrics(metrics);
+
+    ostringstream summary;
+    summary << "scenario "        << mOptions.scenario << endl;
+    summary << "steps "           << mOptions.headlessSteps << endl;
+    summary << "frames "          << frame << endl;
+    summary << "particles "       << metrics.liveCount << endl;
+    summary << "seconds "         << seconds << endl;
+    summary << "stepsPerSecond "  << (seconds > 0.0 ? mOptions.headlessSteps / seconds : 0.0) << endl;
+    summary << "densityError "    << metrics.densityError << endl;
+    summary << "maxDensityError " << metrics.maxDensityError << endl;
+    summary << "kineticEnergy "   << metrics.kineticEnergy << endl;
+    summary << "potentialEnergy " << metrics.potentialEnergy << endl;
+    summary << "totalEnergy "     << metrics.kineticEnergy + metrics.potentialEnergy << endl;
+
+    // Boundary handling per step: quads inside computeDelta, or computeDelta + the SDF pass (see boundary.sweep)
+    summary << "boundaryMsPerStep " << simulation.PerfData.GetAverageTime("computeDelta") + simulation.PerfData.GetAverageTime("applyBoundary") << endl;
+    // Surface extraction runs beside the simulation, it keeps pace while surfaceMsPerFrame <= stepMsPerFrame
+    // (see surface_1m.sweep)
+    if (frame > 0)
+        summary << "stepMsPerFrame "    << seconds * 1000.0 / frame << endl;
+    if (surface.frames > 0)
+        summary << "surfaceMsPerFrame " << surface.totalTime / surface.frames << endl;
+
+    if (mOptions.summaryFile.empty())
+    {
+        cout << summary.str();
+        return true;
+    }
+
+    ofstream ofs(mOptions.summaryFile.c_str(), ios::out | ios::trunc);
+    if (!(ofs << summary.str()))
+    {
+        cerr << "Unable to write summary file " << mOptions.summaryFile << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Runner::runPlayback(CVisual &renderer)
+{
+    // Scenario parameters (cells, particles size and the fluid surface settings)
+    LoadParameters(getScenario(mOptions.scenario));
+    // Every frame is written (lossless capture)
+    FrameCapture capture;
+    if (!initOffscreenRenderer(renderer) || !capture.Start(mOptions.renderFile, g_ScreenFBO.Width, g_ScreenFBO.Height, true))
+        return false;
+
+    // Recorded frames (scanned once, the parallel render passes its count to every slice)
+    const unsigned int frameCount = (mOptions.frameCount > 0) ? mOptions.frameCount : CountFrameFiles(mOptions.playbackFile);
+    if (frameCount == 0)
+    {
+        cerr << "No recorded frames found for " << mOptions.playbackFile << endl;
+        return false;
+    }
+
+    // Frames of this slice (a slice past the last frame has nothing to render)
+    unsigned int rendered = 0;
+    const auto start = chrono::high_resolution_clock::now();
+    for (unsigned int frame = mOptions.sliceIndex; frame < frameCount; frame += max(mOptions.sliceCount, 1u))
+    {
+        ParticlesFile particles;
+        if (!particles.Load(FrameFileName(mOptions.playbackFile, frame)))
+        {
+            cerr << "Unable to load frame " << FrameFileName(mOptions.playbackFile, frame) << endl;
+            capture.Stop();
+            return false;
+        }
+
+        renderer.setParticles(particles.positions, particles.count);
         renderer.renderParticles();
+        capture.Capture(frame);
+        rendered++;
+    }
+    capture.Stop();
+    const double seconds = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
 
-        // Draw UI
-        OGLU_StartTimingSection("Draw UI");
-        UIManager_Draw();
-        OGLU_EndTimingSection();
+    cout << "Rendered " << rendered << " of " << frameCount << " frames of " << mOptions.playbackFile << " in " << seconds << " s" << endl;
+    return true;
+}
 
-        // Transfer to screen
-        OGLU_StartTimingSection("Present-To-Screen");
-        renderer.presentToScreen();
-        OGLU_EndTimingSection();
+int Runner::runParallelRender(const string &executable, unsigned int jobs)
+{
+    // Frames are counted once, no more processes than frames
+    const unsigned int frameCount = CountFrameFiles(mOptions.playbackFile);
+    if (frameCount == 0)
+    {
+        cerr << "No recorded frames found for " << mOptions.playbackFile << endl;
+        return 1;
+    }
+    jobs = min(jobs, frameCount);
+
+    // Each process renders every jobs-th frame in its own context
+    vector<int>    exitCodes(jobs, -1);
+    vector<thread> slots;
+    for (unsigned int j = 0; j < jobs; j++)
+    {
+        ostringstream command;
+        command << "\"" << executable << "\" --scenario \"" << mOptions.scenario << "\" --playback \"" << mOptions.playbackFile
+                << "\" --render \"" << mOptions.renderFile << "\" --render-size " << mOptions.renderWidth << "x" << mOptions.renderHeight
+                << " --render-mode " << mOptions.renderMode << " --frame-slice " << j << "/" << jobs << " --frame-count " << frameCount;
+
+        const string commandLine = command.str();
+        slots.push_back(thread([commandLine, j, &exitCodes]() { exitCodes[j] = system(commandLine.c_str()); }));
+    }
+
+    int failed = 0;
+    for (unsigned int j = 0; j < jobs; j++)
+    {
+        slots[j].join();
+        failed += (exitCodes[j] == 0) ? 0 : 1;
     }
-    while (!UIManager_WindowShouldClose());
 
-#if defined(MAKE_VIDEO)
-    pclose(ffmpeg);
-#endif
+    cout << "Parallel render done (" << jobs << " processes, " << failed << " failed)" << endl;
+    return (failed == 0) ? 0 : 1;
 }
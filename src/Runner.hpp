@@ -4,17 +4,83 @@
 #include "hesp.hpp"
 #include "Simulation.hpp"
 #include "visual/visual.hpp"
+#include "Resources.hpp"
+
+// Command line options
+struct RunnerOptions
+{
+    // Scenario file (name inside the scenarios folder, or a path)
+    string       scenario;
+
+    // Exit after the first initialization (print device memory usage)
+    bool         memoryReportOnly;
+
+    // Exit once the kernels are built (compare radix sort and cell binning)
+    bool         benchmarkBinningOnly;
+
+    // Headless run: simulation steps and the metrics summary file (empty: stdout)
+    unsigned int headlessSteps;
+    string       summaryFile;
+
+    // Frame capture output (empty: none), "name_%06d.ppm" image sequence or a video file (see FrameCapture)
+    string       captureFile;
+
+    // Offscreen rendering of the headless or played back frames (image sequence, see CVisual::initOffscreen)
+    string       renderFile;
+    int          renderWidth;
+    int          renderHeight;
+    int          renderMode;   // CVisual::UICmd_RenderMode (0: smooth fluid)
+
+    // Recorded frames (binary particles files, "frames/state_%06d.bin"): written by headless runs, rendered by playback
+    string       recordFile;
+    string       playbackFile;
+
+    // Fluid surface meshes of the headless frames ("surface_%06d.pbfs" binary or ".obj", see SurfaceExtractor)
+    string       surfaceFile;
+
+    // Played back frames rendered by this process (frame % sliceCount == sliceIndex)
+    unsigned int sliceIndex;
+    unsigned int sliceCount;
+
+    // Recorded frames count (0: scanned from the playback files, set by runParallelRender for its processes)
+    unsigned int frameCount;
+
+    RunnerOptions()
+        : scenario("dam_coarse.par"), memoryReportOnly(false), benchmarkBinningOnly(false), headlessSteps(100),
+          renderWidth(1920), renderHeight(1080), renderMode(0), sliceIndex(0), sliceCount(1), frameCount(0) { }
+};
 
 class Runner
 {
 private:
-    // A list of files to track for changes
-    list<pair<string, time_t> > mKernelFilesTracker;
-    list<pair<string, time_t> > mShaderFilesTracker;
+    // Files change tracking (groups of files)
+    ResourceWatcher mResourceWatcher;
+    int             mKernelFilesGroup;
+    int             mScenarioFilesGroup;
+    int             mShaderFilesGroup;
+
+    // Command line options
+    RunnerOptions   mOptions;
+
+    // Shaders and buffers of an offscreen renderer (particles are uploaded by the caller)
+    bool initOffscreenRenderer(CVisual &renderer);
 
 public:
+    explicit Runner(const RunnerOptions &options = RunnerOptions())
+        : mOptions(options) { }
+
     void run(Simulation &simulation, CVisual &renderer);
 
+    // Run the scenario without a window (no OpenGL sharing), returns false on failure
+    //   Each frame (Params.subSteps steps) is recorded and/or rendered offscreen if pRenderer is set
+    bool runHeadless(Simulation &simulation, CVisual *pRenderer = NULL);
+
+    // Render recorded frames offscreen (no simulation), returns false on failure
+    bool runPlayback(CVisual &renderer);
+
+    // Render recorded frames with concurrent playback processes of "executable" (one context each), returns the exit code
+    int runParallelRender(const string &executable, unsigned int jobs);
+
 };
 
 #endif // __RUNNER_HPP
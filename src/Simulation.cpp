@@ -3,14 +3,25 @@
 #include "Simulation.hpp"
 #include "Resources.hpp"
 #include "ParamUtils.hpp"
+#include "BoundarySDF.hpp"
+#include "OGL_Utils.h"
 #include "ocl/OCLUtils.hpp"
+#include "SpaceCurves.hpp"
 #include "SOIL.h"
 
+#include <glm/glm.hpp>
+
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <sstream>
+#include <fstream>
+#include <iomanip>
 #include <algorithm>
+#include <chrono>
 
 using namespace std;
 
@@ -26,78 +37,131 @@ cl::Memory Simulation::CreateCachedBuffer(cl::ImageFormat& format, int elements)
         return cl::Buffer(mCLContext, CL_MEM_READ_WRITE, elements * sizeof(float) * 4);
 }
 
-void OCL_InitMemory(cl::CommandQueue& queue, cl::Memory& mem, void* pData = NULL, int nDataSize = 0)
-{
-    // Get buffer size
-    int memSize = mem.getInfo<CL_MEM_SIZE>();
-
-    // Create memory
-    char* pBuf = new char[memSize];
-    memset(pBuf, 0, memSize);
-
-    // Fill with data
-    if ((pData != NULL) && (nDataSize > 0))
-        for (int i = 0; i < memSize; i++)
-            pBuf[i] = ((char*)pData)[i % nDataSize];
-
-    // Choose the way to transfer the data
-    switch (mem.getInfo<CL_MEM_TYPE>())
-    {
-        case CL_MEM_OBJECT_BUFFER:
-            queue.enqueueWriteBuffer(*((cl::Buffer*)&mem), CL_TRUE, 0, memSize, pBuf);
-            break;
-    }
-
-    // Release memory
-    delete[] pBuf;
-}
-
-
 Simulation::Simulation(const cl::Context &clContext, const cl::Device &clDevice)
-    : mCLContext(clContext),
+    : mBuildState(KERNELS_BUILD_IDLE),
+      mBuildRestart(false),
+      mCLContext(clContext),
       mCLDevice(clDevice),
-      bDumpParticlesData(false)
+      mSurfacesMaskWidth(512),
+      mLiveCount(0),
+      mEmitDistance(0.0f),
+      mCellsCount(0),
+      mRadixItems(_ITEMS),
+      mRadixGroups(_GROUPS),
+      mBinningScanItems(256),
+      mCellCountsSize(0),
+      mSharedFriendsList(0),
+      bDumpParticlesData(false),
+      bMeasureLocality(false)
 {
     // Create Queue
     mQueue = cl::CommandQueue(mCLContext, mCLDevice, CL_QUEUE_PROFILING_ENABLE);
+    mGLSync.Init(mCLContext, mCLDevice);
+
+    // No locality measurement yet
+    memset(&mLocality, 0, sizeof(mLocality));
+
+    // Load previous tuning results of this device (if any)
+    mTuning.Load(KernelTuner::TuningFileName(mCLDevice));
 }
 
 Simulation::~Simulation()
 {
-    glFinish();
+    // Wait for background kernels build
+    if (mBuildThread.joinable())
+        mBuildThread.join();
+
     mQueue.finish();
 }
 
 void Simulation::CreateParticles()
 {
-    // Create buffers
-    cl_float4* positions   = new cl_float4[Params.particleCount];
-
-    // Compute particle count per axis
-    int ParticlesPerAxis = (int)ceil(pow(Params.particleCount, 1 / 3.0));
+    cl_uint count = Params.particleCount;
 
-    // Build particles blcok
-    float d = Params.h * Params.setupSpacing;
-    float offsetX = (1.0f - ParticlesPerAxis * d) / 2.0f;
-    float offsetY = 0.3f;
-    float offsetZ = (1.0f - ParticlesPerAxis * d) / 2.0f;
-    for (cl_uint i = 0; i < Params.particleCount; i++)
+    // Particles file (reloaded only if it was modified)
+    const string particlesPath = ParticlesFileName.empty() ? "" : getPathForScenario(ParticlesFileName);
+    if (!particlesPath.empty() && !mParticlesFile.IsCurrent(particlesPath))
     {
-        cl_uint x = ((cl_uint)(i / pow(ParticlesPerAxis, 1)) % ParticlesPerAxis);
-        cl_uint y = ((cl_uint)(i / pow(ParticlesPerAxis, 0)) % ParticlesPerAxis);
-        cl_uint z = ((cl_uint)(i / pow(ParticlesPerAxis, 2)) % ParticlesPerAxis);
+        if (mParticlesFile.Load(particlesPath))
+            cout << "Loaded " << mParticlesFile.count << " particles from " << ParticlesFileName
+                 << (mParticlesFile.mapped ? " (mapped)" : "") << " in " << mParticlesFile.loadTime << " ms" << endl;
+        else
+            cerr << "Unable to load particles file " << ParticlesFileName << endl;
+    }
 
-        positions[i].s[0] = offsetX + (x /*+ (y % 2) * .5*/) * d;
-        positions[i].s[1] = offsetY + (y) * d;
-        positions[i].s[2] = offsetZ + (z /*+ (y % 2) * .5*/) * d;
-        positions[i].s[3] = 0;
+    // Generate the scenario blocks on the device (see init_particles.cl)
+    map<string, cl::Kernel>::iterator it = mKernels.find("initParticles");
+    if (!particlesPath.empty())
+    {
+        // Upload the file particles as is (straight from the mapping for binary files)
+        count = min(count, mParticlesFile.count);
+        if (count > 0)
+            mQueue.enqueueWriteBuffer(mPositionsPingBuffer, CL_TRUE, 0, sizeof(cl_float4) * count, mParticlesFile.positions);
+        if ((count > 0) && (mParticlesFile.velocities != NULL))
+            mQueue.enqueueWriteBuffer(mVelocitiesBuffer, CL_TRUE, 0, sizeof(cl_float4) * count, mParticlesFile.velocities);
+        else
+            FillBuffer(mVelocitiesBuffer, 0);
     }
+    else if (it != mKernels.end())
+    {
+        int param = 0; cl::Kernel kernel = it->second;
+        kernel.setArg(param++, mParameters);
+        kernel.setArg(param++, mPositionsPingBuffer);
+        kernel.setArg(param++, mVelocitiesBuffer);
+        kernel.setArg(param++, (cl_uint)1);
+        kernel.setArg(param++, count);
+        mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(max(DivCeil(count, 256), 1u) * 256), cl::NullRange, NULL, PerfData.GetTrackerEvent("initParticles"));
+    }
+    else if (count > 0)
+    {
+        // No kernels yet (failed build): plain lattice from the host
+        const float d = Params.h * Params.setupSpacing;
+        vector<cl_float4> positions(count);
+        cl_uint i = 0;
+        for (cl_uint b = 0; b < Params.blocksCount; b++)
+        {
+            const ParticleBlock &block = Params.blocks[b];
+            for (cl_uint local = 0; (local < block.count) && (i < count); local++, i++)
+            {
+                positions[i].s[0] = block.originX + ((local / block.sizeY) % block.sizeX) * d;
+                positions[i].s[1] = block.originY + (local % block.sizeY) * d;
+                positions[i].s[2] = block.originZ + (local / (block.sizeX * block.sizeY)) * d;
+                positions[i].s[3] = 0.0f;
+            }
+        }
+
+        mQueue.enqueueWriteBuffer(mPositionsPingBuffer, CL_TRUE, 0, sizeof(cl_float4) * count, &positions[0]);
+        FillBuffer(mVelocitiesBuffer, 0);
+    }
+
+    // All created particles are alive
+    SetLiveCount(count);
+    mEmitDistance = 0.0f;
+}
 
-    // Copy data from Host to GPU
-    OCL_InitMemory(mQueue, mPositionsPingBuffer, positions , sizeof(positions[0])  * Params.particleCount);
-    OCL_InitMemory(mQueue, mVelocitiesBuffer);
+void Simulation::FillBuffer(const cl::Buffer &buffer, cl_uint value, cl::Event *event)
+{
+    const cl_uint count = (cl_uint)(buffer.getInfo<CL_MEM_SIZE>() / sizeof(cl_uint));
 
-    delete[] positions;
+#if defined(CL_VERSION_1_2)
+    mQueue.enqueueFillBuffer(buffer, value, 0, count * sizeof(cl_uint), NULL, event);
+#else
+    // Windows builds are limited to OpenCL 1.1 (see hesp.hpp): fill kernel, host upload until the kernels are built
+    map<string, cl::Kernel>::iterator it = mKernels.find("fillBuffer");
+    if (it != mKernels.end())
+    {
+        int param = 0; cl::Kernel kernel = it->second;
+        kernel.setArg(param++, buffer);
+        kernel.setArg(param++, value);
+        kernel.setArg(param++, count);
+        mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(max(DivCeil(count, 256), 1u) * 256), cl::NullRange, NULL, event);
+    }
+    else
+    {
+        vector<cl_uint> data(max(count, 1u), value);
+        mQueue.enqueueWriteBuffer(buffer, CL_TRUE, 0, count * sizeof(cl_uint), &data[0]);
+    }
+#endif
 }
 
 const std::string *Simulation::KernelFileList()
@@ -105,9 +169,12 @@ const std::string *Simulation::KernelFileList()
     static const std::string kernels[] =
     {
         "hesp.hpp",
-        "parameters.hpp",
+        "Parameters.hpp",
+        "SpaceCurves.hpp",
         "logging.cl",
         "utilities.cl",
+        "init_particles.cl",
+        "emit_particles.cl",
         "predict_positions.cl",
         "update_cells.cl",
         "build_friends_list.cl",
@@ -115,11 +182,13 @@ const std::string *Simulation::KernelFileList()
         "compute_scaling.cl",
         "compute_delta.cl",
         "update_predicted.cl",
+        "apply_boundary.cl",
         "pack_data.cl",
         "update_velocities.cl",
         "apply_viscosity.cl",
         "apply_vorticity.cl",
         "radixsort.cl",
+        "cell_binning.cl",
         ""
     };
 
@@ -128,16 +197,36 @@ const std::string *Simulation::KernelFileList()
 
 bool Simulation::InitKernels()
 {
-    // Setup OpenCL Ranges
-    const cl_uint globalSize = (cl_uint)ceil(Params.particleCount / 32.0f) * 32;
-    mGlobalRange = cl::NDRange(globalSize);
-    mLocalRange = cl::NullRange;
+    // Drop any background build (its result would be outdated anyway)
+    if (mBuildThread.joinable())
+        mBuildThread.join();
+    mBuildState   = KERNELS_BUILD_IDLE;
+    mBuildRestart = false;
+
+    // Build and wait for the result
+    StartKernelsBuild();
+    mBuildThread.join();
+    return PollKernelsBuild();
+}
+
+void Simulation::StartKernelsBuild()
+{
+    // A build is already running: rebuild once it's done (its result is outdated)
+    if (mBuildState == KERNELS_BUILD_RUNNING)
+    {
+        mBuildRestart = true;
+        return;
+    }
+
+    // Make sure previous worker was collected
+    if (mBuildThread.joinable())
+        mBuildThread.join();
 
     // Notify OCL logging that we're about to start new kernel processing
-    oclLog.StartKernelProcessing(mCLContext, mCLDevice, 4096);
+    // (the running logger stays untouched until the new program is swapped in)
+    mPendingLog.StartKernelProcessing(mCLContext, Params.EnableKernelLogging, LOG_RING_SIZE);
 
     // setup kernel sources
-    OCLUtils clSetup;
     vector<string> kernelSources;
 
     // Load kernel sources
@@ -149,7 +238,7 @@ bool Simulation::InitKernels()
 
         // Patch kernel for logging
         if (pKernels[iSrc] != "logging.cl")
-            source = oclLog.PatchKernel(source);
+            source = mPendingLog.PatchKernel(source);
 
         // Load into compile list
         kernelSources.push_back(source);
@@ -166,35 +255,96 @@ bool Simulation::InitKernels()
 
     clflags << std::showpoint;
 
-    clflags << "-DLOG_SIZE="                    << (int)1024 << " ";
+    if (Params.EnableKernelLogging)
+        clflags << "-DENABLE_LOGGING -DLOG_RING_SIZE=" << (int)LOG_RING_SIZE << " ";
+
     clflags << "-DEND_OF_CELL_LIST="            << (int)(-1)         << " ";
 
-    clflags << "-DMAX_PARTICLES_COUNT="         << (int)(Params.particleCount)      << " ";  
     clflags << "-DMAX_FRIENDS_CIRCLES="         << (int)(Params.friendsCircles)     << " ";  
     clflags << "-DMAX_FRIENDS_IN_CIRCLE="       << (int)(Params.particlesPerCircle) << " ";  
-    clflags << "-DFRIENDS_BLOCK_SIZE="          << (int)(Params.particleCount * Params.friendsCircles) << " ";  
+    clflags << "-DCELL_CURVE="                  << (int)(Params.cellCurve) << " ";
+    clflags << "-DCELL_CURVE_GRANULARITY="      << (int)(Params.cellCurveGranularity) << " ";
 
-    clflags << "-DGRID_BUF_SIZE="     << (int)(Params.gridBufSize) << " ";
-
-    clflags << "-DPOLY6_FACTOR="      << 315.0f / (64.0f * M_PI * pow(Params.h, 9)) << "f ";
-    clflags << "-DGRAD_SPIKY_FACTOR=" << 45.0f / (M_PI * pow(Params.h, 6)) << "f ";
+    // Values that are read from "Params" at runtime (see utilities.cl) when runtime parameters are enabled
+    if (!Params.EnableRuntimeParams)
+    {
+        clflags << "-DMAX_PARTICLES_COUNT="     << (int)(Params.particleCapacity)   << " ";  
+        clflags << "-DFRIENDS_BLOCK_SIZE="      << (int)(Params.particleCapacity * Params.friendsCircles) << " ";  
+        clflags << "-DGRID_BUF_SIZE="           << (int)(Params.gridBufSize) << " ";
+        clflags << "-DPOLY6_FACTOR="            << Params.poly6Factor << "f ";
+        clflags << "-DGRAD_SPIKY_FACTOR="       << Params.gradSpikyFactor << "f ";
+    }
 
     if (Params.EnableCachedBuffers)
         clflags << "-DENABLE_CACHED_BUFFERS ";
 
-    // Compile kernels
-    cl::Program program = clSetup.createProgram(kernelSources, mCLContext, mCLDevice, clflags.str());
-    if (program() == 0)
+    if (Params.EnableRuntimeParams)
+        clflags << "-DENABLE_RUNTIME_PARAMS ";
+
+    if (Params.EnableSDFBoundary)
+        clflags << "-DENABLE_SDF_BOUNDARY ";
+
+    // Compile kernels on a worker thread (sharing our context)
+    mBuildRestart = false;
+    mBuildState   = KERNELS_BUILD_RUNNING;
+    mBuildThread  = std::thread(&Simulation::BuildKernelsWorker, this, kernelSources, clflags.str());
+}
+
+void Simulation::BuildKernelsWorker(vector<string> kernelSources, string clflags)
+{
+    try
+    {
+        // Compile kernels
+        OCLUtils clSetup;
+        mPendingProgram = clSetup.createProgram(kernelSources, mCLContext, mCLDevice, clflags);
+        mBuildState = (mPendingProgram() != 0) ? KERNELS_BUILD_DONE : KERNELS_BUILD_FAILED;
+    }
+    catch (const cl::Error &ecl)
+    {
+        // Build log was already reported by OCLUtils
+        cerr << "Kernels build failed: " << ecl.what() << "(" << ecl.err() << ")" << endl;
+        mBuildState = KERNELS_BUILD_FAILED;
+    }
+}
+
+bool Simulation::PollKernelsBuild()
+{
+    // Nothing to do while idle or still building
+    int buildState = mBuildState;
+    if ((buildState == KERNELS_BUILD_IDLE) || (buildState == KERNELS_BUILD_RUNNING))
+        return false;
+
+    // Collect worker
+    mBuildThread.join();
+    mBuildState = KERNELS_BUILD_IDLE;
+
+    // Sources changed while building: discard result and rebuild
+    if (mBuildRestart)
+    {
+        mPendingProgram = cl::Program();
+        StartKernelsBuild();
+        return false;
+    }
+
+    // Failed builds leave the running program untouched
+    if (buildState == KERNELS_BUILD_FAILED)
+    {
+        mPendingProgram = cl::Program();
         return false;
+    }
 
     // save BuildLog
-    string buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(mCLDevice);
+    string buildLog = mPendingProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(mCLDevice);
     ofstream f("build.log", ios::out | ios::trunc);
     f << buildLog;
     f.close();
 
-    // Build kernels table
-    mKernels = clSetup.createKernelsMap(program);
+    // Build kernels table and swap it (and the matching logger) in
+    OCLUtils clSetup;
+    mKernels = clSetup.createKernelsMap(mPendingProgram);
+    oclLog.Flush();
+    oclLog   = mPendingLog;
+    mPendingProgram = cl::Program();
 
     // Write kernel info
     cout << "CL_KERNEL_WORK_GROUP_SIZE=" << mKernels["computeDelta"].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(mCLDevice) << endl;
@@ -205,79 +355,391 @@ bool Simulation::InitKernels()
 
 void Simulation::InitBuffers()
 {
-    // Create buffers
-    mPositionsPingBuffer   = cl::BufferGL(mCLContext, CL_MEM_READ_WRITE, mSharedPingBufferID); // buffer could be changed to be CL_MEM_WRITE_ONLY but for debugging also reading it might be helpful
-    mPositionsPongBuffer   = cl::BufferGL(mCLContext, CL_MEM_READ_WRITE, mSharedPongBufferID); // buffer could be changed to be CL_MEM_WRITE_ONLY but for debugging also reading it might be helpful
-    mParticlePosImg        = cl::Image2DGL(mCLContext, CL_MEM_READ_WRITE, GL_TEXTURE_2D, 0, mSharedParticlesPos);
+    // Drop the previous buffers and arena sub-buffers: a grown arena is allocated once the previous one is freed
+    mQueue.finish();
+    mPositionsPingBuffer  = mPositionsPongBuffer = mCellsBuffer = cl::Buffer();
+    mPredictedPingBuffer  = mPredictedPongBuffer = cl::Memory();
+    mVelocitiesBuffer     = mDeltaBuffer = mOmegaBuffer = mDensityBuffer = mLambdaBuffer = cl::Buffer();
+    mFriendsListBuffer    = mParameters = mLiveCountBuffer = cl::Buffer();
+    mInKeysBuffer         = mInPermutationBuffer = mOutKeysBuffer = mOutPermutationBuffer = cl::Buffer();
+    mHistogramBuffer      = mGlobSumBuffer = mHistoTempBuffer = cl::Buffer();
+    mCellCountsBuffer     = mCellBlockSumsBuffer = cl::Buffer();
+    mMemoryArena.Begin();
+
+    // Create buffers (not shared with OpenGL, the window gets copies, see SimulationThread)
+    mPositionsPingBuffer   = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCapacity * sizeof(cl_float4));
+    mPositionsPongBuffer   = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCapacity * sizeof(cl_float4));
+
+    // Layout the memory arena (previous arena is reused if the new layout fits)
+    const size_t capacity = Params.particleCapacity;
+    mRadixItems  = Params.EnableAutotune ? mTuning.radixItems  : _ITEMS;
+    mRadixGroups = Params.EnableAutotune ? mTuning.radixGroups : _GROUPS;
+    mKeysCount   = IntCeil(Params.particleCapacity, mRadixItems * mRadixGroups);
+
+    // Cell binning scans 2 counts per work item, the counts are padded to whole blocks (+1 for the total)
+    mBinningScanItems = 256;
+    while (mBinningScanItems > mCLDevice.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>())
+        mBinningScanItems /= 2;
+    mCellCountsSize = IntCeil(Params.gridBufSize + 1, 2 * mBinningScanItems);
+
+    if (!Params.EnableCachedBuffers)
+    {
+        mMemoryArena.Reserve("PredictedPing", capacity * sizeof(cl_float4));
+        mMemoryArena.Reserve("PredictedPong", capacity * sizeof(cl_float4));
+    }
+    mMemoryArena.Reserve("Velocities",     capacity * sizeof(cl_float4));
+    mMemoryArena.Reserve("Delta",          capacity * sizeof(cl_float4));
+    mMemoryArena.Reserve("Omega",          capacity * sizeof(cl_float4));
+    mMemoryArena.Reserve("Density",        capacity * sizeof(cl_float));
+    mMemoryArena.Reserve("Lambda",         capacity * sizeof(cl_float));
+    mMemoryArena.Reserve("FriendsList",    capacity * Params.friendsCircles * (1 + Params.particlesPerCircle) * sizeof(cl_uint));
+    mMemoryArena.Reserve("Cells",          Params.gridBufSize * 2 * sizeof(cl_uint), false);
+    mMemoryArena.Reserve("Parameters",     sizeof(Params), false, OCL_ARENA_READ_ONLY);
+    mMemoryArena.Reserve("LiveCount",      sizeof(cl_uint) * 2, false);
+    mMemoryArena.Reserve("InKeys",         sizeof(cl_uint) * mKeysCount);
+    mMemoryArena.Reserve("InPermutation",  sizeof(cl_uint) * mKeysCount);
+    mMemoryArena.Reserve("OutKeys",        sizeof(cl_uint) * mKeysCount);
+    mMemoryArena.Reserve("OutPermutation", sizeof(cl_uint) * mKeysCount);
+    mMemoryArena.Reserve("Histogram",      sizeof(cl_uint) * _RADIX * mRadixGroups * mRadixItems, false);
+    mMemoryArena.Reserve("GlobSum",        sizeof(cl_uint) * _HISTOSPLIT, false);
+    mMemoryArena.Reserve("HistoTemp",      sizeof(cl_uint) * _HISTOSPLIT, false);
+    mMemoryArena.Reserve("CellCounts",     sizeof(cl_uint) * mCellCountsSize, false);
+    mMemoryArena.Reserve("CellBlockSums",  sizeof(cl_uint) * mCellCountsSize / (2 * mBinningScanItems), false);
+    mMemoryArena.Commit(mCLContext, mCLDevice);
+
+    // Predicted positions are images when cached buffers are enabled
+    if (Params.EnableCachedBuffers)
+    {
+        mPredictedPingBuffer = CreateCachedBuffer(cl::ImageFormat(CL_RGBA, CL_FLOAT), Params.particleCapacity);
+        mPredictedPongBuffer = CreateCachedBuffer(cl::ImageFormat(CL_RGBA, CL_FLOAT), Params.particleCapacity);
+        mMemoryArena.Track("PredictedPing", mPredictedPingBuffer);
+        mMemoryArena.Track("PredictedPong", mPredictedPongBuffer);
+    }
+    else
+    {
+        mPredictedPingBuffer = mMemoryArena.Get("PredictedPing");
+        mPredictedPongBuffer = mMemoryArena.Get("PredictedPong");
+    }
 
-    mPredictedPingBuffer   = CreateCachedBuffer(cl::ImageFormat(CL_RGBA, CL_FLOAT), Params.particleCount);
-    mPredictedPongBuffer   = CreateCachedBuffer(cl::ImageFormat(CL_RGBA, CL_FLOAT), Params.particleCount);
-    mVelocitiesBuffer      = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCount * sizeof(cl_float4));
-    mDeltaBuffer           = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCount * sizeof(cl_float4));
-    mOmegaBuffer           = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCount * sizeof(cl_float4));
-    mDensityBuffer         = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCount * sizeof(cl_float));
-    mLambdaBuffer          = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCount * sizeof(cl_float));
-    mParameters            = cl::Buffer(mCLContext, CL_MEM_READ_ONLY,  sizeof(Params));
+    mVelocitiesBuffer      = mMemoryArena.Get("Velocities");
+    mDeltaBuffer           = mMemoryArena.Get("Delta");
+    mOmegaBuffer           = mMemoryArena.Get("Omega");
+    mDensityBuffer         = mMemoryArena.Get("Density");
+    mLambdaBuffer          = mMemoryArena.Get("Lambda");
+    mFriendsListBuffer     = mMemoryArena.Get("FriendsList");
+    mCellsBuffer           = mMemoryArena.Get("Cells");
+    mParameters            = mMemoryArena.Get("Parameters");
+    mLiveCountBuffer       = mMemoryArena.Get("LiveCount");
 
     // Radix buffers
-    mKeysCount             = IntCeil(Params.particleCount, _ITEMS * _GROUPS);
-    mInKeysBuffer          = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
-    mInPermutationBuffer   = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
-    mOutKeysBuffer         = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
-    mOutPermutationBuffer  = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
-    mHistogramBuffer       = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * _RADIX * _GROUPS * _ITEMS);
-    mGlobSumBuffer         = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * _HISTOSPLIT);
-    mHistoTempBuffer       = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * _HISTOSPLIT);
-
-    // Update OpenGL lock list
-    mGLLockList.push_back(mPositionsPingBuffer);
-    mGLLockList.push_back(mPositionsPongBuffer);
-    mGLLockList.push_back(mParticlePosImg);
+    mInKeysBuffer          = mMemoryArena.Get("InKeys");
+    mInPermutationBuffer   = mMemoryArena.Get("InPermutation");
+    mOutKeysBuffer         = mMemoryArena.Get("OutKeys");
+    mOutPermutationBuffer  = mMemoryArena.Get("OutPermutation");
+    mHistogramBuffer       = mMemoryArena.Get("Histogram");
+    mGlobSumBuffer         = mMemoryArena.Get("GlobSum");
+    mHistoTempBuffer       = mMemoryArena.Get("HistoTemp");
+
+    // Cell binning buffers (keys and ranks go to the radix "Out" buffers)
+    mCellCountsBuffer      = mMemoryArena.Get("CellCounts");
+    mCellBlockSumsBuffer   = mMemoryArena.Get("CellBlockSums");
+
+    // Positions are outside the arena (swapped each step), reported too
+    mMemoryArena.Track("PositionsPing", mPositionsPingBuffer);
+    mMemoryArena.Track("PositionsPong", mPositionsPongBuffer);
+
+    // Copy Params (Host) => mParams (GPU), the particles are generated from it
+    UpdateParameters();
 
     // Update mPositionsPingBuffer and mVelocitiesBuffer
-    LockGLObjects();
+    ResetParticles();
+}
+
+void Simulation::ReleaseGLObjects()
+{
+    // Delete OpenGL objects (glDelete* ignores 0)
+    glDeleteTextures(1, &mSharedFriendsList);
+    mSharedFriendsList = 0;
+}
+
+void Simulation::PrintMemoryReport(ostream &os) const
+{
+    mMemoryArena.PrintReport(os, mCLDevice, Params.particleCapacity);
+}
+
+void Simulation::ResetParticles()
+{
     CreateParticles();
-    UnlockGLObjects();
+}
 
-    // Copy Params (Host) => mParams (GPU)
+void Simulation::SetLiveCount(cl_uint liveCount)
+{
+    mLiveCount = min(liveCount, Params.particleCapacity);
+
+    // Kernels are dispatched over the live particles only (at least one block, divisible by any tuned local size)
+    mGlobalRange = cl::NDRange(max(DivCeil(mLiveCount, 256), 1u) * 256);
+}
+
+void Simulation::UpdateParameters()
+{
     mQueue.enqueueWriteBuffer(mParameters, CL_TRUE, 0, sizeof(Params), &Params);
 }
 
+void Simulation::ApplyTuning()
+{
+    // Storage type is compiled into the kernels and decides the buffers type
+    if (Params.EnableAutotune && mTuning.valid)
+        Params.EnableCachedBuffers = mTuning.cachedBuffers;
+}
+
+cl::NDRange Simulation::LocalRange(const string &kernelName) const
+{
+    if (!Params.EnableAutotune)
+        return cl::NullRange;
+
+    map<string, size_t>::const_iterator it = mTuning.localSizes.find(kernelName);
+    if ((it == mTuning.localSizes.end()) || (it->second == 0))
+        return cl::NullRange;
+
+    return cl::NDRange(it->second);
+}
+
 void Simulation::InitCells()
 {
-    // Write buffer for cells
-    mCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.gridBufSize * 2 * sizeof(cl_uint));
-    OCL_InitMemory(mQueue, mCellsBuffer, (void*)&END_OF_CELL_LIST, sizeof(END_OF_CELL_LIST));
+    // Reset cells
+    FillBuffer(mCellsBuffer, (cl_uint)END_OF_CELL_LIST);
+    mCellsCount = 0;
 
-    // Init Friends list buffer
-    mFriendsListBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.particleCount * Params.friendsCircles * (1 + Params.particlesPerCircle) * sizeof(cl_uint));
-    OCL_InitMemory(mQueue, mFriendsListBuffer);
+    // Reset Friends list
+    FillBuffer(mFriendsListBuffer, 0);
 }
 
+// Force mask sidecar cache header (followed by the packed mask words)
+struct ForceMaskCacheHeader
+{
+    char               magic[4];
+    unsigned long long sourceHash;
+    int                width;
+    int                height;
+};
+
+static const char FORCE_MASK_CACHE_MAGIC[4] = {'F', 'P', 'M', '1'};
+
 void Simulation::LoadForceMasks()
 {
-    // Load file
-    int width = 0, height = 0, channels = 0;
-    byte* data = SOIL_load_image(getPathForTexture(string("Scene_fp_mask.png")).c_str(), &width, &height, &channels, 4);
+    const string pngFile   = getPathForTexture(string("Scene_fp_mask.png"));
+    const string cacheFile = getPathForTexture(string("Scene_fp_mask.bin"));
+    const unsigned long long pngHash = HashFile(pngFile);
+
+    // Try the decoded sidecar first
+    ForceMaskCacheHeader header;
+    vector<cl_uint> bits;
+    ifstream ifs(cacheFile.c_str(), ios::binary);
+    if (ifs.read((char*)&header, sizeof(header)) &&
+        equal(FORCE_MASK_CACHE_MAGIC, FORCE_MASK_CACHE_MAGIC + 4, header.magic) &&
+        (header.sourceHash == pngHash) && (header.width > 0) && (header.height > 0))
+    {
+        bits.resize(DivCeil(header.width * header.height, 32));
+        if (!ifs.read((char*)&bits[0], bits.size() * sizeof(cl_uint)))
+            bits.clear();
+    }
+    ifs.close();
+
+    // Decode png and pack the red channel to 1 bit per texel
+    if (bits.empty())
+    {
+        int width = 0, height = 0, channels = 0;
+        byte* data = SOIL_load_image(pngFile.c_str(), &width, &height, &channels, 4);
+        if (data == NULL)
+        {
+            cerr << "Unable to load force mask " << pngFile << endl;
+            width = height = 1;
+        }
+
+        bits.assign(DivCeil(width * height, 32), 0);
+        for (int i = 0; (data != NULL) && (i < width * height); i++)
+            if (data[4 * i] != 0)
+                bits[i / 32] |= 1u << (i % 32);
+
+        SOIL_free_image_data(data);
+
+        // Write sidecar
+        copy(FORCE_MASK_CACHE_MAGIC, FORCE_MASK_CACHE_MAGIC + 4, header.magic);
+        header.sourceHash = pngHash;
+        header.width      = width;
+        header.height     = height;
+
+        ofstream ofs(cacheFile.c_str(), ios::binary | ios::trunc);
+        ofs.write((const char*)&header, sizeof(header));
+        ofs.write((const char*)&bits[0], bits.size() * sizeof(cl_uint));
+        if (!ofs.good())
+            cerr << "Unable to write force mask cache " << cacheFile << endl;
+    }
+
+    // Create OpenCL buffer
+    mSurfacesMaskWidth = header.width;
+    mSurfacesMask = cl::Buffer(mCLContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bits.size() * sizeof(cl_uint), &bits[0]);
+    mMemoryArena.Track("SurfacesMask", mSurfacesMask, false);
+}
+
+void Simulation::LoadColliders()
+{
+    // Colliders are stored as 5 float4 per quad:
+    //   (B, invdet) (E0, a) (E1, c) (normal, b) (maskYOffset, maskHeight, maskWidth, 0)
+    const int COLLIDER_STRIDE = 5;
+    vector<cl_float4> colliders;
+    vector<glm::vec3> boundsMin, boundsMax;
+
+    // Bounce margin: the force zone is at most 2 * edgeOffset thick plus the particle movement
+    const float margin = 2.0f * (1.0f + 6.0f * Params.h * 0.03f) + Params.h;
+
+    // Parse quads generated by ProcessForcePlanes (one BouncePointQuad(...) line per surface)
+    istringstream iss(getKernelSource("Scene_equ.txt"));
+    string line;
+    while (getline(iss, line))
+    {
+        // Read B, E0, E1
+        glm::vec3 v[3];
+        size_t pos = 0;
+        bool valid = true;
+        for (int k = 0; (k < 3) && valid; k++)
+        {
+            pos = line.find("(float3)(", pos);
+            valid = (pos != string::npos) && (sscanf(line.c_str() + pos, "(float3)(%f,%f,%f)", &v[k].x, &v[k].y, &v[k].z) == 3);
+            pos++;
+        }
+
+        // Read mask offset and height
+        int maskYOffset = 0, maskHeight = 0;
+        pos = line.find("surfacesMask,");
+        valid = valid && (pos != string::npos) && (sscanf(line.c_str() + pos, "surfacesMask,%d,%d", &maskYOffset, &maskHeight) == 2);
+        if (!valid)
+            continue;
+
+        // Quad precalc
+        const glm::vec3 &B = v[0], &E0 = v[1], &E1 = v[2];
+        const float a = glm::dot(E0, E0);
+        const float b = glm::dot(E0, E1);
+        const float c = glm::dot(E1, E1);
+        const float invdet = 1.0f / (a * c - b * b);
+        const glm::vec3 N = glm::normalize(glm::cross(E0, E1));
+
+        cl_float4 data[COLLIDER_STRIDE] = {{{B.x,  B.y,  B.z,  invdet}},
+                                           {{E0.x, E0.y, E0.z, a}},
+                                           {{E1.x, E1.y, E1.z, c}},
+                                           {{N.x,  N.y,  N.z,  b}},
+                                           {{(float)maskYOffset, (float)maskHeight, (float)mSurfacesMaskWidth, 0}}};
+        colliders.insert(colliders.end(), data, data + COLLIDER_STRIDE);
+
+        // Quad bounds (expanded by the margin)
+        glm::vec3 qMin = glm::min(glm::min(B, B + E0), glm::min(B + E1, B + E0 + E1)) - margin;
+        glm::vec3 qMax = glm::max(glm::max(B, B + E0), glm::max(B + E1, B + E0 + E1)) + margin;
+        boundsMin.push_back(qMin);
+        boundsMax.push_back(qMax);
+    }
 
-    // Clear alpha
-    for (int i = 0; i < width * height * 4; i+=4)
+    const int quadsCount = (int)boundsMin.size();
+    if (quadsCount == 0)
+        cerr << "Warning: no colliders found in Scene_equ.txt" << endl;
+
+    // Compute coarse grid bounds
+    glm::vec3 gridMin(0.0f), gridMax(0.0f);
+    for (int q = 0; q < quadsCount; q++)
     {
-        data[i+1] = 0;
-        data[i+2] = 0;
-        data[i+3] = 0;
+        gridMin = (q == 0) ? boundsMin[q] : glm::min(gridMin, boundsMin[q]);
+        gridMax = (q == 0) ? boundsMax[q] : glm::max(gridMax, boundsMax[q]);
     }
 
-    // Create OpenCL image
-    mSurfacesMask = cl::Image2D(mCLContext, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_UNSIGNED_INT32), width, height);
+    // Longest axis gets COLLIDERS_GRID_RES cells, others keep the cells cubic
+    const int COLLIDERS_GRID_RES = 16;
+    const glm::vec3 extent = gridMax - gridMin;
+    const float cellSize = max(max(extent.x, extent.y), max(extent.z, 1e-3f)) / COLLIDERS_GRID_RES;
+    glm::ivec3 res = (quadsCount == 0) ? glm::ivec3(0) :
+                     glm::max(glm::ivec3(1), glm::ivec3(glm::ceil(extent / cellSize)));
+
+    // Bin quads into cells (quad order is kept inside each cell)
+    vector<cl_uint> cellsRange(2 * max(res.x * res.y * res.z, 1), 0);
+    vector<cl_uint> cellsIndex;
+    for (int z = 0; z < res.z; z++)
+    for (int y = 0; y < res.y; y++)
+    for (int x = 0; x < res.x; x++)
+    {
+        const int cell = (z * res.y + y) * res.x + x;
+        const glm::vec3 cMin = gridMin + glm::vec3(x, y, z) * cellSize;
+        const glm::vec3 cMax = cMin + cellSize;
+
+        cellsRange[2 * cell] = (cl_uint)cellsIndex.size();
+        for (int q = 0; q < quadsCount; q++)
+            if (glm::all(glm::lessThanEqual(boundsMin[q], cMax)) && glm::all(glm::lessThanEqual(cMin, boundsMax[q])))
+                cellsIndex.push_back(q);
+        cellsRange[2 * cell + 1] = (cl_uint)cellsIndex.size() - cellsRange[2 * cell];
+    }
 
-    // Write data
-    cl::size_t<3> org, region; region[0] = width; region[1] = height; region[2] = 1;
-    mQueue.enqueueWriteImage(mSurfacesMask, true,  org, region, 0, 0, data);
-    //mQueue.enqueueReadImage(mSurfacesMask, true,  org, region, 0, 0, data);
+    // Avoid empty buffers
+    if (colliders.empty())  colliders.resize(COLLIDER_STRIDE);
+    if (cellsIndex.empty()) cellsIndex.resize(1, 0);
+
+    // Upload
+    mCollidersBuffer      = cl::Buffer(mCLContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, colliders.size()  * sizeof(cl_float4), &colliders[0]);
+    mCollidersCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cellsRange.size() * sizeof(cl_uint),   &cellsRange[0]);
+    mCollidersIndexBuffer = cl::Buffer(mCLContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cellsIndex.size() * sizeof(cl_uint),   &cellsIndex[0]);
+    mMemoryArena.Track("Colliders",      mCollidersBuffer,      false);
+    mMemoryArena.Track("CollidersCells", mCollidersCellsBuffer, false);
+    mMemoryArena.Track("CollidersIndex", mCollidersIndexBuffer, false);
+
+    mCollidersGridMin.s[0] = gridMin.x;
+    mCollidersGridMin.s[1] = gridMin.y;
+    mCollidersGridMin.s[2] = gridMin.z;
+    mCollidersGridMin.s[3] = 1.0f / cellSize;
+    mCollidersGridRes.s[0] = res.x;
+    mCollidersGridRes.s[1] = res.y;
+    mCollidersGridRes.s[2] = res.z;
+    mCollidersGridRes.s[3] = 0;
+}
 
-    // Release image data
-    SOIL_free_image_data(data);
+void Simulation::LoadBoundarySDF()
+{
+    // Nothing to load if the quads are used
+    if (!Params.EnableSDFBoundary)
+    {
+        mBoundarySDF = cl::Image3D();
+        return;
+    }
+
+    const string objFile   = getPathForObjects("Scene.obj");
+    const string cacheFile = getPathForObjects("Scene.sdf");
+    const unsigned long long objHash = HashFile(objFile);
+
+    // Try the disk cache first, voxelize the mesh otherwise
+    BoundarySDF sdf;
+    if (!sdf.Load(cacheFile, Params.sdfCellSize, objHash))
+    {
+        Mesh mesh;
+        mesh.LoadObj(objFile);
+
+        vector<glm::vec3> triangles;
+        for (size_t i = 0; i < mesh.elements.size(); i++)
+            triangles.push_back(glm::vec3(mesh.vertices[mesh.elements[i]]));
+
+        sdf.Build(triangles, Params.sdfCellSize, 4.0f * Params.sdfCellSize, objHash);
+        if (!sdf.Save(cacheFile))
+            cerr << "Unable to write SDF cache " << cacheFile << endl;
+    }
+
+    // Upload
+    mBoundarySDF = cl::Image3D(mCLContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                               sdf.res.x, sdf.res.y, sdf.res.z, 0, 0, &sdf.voxels[0]);
+    mMemoryArena.Track("BoundarySDF", mBoundarySDF, false);
+
+    mBoundarySDFOrigin.s[0] = sdf.origin.x;
+    mBoundarySDFOrigin.s[1] = sdf.origin.y;
+    mBoundarySDFOrigin.s[2] = sdf.origin.z;
+    mBoundarySDFOrigin.s[3] = 1.0f / sdf.cellSize;
+
+    // Report (per step cost is "boundaryMsPerStep" in the headless summary, see assets/scenarios/boundary.sweep)
+    cout << "Boundary SDF " << sdf.res.x << "x" << sdf.res.y << "x" << sdf.res.z
+         << " (cell " << sdf.cellSize << "): " << sdf.GetMemorySize() / 1024 << " KB, "
+         << (sdf.fromCache ? "loaded from cache" : "built") << " in " << sdf.buildTime << " ms" << endl;
 }
 
 int dumpSession = 0;
@@ -318,11 +780,10 @@ void Simulation::updateVelocities()
     kernel.setArg(param++, mParameters);
     kernel.setArg(param++, mPositionsPingBuffer);
     kernel.setArg(param++, mPredictedPingBuffer);
-    kernel.setArg(param++, mParticlePosImg);
     kernel.setArg(param++, mVelocitiesBuffer);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("updateVelocities"));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("updateVelocities"), NULL, PerfData.GetTrackerEvent("updateVelocities"));
 }
 
 void Simulation::applyViscosity()
@@ -333,9 +794,9 @@ void Simulation::applyViscosity()
     kernel.setArg(param++, mVelocitiesBuffer);
     kernel.setArg(param++, mOmegaBuffer);
     kernel.setArg(param++, mFriendsListBuffer);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("applyViscosity"));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("applyViscosity"), NULL, PerfData.GetTrackerEvent("applyViscosity"));
 }
 
 void Simulation::applyVorticity()
@@ -346,9 +807,9 @@ void Simulation::applyVorticity()
     kernel.setArg(param++, mVelocitiesBuffer);
     kernel.setArg(param++, mOmegaBuffer);
     kernel.setArg(param++, mFriendsListBuffer);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("applyVorticity"));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("applyVorticity"), NULL, PerfData.GetTrackerEvent("applyVorticity"));
 }
 
 void Simulation::predictPositions()
@@ -359,9 +820,9 @@ void Simulation::predictPositions()
     kernel.setArg(param++, mPositionsPingBuffer);
     kernel.setArg(param++, mPredictedPingBuffer);
     kernel.setArg(param++, mVelocitiesBuffer);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("predictPositions"));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("predictPositions"), NULL, PerfData.GetTrackerEvent("predictPositions"));
 }
 
 void Simulation::buildFriendsList()
@@ -371,15 +832,19 @@ void Simulation::buildFriendsList()
     kernel.setArg(param++, mPredictedPingBuffer);
     kernel.setArg(param++, mCellsBuffer);
     kernel.setArg(param++, mFriendsListBuffer);
-    kernel.setArg(param++, Params.particleCount);
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("buildFriendsList"));
+    kernel.setArg(param++, mLiveCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("buildFriendsList"), NULL, PerfData.GetTrackerEvent("buildFriendsList"));
+}
 
-    param = 0; kernel = mKernels["resetGrid"];
+void Simulation::resetCells()
+{
+    // Reset the cells of the previous sort (they are kept until now, the renderer reads them between steps)
+    int param = 0; cl::Kernel kernel = mKernels["resetGrid"];
     kernel.setArg(param++, mParameters);
     kernel.setArg(param++, mInKeysBuffer);
     kernel.setArg(param++, mCellsBuffer);
-    kernel.setArg(param++, Params.particleCount);
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("resetPartList"));
+    kernel.setArg(param++, mCellsCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(max(DivCeil(mCellsCount, 256), 1u) * 256), LocalRange("resetGrid"), NULL, PerfData.GetTrackerEvent("resetPartList"));
 }
 
 void Simulation::updatePredicted(int iterationIndex)
@@ -388,9 +853,25 @@ void Simulation::updatePredicted(int iterationIndex)
     kernel.setArg(param++, mPredictedPingBuffer);
     kernel.setArg(param++, mPredictedPongBuffer);
     kernel.setArg(param++, mDeltaBuffer);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mLiveCount);
+
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("updatePredicted"), NULL, PerfData.GetTrackerEvent("updatePredicted", iterationIndex));
+
+    SWAP(cl::Memory, mPredictedPingBuffer, mPredictedPongBuffer);
+}
+
+void Simulation::applyBoundary()
+{
+    int param = 0; cl::Kernel kernel = mKernels["applyBoundary"];
+    kernel.setArg(param++, mParameters);
+    kernel.setArg(param++, mPositionsPingBuffer);
+    kernel.setArg(param++, mPredictedPingBuffer);
+    kernel.setArg(param++, mPredictedPongBuffer);
+    kernel.setArg(param++, mBoundarySDF);
+    kernel.setArg(param++, mBoundarySDFOrigin);
+    kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("updatePredicted", iterationIndex));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("applyBoundary"), NULL, PerfData.GetTrackerEvent("applyBoundary"));
 
     SWAP(cl::Memory, mPredictedPingBuffer, mPredictedPongBuffer);
 }
@@ -401,9 +882,9 @@ void Simulation::packData(cl::Memory& sourceImg, cl::Memory& pongImg, cl::Buffer
    kernel.setArg(param++, pongImg);
    kernel.setArg(param++, sourceImg);
    kernel.setArg(param++, packSource);
-   kernel.setArg(param++, Params.particleCount);
+   kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("packData", iterationIndex));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("packData"), NULL, PerfData.GetTrackerEvent("packData", iterationIndex));
 
     // Swap between source and pong
     SWAP(cl::Memory, sourceImg, pongImg);
@@ -413,19 +894,25 @@ void Simulation::computeDelta(int iterationIndex)
 {
     int param = 0; cl::Kernel kernel = mKernels["computeDelta"];
     kernel.setArg(param++, mParameters);
-    kernel.setArg(param++, oclLog.GetDebugBuffer());
+    if (oclLog.IsEnabled())
+        kernel.setArg(param++, oclLog.GetDebugBuffer());
     kernel.setArg(param++, mDeltaBuffer);
     kernel.setArg(param++, mPositionsPingBuffer);
     kernel.setArg(param++, mPredictedPingBuffer); // xyz=Predicted z=Scaling
     kernel.setArg(param++, mFriendsListBuffer);
     kernel.setArg(param++, fWavePos);
     kernel.setArg(param++, mSurfacesMask);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mCollidersBuffer);
+    kernel.setArg(param++, mCollidersCellsBuffer);
+    kernel.setArg(param++, mCollidersIndexBuffer);
+    kernel.setArg(param++, mCollidersGridMin);
+    kernel.setArg(param++, mCollidersGridRes);
+    kernel.setArg(param++, mLiveCount);
 
 #ifdef LOCALMEM
-    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(DivCeil(Params.particleCount, 256)*256), cl::NDRange(256), NULL, PerfData.GetTrackerEvent("computeDelta", iterationIndex));
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(max(DivCeil(mLiveCount, 256), 1u)*256), cl::NDRange(256), NULL, PerfData.GetTrackerEvent("computeDelta", iterationIndex));
 #else
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("computeDelta", iterationIndex));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("computeDelta"), NULL, PerfData.GetTrackerEvent("computeDelta", iterationIndex));
 #endif
 }
 
@@ -437,10 +924,10 @@ void Simulation::computeScaling(int iterationIndex)
     kernel.setArg(param++, mDensityBuffer);
     kernel.setArg(param++, mLambdaBuffer);
     kernel.setArg(param++, mFriendsListBuffer);
-    kernel.setArg(param++, Params.particleCount);
+    kernel.setArg(param++, mLiveCount);
 
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("computeScaling", iterationIndex));
-    // mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(((Params.particleCount + 399) / 400) * 400), cl::NDRange(400), NULL, PerfData.GetTrackerEvent("computeScaling", iterationIndex));
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("computeScaling"), NULL, PerfData.GetTrackerEvent("computeScaling", iterationIndex));
+    // mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(((mLiveCount + 399) / 400) * 400), cl::NDRange(400), NULL, PerfData.GetTrackerEvent("computeScaling", iterationIndex));
 }
 
 void Simulation::updateCells()
@@ -449,38 +936,43 @@ void Simulation::updateCells()
     kernel.setArg(param++, mParameters);
     kernel.setArg(param++, mInKeysBuffer);
     kernel.setArg(param++, mCellsBuffer);
-    kernel.setArg(param++, Params.particleCount);
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("updateCells"));
+    kernel.setArg(param++, mLiveCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("updateCells"), NULL, PerfData.GetTrackerEvent("updateCells"));
 }
 
 void Simulation::radixsort()
 {
+    // Count survivors while computing keys (killed particles get the max key and are sorted past the live ones)
+    static const cl_uint zero = 0;
+    mQueue.enqueueWriteBuffer(mLiveCountBuffer, CL_FALSE, 0, sizeof(cl_uint), &zero);
+
     int param = 0; cl::Kernel kernel = mKernels["computeKeys"];
     kernel.setArg(param++, mParameters);
     kernel.setArg(param++, mPredictedPingBuffer);
     kernel.setArg(param++, mInKeysBuffer);
     kernel.setArg(param++, mInPermutationBuffer);
-    kernel.setArg(param++, Params.particleCount);
-    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(mKeysCount), mLocalRange, NULL, PerfData.GetTrackerEvent("computeKeys"));
+    kernel.setArg(param++, mLiveCountBuffer);
+    kernel.setArg(param++, mLiveCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(mKeysCount), LocalRange("computeKeys"), NULL, PerfData.GetTrackerEvent("computeKeys"));
 
     for (size_t pass = 0; pass < _PASS; pass++)
     {
         // Histogram(pass);
-        const size_t h_nblocitems = _ITEMS;
-        const size_t h_nbitems = _GROUPS * _ITEMS;
+        const size_t h_nblocitems = mRadixItems;
+        const size_t h_nbitems = mRadixGroups * mRadixItems;
         param = 0; kernel = mKernels["histogram"];
         kernel.setArg(param++, mInKeysBuffer);
         kernel.setArg(param++, mHistogramBuffer);
         kernel.setArg(param++, pass);
-        kernel.setArg(param++, sizeof(cl_uint) * _RADIX * _ITEMS, NULL);
+        kernel.setArg(param++, sizeof(cl_uint) * _RADIX * mRadixItems, NULL);
         kernel.setArg(param++, mKeysCount);
         mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(h_nbitems), cl::NDRange(h_nblocitems), NULL, PerfData.GetTrackerEvent("histogram", pass));
 
         // ScanHistogram();
         param = 0; kernel = mKernels["scanhistograms"];
-        const size_t sh1_nbitems = _RADIX * _GROUPS * _ITEMS / 2;
+        const size_t sh1_nbitems = _RADIX * mRadixGroups * mRadixItems / 2;
         const size_t sh1_nblocitems = sh1_nbitems / _HISTOSPLIT ;
-        const int maxmemcache = max(_HISTOSPLIT, _ITEMS * _GROUPS * _RADIX / _HISTOSPLIT);
+        const int maxmemcache = max(_HISTOSPLIT, (int)(mRadixItems * mRadixGroups * _RADIX / _HISTOSPLIT));
         kernel.setArg(param++, mHistogramBuffer);
         kernel.setArg(param++, sizeof(cl_uint)* maxmemcache, NULL);
         kernel.setArg(param++, mGlobSumBuffer);
@@ -495,7 +987,7 @@ void Simulation::radixsort()
         mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(sh2_nbitems), cl::NDRange(sh2_nblocitems), NULL, PerfData.GetTrackerEvent("scanhistograms2", pass));
 
         param = 0; kernel = mKernels["pastehistograms"];
-        const size_t ph_nbitems = _RADIX * _GROUPS * _ITEMS / 2;
+        const size_t ph_nbitems = _RADIX * mRadixGroups * mRadixItems / 2;
         const size_t ph_nblocitems = ph_nbitems / _HISTOSPLIT;
         kernel.setArg(param++, mHistogramBuffer);
         kernel.setArg(param++, mGlobSumBuffer);
@@ -503,71 +995,164 @@ void Simulation::radixsort()
 
         // Reorder(pass);
         param = 0; kernel = mKernels["reorder"];
-        const size_t r_nblocitems = _ITEMS;
-        const size_t r_nbitems = _GROUPS * _ITEMS;
+        const size_t r_nblocitems = mRadixItems;
+        const size_t r_nbitems = mRadixGroups * mRadixItems;
         kernel.setArg(param++, mInKeysBuffer);
         kernel.setArg(param++, mOutKeysBuffer);
         kernel.setArg(param++, mHistogramBuffer);
         kernel.setArg(param++, pass);
         kernel.setArg(param++, mInPermutationBuffer);
         kernel.setArg(param++, mOutPermutationBuffer);
-        kernel.setArg(param++, sizeof(cl_uint)* _RADIX * _ITEMS, NULL);
+        kernel.setArg(param++, sizeof(cl_uint)* _RADIX * mRadixItems, NULL);
         kernel.setArg(param++, mKeysCount);
         mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(r_nbitems), cl::NDRange(r_nblocitems), NULL, PerfData.GetTrackerEvent("reorder", pass));
 
         SWAP(cl::Buffer, mInKeysBuffer, mOutKeysBuffer);
         SWAP(cl::Buffer, mInPermutationBuffer, mOutPermutationBuffer);
     }
+}
+
+void Simulation::binParticles()
+{
+    // Live and killed particles counters
+    static const cl_uint zeros[2] = {0, 0};
+    mQueue.enqueueWriteBuffer(mLiveCountBuffer, CL_FALSE, 0, sizeof(zeros), zeros);
+
+    // Clear cells counts
+    FillBuffer(mCellCountsBuffer, 0, PerfData.GetTrackerEvent("clearCellCounts"));
+
+    // Cell key and rank inside the cell of each particle (ranks are kept in the permutation "Out" buffer)
+    int param = 0; cl::Kernel kernel = mKernels["countCells"];
+    kernel.setArg(param++, mParameters);
+    kernel.setArg(param++, mPredictedPingBuffer);
+    kernel.setArg(param++, mOutKeysBuffer);
+    kernel.setArg(param++, mOutPermutationBuffer);
+    kernel.setArg(param++, mCellCountsBuffer);
+    kernel.setArg(param++, mLiveCountBuffer);
+    kernel.setArg(param++, mLiveCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("countCells"), NULL, PerfData.GetTrackerEvent("countCells"));
+
+    // Exclusive scan of the counts => cells start
+    const size_t scanItems = mCellCountsSize / 2;
+    const cl_uint blocksCount = mCellCountsSize / (2 * mBinningScanItems);
+    param = 0; kernel = mKernels["scanCellsBlocks"];
+    kernel.setArg(param++, mCellCountsBuffer);
+    kernel.setArg(param++, mCellBlockSumsBuffer);
+    kernel.setArg(param++, sizeof(cl_uint) * 2 * mBinningScanItems, NULL);
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(scanItems), cl::NDRange(mBinningScanItems), NULL, PerfData.GetTrackerEvent("scanCellsBlocks"));
+
+    param = 0; kernel = mKernels["scanCellsSums"];
+    kernel.setArg(param++, mCellBlockSumsBuffer);
+    kernel.setArg(param++, sizeof(cl_uint) * 2 * mBinningScanItems, NULL);
+    kernel.setArg(param++, blocksCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(mBinningScanItems), cl::NDRange(mBinningScanItems), NULL, PerfData.GetTrackerEvent("scanCellsSums"));
+
+    param = 0; kernel = mKernels["addCellsOffsets"];
+    kernel.setArg(param++, mCellCountsBuffer);
+    kernel.setArg(param++, mCellBlockSumsBuffer);
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(scanItems), cl::NDRange(mBinningScanItems), NULL, PerfData.GetTrackerEvent("addCellsOffsets"));
+
+    // Scatter to the sorted order (same outputs as the radix sort + updateCells)
+    param = 0; kernel = mKernels["scatterCells"];
+    kernel.setArg(param++, mOutKeysBuffer);
+    kernel.setArg(param++, mOutPermutationBuffer);
+    kernel.setArg(param++, mCellCountsBuffer);
+    kernel.setArg(param++, mLiveCountBuffer);
+    kernel.setArg(param++, mInKeysBuffer);
+    kernel.setArg(param++, mInPermutationBuffer);
+    kernel.setArg(param++, mCellsBuffer);
+    kernel.setArg(param++, mLiveCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("scatterCells"), NULL, PerfData.GetTrackerEvent("scatterCells"));
+
+    // Atomic ranks depend on the scheduling, order each cell by particle index to get reproducible runs
+    if (Params.EnableStableBinning)
+    {
+        param = 0; kernel = mKernels["stabilizeCells"];
+        kernel.setArg(param++, mCellCountsBuffer);
+        kernel.setArg(param++, mInPermutationBuffer);
+        kernel.setArg(param++, Params.gridBufSize);
+        mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(IntCeil(Params.gridBufSize, 256)), cl::NullRange, NULL, PerfData.GetTrackerEvent("stabilizeCells"));
+    }
+}
 
+void Simulation::reorderParticles()
+{
     // Execute particle reposition
-    param = 0; kernel = mKernels["sortParticles"];
+    int param = 0; cl::Kernel kernel = mKernels["sortParticles"];
     kernel.setArg(param++, mInPermutationBuffer);
     kernel.setArg(param++, mPositionsPingBuffer);
     kernel.setArg(param++, mPositionsPongBuffer);
     kernel.setArg(param++, mPredictedPingBuffer);
     kernel.setArg(param++, mPredictedPongBuffer);
-    kernel.setArg(param++, Params.particleCount);
-    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, mLocalRange, NULL, PerfData.GetTrackerEvent("sortParticles"));
+    kernel.setArg(param++, mLiveCount);
+    mQueue.enqueueNDRangeKernel(kernel, 0, mGlobalRange, LocalRange("sortParticles"), NULL, PerfData.GetTrackerEvent("sortParticles"));
 
     // Double buffering of positions and velocity buffers
-    SWAP(cl::BufferGL, mPositionsPingBuffer, mPositionsPongBuffer);
+    SWAP(cl::Buffer,   mPositionsPingBuffer, mPositionsPongBuffer);
     SWAP(cl::Memory,  mPredictedPingBuffer, mPredictedPongBuffer);
-    SWAP(GLuint,       mSharedPingBufferID,  mSharedPongBufferID);
+
+    // Live particles are now dense at the start of the buffers, the rest of the step runs over them only
+    cl_uint liveCount = 0;
+    mQueue.enqueueReadBuffer(mLiveCountBuffer, CL_TRUE, 0, sizeof(cl_uint), &liveCount);
+    SetLiveCount(liveCount);
 }
 
-void Simulation::LockGLObjects()
+void Simulation::emitParticles()
 {
-    // Make sure OpenGL finish doing things (This is required according to OpenCL spec, see enqueueAcquireGLObjects)
-    glFinish();
+    // Emit a new layer each time the previous one moved by the particles spacing
+    const float spacing = Params.h * Params.setupSpacing;
+    const float speed   = sqrt(Params.emitterVelX * Params.emitterVelX + Params.emitterVelY * Params.emitterVelY + Params.emitterVelZ * Params.emitterVelZ);
+    mEmitDistance += speed * Params.timeStep;
+    if ((Params.emitterSize == 0) || (speed == 0.0f) || (mEmitDistance < spacing))
+        return;
+    mEmitDistance = fmod(mEmitDistance, spacing);
 
-    // Request lock
-    mQueue.enqueueAcquireGLObjects(&mGLLockList);
-}
+    // Spawn into the free slots past the live particles
+    const cl_uint count = min(Params.emitterSize * Params.emitterSize, Params.particleCapacity - mLiveCount);
+    if (count == 0)
+        return;
 
-void Simulation::UnlockGLObjects()
-{
-    // Release lock
-    mQueue.enqueueReleaseGLObjects(&mGLLockList);
-    mQueue.finish();
+    int param = 0; cl::Kernel kernel = mKernels["emitParticles"];
+    kernel.setArg(param++, mParameters);
+    kernel.setArg(param++, mPositionsPingBuffer);
+    kernel.setArg(param++, mVelocitiesBuffer);
+    kernel.setArg(param++, mLiveCount);
+    kernel.setArg(param++, (cl_uint)cycleCounter);
+    kernel.setArg(param++, count);
+    mQueue.enqueueNDRangeKernel(kernel, 0, cl::NDRange(DivCeil(count, 32) * 32), cl::NullRange, NULL, PerfData.GetTrackerEvent("emitParticles"));
+
+    SetLiveCount(mLiveCount + count);
 }
 
 void Simulation::Step()
 {
-    // Lock OpenGL objects
-    LockGLObjects();
-
     // Inc sample counter
     cycleCounter++;
 
+    // Spawn particles (compaction in radixsort keeps them dense, so no emission while paused)
+    if (!bPauseSim)
+        this->emitParticles();
+
     // Predicit positions
     this->predictPositions();
 
-    // sort particles buffer
+    // sort particles buffer (cell binning also fills the cells)
     if (!bPauseSim)
-        this->radixsort();
+    {
+        this->resetCells();
+
+        if (Params.EnableCellBinning)
+            this->binParticles();
+        else
+            this->radixsort();
+
+        this->reorderParticles();
+        mCellsCount = mLiveCount;
+    }
 
     // Update cells
-    this->updateCells();
+    if (!Params.EnableCellBinning || bPauseSim)
+        this->updateCells();
 
     // Build friends list
     this->buildFriendsList();
@@ -587,6 +1172,10 @@ void Simulation::Step()
         this->updatePredicted(i);
     }
 
+    // Collide against the boundary SDF (once, the quads are tested inside computeDelta)
+    if (Params.EnableSDFBoundary)
+        this->applyBoundary();
+
     // Place density in "mPredictedPingBuffer[x].w"
     this->packData(mPredictedPingBuffer, mPredictedPongBuffer, mDensityBuffer, -1);
 
@@ -597,6 +1186,13 @@ void Simulation::Step()
     this->applyViscosity();
     this->applyVorticity();
 
+    // [DEBUG] Measure friends gather locality (if needed)
+    if (bMeasureLocality)
+    {
+        bMeasureLocality = false;
+        MeasureGatherLocality(cout);
+    }
+
     // [DEBUG] Read back friends information (if needed)
     //if (bReadFriendsList || bDumpParticlesData)
         // TODO: Get frients list to host
@@ -610,12 +1206,244 @@ void Simulation::Step()
         // TODO: Dump particles to disk
     }
 
-    // Release OpenGL shared object, allowing openGL do to it's thing...
-    UnlockGLObjects();
-
-    // Collect performance data
+    // Submit the step without waiting for it, the timings of the completed events are collected
+    mQueue.flush();
     PerfData.UpdateTimings();
 
-    // Allow OpenCL logger to process
+    // Allow OpenCL logger to process (non blocking, does nothing when logging is compiled out)
     oclLog.CycleExecute(mQueue);
 }
+
+void Simulation::BenchmarkCellBinning(ostream &os)
+{
+    static const cl_uint BENCHMARK_COUNTS[] = {50000, 200000, 1000000, 4000000, 8000000};
+    static const int     BENCHMARK_WARMUP   = 2;
+    static const int     BENCHMARK_RUNS     = 10;
+
+    // Keep the simulation buffers (the sort kernels run on temporary ones)
+    const cl::Memory   predicted   = mPredictedPingBuffer;
+    const cl::Buffer   inKeys      = mInKeysBuffer;
+    const cl::Buffer   inPerm      = mInPermutationBuffer;
+    const cl::Buffer   outKeys     = mOutKeysBuffer;
+    const cl::Buffer   outPerm     = mOutPermutationBuffer;
+    const cl::Buffer   cells       = mCellsBuffer;
+    const cl_uint      keysCount   = mKeysCount;
+    const cl_uint      liveCount   = mLiveCount;
+    const cl::NDRange  globalRange = mGlobalRange;
+
+    os << "Cell binning benchmark (" << Params.gridBufSize << " cells, " << (Params.EnableCachedBuffers ? "images" : "buffers")
+       << ", reorder excluded)" << endl;
+    os << "  Particles   Radix [ms]  Binning [ms]  Speedup  Keys" << endl;
+
+    // Binning writes the cells (scratch cells, the simulation ones are restored below)
+    mCellsBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, Params.gridBufSize * 2 * sizeof(cl_uint));
+    FillBuffer(mCellsBuffer, (cl_uint)END_OF_CELL_LIST);
+
+    for (size_t c = 0; c < sizeof(BENCHMARK_COUNTS) / sizeof(BENCHMARK_COUNTS[0]); c++)
+    {
+        const cl_uint count = BENCHMARK_COUNTS[c];
+        try
+        {
+            // Random positions inside the domain (padded to whole image rows)
+            vector<cl_float4> positions(IntCeil(count, 2048));
+            srand(1);
+            for (cl_uint i = 0; i < count; i++)
+            {
+                positions[i].s[0] = Params.xMin + (Params.xMax - Params.xMin) * rand() / (float)RAND_MAX;
+                positions[i].s[1] = Params.yMin + (Params.yMax - Params.yMin) * rand() / (float)RAND_MAX;
+                positions[i].s[2] = Params.zMin + (Params.zMax - Params.zMin) * rand() / (float)RAND_MAX;
+                positions[i].s[3] = 0.0f;
+            }
+
+            mPredictedPingBuffer = CreateCachedBuffer(cl::ImageFormat(CL_RGBA, CL_FLOAT), count);
+            if (Params.EnableCachedBuffers)
+            {
+                cl::size_t<3> origin, region;
+                region[0] = 2048; region[1] = DivCeil(count, 2048); region[2] = 1;
+                mQueue.enqueueWriteImage(*((cl::Image2D*)&mPredictedPingBuffer), CL_TRUE, origin, region, 0, 0, &positions[0]);
+            }
+            else
+            {
+                mQueue.enqueueWriteBuffer(*((cl::Buffer*)&mPredictedPingBuffer), CL_TRUE, 0, count * sizeof(cl_float4), &positions[0]);
+            }
+
+            // Temporary keys/permutation buffers
+            mKeysCount   = IntCeil(count, mRadixItems * mRadixGroups);
+            mLiveCount   = count;
+            mGlobalRange = cl::NDRange(DivCeil(count, 256) * 256);
+            mInKeysBuffer         = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
+            mInPermutationBuffer  = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
+            mOutKeysBuffer        = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
+            mOutPermutationBuffer = cl::Buffer(mCLContext, CL_MEM_READ_WRITE, sizeof(cl_uint) * mKeysCount);
+
+            // Time both paths (each run ends with a queue finish)
+            double times[2] = {0.0, 0.0};
+            vector<cl_int> sortedKeys[2];
+            for (int path = 0; path < 2; path++)
+            {
+                for (int run = 0; run < BENCHMARK_WARMUP + BENCHMARK_RUNS; run++)
+                {
+                    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+                    if (path == 0)
+                        radixsort();
+                    else
+                        binParticles();
+                    mQueue.finish();
+
+                    if (run >= BENCHMARK_WARMUP)
+                        times[path] += chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count() / BENCHMARK_RUNS;
+                }
+
+                // Both paths must produce the same sorted keys
+                sortedKeys[path].resize(count);
+                mQueue.enqueueReadBuffer(mInKeysBuffer, CL_TRUE, 0, sizeof(cl_int) * count, &sortedKeys[path][0]);
+            }
+
+            os << "  " << setw(9) << count << fixed << setprecision(3) << setw(13) << times[0] << setw(14) << times[1]
+               << setprecision(2) << setw(8) << times[0] / times[1] << "x  " << (sortedKeys[0] == sortedKeys[1] ? "match" : "MISMATCH") << endl;
+            os.unsetf(ios::floatfield);
+        }
+        catch (const cl::Error &ecl)
+        {
+            // Most likely out of device memory
+            mQueue.finish();
+            os << "  " << setw(9) << count << "  skipped (" << ecl.what() << " " << ecl.err() << ")" << endl;
+        }
+    }
+
+    // Restore the simulation buffers
+    mPredictedPingBuffer  = predicted;
+    mInKeysBuffer         = inKeys;
+    mInPermutationBuffer  = inPerm;
+    mOutKeysBuffer        = outKeys;
+    mOutPermutationBuffer = outPerm;
+    mCellsBuffer          = cells;
+    mKeysCount            = keysCount;
+    mLiveCount            = liveCount;
+    mGlobalRange          = globalRange;
+}
+
+void Simulation::MeasureGatherLocality(ostream &os)
+{
+    // Read back the friends list (see build_friends_list.cl for the layout)
+    const cl_uint capacity  = Params.particleCapacity;
+    const cl_uint perCircle = Params.particlesPerCircle;
+    vector<cl_uint> friends(capacity * Params.friendsCircles * (1 + perCircle));
+    mQueue.enqueueReadBuffer(mFriendsListBuffer, CL_TRUE, 0, friends.size() * sizeof(cl_uint), &friends[0]);
+
+    // Particles per cache line and per global cache (positions are float4)
+    const cl_uint lineParticles  = max((cl_uint)(mCLDevice.getInfo<CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE>() / sizeof(cl_float4)), 1u);
+    const cl_ulong cacheParticles = max(mCLDevice.getInfo<CL_DEVICE_GLOBAL_MEM_CACHE_SIZE>() / sizeof(cl_float4), (cl_ulong)1);
+    const cl_uint blockParticles = 256;
+
+    // Lines already read by the current block (marked with the block index + 1)
+    vector<cl_uint> lineBlock(DivCeil(capacity, lineParticles), 0);
+
+    double friendsCount = 0, distanceSum = 0, sameLine = 0, groupHits = 0, cacheWindow = 0;
+    const cl_uint friendsBlockSize = capacity * Params.friendsCircles;
+    for (cl_uint i = 0; i < mLiveCount; i++)
+    {
+        const cl_uint block = i / blockParticles + 1;
+        for (cl_uint circle = 0; circle < Params.friendsCircles; circle++)
+        {
+            const cl_uint count = min(friends[circle * capacity + i], perCircle);
+            for (cl_uint f = 0; f < count; f++)
+            {
+                const cl_uint j = friends[friendsBlockSize + circle * capacity * perCircle + f * capacity + i];
+                if (j >= capacity)
+                    continue;
+
+                const cl_uint distance = (i > j) ? i - j : j - i;
+                friendsCount++;
+                distanceSum += distance;
+                sameLine    += (i / lineParticles == j / lineParticles) ? 1 : 0;
+                cacheWindow += (distance < cacheParticles) ? 1 : 0;
+
+                cl_uint &lineOwner = lineBlock[j / lineParticles];
+                groupHits += (lineOwner == block) ? 1 : 0;
+                lineOwner = block;
+            }
+        }
+    }
+
+    // computeDelta is where the gathers cost the most
+    double computeDeltaTime = 0;
+    for (size_t t = 0; t < PerfData.Trackers.size(); t++)
+        if (PerfData.Trackers[t]->eventName.compare(0, 12, "computeDelta") == 0)
+            computeDeltaTime += PerfData.Trackers[t]->last_time;
+
+    const double total = max(friendsCount, 1.0);
+    mLocality.friendsCount     = friendsCount;
+    mLocality.avgIndexDistance = distanceSum / total;
+    mLocality.sameLineRatio    = 100.0 * sameLine / total;
+    mLocality.groupHitRatio    = 100.0 * groupHits / total;
+    mLocality.cacheWindowRatio = 100.0 * cacheWindow / total;
+    mLocality.computeDeltaTime = computeDeltaTime;
+
+    os << "Gather locality (" << (Params.cellCurve == SFC_HILBERT ? "Hilbert" : "Morton") << " curve, granularity " << Params.cellCurveGranularity
+       << ", " << mLiveCount << " particles, " << (cl_ulong)friendsCount << " friends)" << endl;
+    os << "  Avg index distance  " << mLocality.avgIndexDistance << endl;
+    os << "  Same line           " << mLocality.sameLineRatio    << " % (" << lineParticles << " particles per line)" << endl;
+    os << "  Block line hits     " << mLocality.groupHitRatio    << " % (" << blockParticles << " particles per block)" << endl;
+    os << "  Cache window        " << mLocality.cacheWindowRatio << " % (" << cacheParticles << " particles)" << endl;
+    os << "  computeDelta        " << mLocality.computeDeltaTime << " ms" << endl;
+}
+
+void Simulation::ReadParticles(vector<cl_float4> &positions, vector<cl_float4> *velocities, vector<cl_uint> *cells)
+{
+    positions.resize(mLiveCount);
+    if (velocities != NULL)
+        velocities->resize(mLiveCount);
+    if (cells != NULL)
+        cells->resize(Params.gridBufSize * 2);
+    if (mLiveCount == 0)
+    {
+        // No particle, no cell
+        if (cells != NULL)
+            fill(cells->begin(), cells->end(), (cl_uint)END_OF_CELL_LIST);
+        return;
+    }
+
+    // The queue is in order, waiting for the last read covers the others
+    cl::Event read;
+    mQueue.enqueueReadBuffer(mPositionsPingBuffer, CL_FALSE, 0, mLiveCount * sizeof(cl_float4), &positions[0], NULL, &read);
+    if (velocities != NULL)
+        mQueue.enqueueReadBuffer(mVelocitiesBuffer, CL_FALSE, 0, mLiveCount * sizeof(cl_float4), &(*velocities)[0], NULL, &read);
+    if (cells != NULL)
+        mQueue.enqueueReadBuffer(mCellsBuffer, CL_FALSE, 0, Params.gridBufSize * 2 * sizeof(cl_uint), &(*cells)[0], NULL, &read);
+    read.wait();
+}
+
+void Simulation::MeasureMetrics(SIMULATION_METRICS &metrics)
+{
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.liveCount = mLiveCount;
+    if (mLiveCount == 0)
+        return;
+
+    // Read back the live particles (density is from the last solver iteration, in the same order)
+    vector<cl_float4> positions(mLiveCount);
+    vector<cl_float4> velocities(mLiveCount);
+    vector<cl_float>  density(mLiveCount);
+    cl::Event read;
+    mQueue.enqueueReadBuffer(mPositionsPingBuffer, CL_FALSE, 0, mLiveCount * sizeof(cl_float4), &positions[0]);
+    mQueue.enqueueReadBuffer(mVelocitiesBuffer,    CL_FALSE, 0, mLiveCount * sizeof(cl_float4), &velocities[0]);
+    mQueue.enqueueReadBuffer(mDensityBuffer,       CL_FALSE, 0, mLiveCount * sizeof(cl_float),  &density[0], NULL, &read);
+    read.wait();
+
+    double errorSum = 0, kinetic = 0, potential = 0;
+    for (cl_uint i = 0; i < mLiveCount; i++)
+    {
+        const double error = fabs(density[i] / Params.restDensity - 1.0);
+        errorSum += error;
+        metrics.maxDensityError = max(metrics.maxDensityError, error);
+
+        const cl_float *v = velocities[i].s;
+        kinetic   += 0.5 * (v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+        potential += Params.garvity * (positions[i].s[1] - Params.yMin);
+    }
+
+    metrics.densityError    = errorSum  / mLiveCount;
+    metrics.kineticEnergy   = kinetic   / mLiveCount;
+    metrics.potentialEnergy = potential / mLiveCount;
+}
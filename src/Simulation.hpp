@@ -9,18 +9,57 @@
 #include <stdexcept>
 #include <assert.h>
 #include <algorithm>
+#include <thread>
+#include <atomic>
 
 #include "hesp.hpp"
 #include "Parameters.hpp"
 #include "Particle.hpp"
 #include "OCLPerfMon.h"
+#include "OCLMemoryArena.h"
+#include "KernelTuner.hpp"
 #include "OCL_Logger.h"
+#include "ParticlesFile.hpp"
+#include "CLGLSync.hpp"
 
 #include <GLFW/glfw3.h>
 
 // Macro used for the end of cell list
 static const int END_OF_CELL_LIST = -1;
 
+// Kernel logging ring size [words]
+static const int LOG_RING_SIZE = 64 * 1024;
+
+// Neighbors gather locality (how close the friends of a particle are in memory)
+typedef struct
+{
+    double friendsCount;     // Friends in the list
+    double avgIndexDistance; // Average |i - j| over all friends
+    double sameLineRatio;    // [%] Friends in the cache line of "i" (CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE)
+    double groupHitRatio;    // [%] Friends whose line was already read by the 256 particles block of "i"
+    double cacheWindowRatio; // [%] Friends closer than the global memory cache size
+    double computeDeltaTime; // [ms] All computeDelta iterations of the measured step
+} GATHER_LOCALITY;
+
+// Simulation state summary (batch runs)
+typedef struct
+{
+    cl_uint liveCount;
+    double  densityError;    // Average |density / rest density - 1| of the last solver iteration
+    double  maxDensityError; // Largest |density / rest density - 1|
+    double  kineticEnergy;   // Per particle (unit mass)
+    double  potentialEnergy; // Per particle (unit mass), relative to yMin
+} SIMULATION_METRICS;
+
+// Background kernels build states
+enum KernelsBuildState
+{
+    KERNELS_BUILD_IDLE,
+    KERNELS_BUILD_RUNNING,
+    KERNELS_BUILD_DONE,
+    KERNELS_BUILD_FAILED,
+};
+
 using std::map;
 using std::vector;
 using std::string;
@@ -35,12 +74,24 @@ private:
     // Init particles positions
     void CreateParticles();
 
+    // Set the number of live particles (and the kernels global range)
+    void SetLiveCount(cl_uint liveCount);
+
     // Create cached buffers
     cl::Memory CreateCachedBuffer(cl::ImageFormat& format, int elements);
 
-    // Lock and unlock opengl objects
-    void LockGLObjects();
-    void UnlockGLObjects();
+    // Fill a buffer with a 32 bit value
+    void FillBuffer(const cl::Buffer &buffer, cl_uint value, cl::Event *event = NULL);
+
+    // Background kernels build (runs on mBuildThread)
+    void BuildKernelsWorker(vector<string> kernelSources, string clflags);
+
+    // Background kernels build state
+    std::thread      mBuildThread;
+    std::atomic<int> mBuildState;
+    bool             mBuildRestart;
+    cl::Program      mPendingProgram;
+    OCL_Logger       mPendingLog;
 
 public:
 
@@ -54,16 +105,21 @@ public:
     // command queue all OpenCL calls are run on
     cl::CommandQueue mQueue;
 
-    // ranges used for executing the kernels
+    // OpenGL shared objects synchronization (device events when supported)
+    CLGLSync mGLSync;
+
+    // ranges used for executing the kernels (local ranges come from the tuning, see LocalRange)
     cl::NDRange mGlobalRange;
-    cl::NDRange mLocalRange;
+
+    // Per-device kernels configuration (used when Params.EnableAutotune is set)
+    TuningConfig mTuning;
 
     // The device memory buffers holding the simulation data
-    cl::Buffer   mCellsBuffer;
+    cl::Buffer   mCellsBuffer;         // Arena sub-buffer (copied to the frame snapshots)
     cl::Buffer   mParticlesListBuffer;
     cl::Buffer   mFriendsListBuffer;
-    cl::BufferGL mPositionsPingBuffer;
-    cl::BufferGL mPositionsPongBuffer;
+    cl::Buffer   mPositionsPingBuffer; // Plain buffers (copied to the frame snapshots)
+    cl::Buffer   mPositionsPongBuffer;
     cl::Memory   mPredictedPingBuffer;
     cl::Memory   mPredictedPongBuffer;
     cl::Buffer   mVelocitiesBuffer;
@@ -72,11 +128,34 @@ public:
     cl::Buffer   mDeltaBuffer;
     cl::Buffer   mOmegaBuffer;
     cl::Buffer   mParameters;
-    cl::Image2D  mSurfacesMask;
+    cl::Buffer   mLiveCountBuffer;
+    cl::Buffer   mSurfacesMask;      // 1 bit per texel, row major
+    int          mSurfacesMaskWidth;
+
+    // Colliders (precomputed quads binned into a coarse grid)
+    cl::Buffer   mCollidersBuffer;
+    cl::Buffer   mCollidersCellsBuffer;
+    cl::Buffer   mCollidersIndexBuffer;
+    cl_float4    mCollidersGridMin; // xyz=grid origin, w=1/cell size
+    cl_int4      mCollidersGridRes;
 
-    cl::Image2DGL mParticlePosImg;
+    // Live particles (dense at the start of the particles buffers)
+    cl_uint      mLiveCount;
+    float        mEmitDistance;
+
+    // Sorted keys in mInKeysBuffer the cells were built from (reset at the start of the next sort)
+    cl_uint      mCellsCount;
+
+    // Boundary signed distance field
+    cl::Image3D  mBoundarySDF;
+    cl_float4    mBoundarySDFOrigin; // xyz=origin, w=1/cell size
+
+    // Initial particles file (kept loaded between resets)
+    ParticlesFile mParticlesFile;
 
     // Radix related
+    cl_uint    mRadixItems;
+    cl_uint    mRadixGroups;
     cl_uint    mKeysCount;
     cl::Buffer mInKeysBuffer;
     cl::Buffer mInPermutationBuffer;
@@ -86,10 +165,15 @@ public:
     cl::Buffer mGlobSumBuffer;
     cl::Buffer mHistoTempBuffer;
 
-    // OpenGL locking related
-    vector<cl::Memory> mGLLockList;
+    // Cell binning related (counting sort, see cell_binning.cl)
+    cl_uint    mBinningScanItems;
+    cl_uint    mCellCountsSize;
+    cl::Buffer mCellCountsBuffer;
+    cl::Buffer mCellBlockSumsBuffer;
 
     // Private member functions
+    void emitParticles();
+    void resetCells();
     void updateCells();
     void updateVelocities();
     void applyViscosity();
@@ -97,9 +181,12 @@ public:
     void predictPositions();
     void buildFriendsList();
     void updatePredicted(int iterationIndex);
+    void applyBoundary();
     void computeScaling(int iterationIndex);
     void computeDelta(int iterationIndex);
     void radixsort();
+    void binParticles();
+    void reorderParticles();
     void packData(cl::Memory& sourceImg, cl::Memory& pongImg, cl::Buffer packSource,  int iterationIndex);
 
 public:
@@ -112,42 +199,86 @@ public:
     // Create all buffer and particles
     void InitBuffers();
 
+    // Recreate the initial particles (buffers are kept)
+    void ResetParticles();
+
     // Init Grid
     void InitCells();
 
+    // Release the OpenGL objects of the simulation (friends list texture, before the renderer recreates them)
+    void ReleaseGLObjects();
+
+    // Print device memory usage
+    void PrintMemoryReport(std::ostream &os) const;
+
     // Load force masks
     void LoadForceMasks();
 
-    // Load and build kernels
+    // Load colliders quads and bin them into the colliders grid
+    void LoadColliders();
+
+    // Load (or voxelize) the boundary signed distance field
+    void LoadBoundarySDF();
+
+    // Load and build kernels (blocking)
     bool InitKernels();
 
+    // Start building kernels in the background (the running kernels stay in use)
+    void StartKernelsBuild();
+
+    // Swap in background built kernels (call between steps), returns true if new kernels are in use
+    bool PollKernelsBuild();
+
+    // Copy Params (Host) => mParameters (GPU)
+    void UpdateParameters();
+
+    // Apply tuned settings that live in Params (call after loading parameters)
+    void ApplyTuning();
+
+    // Local range of a kernel (NullRange unless tuned)
+    cl::NDRange LocalRange(const string &kernelName) const;
+
     // Perform single simulation step
     void Step();
 
+    // Measure the gather locality of the current friends list (results in mLocality)
+    void MeasureGatherLocality(std::ostream &os);
+
+    // Read back the live particles and summarize their state (call between steps)
+    void MeasureMetrics(SIMULATION_METRICS &metrics);
+
+    // Read back the live particles sorted into the cells (call between steps, velocities and cells may be NULL)
+    void ReadParticles(std::vector<cl_float4> &positions, std::vector<cl_float4> *velocities, std::vector<cl_uint> *cells = NULL);
+
+    // Compare radix sort and cell binning times on random particles (particles and cells are not touched)
+    void BenchmarkCellBinning(std::ostream &os);
+
     // Get a list of kernel files
     const std::string *KernelFileList();
 
 public:
 
-    // Open GL Sharing buffers
-    GLuint mSharedPingBufferID;
-    GLuint mSharedPongBufferID;
-
     // Open GL Sharing Texture buffer
-    GLuint mSharedParticlesPos;
     GLuint mSharedFriendsList;
 
     // Performance measurement
     OCLPerfMon PerfData;
 
+    // Device memory (simulation buffers are sub-buffers of a single arena)
+    OCLMemoryArena mMemoryArena;
+
     // OCL Logging
     OCL_Logger oclLog;
 
-    // Rendering state
-    bool      bPauseSim;
-    bool      bReadFriendsList;
-    bool      bDumpParticlesData;
-    cl_float  fWavePos;
+    // Last gather locality measurement
+    GATHER_LOCALITY mLocality;
+
+    // Rendering state (requests are set by the UI thread)
+    bool              bPauseSim;
+    bool              bReadFriendsList;
+    std::atomic<bool> bDumpParticlesData;
+    std::atomic<bool> bMeasureLocality;
+    cl_float          fWavePos;
 };
 
 #endif // __SIMULATION_HPP
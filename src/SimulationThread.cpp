@@ -0,0 +1,298 @@
+#include "SimulationThread.hpp"
+#include "visual/visual.hpp"
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+// Ready snapshot index and its "not taken yet" flag
+#define SNAPSHOT_INDEX 0x3u
+#define SNAPSHOT_FRESH 0x4u
+
+// Paused simulation: frames are still published (the UI stays live) at this period [millisec]
+#define PAUSED_FRAME_PERIOD 16
+
+SimulationThread::SimulationThread(Simulation &simulation)
+    : mSimulation(simulation), mBack(0), mReady(1), mFront(2), mHasFrame(false),
+      mStopping(false), mWaveTime(0.0f), mSteps(0), mSeconds(0.0), mStepsPerSecond(0.0)
+{
+    memset(&mControls, 0, sizeof(mControls));
+    for (int i = 0; i < 3; i++)
+    {
+        mSnapshots[i].positionsID = 0;
+        mSnapshots[i].cellsID     = 0;
+        mSnapshots[i].count       = 0;
+        mSnapshots[i].readFence   = 0;
+    }
+}
+
+SimulationThread::~SimulationThread()
+{
+    Stop();
+    ReleaseSnapshots();
+}
+
+void SimulationThread::InitSnapshots(const CVisual &renderer)
+{
+    ReleaseSnapshots();
+
+    for (int i = 0; i < 3; i++)
+    {
+        SNAPSHOT &snapshot = mSnapshots[i];
+        snapshot.positionsID = renderer.createSharingBuffer(Params.particleCapacity * sizeof(cl_float4));
+        snapshot.cellsID     = renderer.createSharingBuffer(Params.gridBufSize * 2 * sizeof(cl_uint));
+        snapshot.positions   = cl::BufferGL(mSimulation.mCLContext, CL_MEM_WRITE_ONLY, snapshot.positionsID);
+        snapshot.cells       = cl::BufferGL(mSimulation.mCLContext, CL_MEM_WRITE_ONLY, snapshot.cellsID);
+        snapshot.count       = 0;
+    }
+
+    // OpenGL has to be done with the new buffers before OpenCL acquires them
+    glFinish();
+}
+
+void SimulationThread::ReleaseSnapshots()
+{
+    // Both sides are done with the snapshots (the last copy might still run)
+    mSimulation.mQueue.finish();
+    mInFlight = cl::Event();
+    glFinish();
+
+    // OpenCL references first (glDeleteBuffers ignores 0)
+    for (int i = 0; i < 3; i++)
+    {
+        SNAPSHOT &snapshot = mSnapshots[i];
+        if (snapshot.readFence != 0)
+            glDeleteSync(snapshot.readFence);
+        snapshot.readFence = 0;
+        snapshot.written   = cl::Event();
+        snapshot.positions = cl::BufferGL();
+        snapshot.cells     = cl::BufferGL();
+        glDeleteBuffers(1, &snapshot.positionsID);
+        glDeleteBuffers(1, &snapshot.cellsID);
+        snapshot.positionsID = snapshot.cellsID = 0;
+        snapshot.count = 0;
+    }
+
+    mBack     = 0;
+    mReady    = 1;
+    mFront    = 2;
+    mHasFrame = false;
+}
+
+void SimulationThread::Start()
+{
+    if (IsRunning())
+        return;
+
+    mStopping = false;
+    mThread = thread(&SimulationThread::threadLoop, this);
+}
+
+void SimulationThread::Stop()
+{
+    if (!IsRunning())
+        return;
+
+    mStopping = true;
+    mThread.join();
+}
+
+void SimulationThread::SetControls(const SIMULATION_CONTROLS &controls)
+{
+    lock_guard<mutex> lock(mMutex);
+    mControls = controls;
+}
+
+void SimulationThread::threadLoop()
+{
+    unsigned int rateSteps = 0;
+    auto rateStart = chrono::high_resolution_clock::now();
+
+    while (!mStopping)
+    {
+        const auto frameStart = chrono::high_resolution_clock::now();
+
+        // Swap in kernels that were built in the background
+        mSimulation.PollKernelsBuild();
+
+        SIMULATION_CONTROLS controls;
+        {
+            lock_guard<mutex> lock(mMutex);
+            controls = mControls;
+        }
+
+        // Generate waves
+        cl_float wavePos = 0.0f;
+        if (controls.generateWaves)
+        {
+            // Wave consts
+            const cl_float wave_push_length = Params.waveGenAmp * (Params.xMax - Params.xMin);
+
+            // Update the wave position
+            float t = Params.waveGenFreq * mWaveTime;
+            wavePos = (float)(1 - cos(2.0f * M_PI * pow(fmod(t, 1.0f), Params.waveGenDuty))) * wave_push_length / 2.0f;
+
+            // Update wave running time
+            if (!controls.pause)
+                mWaveTime += Params.timeStep;
+        }
+        else
+        {
+            mWaveTime = 0.0f;
+        }
+
+        // Load simulation settings
+        mSimulation.bPauseSim        = controls.pause;
+        mSimulation.bReadFriendsList = controls.readFriendsList;
+        mSimulation.fWavePos         = wavePos;
+
+        // Sub frames
+        for (cl_uint i = 0; i < Params.subSteps; i++)
+            mSimulation.Step();
+
+        publishFrame();
+
+        // Statistics (steps/s over the last second)
+        const auto now = chrono::high_resolution_clock::now();
+        const double rateSeconds = chrono::duration<double>(now - rateStart).count();
+        rateSteps += Params.subSteps;
+        {
+            lock_guard<mutex> lock(mMutex);
+            mSteps   += Params.subSteps;
+            mSeconds += chrono::duration<double>(now - frameStart).count();
+            if (rateSeconds >= 1.0)
+                mStepsPerSecond = rateSteps / rateSeconds;
+        }
+        if (rateSeconds >= 1.0)
+        {
+            rateSteps = 0;
+            rateStart = now;
+        }
+
+        // Nothing moves while paused, don't spin
+        if (controls.pause)
+            this_thread::sleep_for(chrono::milliseconds(PAUSED_FRAME_PERIOD));
+    }
+}
+
+void SimulationThread::publishFrame()
+{
+    SNAPSHOT &snapshot = mSnapshots[mBack];
+    if (snapshot.positionsID == 0)
+        return;
+
+    vector<cl::Memory> objects;
+    objects.push_back(snapshot.positions);
+    objects.push_back(snapshot.cells);
+
+    // OpenGL is done with the snapshot once its last drawing fence is signalled (the device waits for it with
+    // cl_khr_gl_event, otherwise the render thread waited before handing the snapshot back)
+    const CLGLSync &sync = mSimulation.mGLSync;
+    vector<cl::Event> drawn;
+    if (sync.IsSupported() && (snapshot.readFence != 0))
+        drawn.push_back(sync.CreateEvent(snapshot.readFence));
+
+    // Copy the frame
+    cl::CommandQueue &queue = mSimulation.mQueue;
+    queue.enqueueAcquireGLObjects(&objects, drawn.empty() ? NULL : &drawn);
+    if (mSimulation.mLiveCount > 0)
+        queue.enqueueCopyBuffer(mSimulation.mPositionsPingBuffer, snapshot.positions, 0, 0, mSimulation.mLiveCount * sizeof(cl_float4));
+    queue.enqueueCopyBuffer(mSimulation.mCellsBuffer, snapshot.cells, 0, 0, Params.gridBufSize * 2 * sizeof(cl_uint));
+    snapshot.count = mSimulation.mLiveCount;
+
+    // The render thread waits for the copy only (the next steps are queued meanwhile), or it's drained here
+    if (sync.IsSupported())
+    {
+        queue.enqueueReleaseGLObjects(&objects, NULL, &snapshot.written);
+        queue.flush();
+
+        // Stay at most one frame ahead of the device
+        if (mInFlight() != NULL)
+            mInFlight.wait();
+        mInFlight = snapshot.written;
+    }
+    else
+    {
+        queue.enqueueReleaseGLObjects(&objects);
+        queue.finish();
+    }
+
+    // Latest frame (the render thread takes it once the copy is complete)
+    lock_guard<mutex> lock(mExchange);
+    mBack = mReady.exchange(mBack | SNAPSHOT_FRESH) & SNAPSHOT_INDEX;
+}
+
+bool SimulationThread::AcquireFrame(GLuint &positionsID, GLuint &cellsID, cl_uint &count)
+{
+    const CLGLSync &sync = mSimulation.mGLSync;
+
+    // Newer frame whose copy is complete (the device may still run its steps, keep drawing the current one meanwhile)
+    lock_guard<mutex> lock(mExchange);
+    const unsigned int ready = mReady.load();
+    const cl::Event   &written = mSnapshots[ready & SNAPSHOT_INDEX].written;
+    if ((ready & SNAPSHOT_FRESH) && ((written() == NULL) || (written.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE)))
+    {
+        // Hand the drawn snapshot back, without cl_khr_gl_event OpenGL has to be done with it first (usually long ago)
+        SNAPSHOT &drawn = mSnapshots[mFront];
+        if (!sync.IsSupported() && (drawn.readFence != 0))
+        {
+            glClientWaitSync(drawn.readFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+            glDeleteSync(drawn.readFence);
+            drawn.readFence = 0;
+        }
+
+        mFront    = mReady.exchange(mFront) & SNAPSHOT_INDEX;
+        mHasFrame = true;
+
+        // The copy is done, so is the fence OpenCL waited for before it
+        SNAPSHOT &snapshot = mSnapshots[mFront];
+        snapshot.written = cl::Event();
+        if (snapshot.readFence != 0)
+        {
+            glDeleteSync(snapshot.readFence);
+            snapshot.readFence = 0;
+        }
+    }
+
+    if (!mHasFrame)
+        return false;
+
+    positionsID = mSnapshots[mFront].positionsID;
+    cellsID     = mSnapshots[mFront].cellsID;
+    count       = mSnapshots[mFront].count;
+    return true;
+}
+
+void SimulationThread::ReleaseFrame()
+{
+    // Only the last drawing matters (fences are signalled in order)
+    SNAPSHOT &snapshot = mSnapshots[mFront];
+    if (snapshot.readFence != 0)
+        glDeleteSync(snapshot.readFence);
+    snapshot.readFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    // OpenCL may wait for the fence on the device: it has to reach the GPU
+    if (mSimulation.mGLSync.IsSupported())
+        glFlush();
+}
+
+double SimulationThread::StepsPerSecond()
+{
+    lock_guard<mutex> lock(mMutex);
+    return mStepsPerSecond;
+}
+
+unsigned long long SimulationThread::Steps()
+{
+    lock_guard<mutex> lock(mMutex);
+    return mSteps;
+}
+
+double SimulationThread::Seconds()
+{
+    lock_guard<mutex> lock(mMutex);
+    return mSeconds;
+}
@@ -0,0 +1,100 @@
+#ifndef __SIMULATION_THREAD_HPP
+#define __SIMULATION_THREAD_HPP
+
+#include "Precomp_OpenGL.h"
+#include "hesp.hpp"
+#include "Simulation.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+class CVisual;
+
+// Simulation controls set by the UI (applied at the next simulated frame)
+typedef struct {
+    bool pause;
+    bool generateWaves;
+    bool readFriendsList;
+} SIMULATION_CONTROLS;
+
+// Simulation stepped on its own thread, frames handed to the render thread through triple buffered snapshots
+//   The simulation buffers are not shared with OpenGL (as headless), each frame (Params.subSteps steps) is copied
+//   into the back snapshot, which is then swapped with the ready one. The render thread takes the ready snapshot
+//   when it holds a newer frame whose copy the device has completed (polled, the render thread never waits for the
+//   simulated steps): it always draws the latest complete frame and the simulation never waits for it.
+//   A snapshot is handed back with the fence of its last drawing, OpenCL writes it once the fence is signalled
+//   (waited for on the device with cl_khr_gl_event, by the render thread otherwise, see CLGLSync).
+//
+//   Anything else touching the simulation (reloads, tuning) has to Stop the thread first.
+class SimulationThread
+{
+private:
+    // Shared particles of a frame
+    typedef struct {
+        GLuint       positionsID;
+        GLuint       cellsID;
+        cl::BufferGL positions;
+        cl::BufferGL cells;
+        cl_uint      count;
+        GLsync       readFence; // OpenGL done drawing it (created and deleted by the render thread)
+        cl::Event    written;   // OpenCL done copying the frame (cl_khr_gl_event only)
+    } SNAPSHOT;
+
+    Simulation               &mSimulation;
+
+    // Snapshots exchange (the ready index carries SNAPSHOT_FRESH until the render thread takes it)
+    SNAPSHOT                  mSnapshots[3];
+    unsigned int              mBack;       // Simulation thread
+    cl::Event                 mInFlight;   // Copy of the last published frame (Step doesn't wait for the device)
+    std::atomic<unsigned int> mReady;
+    std::mutex                mExchange;   // Ready snapshot swap (the render thread polls its copy first)
+    unsigned int              mFront;      // Render thread
+    bool                      mHasFrame;
+
+    // Thread
+    std::thread               mThread;
+    std::atomic<bool>         mStopping;
+    std::mutex                mMutex;      // Controls and statistics
+    SIMULATION_CONTROLS       mControls;
+
+    // Waves generator
+    cl_float                  mWaveTime;
+
+    // Statistics
+    unsigned long long        mSteps;
+    double                    mSeconds;
+    double                    mStepsPerSecond;
+
+    void threadLoop();
+    void publishFrame();
+
+public:
+    explicit SimulationThread(Simulation &simulation);
+    ~SimulationThread();
+
+    // Create the snapshots for the current parameters (render thread, thread stopped)
+    void InitSnapshots(const CVisual &renderer);
+    void ReleaseSnapshots();
+
+    // Start and stop stepping (Stop returns once the current frame is published)
+    void Start();
+    void Stop();
+    bool IsRunning() const { return mThread.joinable(); }
+
+    void SetControls(const SIMULATION_CONTROLS &controls);
+
+    // Restart the waves generator (thread stopped)
+    void ResetWaves() { mWaveTime = 0.0f; }
+
+    // Render thread: latest complete frame (false until the first one), release it once its drawing is submitted
+    bool AcquireFrame(GLuint &positionsID, GLuint &cellsID, cl_uint &count);
+    void ReleaseFrame();
+
+    // Simulation rate (last second) and totals
+    double StepsPerSecond();
+    unsigned long long Steps();
+    double Seconds();
+};
+
+#endif // __SIMULATION_THREAD_HPP
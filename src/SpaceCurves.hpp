@@ -0,0 +1,104 @@
+#ifndef __OPENCL_VERSION__
+    #pragma once
+#endif
+
+// Space filling curves shared by the host and the kernels
+//   Cells are ordered along the curve in blocks of 2^granularity cells per axis, Morton order is used inside
+//   each block. Morton ignores the granularity (its blocks are contiguous anyway).
+//   Cell coordinates wrap every 2^SFC_COORD_BITS cells (same as the previous Morton hash).
+
+#define SFC_MORTON          0
+#define SFC_HILBERT         1
+
+#define SFC_COORD_BITS      10
+#define SFC_COORD_MASK      ((1u << SFC_COORD_BITS) - 1)
+
+#ifdef __OPENCL_VERSION__
+    #define SFC_FUNC
+#else
+    #define SFC_FUNC inline
+#endif
+
+// fixes compiler warning: no previous prototype for function
+SFC_FUNC unsigned int sfcExpandBits(unsigned int x);
+SFC_FUNC unsigned int sfcMortonIndex(unsigned int x, unsigned int y, unsigned int z);
+SFC_FUNC unsigned int sfcHilbertIndex(unsigned int x, unsigned int y, unsigned int z, unsigned int bits);
+SFC_FUNC unsigned int sfcCellIndex(int cellX, int cellY, int cellZ, unsigned int curve, unsigned int granularity);
+
+// Insert two zero bits between each of the low 10 bits
+SFC_FUNC unsigned int sfcExpandBits(unsigned int x)
+{
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+
+    return x;
+}
+
+SFC_FUNC unsigned int sfcMortonIndex(unsigned int x, unsigned int y, unsigned int z)
+{
+    return sfcExpandBits(x) | (sfcExpandBits(y) << 1) | (sfcExpandBits(z) << 2);
+}
+
+// Hilbert index of a cube with 2^bits cells per axis (J. Skilling, "Programming the Hilbert curve", 2004)
+SFC_FUNC unsigned int sfcHilbertIndex(unsigned int x, unsigned int y, unsigned int z, unsigned int bits)
+{
+    if (bits == 0)
+        return 0;
+
+    unsigned int X[3];
+    X[0] = x; X[1] = y; X[2] = z;
+
+    // Inverse undo
+    const unsigned int M = 1u << (bits - 1);
+    for (unsigned int Q = M; Q > 1; Q >>= 1)
+    {
+        const unsigned int P = Q - 1;
+        for (int i = 0; i < 3; i++)
+        {
+            if (X[i] & Q)
+            {
+                X[0] ^= P;
+            }
+            else
+            {
+                const unsigned int t = (X[0] ^ X[i]) & P;
+                X[0] ^= t;
+                X[i] ^= t;
+            }
+        }
+    }
+
+    // Gray encode
+    X[1] ^= X[0];
+    X[2] ^= X[1];
+    unsigned int t = 0;
+    for (unsigned int Q = M; Q > 1; Q >>= 1)
+        if (X[2] & Q)
+            t ^= Q - 1;
+    X[0] ^= t;
+    X[1] ^= t;
+    X[2] ^= t;
+
+    // Transposed index => index (X[0] holds the most significant bit of each level)
+    return sfcMortonIndex(X[2], X[1], X[0]);
+}
+
+// Curve index of a cell
+SFC_FUNC unsigned int sfcCellIndex(int cellX, int cellY, int cellZ, unsigned int curve, unsigned int granularity)
+{
+    const unsigned int x = (unsigned int)cellX & SFC_COORD_MASK;
+    const unsigned int y = (unsigned int)cellY & SFC_COORD_MASK;
+    const unsigned int z = (unsigned int)cellZ & SFC_COORD_MASK;
+
+    if ((curve != SFC_HILBERT) || (granularity >= SFC_COORD_BITS))
+        return sfcMortonIndex(x, y, z);
+
+    // Hilbert order of the blocks, Morton order inside them
+    const unsigned int blockMask = (1u << granularity) - 1;
+    const unsigned int block = sfcHilbertIndex(x >> granularity, y >> granularity, z >> granularity, SFC_COORD_BITS - granularity);
+    const unsigned int inner = sfcMortonIndex(x & blockMask, y & blockMask, z & blockMask);
+
+    return (block << (3 * granularity)) | inner;
+}
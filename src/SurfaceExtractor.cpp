@@ -0,0 +1,553 @@
+#include "SurfaceExtractor.hpp"
+#include "Simulation.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+using namespace std;
+
+// Cubes per block axis (a block samples BLOCK_NODES^3 grid nodes)
+#define BLOCK_CUBES 8
+#define BLOCK_NODES (BLOCK_CUBES + 1)
+
+// Grid limits (weld keys hold 20 bits per node coordinate, the last node of a border block included)
+#define MAX_GRID_NODES  (1 << 20)
+#define MAX_GRID_BLOCKS (1 << 24)
+
+// Vertices addressed by Mesh::LoadObj (16 bit indices)
+#define MAX_OBJ_VERTICES 65536
+
+static const cl_ulong INNER_VERTEX = ~(cl_ulong)0;
+
+// Binary mesh file header (followed by float3 positions, float3 normals and uint3 triangles)
+struct SurfaceFileHeader
+{
+    char    magic[4];
+    cl_uint version;
+    cl_uint vertices;
+    cl_uint triangles;
+};
+
+static const char    SURFACE_FILE_MAGIC[4] = {'P', 'B', 'F', 'S'};
+static const cl_uint SURFACE_FILE_VERSION  = 1;
+
+// Marching cubes tables
+//   Corner c is at (c & 1, (c >> 1) & 1, (c >> 2) & 1), edge e joins edgeCorners[e][0] to edgeCorners[e][1] along
+//   edgeAxis[e]. The triangles of a configuration are built from the iso lines of the cube faces (the inside corners
+//   of an ambiguous face are kept apart, so neighbour cubes agree on their shared face), each closed line is fanned.
+typedef struct {
+    int         edgeCorners[12][2];
+    int         edgeAxis[12];
+    signed char triangles[256][31]; // Edges of the triangles, -1 terminated
+} MARCHING_CUBES_TABLES;
+
+static MARCHING_CUBES_TABLES BuildTables()
+{
+    MARCHING_CUBES_TABLES tables;
+
+    // Edges
+    int edgeOf[8][8];
+    int e = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        for (int c = 0; c < 8; c++)
+        {
+            if (c & (1 << axis))
+                continue;
+
+            tables.edgeCorners[e][0] = c;
+            tables.edgeCorners[e][1] = c | (1 << axis);
+            tables.edgeAxis[e]       = axis;
+            edgeOf[c][c | (1 << axis)] = edgeOf[c | (1 << axis)][c] = e;
+            e++;
+        }
+    }
+
+    for (int config = 0; config < 256; config++)
+    {
+        // Faces iso lines: counter clockwise seen from outside the cube, from the edge leaving a run of inside
+        // corners to the edge entering it (the inside corners are on the left, lines chain across the faces)
+        int next[12];
+        fill(next, next + 12, -1);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            for (int side = 0; side < 2; side++)
+            {
+                const int u    = 1 << ((axis + 1) % 3);
+                const int v    = 1 << ((axis + 2) % 3);
+                const int base = side ? (1 << axis) : 0;
+                int k[4] = {base, base | u, base | u | v, base | v};
+                if (side == 0)
+                    swap(k[1], k[3]);
+
+                for (int i = 0; i < 4; i++)
+                {
+                    if (!((config >> k[i]) & 1) || ((config >> k[(i + 1) % 4]) & 1))
+                        continue;
+
+                    int m = i;
+                    while ((config >> k[(m + 3) % 4]) & 1)
+                        m = (m + 3) % 4;
+                    next[edgeOf[k[i]][k[(i + 1) % 4]]] = edgeOf[k[(m + 3) % 4]][k[m]];
+                }
+            }
+        }
+
+        // Closed lines => triangle fans
+        int  count = 0;
+        bool used[12] = {false};
+        for (int start = 0; start < 12; start++)
+        {
+            if ((next[start] < 0) || used[start])
+                continue;
+
+            int loop[12];
+            int n = 0;
+            for (int edge = start; (edge >= 0) && !used[edge]; edge = next[edge])
+            {
+                used[edge] = true;
+                loop[n++] = edge;
+            }
+
+            // Orient the fan normal away from the inside corners
+            float area[3] = {0.0f, 0.0f, 0.0f};
+            float out[3]  = {0.0f, 0.0f, 0.0f};
+            for (int i = 0; i < n; i++)
+            {
+                const int *c0 = tables.edgeCorners[loop[i]];
+                const int *c1 = tables.edgeCorners[loop[(i + 1) % n]];
+                float p0[3], p1[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    p0[a] = 0.5f * (((c0[0] >> a) & 1) + ((c0[1] >> a) & 1));
+                    p1[a] = 0.5f * (((c1[0] >> a) & 1) + ((c1[1] >> a) & 1));
+                }
+                area[0] += p0[1] * p1[2] - p0[2] * p1[1];
+                area[1] += p0[2] * p1[0] - p0[0] * p1[2];
+                area[2] += p0[0] * p1[1] - p0[1] * p1[0];
+
+                const int inside  = ((config >> c0[0]) & 1) ? c0[0] : c0[1];
+                const int outside = c0[0] + c0[1] - inside;
+                for (int a = 0; a < 3; a++)
+                    out[a] += (float)(((outside >> a) & 1) - ((inside >> a) & 1));
+            }
+            if (area[0] * out[0] + area[1] * out[1] + area[2] * out[2] < 0.0f)
+                reverse(loop, loop + n);
+
+            for (int i = 1; i + 1 < n; i++)
+            {
+                tables.triangles[config][count++] = (signed char)loop[0];
+                tables.triangles[config][count++] = (signed char)loop[i];
+                tables.triangles[config][count++] = (signed char)loop[i + 1];
+            }
+        }
+        tables.triangles[config][count] = -1;
+    }
+
+    return tables;
+}
+
+// Surface of a block (vertices are welded inside the block)
+typedef struct {
+    vector<cl_float> positions;
+    vector<cl_ulong> keys;      // Weld key of the vertices on the block border (INNER_VERTEX otherwise)
+    vector<cl_uint>  triangles; // Block vertices
+} BLOCK_MESH;
+
+// Grid shared by the blocks workers
+typedef struct {
+    const MARCHING_CUBES_TABLES *pTables;
+    const ParticleCells         *pCells;
+    float                        origin[3]; // Node 0 position
+    float                        spacing;
+    int                          dims[3];   // Blocks
+    float                        isoLevel;  // Unscaled poly6 sum
+} SURFACE_GRID;
+
+static void ExtractBlock(const SURFACE_GRID &grid, cl_uint blockIndex, vector<float> &density, vector<cl_uint> &edgeVertex,
+                         vector<cl_uint> &hashes, BLOCK_MESH &mesh)
+{
+    const float h   = Params.h;
+    const float h_2 = h * h;
+    const float s   = grid.spacing;
+
+    // Block nodes
+    int   node0[3];
+    float lo[3];
+    node0[0] = (blockIndex % grid.dims[0]) * BLOCK_CUBES;
+    node0[1] = (blockIndex / grid.dims[0] % grid.dims[1]) * BLOCK_CUBES;
+    node0[2] = (blockIndex / grid.dims[0] / grid.dims[1]) * BLOCK_CUBES;
+    for (int a = 0; a < 3; a++)
+        lo[a] = grid.origin[a] + node0[a] * s;
+
+    // Cells within h of the block (different cells may share a hash)
+    hashes.clear();
+    int cellMin[3], cellMax[3];
+    for (int a = 0; a < 3; a++)
+    {
+        cellMin[a] = ParticleCells::Cell(lo[a] - h);
+        cellMax[a] = ParticleCells::Cell(lo[a] + BLOCK_CUBES * s + h);
+    }
+    for (int cz = cellMin[2]; cz <= cellMax[2]; cz++)
+        for (int cy = cellMin[1]; cy <= cellMax[1]; cy++)
+            for (int cx = cellMin[0]; cx <= cellMax[0]; cx++)
+                hashes.push_back(ParticleCells::Hash(cx, cy, cz));
+    sort(hashes.begin(), hashes.end());
+    hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+
+    // Density (poly6 sum of the particles, scattered to the nodes within h)
+    fill(density.begin(), density.end(), 0.0f);
+    for (size_t iHash = 0; iHash < hashes.size(); iHash++)
+    {
+        const cl_uint first = grid.pCells->cells[hashes[iHash] * 2 + 0];
+        const cl_uint last  = grid.pCells->cells[hashes[iHash] * 2 + 1];
+        if (first == (cl_uint)END_OF_CELL_LIST)
+            continue;
+
+        for (cl_uint j = first; j <= last; j++)
+        {
+            const cl_float *p = grid.pCells->positions[j].s;
+            int nMin[3], nMax[3];
+            for (int a = 0; a < 3; a++)
+            {
+                nMin[a] = max((int)ceil((p[a] - h - lo[a]) / s), 0);
+                nMax[a] = min((int)floor((p[a] + h - lo[a]) / s), BLOCK_CUBES);
+            }
+
+            for (int z = nMin[2]; z <= nMax[2]; z++)
+            {
+                const float dz = lo[2] + z * s - p[2];
+                for (int y = nMin[1]; y <= nMax[1]; y++)
+                {
+                    const float dy = lo[1] + y * s - p[1];
+                    for (int x = nMin[0]; x <= nMax[0]; x++)
+                    {
+                        const float dx = lo[0] + x * s - p[0];
+                        const float r_2 = dx * dx + dy * dy + dz * dz;
+                        if (r_2 < h_2)
+                        {
+                            const float q = h_2 - r_2;
+                            density[(z * BLOCK_NODES + y) * BLOCK_NODES + x] += q * q * q;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // March the cubes
+    const MARCHING_CUBES_TABLES &tables = *grid.pTables;
+    fill(edgeVertex.begin(), edgeVertex.end(), ~0u);
+    for (int z = 0; z < BLOCK_CUBES; z++)
+    {
+        for (int y = 0; y < BLOCK_CUBES; y++)
+        {
+            for (int x = 0; x < BLOCK_CUBES; x++)
+            {
+                int config = 0;
+                for (int c = 0; c < 8; c++)
+                {
+                    const int index = ((z + ((c >> 2) & 1)) * BLOCK_NODES + y + ((c >> 1) & 1)) * BLOCK_NODES + x + (c & 1);
+                    config |= (density[index] > grid.isoLevel) ? (1 << c) : 0;
+                }
+
+                for (const signed char *pEdge = tables.triangles[config]; *pEdge >= 0; pEdge++)
+                {
+                    const int c0   = tables.edgeCorners[*pEdge][0];
+                    const int axis = tables.edgeAxis[*pEdge];
+                    const int n[3] = {x + (c0 & 1), y + ((c0 >> 1) & 1), z + ((c0 >> 2) & 1)};
+                    const int node = (n[2] * BLOCK_NODES + n[1]) * BLOCK_NODES + n[0];
+                    cl_uint  &vertex = edgeVertex[axis * BLOCK_NODES * BLOCK_NODES * BLOCK_NODES + node];
+
+                    // New vertex (on the iso level, along the edge)
+                    if (vertex == ~0u)
+                    {
+                        const int   stride = (axis == 0) ? 1 : ((axis == 1) ? BLOCK_NODES : BLOCK_NODES * BLOCK_NODES);
+                        const float d0 = density[node];
+                        const float d1 = density[node + stride];
+                        vertex = (cl_uint)mesh.keys.size();
+                        for (int a = 0; a < 3; a++)
+                            mesh.positions.push_back(lo[a] + (n[a] + ((a == axis) ? (grid.isoLevel - d0) / (d1 - d0) : 0.0f)) * s);
+
+                        // Vertices on the block faces are shared with the neighbour blocks
+                        bool border = false;
+                        for (int a = 0; a < 3; a++)
+                            border = border || ((a != axis) && ((n[a] == 0) || (n[a] == BLOCK_CUBES)));
+                        mesh.keys.push_back(border ? ((((((cl_ulong)axis << 20) | (cl_ulong)(node0[2] + n[2])) << 20) |
+                                                        (cl_ulong)(node0[1] + n[1])) << 20) | (cl_ulong)(node0[0] + n[0])
+                                                   : INNER_VERTEX);
+                    }
+
+                    mesh.triangles.push_back(vertex);
+                }
+            }
+        }
+    }
+}
+
+SurfaceExtractor::SurfaceExtractor(float resolution, float isoLevel)
+    : mResolution(resolution), mIsoLevel(isoLevel), mFailed(false),
+      lastTime(0.0), totalTime(0.0), frames(0), activeBlocks(0)
+{
+}
+
+SurfaceExtractor::~SurfaceExtractor()
+{
+    Finish();
+}
+
+void SurfaceExtractor::Extract(const cl_float4 *particles, cl_uint count, SURFACE_MESH &mesh)
+{
+    const auto start = chrono::high_resolution_clock::now();
+
+    // Sort the particles into the simulation cells
+    mCells.Build(particles, count);
+    extract(mesh);
+
+    lastTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+void SurfaceExtractor::extract(SURFACE_MESH &mesh)
+{
+    static const MARCHING_CUBES_TABLES tables = BuildTables();
+
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.triangles.clear();
+    activeBlocks = 0;
+
+    const cl_float4 *sorted = mCells.positions.data();
+    const cl_uint    count  = (cl_uint)mCells.positions.size();
+
+    // Grid bounds (particles extended by h)
+    const float h = Params.h;
+    SURFACE_GRID grid;
+    grid.pTables  = &tables;
+    grid.pCells   = &mCells;
+    grid.spacing  = h * mResolution;
+    grid.isoLevel = mIsoLevel * Params.restDensity / Params.poly6Factor;
+
+    float lo[3] = {+numeric_limits<float>::max(), +numeric_limits<float>::max(), +numeric_limits<float>::max()};
+    float hi[3] = {-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max()};
+    for (cl_uint i = 0; i < count; i++)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            lo[a] = min(lo[a], sorted[i].s[a]);
+            hi[a] = max(hi[a], sorted[i].s[a]);
+        }
+    }
+
+    const float blockSize = grid.spacing * BLOCK_CUBES;
+    size_t totalBlocks = (count > 0) ? 1 : 0;
+    for (int a = 0; (a < 3) && (count > 0); a++)
+    {
+        const float first = floor((lo[a] - h) / blockSize);
+        grid.origin[a] = first * blockSize;
+        grid.dims[a]   = (int)min(floor((hi[a] + h) / blockSize) - first + 1.0f, (float)(MAX_GRID_NODES / BLOCK_CUBES - 1));
+        totalBlocks   *= grid.dims[a];
+    }
+    if ((totalBlocks == 0) || (totalBlocks > MAX_GRID_BLOCKS))
+    {
+        if (totalBlocks != 0)
+            cerr << "Surface grid of " << totalBlocks << " blocks is too large, skipped." << endl;
+        return;
+    }
+
+    // Active blocks: within h of a particle (marked in parallel)
+    const unsigned int workers = max(thread::hardware_concurrency(), 1u);
+    vector<atomic<unsigned char> > marks(totalBlocks);
+    for (size_t b = 0; b < totalBlocks; b++)
+        marks[b].store(0, memory_order_relaxed);
+
+    vector<thread> threads;
+    for (unsigned int w = 0; w < workers; w++)
+    {
+        threads.push_back(thread([&, w]()
+        {
+            const cl_uint end = (cl_uint)((cl_ulong)count * (w + 1) / workers);
+            for (cl_uint i = (cl_uint)((cl_ulong)count * w / workers); i < end; i++)
+            {
+                int bMin[3], bMax[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    // Cubes sharing a node within h
+                    const int nMin = (int)ceil((sorted[i].s[a] - h - grid.origin[a]) / grid.spacing);
+                    const int nMax = (int)floor((sorted[i].s[a] + h - grid.origin[a]) / grid.spacing);
+                    bMin[a] = max(nMin - 1, 0) / BLOCK_CUBES;
+                    bMax[a] = min(nMax / BLOCK_CUBES, grid.dims[a] - 1);
+                }
+
+                for (int bz = bMin[2]; bz <= bMax[2]; bz++)
+                    for (int by = bMin[1]; by <= bMax[1]; by++)
+                        for (int bx = bMin[0]; bx <= bMax[0]; bx++)
+                            marks[((size_t)bz * grid.dims[1] + by) * grid.dims[0] + bx].store(1, memory_order_relaxed);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+    threads.clear();
+
+    vector<cl_uint> active;
+    for (size_t b = 0; b < totalBlocks; b++)
+        if (marks[b].load(memory_order_relaxed))
+            active.push_back((cl_uint)b);
+    activeBlocks = (cl_uint)active.size();
+
+    // March the active blocks (each worker takes the next block)
+    vector<BLOCK_MESH> blocks(active.size());
+    atomic<size_t> nextBlock(0);
+    for (unsigned int w = 0; w < workers; w++)
+    {
+        threads.push_back(thread([&]()
+        {
+            vector<float>   density(BLOCK_NODES * BLOCK_NODES * BLOCK_NODES);
+            vector<cl_uint> edgeVertex(3 * BLOCK_NODES * BLOCK_NODES * BLOCK_NODES);
+            vector<cl_uint> hashes;
+            for (size_t b = nextBlock++; b < active.size(); b = nextBlock++)
+                ExtractBlock(grid, active[b], density, edgeVertex, hashes, blocks[b]);
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    // Weld the blocks (in blocks order, the mesh does not depend on the threads count)
+    unordered_map<cl_ulong, cl_uint> welded;
+    vector<cl_uint> remap;
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        const BLOCK_MESH &block = blocks[b];
+        remap.resize(block.keys.size());
+        for (size_t v = 0; v < block.keys.size(); v++)
+        {
+            const cl_uint index = (cl_uint)(mesh.positions.size() / 3);
+            if (block.keys[v] != INNER_VERTEX)
+            {
+                const pair<unordered_map<cl_ulong, cl_uint>::iterator, bool> inserted = welded.insert(make_pair(block.keys[v], index));
+                if (!inserted.second)
+                {
+                    remap[v] = inserted.first->second;
+                    continue;
+                }
+            }
+
+            remap[v] = index;
+            mesh.positions.insert(mesh.positions.end(), &block.positions[v * 3], &block.positions[v * 3] + 3);
+        }
+
+        for (size_t t = 0; t < block.triangles.size(); t++)
+            mesh.triangles.push_back(remap[block.triangles[t]]);
+    }
+
+    // Vertex normals (area weighted)
+    mesh.normals.assign(mesh.positions.size(), 0.0f);
+    for (size_t t = 0; t < mesh.triangles.size(); t += 3)
+    {
+        const cl_float *p0 = &mesh.positions[mesh.triangles[t + 0] * 3];
+        const cl_float *p1 = &mesh.positions[mesh.triangles[t + 1] * 3];
+        const cl_float *p2 = &mesh.positions[mesh.triangles[t + 2] * 3];
+        const float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+        const float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+        const float n[3]  = {e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0]};
+        for (int k = 0; k < 3; k++)
+            for (int a = 0; a < 3; a++)
+                mesh.normals[mesh.triangles[t + k] * 3 + a] += n[a];
+    }
+    for (size_t v = 0; v < mesh.normals.size(); v += 3)
+    {
+        const float length = sqrt(mesh.normals[v] * mesh.normals[v] + mesh.normals[v + 1] * mesh.normals[v + 1] + mesh.normals[v + 2] * mesh.normals[v + 2]);
+        for (int a = 0; (a < 3) && (length > 0.0f); a++)
+            mesh.normals[v + a] /= length;
+    }
+}
+
+void SurfaceExtractor::Submit(vector<cl_float4> &particles, vector<cl_uint> &cells, const string &fileName)
+{
+    // One frame in flight
+    Finish();
+
+    mPending.swap(particles);
+    mPendingCells.swap(cells);
+    mWorker = thread([this, fileName]()
+    {
+        const auto start = chrono::high_resolution_clock::now();
+
+        // Already sorted into the simulation cells (the particles moved at most one step since they were binned,
+        // a particle missed that way is almost h away from the nodes, where poly6 vanishes)
+        SURFACE_MESH mesh;
+        mCells.Assign(mPending, mPendingCells);
+        extract(mesh);
+        lastTime = chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count();
+        totalTime += lastTime;
+        frames++;
+
+        if (!Save(fileName, mesh))
+        {
+            cerr << "Unable to write surface " << fileName << endl;
+            mFailed = true;
+        }
+    });
+}
+
+bool SurfaceExtractor::Finish()
+{
+    if (mWorker.joinable())
+        mWorker.join();
+
+    return !mFailed;
+}
+
+bool SurfaceExtractor::Save(const string &fileName, const SURFACE_MESH &mesh)
+{
+    const cl_uint vertices  = (cl_uint)(mesh.positions.size() / 3);
+    const cl_uint triangles = (cl_uint)(mesh.triangles.size() / 3);
+
+    ofstream ofs(fileName.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!ofs.is_open())
+        return false;
+
+    // OBJ ("v/vt/vn" faces, as read by Mesh::LoadObj)
+    if ((fileName.size() >= 4) && (fileName.compare(fileName.size() - 4, 4, ".obj") == 0))
+    {
+        if (vertices > MAX_OBJ_VERTICES)
+            cerr << "Warning: " << fileName << " has " << vertices << " vertices, Mesh::LoadObj reads up to "
+                 << MAX_OBJ_VERTICES << " (use the binary format)" << endl;
+
+        ofs << "# Fluid surface, " << vertices << " vertices, " << triangles << " triangles" << "\n";
+        for (cl_uint v = 0; v < vertices; v++)
+            ofs << "v " << mesh.positions[v * 3] << " " << mesh.positions[v * 3 + 1] << " " << mesh.positions[v * 3 + 2] << "\n";
+        ofs << "vt 0 0" << "\n";
+        for (cl_uint v = 0; v < vertices; v++)
+            ofs << "vn " << mesh.normals[v * 3] << " " << mesh.normals[v * 3 + 1] << " " << mesh.normals[v * 3 + 2] << "\n";
+        for (cl_uint t = 0; t < triangles; t++)
+        {
+            ofs << "f";
+            for (int k = 0; k < 3; k++)
+                ofs << " " << mesh.triangles[t * 3 + k] + 1 << "/1/" << mesh.triangles[t * 3 + k] + 1;
+            ofs << "\n";
+        }
+
+        return ofs.good();
+    }
+
+    // Binary
+    SurfaceFileHeader header;
+    copy(SURFACE_FILE_MAGIC, SURFACE_FILE_MAGIC + 4, header.magic);
+    header.version   = SURFACE_FILE_VERSION;
+    header.vertices  = vertices;
+    header.triangles = triangles;
+
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)mesh.positions.data(), mesh.positions.size() * sizeof(cl_float));
+    ofs.write((const char *)mesh.normals.data(),   mesh.normals.size()   * sizeof(cl_float));
+    ofs.write((const char *)mesh.triangles.data(), mesh.triangles.size() * sizeof(cl_uint));
+
+    return ofs.good();
+}
@@ -0,0 +1,76 @@
+#ifndef __SURFACE_EXTRACTOR_HPP
+#define __SURFACE_EXTRACTOR_HPP
+
+#include "hesp.hpp"
+#include "ParticleCells.hpp"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Extracted fluid surface (welded vertices, triangles are counter clockwise seen from outside the fluid)
+typedef struct {
+    vector<cl_float>  positions; // x, y, z per vertex
+    vector<cl_float>  normals;   // x, y, z per vertex
+    vector<cl_uint>   triangles; // 3 vertices per triangle
+} SURFACE_MESH;
+
+// Fluid surface extraction (marching cubes over the particles density, multithreaded on the host)
+//   The particles are sorted into the simulation cells (see ParticleCells, frames submitted in the background reuse
+//   the simulation sort and cells read back with the positions), the density is the simulation one
+//   (poly6 sum, see compute_scaling.cl) sampled on a grid of resolution x h spaced nodes. Only the blocks of
+//   BLOCK_CUBES^3 cubes within h of a particle are evaluated, each by one worker thread. Vertices are shared
+//   by the cubes of a block and welded across the blocks borders.
+//
+//   Meshes are written as ".obj" (Mesh::LoadObj compatible up to 65536 vertices, larger meshes are written with a
+//   warning) or in the binary format:
+//     header {'P','B','F','S', version, vertices count, triangles count}, float3 positions, float3 normals,
+//     uint triangles
+class SurfaceExtractor
+{
+private:
+    // Surface settings
+    float         mResolution; // Grid spacing [h]
+    float         mIsoLevel;   // Surface density [rest density]
+
+    // Particles of the extracted frame
+    ParticleCells mCells;
+
+    // Background extraction (see Submit)
+    std::thread       mWorker;
+    vector<cl_float4> mPending;
+    vector<cl_uint>   mPendingCells;
+    bool              mFailed;
+
+    // Extract the surface of the particles in mCells
+    void extract(SURFACE_MESH &mesh);
+
+public:
+    // Statistics (read after Finish when extracting in the background)
+    double  lastTime;      // Last extraction [millisec]
+    double  totalTime;     // Background extractions [millisec]
+    cl_uint frames;        // Background extractions
+    cl_uint activeBlocks;  // Last extraction
+
+public:
+    SurfaceExtractor(float resolution = 0.5f, float isoLevel = 0.5f);
+    ~SurfaceExtractor();
+
+    // Extract the surface of the particles (uses all cores)
+    void Extract(const cl_float4 *particles, cl_uint count, SURFACE_MESH &mesh);
+
+    // Extract and write in the background (particles sorted by the simulation and its cells are swapped out, waits
+    // for the previous frame)
+    void Submit(vector<cl_float4> &particles, vector<cl_uint> &cells, const string &fileName);
+
+    // Wait for the background extraction, returns false if a mesh could not be written
+    bool Finish();
+
+    // Write a mesh (the format is decided by the extension)
+    static bool Save(const string &fileName, const SURFACE_MESH &mesh);
+};
+
+#endif // __SURFACE_EXTRACTOR_HPP
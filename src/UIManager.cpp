@@ -10,6 +10,8 @@
 #include "../../lib/AntTweakBar/src/TwMgr.h"
 #include "../../lib/AntTweakBar/src/TwOpenGLCore.h"
 
+#include <chrono>
+
 CTwGraphOpenGLCore tw;
 void *twFont;
 
@@ -30,7 +32,13 @@ float       mMousePosX;
 float       mMousePosY;
 
 double      mFPS;
-__int64     mFPS_LastQPC;
+std::chrono::high_resolution_clock::time_point mFPS_LastTime;
+double      mSimStepsPerSecond;
+
+// Simulation kernels timings (copied each frame, the simulation steps on its own thread)
+vector<pair<string, double> > mSimTimings;
+vector<string>  mSimTimingRowNames;
+size_t          Prev_Sim_Timings_Count = 0;
 
 int  UIM_SelectedInspectionStage;
 bool UIM_SaveInspectionStage = false;
@@ -39,6 +47,13 @@ int  UIM_RenderMode;
 bool mIsFirstCycle = true;
 unsigned int  Prev_OGSI_Stages_Count = 0;
 
+// Device memory rows (rebuilt when the arena layout changes)
+unsigned int    Prev_Memory_Generation = 0;
+vector<string>  mMemoryRowNames;
+vector<double>  mMemoryRowsKB;
+double          mMemoryTotalKB;
+double          mMemoryMaxParticles;
+
 
 void MouseButtonCB(GLFWwindow *window, int button, int action, int mods)
 {
@@ -90,6 +105,16 @@ void TW_CALL DumpParticlesData(void *clientData)
     ((Simulation*)clientData)->bDumpParticlesData = true;
 }
 
+void TW_CALL DumpMemoryReport(void *clientData)
+{
+    ((Simulation*)clientData)->PrintMemoryReport(cout);
+}
+
+void TW_CALL MeasureGatherLocality(void *clientData)
+{
+    ((Simulation*)clientData)->bMeasureLocality = true;
+}
+
 void TW_CALL SaveInspection(void *clientData)
 {
     (void)clientData;
@@ -147,6 +172,8 @@ void UIManager_Init(GLFWwindow *window, CVisual *pRenderer, Simulation *pSim)
     // Sim debugging related
     TwAddVarRW (mTweakBar, "Friends Histogram",      TW_TYPE_BOOLCPP,   &mRenderer->UICmd_FriendsHistogarm, "group='Sim Debugging'");
     TwAddButton(mTweakBar, "Dump Particles Data",    DumpParticlesData, mSim,                               "group='Sim Debugging'");
+    TwAddButton(mTweakBar, "Dump Memory Report",     DumpMemoryReport,  mSim,                               "group='Sim Debugging'");
+    TwAddButton(mTweakBar, "Measure Gather Locality", MeasureGatherLocality, mSim,                          "group='Sim Debugging'");
 
     // View debugging related
     TwAddButton(mTweakBar, "Save Inspection",       SaveInspection,   mRenderer, "group='View Debugging'");
@@ -165,6 +192,20 @@ void UIManager_Init(GLFWwindow *window, CVisual *pRenderer, Simulation *pSim)
     TwAddVarRO(mTweakBar, "Sim time", TW_TYPE_DOUBLE, &mTotalSimTime, "precision=2 group=General_Timings");
     TwAddVarRO(mTweakBar, "Render time", TW_TYPE_DOUBLE, &mTotalRenderTime, "precision=2 group=General_Timings");
     TwAddVarRO(mTweakBar, "FPS", TW_TYPE_DOUBLE, &mFPS, "precision=2 group=General_Timings");
+    TwAddVarRO(mTweakBar, "Sim steps/s", TW_TYPE_DOUBLE, &mSimStepsPerSecond, "precision=1 group=General_Timings");
+
+    // Device memory [KB]
+    TwAddVarRO(mTweakBar, "Total memory", TW_TYPE_DOUBLE, &mMemoryTotalKB, "precision=0 group=Device_Memory");
+    TwAddVarRO(mTweakBar, "Max particles", TW_TYPE_DOUBLE, &mMemoryMaxParticles, "precision=0 group=Device_Memory");
+    TwDefine(" PBFTweak/Device_Memory opened=false ");
+
+    // Gather locality (last measurement)
+    TwAddVarRO(mTweakBar, "Avg index distance", TW_TYPE_DOUBLE, &mSim->mLocality.avgIndexDistance, "precision=1 group=Gather_Locality");
+    TwAddVarRO(mTweakBar, "Same line [%]",      TW_TYPE_DOUBLE, &mSim->mLocality.sameLineRatio,    "precision=1 group=Gather_Locality");
+    TwAddVarRO(mTweakBar, "Block hits [%]",     TW_TYPE_DOUBLE, &mSim->mLocality.groupHitRatio,    "precision=1 group=Gather_Locality");
+    TwAddVarRO(mTweakBar, "Cache window [%]",   TW_TYPE_DOUBLE, &mSim->mLocality.cacheWindowRatio, "precision=1 group=Gather_Locality");
+    TwAddVarRO(mTweakBar, "computeDelta [ms]",  TW_TYPE_DOUBLE, &mSim->mLocality.computeDeltaTime, "precision=2 group=Gather_Locality");
+    TwDefine(" PBFTweak/Gather_Locality opened=false ");
 
     // Init drawing ATB
     g_TwMgr->m_GraphAPI = TW_OPENGL_CORE;
@@ -189,8 +230,8 @@ void DrawPerformanceGraph()
 
     // Find total time
     double totalTime = 0;
-    for (size_t i = 0; i < mSim->PerfData.Trackers.size(); i++)
-        totalTime += mSim->PerfData.Trackers[i]->total_time;
+    for (size_t i = 0; i < mSimTimings.size(); i++)
+        totalTime += mSimTimings[i].second;
 
     // Draw
     const color32 StartClr[] = {0xFF0000, 0x00FF00, 0x0000FF};
@@ -198,12 +239,10 @@ void DrawPerformanceGraph()
     const color32 Alpha      = 0x80000000;
     int prevX = BarLeft;
     double accTime = 0;
-    for (size_t i = 0; i < mSim->PerfData.Trackers.size(); i++)
+    for (size_t i = 0; i < mSimTimings.size(); i++)
     {
-        PM_PERFORMANCE_TRACKER *pTracker = mSim->PerfData.Trackers[i];
-
         // Add segment time
-        accTime += pTracker->total_time;
+        accTime += mSimTimings[i].second;
 
         // Compute screen position
         int newX = BarLeft + (int)(0.5f + accTime * BarWidth / totalTime);
@@ -217,13 +256,13 @@ void DrawPerformanceGraph()
             // Draw name text
             const int NameVertOffset = -2;
 
-            tw.BuildText(twFont, &pTracker->eventName, NULL, NULL, 1, mDisplayFont, 0, 0);
+            tw.BuildText(twFont, &mSimTimings[i].first, NULL, NULL, 1, mDisplayFont, 0, 0);
             tw.SetScissor(prevX + 2, BarTop + NameVertOffset, newX - prevX, BarHeight);
             tw.DrawText(twFont, prevX + 2, BarTop + NameVertOffset, 0xffffffffu, 0);
 
             // Build ms text
             char tmp[128];
-            sprintf(tmp, "%3.2f", pTracker->total_time);
+            sprintf(tmp, "%3.2f", mSimTimings[i].second);
             string str(tmp);
 
             // Draw time text
@@ -326,28 +365,67 @@ void DrawAntTweakBar()
         // Remember that ATB row was created
         (*iter)->tag = 1;
 
-        // create row
+        // create row (average over the section history, nested sections indented)
         string title = "  " + (*iter)->sectionName;
-        void* pValue = &(*iter)->total_time_ms;
-        TwAddVarRO(mTweakBar, title.c_str(),  TW_TYPE_DOUBLE,  pValue, "precision=2 group=OGL_Timings");
+        string def   = "precision=2 group=OGL_Timings label='" + string(2 * ((*iter)->depth + 1), ' ') + (*iter)->sectionName + "'";
+        void* pValue = &(*iter)->avg_time_ms;
+        TwAddVarRO(mTweakBar, title.c_str(),  TW_TYPE_DOUBLE,  pValue, def.c_str());
     }
 
-    if (mIsFirstCycle)
+    // Rebuild performance rows when trackers were added (values are copied aside, see UIManager_Draw)
+    if (Prev_Sim_Timings_Count != mSimTimings.size())
     {
-        // Create performance rows
-        for (size_t i = 0; i < mSim->PerfData.Trackers.size(); i++)
+        // Remove previous rows (they point into the previous copy)
+        for (size_t i = 0; i < mSimTimingRowNames.size(); i++)
+            TwRemoveVar(mTweakBar, mSimTimingRowNames[i].c_str());
+
+        // create rows
+        mSimTimingRowNames.resize(mSimTimings.size());
+        for (size_t i = 0; i < mSimTimings.size(); i++)
         {
-            // create row
-            string title = "  " + mSim->PerfData.Trackers[i]->eventName;
-            void* pValue = &mSim->PerfData.Trackers[i]->total_time;
-            TwAddVarRO(mTweakBar, title.c_str(),  TW_TYPE_DOUBLE,  pValue, "precision=2 group=OCL_Timings");
+            mSimTimingRowNames[i] = "  " + mSimTimings[i].first;
+            void* pValue = &mSimTimings[i].second;
+            TwAddVarRO(mTweakBar, mSimTimingRowNames[i].c_str(),  TW_TYPE_DOUBLE,  pValue, "precision=2 group=OCL_Timings");
         }
 
+        // Make sure Stats group is folded (created with the first rows)
+        if (Prev_Sim_Timings_Count == 0)
+            TwDefine(" PBFTweak/OCL_Timings opened=false ");
+        Prev_Sim_Timings_Count = mSimTimings.size();
+    }
+
+    if (mIsFirstCycle)
+    {
         // Make sure Stats group is folded
-        TwDefine(" PBFTweak/OCL_Timings opened=false ");
         TwDefine(" PBFTweak/OGL_Timings opened=false ");
     }
 
+    // Rebuild device memory rows if the arena layout changed
+    const OCLMemoryArena &arena = mSim->mMemoryArena;
+    if (Prev_Memory_Generation != arena.Generation)
+    {
+        Prev_Memory_Generation = arena.Generation;
+
+        // Remove previous rows
+        for (size_t i = 0; i < mMemoryRowNames.size(); i++)
+            TwRemoveVar(mTweakBar, mMemoryRowNames[i].c_str());
+
+        // Create a row per entry (values are stored aside, entries might move)
+        mMemoryRowNames.resize(arena.Entries.size());
+        mMemoryRowsKB.resize(arena.Entries.size());
+        for (size_t i = 0; i < arena.Entries.size(); i++)
+        {
+            mMemoryRowNames[i] = "Mem_" + arena.Entries[i].name;
+            mMemoryRowsKB[i]   = arena.Entries[i].size / 1024.0;
+
+            string def = "precision=0 group=Device_Memory label='  " + arena.Entries[i].name + "'";
+            TwAddVarRO(mTweakBar, mMemoryRowNames[i].c_str(), TW_TYPE_DOUBLE, &mMemoryRowsKB[i], def.c_str());
+        }
+
+        mMemoryTotalKB      = arena.GetTotalSize() / 1024.0;
+        mMemoryMaxParticles = (double)arena.EstimateMaxParticles(mSim->mCLDevice, Params.particleCapacity);
+    }
+
     // Check if we need to refresh OGSI stage list
     if (Prev_OGSI_Stages_Count != OGSI_Stages_Count)
     {
@@ -370,12 +448,13 @@ void DrawAntTweakBar()
 
     // Accumulate execution time
     mTotalSimTime = 0;
-    for (size_t i = 0; i < mSim->PerfData.Trackers.size(); i++)
-        mTotalSimTime += mSim->PerfData.Trackers[i]->total_time;
+    for (size_t i = 0; i < mSimTimings.size(); i++)
+        mTotalSimTime += mSimTimings[i].second;
 
     mTotalRenderTime = 0.0;
     for (iter = g_OGL_Timings.begin(); iter != g_OGL_Timings.end(); iter++)
-        mTotalRenderTime += (*iter)->total_time_ms;
+        if ((*iter)->depth == 0)
+            mTotalRenderTime += (*iter)->avg_time_ms;
 
     // Make sure bar refresh it's values
     TwRefreshBar(mTweakBar);
@@ -406,16 +485,16 @@ void UIManager_Draw()
     processGLFWEvents();
 
     // Measure FPS
-    __int64 newQPC;
-    __int64 QPFreq;
-    QueryPerformanceCounter((LARGE_INTEGER*)&newQPC);
-    QueryPerformanceFrequency((LARGE_INTEGER*)&QPFreq);
-    mFPS = 1.0 / ((double)(newQPC - mFPS_LastQPC) / QPFreq);
-    mFPS_LastQPC = newQPC;
+    const std::chrono::high_resolution_clock::time_point newTime = std::chrono::high_resolution_clock::now();
+    mFPS = 1.0 / std::chrono::duration<double>(newTime - mFPS_LastTime).count();
+    mFPS_LastTime = newTime;
 
     // Collect OpenGL timings
     OGLU_CollectTimings();
 
+    // Collect OpenCL timings
+    mSim->PerfData.GetTimings(mSimTimings);
+
     DrawAntTweakBar();
 
     DrawPerformanceGraph();
@@ -426,6 +505,11 @@ void UIManager_Draw()
     mIsFirstCycle = false;
 }
 
+void UIManager_SetSimulationRate(double stepsPerSecond)
+{
+    mSimStepsPerSecond = stepsPerSecond;
+}
+
 bool UIManager_WindowShouldClose()
 {
     return glfwWindowShouldClose(mWindow);
@@ -6,4 +6,5 @@ extern int UIM_SelectedInspectionStage;
 
 void UIManager_Init(GLFWwindow* window, CVisual* pRenderer, Simulation* pSim);
 void UIManager_Draw();
+void UIManager_SetSimulationRate(double stepsPerSecond); // Simulation thread steps/s (the FPS row is the render rate)
 bool UIManager_WindowShouldClose();
@@ -1,7 +1,9 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <cstdio>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
 #include <string>
 #include <iostream>
 #include <fstream>
@@ -15,11 +17,13 @@ using namespace std;
 #include "Simulation.hpp"
 #include "Runner.hpp"
 #include "Resources.hpp"
+#include "BatchSweep.hpp"
 
 static const int WINDOW_WIDTH = 1280;
 static const int WINDOW_HEIGHT = 720;
 
-void SelectOpenCLDevice(cl::Platform &platform, cl::Device &device)
+// Device #deviceIndex as listed (1 based), the fastest suitable one if 0
+void SelectOpenCLDevice(cl::Platform &platform, cl::Device &device, bool requireGLSharing, unsigned int deviceIndex = 0)
 {
     // Scan platforms/devices for most sutable option
     cl_int      BestOption        = -1;
@@ -57,7 +61,7 @@ void SelectOpenCLDevice(cl::Platform &platform, cl::Device &device)
             cl_int TotalClock   = clockFreq * computeUnits;
 
             // Check agaist "best" option
-            if (support_gl_sharing && (BestOption_Clocks < TotalClock) && (devType == CL_DEVICE_TYPE_GPU))
+            if ((support_gl_sharing || !requireGLSharing) && (BestOption_Clocks < TotalClock) && (devType == CL_DEVICE_TYPE_GPU))
             {
                 BestOption = deviceOptions.size() - 1;
                 BestOption_Clocks = TotalClock;
@@ -77,6 +81,16 @@ void SelectOpenCLDevice(cl::Platform &platform, cl::Device &device)
     // BestOption = ...;
     // BestOption = 0;
 
+    // Headless runs fall back to any device (e.g. CPU)
+    if ((BestOption == -1) && !requireGLSharing && !deviceOptions.empty())
+        BestOption = 0;
+
+    // Requested device
+    if (deviceIndex > deviceOptions.size())
+        throw runtime_error("No such device.");
+    if (deviceIndex > 0)
+        BestOption = deviceIndex - 1;
+
     // Check if found atleast one device
     if (BestOption == -1)
         throw runtime_error("No devices were found.");
@@ -87,10 +101,136 @@ void SelectOpenCLDevice(cl::Platform &platform, cl::Device &device)
     cout << "Selected device is #" << (BestOption + 1) << " => " << device.getInfo<CL_DEVICE_NAME>() << endl;
 }
 
-int main()
+// Part "part" of the device split in "parts" sub-devices of equal compute units (concurrent runs on a CPU device)
+void SplitOpenCLDevice(cl::Device &device, unsigned int part, unsigned int parts)
+{
+#if defined(CL_VERSION_1_2)
+    const cl_uint units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() / parts;
+    const vector<cl_device_partition_property> partitions = device.getInfo<CL_DEVICE_PARTITION_PROPERTIES>();
+    if ((units == 0) || (find(partitions.begin(), partitions.end(), (cl_device_partition_property)CL_DEVICE_PARTITION_EQUALLY) == partitions.end()))
+    {
+        cout << "Device can't be split in " << parts << " parts, using the whole device" << endl;
+        return;
+    }
+
+    const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)units, 0 };
+    vector<cl::Device> subDevices;
+    device.createSubDevices(properties, &subDevices);
+    device = subDevices[part % subDevices.size()];
+    cout << "Selected sub-device " << part << "/" << parts << " (" << units << " compute units)" << endl;
+#else
+    // Device fission needs OpenCL 1.2 (Windows builds are limited to 1.1, see hesp.hpp)
+    cout << "Device can't be split in " << parts << " parts, using the whole device" << endl;
+#endif
+}
+
+int main(int argc, char **argv)
 {
+    // Parse command line
+    RunnerOptions options;
+    bool bHeadless = false;
+    string sweepFile;
+    unsigned int jobs = 0;
+    unsigned int deviceIndex = 0;
+    unsigned int devicePart = 0, deviceParts = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if ((string(argv[i]) == "--scenario") && (i + 1 < argc))
+            options.scenario = argv[++i];
+        else if (string(argv[i]) == "--memory-report")
+            options.memoryReportOnly = true;
+        else if (string(argv[i]) == "--benchmark-binning")
+            options.benchmarkBinningOnly = true;
+        else if (string(argv[i]) == "--headless")
+            bHeadless = true;
+        else if ((string(argv[i]) == "--steps") && (i + 1 < argc))
+            options.headlessSteps = (unsigned int)atoi(argv[++i]);
+        else if ((string(argv[i]) == "--summary") && (i + 1 < argc))
+            options.summaryFile = argv[++i];
+        else if ((string(argv[i]) == "--capture") && (i + 1 < argc))
+            options.captureFile = argv[++i];
+        else if ((string(argv[i]) == "--sweep") && (i + 1 < argc))
+            sweepFile = argv[++i];
+        else if ((string(argv[i]) == "--jobs") && (i + 1 < argc))
+            jobs = (unsigned int)atoi(argv[++i]);
+        else if ((string(argv[i]) == "--render") && (i + 1 < argc))
+            options.renderFile = argv[++i];
+        else if ((string(argv[i]) == "--render-size") && (i + 1 < argc))
+            sscanf(argv[++i], "%dx%d", &options.renderWidth, &options.renderHeight);
+        else if ((string(argv[i]) == "--render-mode") && (i + 1 < argc))
+            options.renderMode = atoi(argv[++i]);
+        else if ((string(argv[i]) == "--record") && (i + 1 < argc))
+            options.recordFile = argv[++i];
+        else if ((string(argv[i]) == "--playback") && (i + 1 < argc))
+            options.playbackFile = argv[++i];
+        else if ((string(argv[i]) == "--surface") && (i + 1 < argc))
+            options.surfaceFile = argv[++i];
+        else if ((string(argv[i]) == "--frame-slice") && (i + 1 < argc))
+            sscanf(argv[++i], "%u/%u", &options.sliceIndex, &options.sliceCount);
+        else if ((string(argv[i]) == "--frame-count") && (i + 1 < argc))
+            options.frameCount = (unsigned int)atoi(argv[++i]);
+        else if ((string(argv[i]) == "--device") && (i + 1 < argc))
+            deviceIndex = (unsigned int)atoi(argv[++i]);
+        else if ((string(argv[i]) == "--device-part") && (i + 1 < argc))
+            sscanf(argv[++i], "%u/%u", &devicePart, &deviceParts);
+        else
+            cerr << "Unknown argument " << argv[i] << " (usage: " << argv[0] << " [--scenario <file.par>] [--memory-report] [--benchmark-binning] [--capture <file>]"
+                 << " [--headless [--steps <n>] [--summary <file>] [--record <file_%06d.bin>] [--surface <file_%06d.pbfs|.obj>] [--render <file_%06d.ppm>]]"
+                 << " [--playback <file_%06d.bin> --render <file_%06d.ppm> [--jobs <n>]] [--render-size <w>x<h>] [--render-mode <n>]"
+                 << " [--sweep <file> [--jobs <n>]] [--device <n> [--device-part <i>/<n>]])" << endl;
+    }
+
+    // Batch sweep (runs headless processes of this executable, see BatchSweep.hpp)
+    if (!sweepFile.empty())
+        return RunBatchSweep(sweepFile, argv[0], jobs);
+
+    // Playback runs without a window too
+    bHeadless = bHeadless || !options.playbackFile.empty();
+
     try
     {
+        // Playback of recorded frames: offscreen rendering only (no OpenCL)
+        if (!options.playbackFile.empty())
+        {
+            Runner runner(options);
+            if (jobs > 1)
+                return runner.runParallelRender(argv[0], jobs);
+
+            CVisual renderer(options.renderWidth, options.renderHeight);
+            renderer.initOffscreen();
+            return runner.runPlayback(renderer) ? 0 : 1;
+        }
+
+        // Headless run: no window, any OpenCL device
+        if (bHeadless)
+        {
+            cl::Platform ocl_platform;
+            cl::Device   ocl_device;
+            SelectOpenCLDevice(ocl_platform, ocl_device, false, deviceIndex);
+            if (deviceParts > 1)
+                SplitOpenCLDevice(ocl_device, devicePart, deviceParts);
+
+            cl_context_properties properties[] =
+            {
+                CL_CONTEXT_PLATFORM, (cl_context_properties) (ocl_platform)(),
+                0
+            };
+
+            std::vector<cl::Device> devices;
+            devices.push_back(ocl_device);
+            cl::Context context = cl::Context(devices, properties);
+
+            Simulation simulation(context, ocl_device);
+            Runner runner(options);
+            if (options.renderFile.empty())
+                return runner.runHeadless(simulation) ? 0 : 1;
+
+            // Offscreen rendering of the simulated frames
+            CVisual renderer(options.renderWidth, options.renderHeight);
+            renderer.initOffscreen();
+            return runner.runHeadless(simulation, &renderer) ? 0 : 1;
+        }
+
         // Create rendering window
         CVisual renderer(WINDOW_WIDTH, WINDOW_HEIGHT);
         renderer.initWindow("PBF Project");
@@ -98,7 +238,7 @@ int main()
         // Select OpenCL device
         cl::Platform ocl_platform;
         cl::Device   ocl_device;
-        SelectOpenCLDevice(ocl_platform, ocl_device);
+        SelectOpenCLDevice(ocl_platform, ocl_device, true, deviceIndex);
 
 
 #if defined(__APPLE__)
@@ -146,19 +286,21 @@ int main()
         Simulation simulation(context, ocl_device);
 
         // Create runner object
-        Runner runner;
+        Runner runner(options);
         runner.run(simulation, renderer);
     }
     catch (const cl::Error &ecl)
     {
         cerr << "OpenCL Error caught: " << ecl.what() << "(" << ecl.err() << ")" << endl;
-        getchar();
+        if (!bHeadless)
+            getchar();
         exit(-1);
     }
     catch (const exception &e)
     {
         cerr << "STD Error caught: " << e.what() << endl;
-        getchar();
+        if (!bHeadless)
+            getchar();
         exit(-1);
     }
 
@@ -0,0 +1,104 @@
+#include "OffscreenContext.hpp"
+#include "../Precomp_OpenGL.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(ENABLE_OFFSCREEN)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+using namespace std;
+
+#if defined(ENABLE_OFFSCREEN)
+static bool HasExtension(const char *szExtensions, const char *szName)
+{
+    if (szExtensions == NULL)
+        return false;
+
+    // Whole word match
+    const size_t length = strlen(szName);
+    for (const char *p = strstr(szExtensions, szName); p != NULL; p = strstr(p + length, szName))
+        if (((p == szExtensions) || (p[-1] == ' ')) && ((p[length] == ' ') || (p[length] == '\0')))
+            return true;
+
+    return false;
+}
+#endif
+
+OffscreenContext::OffscreenContext()
+    : mDisplay(NULL),
+      mContext(NULL)
+{
+}
+
+OffscreenContext::~OffscreenContext()
+{
+#if defined(ENABLE_OFFSCREEN)
+    if (mContext != NULL)
+    {
+        eglMakeCurrent((EGLDisplay)mDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext((EGLDisplay)mDisplay, (EGLContext)mContext);
+    }
+    if (mDisplay != NULL)
+        eglTerminate((EGLDisplay)mDisplay);
+#endif
+}
+
+void OffscreenContext::create()
+{
+#if defined(ENABLE_OFFSCREEN)
+    // Surfaceless platform (no display server needed), default display otherwise
+    EGLDisplay display = EGL_NO_DISPLAY;
+    const char *szClientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (HasExtension(szClientExtensions, "EGL_MESA_platform_surfaceless"))
+    {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (eglGetPlatformDisplayEXT != NULL)
+            display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    if ((display == EGL_NO_DISPLAY) || !eglInitialize(display, NULL, NULL))
+        throw runtime_error("Could not initialize EGL!");
+    mDisplay = display;
+
+    if (!HasExtension(eglQueryString(display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context"))
+        throw runtime_error("EGL display does not support surfaceless contexts!");
+
+    // Any OpenGL capable config (rendering goes to FBOs)
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config;
+    EGLint    configCount = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || (configCount == 0))
+        throw runtime_error("No OpenGL EGL config!");
+
+    // Compatibility profile, same as the window context (compute shaders need 4.3)
+    const EGLint contextAttribs[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE
+    };
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT)
+        throw runtime_error("Could not create an OpenGL 4.3 EGL context!");
+    mContext = context;
+
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+        throw runtime_error("Could not make the EGL context current!");
+#else
+    throw runtime_error("Offscreen rendering is not available (build with PBF_OFFSCREEN)!");
+#endif
+}
+
+string OffscreenContext::renderer() const
+{
+    const GLubyte *szRenderer = glGetString(GL_RENDERER);
+    return (szRenderer != NULL) ? string((const char *)szRenderer) : string("unknown");
+}
@@ -0,0 +1,36 @@
+#ifndef _OFFSCREEN_CONTEXT_HPP
+#define _OFFSCREEN_CONTEXT_HPP
+
+#include <string>
+using std::string;
+
+/**
+ *  \brief  OffscreenContext
+ *
+ *  OpenGL context without a window or a display (EGL surfaceless, e.g. Mesa llvmpipe on nodes without a GPU).
+ *  Rendering goes to FBOs only. Available on Linux when built with PBF_OFFSCREEN (ENABLE_OFFSCREEN), not build
+ *  verified yet (see src/CMakeLists.txt).
+ */
+class OffscreenContext
+{
+private:
+    // Avoid copy
+    OffscreenContext &operator=(const OffscreenContext &other);
+    OffscreenContext (const OffscreenContext &other);
+
+    // EGL handles (EGLDisplay, EGLContext)
+    void *mDisplay;
+    void *mContext;
+
+public:
+    OffscreenContext();
+    ~OffscreenContext();
+
+    // Create an OpenGL 4.3 context and make it current (throws on failure)
+    void create();
+
+    // Renderer description (GL_RENDERER)
+    string renderer() const;
+};
+
+#endif // _OFFSCREEN_CONTEXT_HPP
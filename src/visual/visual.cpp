@@ -1,4 +1,5 @@
 #include "visual.hpp"
+#include "OffscreenContext.hpp"
 #include "../OGL_Utils.h"
 #include "../ParamUtils.hpp"
 #include "../ZPR.h"
@@ -8,6 +9,7 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <algorithm>
 #include <fstream>
 #include <vector>
 
@@ -38,13 +40,37 @@ CVisual::CVisual (const int windowWidth, const int windowHeight)
       mWindowWidth(windowWidth),
       mWindowHeight(windowHeight),
       mCycleID(0),
-      mSystemBufferID(0)
+      pOffscreenContext(NULL),
+      pFBO_Offscreen(NULL),
+      pFBO_Thickness(NULL),
+      pFBO_SmoothPing(NULL),
+      pFBO_SmoothPong(NULL),
+      mCullCommandBufferID(0),
+      mCullIndicesBufferID(0),
+      mCullListCapacity(0),
+      mSystemBufferID(0),
+      mParticlesBufferID(0),
+      mCellsBufferID(0),
+      mParticlesCount(0),
+      mParticlesCapacity(0)
 {
 }
 
 CVisual::~CVisual ()
 {
     glFinish();
+
+    // Offscreen: release the uploaded particles and the frame target before the context
+    if (pOffscreenContext != NULL)
+    {
+        glDeleteBuffers(1, &mParticlesBufferID);
+        glDeleteBuffers(1, &mCellsBufferID);
+        delete pFBO_Offscreen;
+        g_ScreenFBO.ID = 0;
+        delete pOffscreenContext;
+        return;
+    }
+
     glfwTerminate();
 }
 
@@ -88,9 +114,40 @@ void CVisual::initWindow(const string windowname)
     // Get frame size (apple retina makes the frame size X2 the window size)
     glfwGetFramebufferSize(mWindow, &mFrameWidth, &mFrameHeight);
 
+    initRenderStates();
+
+    // Check that things are fine
+    OGLU_CheckCoreError("initWindow (end)");
+}
+
+void CVisual::initOffscreen()
+{
+    // Create the context (no window, no display)
+    pOffscreenContext = new OffscreenContext();
+    pOffscreenContext->create();
+
+    glewInit();
+
+    // Frame size is the requested window size
+    mFrameWidth  = mWindowWidth;
+    mFrameHeight = mWindowHeight;
+
+    // Frame target (replaces the window framebuffer, see initSystemVisual)
+    pFBO_Offscreen = new FBO(1, true, mFrameWidth, mFrameHeight, GL_RGBA8);
+    glViewport(0, 0, mFrameWidth, mFrameHeight);
+
+    initRenderStates();
+
+    cout << "Offscreen rendering " << mFrameWidth << "x" << mFrameHeight << " (" << pOffscreenContext->renderer() << ")" << endl;
+
+    // Check that things are fine
+    OGLU_CheckCoreError("initOffscreen (end)");
+}
+
+void CVisual::initRenderStates()
+{
     pPrevTarget    = new FBO(1, true, mFrameWidth, mFrameHeight, GL_RGBA32F);
     pNextTarget    = new FBO(1, true, mFrameWidth, mFrameHeight, GL_RGBA32F);
-    pFBO_Thickness = new FBO(1, true, mFrameWidth, mFrameHeight, GL_R16UI);
 
     glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
     glEnable(GL_POINT_SPRITE);
@@ -99,9 +156,6 @@ void CVisual::initWindow(const string windowname)
     glEnable(GL_DEPTH_TEST);
     glDepthMask(GL_TRUE);
     glDepthFunc(GL_LEQUAL);
-
-    // Check that things are fine
-    OGLU_CheckCoreError("initWindow (end)");
 }
 
 
@@ -127,51 +181,93 @@ void CVisual::setupProjection()
     ZPR_Reset();
 }
 
-#define DivCeil(num, divider) ((num + divider - 1) / divider) 
-
-void CVisual::initImageBuffers()
+void CVisual::initCullBuffers()
 {
-    // Generate texture
-    mImgParticleVisible = OGLU_GenerateTexture(2048, DivCeil(Params.particleCount, 2048), GL_R32UI);
-    mImgGridChain       = OGLU_GenerateTexture(2048, DivCeil(Params.particleCount, 2048), GL_R32I);
-    mImgGrid            = OGLU_GenerateTexture(2048, 2048, GL_R32I);
-
-    // Bind texture to an image units (so we can write to it)
-    glBindImageTexture(0, mImgParticleVisible, 0, true, 0,  GL_READ_WRITE, GL_R32UI);
-    glBindImageTexture(1, mImgGridChain,       0, true, 0,  GL_READ_WRITE, GL_R32I);
-    glBindImageTexture(2, mImgGrid,            0, true, 0,  GL_READ_WRITE, GL_R32I);
+    // Release previous buffers (glDeleteBuffers ignores 0)
+    glDeleteBuffers(1, &mCullCommandBufferID);
+    glDeleteBuffers(1, &mCullIndicesBufferID);
+
+    // Indirect draw commands of the thinned and full lists (count, instanceCount, firstIndex, baseVertex, baseInstance)
+    glGenBuffers(1, &mCullCommandBufferID);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mCullCommandBufferID);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, 2 * 5 * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // Visible particles indices of both lists (up to the particles capacity, or the uploaded particles count)
+    mCullListCapacity = max(Params.particleCapacity, mParticlesCapacity);
+    glGenBuffers(1, &mCullIndicesBufferID);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, mCullIndicesBufferID);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * mCullListCapacity * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
 void CVisual::parametersChanged()
 {
-    initImageBuffers();
+    initCullBuffers();
 }
 
-void CVisual::initSystemVisual(Simulation &sim)
+void CVisual::initSystemVisual()
 {
-    mSimulation = &sim;
-
     OGLU_Init();
 
+    // Offscreen frame target stands for the window framebuffer
+    if (pFBO_Offscreen != NULL)
+        g_ScreenFBO.ID = pFBO_Offscreen->ID;
+
     setupProjection();
 }
 
+void CVisual::setParticleBuffers(GLuint positionsID, GLuint cellsID, cl_uint count)
+{
+    mParticlesBufferID = positionsID;
+    mCellsBufferID     = cellsID;
+    mParticlesCount    = count;
+}
+
+void CVisual::setParticles(const cl_float4 *positions, cl_uint count)
+{
+    if (mParticlesBufferID == 0)
+    {
+        glGenBuffers(1, &mParticlesBufferID);
+        glGenBuffers(1, &mCellsBufferID);
+    }
+
+    // The visible list follows the particles count
+    if (count > mParticlesCapacity)
+    {
+        mParticlesCapacity = count;
+        initCullBuffers();
+    }
+
+    // Sort by cell (the depth smoothing scans the cells ranges)
+    mParticleCells.Build(positions, count);
+
+    // Upload (orphans the previous frame data)
+    glBindBuffer(GL_ARRAY_BUFFER, mParticlesBufferID);
+    glBufferData(GL_ARRAY_BUFFER, count * sizeof(cl_float4), mParticleCells.positions.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, mCellsBufferID);
+    glBufferData(GL_ARRAY_BUFFER, mParticleCells.cells.size() * sizeof(cl_uint), mParticleCells.cells.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    mParticlesCount = count;
+}
+
 const string *CVisual::ShaderFileList()
 {
     static const string shaders[] =
     {
         "particles.vs",
         "particles_color.fs",
+        "particles_thickness.fs",
+        "particles_cull.cms",
         "standard.vs",
         "standard_copy.fs",
         "standard_color.fs",
         "standard_mesh.fs",
         "fluid_depth_smoothing.fs",
         "fluid_final_render.fs",
-        "grid_reset.cms",
-        "grid_chain_reset.cms",
-        "grid_build.cms",
-        "vis_scan.cms",
+        "fluid_smooth_filter.fs",
+        "fluid_upsample.fs",
         ""
     };
 
@@ -183,40 +279,19 @@ bool CVisual::initShaders()
     // Load Shaders
     bool bLoadOK = true;
     bLoadOK = bLoadOK && (mParticleProgID         = OGLU_LoadProgram("Particles",   getShaderSource("particles.vs"), getShaderSource("particles_color.fs")));
+    bLoadOK = bLoadOK && (mParticleThicknessProgID = OGLU_LoadProgram("Thickness",  getShaderSource("particles.vs"), getShaderSource("particles_thickness.fs")));
     bLoadOK = bLoadOK && (mFluidDepthSmoothProgID = OGLU_LoadProgram("DepthSmooth", getShaderSource("standard.vs"),  getShaderSource("fluid_depth_smoothing.fs")));
+    bLoadOK = bLoadOK && (mFluidSmoothFilterProgID = OGLU_LoadProgram("SmoothFilter", getShaderSource("standard.vs"), getShaderSource("fluid_smooth_filter.fs")));
+    bLoadOK = bLoadOK && (mFluidUpsampleProgID    = OGLU_LoadProgram("Upsample",    getShaderSource("standard.vs"),  getShaderSource("fluid_upsample.fs")));
     bLoadOK = bLoadOK && (mFluidFinalRenderProgID = OGLU_LoadProgram("FluidFinal",  getShaderSource("standard.vs"),  getShaderSource("fluid_final_render.fs")));
     bLoadOK = bLoadOK && (mStandardCopyProgID     = OGLU_LoadProgram("StdCopy",     getShaderSource("standard.vs"),  getShaderSource("standard_copy.fs")));
     bLoadOK = bLoadOK && (mStandardColorProgID    = OGLU_LoadProgram("StdColor",    getShaderSource("standard.vs"),  getShaderSource("standard_color.fs")));
     bLoadOK = bLoadOK && (mStandardMeshProgID     = OGLU_LoadProgram("StdMesh",     getShaderSource("standard.vs"),  getShaderSource("standard_mesh.fs")));
-    bLoadOK = bLoadOK && (mVisibleScanProgID      = OGLU_LoadProgram("VisScan",     getShaderSource("vis_scan.cms"), GL_COMPUTE_SHADER));
-    bLoadOK = bLoadOK && (mResetGridProgID        = OGLU_LoadProgram("GridReset",   getShaderSource("grid_reset.cms"), GL_COMPUTE_SHADER));
-    bLoadOK = bLoadOK && (mResetGridChainProgID   = OGLU_LoadProgram("GridChReset", getShaderSource("grid_chain_reset.cms"), GL_COMPUTE_SHADER));
-    bLoadOK = bLoadOK && (mBuildGridProgID        = OGLU_LoadProgram("GridBuild",   getShaderSource("grid_build.cms"), GL_COMPUTE_SHADER));
+    bLoadOK = bLoadOK && (mParticleCullProgID     = OGLU_LoadProgram("Cull",        getShaderSource("particles_cull.cms"), GL_COMPUTE_SHADER));
 
     // Set-up Render-Stange-Inspector
     OGSI_Setup(mStandardCopyProgID);
 
-    // Setup Unitforms
-    if (bLoadOK)
-    {
-        glUseProgram(g_SelectedProgram = mVisibleScanProgID);
-        glUniform1i(UniformLoc("destTex"),    0);
-
-        glUseProgram(g_SelectedProgram = mResetGridChainProgID);
-        glUniform1i(UniformLoc("grid_chain"), 1);
-
-        glUseProgram(g_SelectedProgram = mResetGridProgID);
-        glUniform1i(UniformLoc("grid"),       2);
-
-        glUseProgram(g_SelectedProgram = mBuildGridProgID);
-        glUniform1i(UniformLoc("grid_chain"), 1);
-        glUniform1i(UniformLoc("grid"),       2);
-
-        glUseProgram(g_SelectedProgram = mFluidDepthSmoothProgID);
-        glUniform1i(UniformLoc("grid_chain"), 1);
-        glUniform1i(UniformLoc("grid"),       2);
-    }
-
     return bLoadOK;
 }
 
@@ -239,12 +314,6 @@ GLuint CVisual::createSharingBuffer(const GLsizei size) const
     return bufferID;
 }
 
-GLuint CVisual::createSharingTexture(const GLsizei width, const GLsizei height) const
-{
-    GLuint texID = OGLU_GenerateTexture(width, height, GL_RGBA32F);
-    return texID;
-}
-
 void CVisual::swapTargets()
 {
     FBO* pTmp = pNextTarget;
@@ -253,25 +322,183 @@ void CVisual::swapTargets()
 }
 
 
+void CVisual::initSmoothTargets()
+{
+    // Reduced resolution size (full resolution if the scale is not set)
+    float scale = Params.fluidRenderScale;
+    if ((scale <= 0.0f) || (scale > 1.0f))
+        scale = 1.0f;
+    scale = max(scale, 0.1f);
+    const int width  = max((int)(mFrameWidth  * scale), 1);
+    const int height = max((int)(mFrameHeight * scale), 1);
+
+    // Nothing to do if the size is unchanged
+    if ((pFBO_Thickness != NULL) && (pFBO_Thickness->Width == width) && (pFBO_Thickness->Height == height))
+        return;
+
+    delete pFBO_Thickness;
+    delete pFBO_SmoothPing;
+    delete pFBO_SmoothPong;
+    pFBO_Thickness  = new FBO(2, false, width, height, GL_R32F);
+    pFBO_SmoothPing = new FBO(1, false, width, height, GL_RGBA32F);
+    pFBO_SmoothPong = new FBO(1, false, width, height, GL_RGBA32F);
+
+    // Thickness is sampled bilinearly by the final render
+    glBindTexture(GL_TEXTURE_2D, pFBO_SmoothPing->pColorTextureId[0]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void CVisual::cullParticles()
+{
+    // Frustum planes of the current camera (rows of the view-projection matrix, inside is positive)
+    const glm::mat4 viewProj = mProjectionMatrix * ZPR_ModelViewMatrix;
+    const glm::vec4 rowW(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+    glm::vec4 planes[6];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const glm::vec4 row(viewProj[0][axis], viewProj[1][axis], viewProj[2][axis], viewProj[3][axis]);
+        planes[axis * 2 + 0] = rowW + row;
+        planes[axis * 2 + 1] = rowW - row;
+    }
+    for (int p = 0; p < 6; p++)
+        planes[p] /= glm::length(glm::vec3(planes[p]));
+
+    // Empty the draw commands (the shader appends to the counts, the full list starts at mCullListCapacity)
+    const GLuint emptyCommands[2 * 5] = {0, 1, 0, 0, 0,   0, 1, mCullListCapacity, 0, 0};
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mCullCommandBufferID);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(emptyCommands), emptyCommands);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+    // Setup program
+    glUseProgram(g_SelectedProgram = mParticleCullProgID);
+    glUniformMatrix4fv(UniformLoc("viewProjMatrix"), 1, GL_FALSE, glm::value_ptr(viewProj));
+    glUniform4fv(UniformLoc("frustumPlanes"), 6, glm::value_ptr(planes[0]));
+    glUniform1ui(UniformLoc("particlesCount"), mParticlesCount);
+    glUniform1ui(UniformLoc("listCapacity"),   mCullListCapacity);
+    glUniform1f(UniformLoc("pointSize"),        Params.particleRenderSize);
+    glUniform1f(UniformLoc("widthOfNearPlane"), mWidthOfNearPlane);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mParticlesBufferID);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mCullCommandBufferID);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, mCullIndicesBufferID);
+    glDispatchCompute((mParticlesCount + 255) / 256, 1, 1);
+
+    // Indices and count are read by the draws
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT);
+}
+
+void CVisual::drawVisibleParticles(bool lod)
+{
+    // Bind positions buffer (indexed by the visible list, gl_VertexID stays the particle index)
+    glEnableVertexAttribArray(AttribLoc("position"));
+    glBindBuffer(GL_ARRAY_BUFFER, mParticlesBufferID);
+    glVertexAttribPointer(AttribLoc("position"), 4, GL_FLOAT, GL_FALSE, 0, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mCullIndicesBufferID);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, mCullCommandBufferID);
+
+    // Draw particles (second command for the full list)
+    glDrawElementsIndirect(GL_POINTS, GL_UNSIGNED_INT, (const void *)(lod ? 0 : 5 * sizeof(GLuint)));
+
+    // Unbind buffers
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glDisableVertexAttribArray(AttribLoc("position"));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CVisual::renderFluidThickness()
+{
+    // Thickness is summed, depth keeps the front most particle
+    const GLfloat noThickness = 0.0f;
+    const GLfloat noDepth     = 1.0f;
+    pFBO_Thickness->SetAsDrawTarget();
+    glClearBufferfv(GL_COLOR, 0, &noThickness);
+    glClearBufferfv(GL_COLOR, 1, &noDepth);
+
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glBlendEquationi(0, GL_FUNC_ADD);
+    glBlendEquationi(1, GL_MIN);
+
+    // Setup uniforms (point size is scaled to the reduced resolution)
+    glUseProgram(g_SelectedProgram = mParticleThicknessProgID);
+    glUniformMatrix4fv(UniformLoc("projectionMatrix"), 1, GL_FALSE, glm::value_ptr(mProjectionMatrix));
+    glUniformMatrix4fv(UniformLoc("modelViewMatrix"),  1, GL_FALSE, glm::value_ptr(ZPR_ModelViewMatrix));
+    glUniform1f(UniformLoc("widthOfNearPlane"), mWidthOfNearPlane * pFBO_Thickness->Width / mFrameWidth);
+    glUniform1f(UniformLoc("pointSize"),        Params.particleRenderSize);
+
+    // Draw particles (culled by cullParticles, not thinned: thickness is summed, dropped particles would thin it)
+    drawVisibleParticles(false);
+
+    // Restore states
+    glBlendEquation(GL_FUNC_ADD);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+}
+
 void CVisual::renderFluidSmoothDepth()
 {
-    pNextTarget->SetAsDrawTarget();
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    // Pixels without fluid keep the background
+    const GLfloat background[4] = {1.0f, 0.0f, 0.0f, 0.0f};
+    pFBO_SmoothPing->SetAsDrawTarget();
+    glClearBufferfv(GL_COLOR, 0, background);
 
     //ZPR_ModelViewMatrix = glm::inverse(ZPR_InvModelViewMatrix);
     ZPR_InvModelViewMatrix = glm::inverse(ZPR_ModelViewMatrix);
     glUseProgram(g_SelectedProgram = mFluidDepthSmoothProgID);
-    OGLU_BindTextureToUniform("depthTexture", 0, pPrevTarget->pColorTextureId[0]);
-    OGLU_BindTextureToUniform("particlesPos", 1, mSimulation->mSharedParticlesPos);
-    OGLU_BindTextureToUniform("visParticles", 2, mImgParticleVisible);
+    OGLU_BindTextureToUniform("depthTexture",     0, pFBO_Thickness->pColorTextureId[1]);
+    OGLU_BindTextureToUniform("thicknessTexture", 1, pFBO_Thickness->pColorTextureId[0]);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mParticlesBufferID);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, mCellsBufferID);
     glUniformMatrix4fv(UniformLoc("iMV_Matrix"), 1, GL_FALSE, glm::value_ptr(ZPR_InvModelViewMatrix));
     glUniformMatrix4fv(UniformLoc("MV_Matrix"),  1, GL_FALSE, glm::value_ptr(ZPR_ModelViewMatrix));
     glUniformMatrix4fv(UniformLoc("Proj_Matrix"), 1, GL_FALSE, glm::value_ptr(mProjectionMatrix));
     glUniform2f(UniformLoc("depthRange"), 0.1f, 1000.0f);
     glUniform2fv(UniformLoc("invFocalLen"), 1, glm::value_ptr(mInvFocalLen));
     glUniform1f(UniformLoc("smoothLength"), Params.h);
-    glUniform1i(UniformLoc("particlesCount"), Params.particleCount);
-    glUniform1ui(UniformLoc("currentCycleID"), mCycleID);
+    glUniform1ui(UniformLoc("gridBufSize"), Params.gridBufSize);
+    glUniform1ui(UniformLoc("cellCurve"), Params.cellCurve);
+    glUniform1ui(UniformLoc("cellCurveGranularity"), Params.cellCurveGranularity);
+
+    OGLU_RenderQuad(0, 0, 1.0, 1.0);
+}
+
+void CVisual::filterFluidSmooth()
+{
+    // Separable bilateral filter (radius is the projected smoothing length)
+    glUseProgram(g_SelectedProgram = mFluidSmoothFilterProgID);
+    glUniform2f(UniformLoc("depthRange"), 0.1f, 1000.0f);
+    glUniform1f(UniformLoc("smoothLength"), Params.h);
+    glUniform1f(UniformLoc("pixelsPerUnit"), mWidthOfNearPlane * pFBO_SmoothPing->Width / mFrameWidth);
+
+    // Horizontal pass (ping => pong)
+    pFBO_SmoothPong->SetAsDrawTarget();
+    OGLU_BindTextureToUniform("sourceTexture", 0, pFBO_SmoothPing->pColorTextureId[0]);
+    glUniform2i(UniformLoc("filterDirection"), 1, 0);
+    OGLU_RenderQuad(0, 0, 1.0, 1.0);
+
+    // Vertical pass (pong => ping)
+    pFBO_SmoothPing->SetAsDrawTarget();
+    OGLU_BindTextureToUniform("sourceTexture", 0, pFBO_SmoothPong->pColorTextureId[0]);
+    glUniform2i(UniformLoc("filterDirection"), 0, 1);
+    OGLU_RenderQuad(0, 0, 1.0, 1.0);
+}
+
+void CVisual::renderFluidUpsample()
+{
+    pNextTarget->SetAsDrawTarget();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Full resolution depth guides the upsampling of the filtered surface
+    glUseProgram(g_SelectedProgram = mFluidUpsampleProgID);
+    OGLU_BindTextureToUniform("depthTexture",  0, pPrevTarget->pDepthTextureId);
+    OGLU_BindTextureToUniform("smoothTexture", 1, pFBO_SmoothPing->pColorTextureId[0]);
+    glUniformMatrix4fv(UniformLoc("iMV_Matrix"), 1, GL_FALSE, glm::value_ptr(ZPR_InvModelViewMatrix));
+    glUniform2f(UniformLoc("depthRange"), 0.1f, 1000.0f);
+    glUniform2fv(UniformLoc("invFocalLen"), 1, glm::value_ptr(mInvFocalLen));
+    glUniform1f(UniformLoc("smoothLength"), Params.h);
 
     OGLU_RenderQuad(0, 0, 1.0, 1.0);
     swapTargets();
@@ -290,39 +517,7 @@ void CVisual::drawFullScreenTexture(GLuint textureID)
     OGLU_RenderQuad(0, 0, 1.0, 1.0);
 }
 
-void CVisual::scanForVisible(GLuint inputTexture)
-{
-    // Setup program
-    glUseProgram(g_SelectedProgram = mVisibleScanProgID);
-    glUniform1ui(UniformLoc("cycleID"), mCycleID);
-    OGLU_BindTextureToUniform("inputTexture", 0, inputTexture);
-    glDispatchCompute(mFrameWidth, mFrameHeight, 1);
-}
-
-void CVisual::buildGrid()
-{
-    // Reset grid
-    glUseProgram(g_SelectedProgram = mResetGridProgID);
-    glDispatchCompute(2048, 2048, 1);
-
-    // Reset grid chains
-    glUseProgram(g_SelectedProgram = mResetGridChainProgID);
-    glDispatchCompute(2048, DivCeil(Params.particleCount, 2048), 1);
-
-    // Build Grid
-    glUseProgram(g_SelectedProgram = mBuildGridProgID);
-    glUniform1ui(UniformLoc("currentCycleID"), mCycleID);
-    glUniform1ui(UniformLoc("particlesCount"), Params.particleCount);
-    glUniform1f (UniformLoc("smoothLength"), Params.h);
-    OGLU_BindTextureToUniform("visiblityMap", 0, mImgParticleVisible);
-    OGLU_BindTextureToUniform("particlesPos", 1, mSimulation->mSharedParticlesPos);
-    
-    glDispatchCompute(2048, DivCeil(Params.particleCount, 2048), 1);
-
-    if (OGSI_InspectTexture(mImgGrid, "Build Grid", 0)) return;
-}
-
-void CVisual::renderFluidFinal(GLuint depthTexture)
+void CVisual::renderFluidFinal(GLuint depthTexture, GLuint thicknessTexture)
 {
     // Copy Result to screen buffer
     g_ScreenFBO.SetAsDrawTarget();
@@ -330,6 +525,7 @@ void CVisual::renderFluidFinal(GLuint depthTexture)
 
     glUseProgram(g_SelectedProgram = mFluidFinalRenderProgID);
     OGLU_BindTextureToUniform("depthTexture", 0, depthTexture);
+    OGLU_BindTextureToUniform("thicknessTexture", 1, thicknessTexture);
     glUniformMatrix4fv(UniformLoc("invProjectionMatrix"), 1, GL_FALSE, glm::value_ptr(mInvProjectionMatrix));
     glUniformMatrix4fv(UniformLoc("iMV_Matrix"), 1, GL_FALSE, glm::value_ptr(ZPR_InvModelViewMatrix));
     glUniformMatrix4fv(UniformLoc("MV_Matrix"),  1, GL_FALSE, glm::value_ptr(ZPR_ModelViewMatrix));
@@ -357,6 +553,9 @@ void CVisual::renderMesh()
 
 void CVisual::renderParticles()
 {
+    // Frame stage (passes are nested sections)
+    OGLU_TIMING_SCOPE("Render Particles");
+
     // Increment cycleID
     mCycleID++;
 
@@ -366,76 +565,92 @@ void CVisual::renderParticles()
     // Clear target
     pNextTarget->SetAsDrawTarget();
 
-    OGLU_StartTimingSection("Clear FBO");
-    glClearColor(0, 0, 0, 0);
-    glClearDepth(1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    renderMesh();
-
-    // Setup Particle drawing
-    OGLU_StartTimingSection("Draw Particles");
-    glUseProgram(g_SelectedProgram = mParticleProgID);
-
-    // Setup uniforms
-    glUniformMatrix4fv(UniformLoc("projectionMatrix"), 1, GL_FALSE, glm::value_ptr(mProjectionMatrix));
-    glUniformMatrix4fv(UniformLoc("modelViewMatrix"),  1, GL_FALSE, glm::value_ptr(ZPR_ModelViewMatrix));
-    glUniformMatrix3fv(UniformLoc("normalMatrix"),     1, GL_FALSE, glm::value_ptr(glm::inverseTranspose(glm::mat3(ZPR_ModelViewMatrix))));
-    glUniform1i(UniformLoc("particleCount"),    Params.particleCount);
-    glUniform1i(UniformLoc("renderMethod"),     UICmd_RenderMode);
-    glUniform1f(UniformLoc("widthOfNearPlane"), mWidthOfNearPlane);
-    glUniform1f(UniformLoc("pointSize"),        Params.particleRenderSize);
-
-    // Bind positions buffer
-    glEnableVertexAttribArray(AttribLoc("position"));
-    glBindBuffer(GL_ARRAY_BUFFER, mSimulation->mSharedPingBufferID);
-    glVertexAttribPointer(AttribLoc("position"), 4, GL_FLOAT, GL_FALSE, 0, 0);
+    {
+        OGLU_TIMING_DETAIL_SCOPE("Clear FBO");
+        glClearColor(0, 0, 0, 0);
+        glClearDepth(1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glBindFragDataLocation(g_SelectedProgram, 0, "colorOut");
+        renderMesh();
+    }
 
-    // Draw particles
-    glDrawArrays(GL_POINTS, 0, Params.particleCount);
-    swapTargets();
+    // Cull particles (the visible lists are drawn by all particles passes)
+    {
+        OGLU_TIMING_DETAIL_SCOPE("Cull Particles");
+        cullParticles();
+    }
 
-    // Unbind buffer
-    glDisableVertexAttribArray(AttribLoc("position"));
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // Setup Particle drawing
+    {
+        OGLU_TIMING_DETAIL_SCOPE("Draw Particles");
+        glUseProgram(g_SelectedProgram = mParticleProgID);
+
+        // Setup uniforms
+        glUniformMatrix4fv(UniformLoc("projectionMatrix"), 1, GL_FALSE, glm::value_ptr(mProjectionMatrix));
+        glUniformMatrix4fv(UniformLoc("modelViewMatrix"),  1, GL_FALSE, glm::value_ptr(ZPR_ModelViewMatrix));
+        glUniformMatrix3fv(UniformLoc("normalMatrix"),     1, GL_FALSE, glm::value_ptr(glm::inverseTranspose(glm::mat3(ZPR_ModelViewMatrix))));
+        glUniform1i(UniformLoc("particleCount"),    mParticlesCount);
+        glUniform1i(UniformLoc("renderMethod"),     UICmd_RenderMode);
+        glUniform1f(UniformLoc("widthOfNearPlane"), mWidthOfNearPlane);
+        glUniform1f(UniformLoc("pointSize"),        Params.particleRenderSize);
+
+        glBindFragDataLocation(g_SelectedProgram, 0, "colorOut");
+
+        // Draw particles
+        drawVisibleParticles();
+        swapTargets();
+    }
 
     // Inspect
     if (OGSI_InspectTexture(pPrevTarget->pColorTextureId[0],  "Draw Particles [texture]", 0)) return;
     if (OGSI_InspectTexture(pPrevTarget->pDepthTextureId,     "Draw Particles [depth]",   1)) return;
-    if (OGSI_InspectTexture(mSimulation->mSharedParticlesPos, "ParticlePos",   0)) return;
 
     // Smooth fluid depth
     GLuint depthTexture = pPrevTarget->pDepthTextureId;
     if (UICmd_RenderMode == 0/*Smooth*/)
     {
-        // Scan for visible particles
-        OGLU_StartTimingSection("Scan for visible");
-        scanForVisible(pPrevTarget->pColorTextureId[0]);
-        if (OGSI_InspectTexture(mImgParticleVisible,    "VisImg",   0)) return;
-
-        // Build grid
-        OGLU_StartTimingSection("Build visual grid");
-        buildGrid();
-
-        // Render depth
-        OGLU_StartTimingSection("Render Depth Smooth");
-        renderFluidSmoothDepth();
-        if (OGSI_InspectTexture(pPrevTarget->pColorTextureId[0], "DepthSmooth [texture]", 0)) return;
-        if (OGSI_InspectTexture(pPrevTarget->pDepthTextureId, "DepthSmooth [depth]", 1)) return;
+        // Reduced resolution targets follow the frame size and Params.fluidRenderScale
+        initSmoothTargets();
+
+        // Particles thickness and front depth (reduced resolution)
+        {
+            OGLU_TIMING_DETAIL_SCOPE("Fluid Thickness");
+            renderFluidThickness();
+        }
+        if (OGSI_InspectTexture(pFBO_Thickness->pColorTextureId[0], "Thickness", 0)) return;
+
+        // Render depth (sampled from the simulation cells, see Simulation::resetCells)
+        {
+            OGLU_TIMING_DETAIL_SCOPE("Render Depth Smooth");
+            renderFluidSmoothDepth();
+        }
+        if (OGSI_InspectTexture(pFBO_SmoothPing->pColorTextureId[0], "DepthSmooth [texture]", 0)) return;
+
+        // Filter depth and thickness
+        {
+            OGLU_TIMING_DETAIL_SCOPE("Smooth Filter");
+            filterFluidSmooth();
+        }
+        if (OGSI_InspectTexture(pFBO_SmoothPing->pColorTextureId[0], "SmoothFilter [texture]", 0)) return;
+
+        // Back to full resolution
+        {
+            OGLU_TIMING_DETAIL_SCOPE("Upsample");
+            renderFluidUpsample();
+        }
+        if (OGSI_InspectTexture(pPrevTarget->pColorTextureId[0], "Upsample [texture]", 0)) return;
 
         // Change next step input to smoothed depth
         depthTexture = pPrevTarget->pColorTextureId[0];
 
         // Final fluid render
-        OGLU_StartTimingSection("Final Render");
-        renderFluidFinal(depthTexture);
+        OGLU_TIMING_DETAIL_SCOPE("Final Render");
+        renderFluidFinal(depthTexture, pFBO_SmoothPing->pColorTextureId[0]);
     }
     else
     {
         // Copy to screen
-        OGLU_StartTimingSection("Copy to Screen");
+        OGLU_TIMING_DETAIL_SCOPE("Copy to Screen");
 
         // Select output
         g_ScreenFBO.SetAsDrawTarget();
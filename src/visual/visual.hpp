@@ -8,6 +8,7 @@
 #include "../hesp.hpp"
 #include "../Resources.hpp"
 #include "../Simulation.hpp"
+#include "../ParticleCells.hpp"
 
 #include <GLFW/glfw3.h>
 
@@ -21,6 +22,8 @@
 #include <string>
 using std::string;
 
+class OffscreenContext;
+
 
 // Macros
 static const unsigned int DIM = 3;
@@ -44,13 +47,26 @@ public:
 private:
     void swapTargets();
 
+    void initRenderStates();
+
+    void initSmoothTargets();
+
+    void initCullBuffers();
+
+    void cullParticles();
+
+    // Thinned list (LOD) by default, the full visible list for summed passes (thickness)
+    void drawVisibleParticles(bool lod = true);
+
+    void renderFluidThickness();
+
     void renderFluidSmoothDepth();
 
-    void renderFluidFinal(GLuint depthTexture);
+    void filterFluidSmooth();
 
-    void scanForVisible(GLuint inputTexture);
+    void renderFluidUpsample();
 
-    void buildGrid();
+    void renderFluidFinal(GLuint depthTexture, GLuint thicknessTexture);
 
 public:
     // Default constructor
@@ -60,6 +76,9 @@ public:
 
     void initWindow(const string windowname = "GLFW Window");
 
+    // Render without a window (EGL surfaceless context, the frame is the offscreen target, see OffscreenContext)
+    void initOffscreen();
+
     static GLuint loadShaders(const string &vertexFilename, const string &fragmentFilename);
 
     const string *ShaderFileList();
@@ -68,11 +87,16 @@ public:
 
     void loadMesh();
 
-    void initImageBuffers();
-
     void setupProjection();
 
-    void initSystemVisual(Simulation &sim);
+    // Particles are given by setParticleBuffers or setParticles
+    void initSystemVisual();
+
+    // Draw shared buffers (simulation frame snapshots, see SimulationThread)
+    void setParticleBuffers(GLuint positionsID, GLuint cellsID, cl_uint count);
+
+    // Upload particles (offscreen rendering, the simulation buffers are not shared)
+    void setParticles(const cl_float4 *positions, cl_uint count);
 
     void parametersChanged();
 
@@ -86,8 +110,6 @@ public:
 
     GLuint createSharingBuffer(const GLsizei size) const;
 
-    GLuint createSharingTexture(const GLsizei width, const GLsizei height) const;
-
 public:
     GLFWwindow *mWindow;
 
@@ -110,23 +132,32 @@ private:
     // Rendering FBOs
     FBO *pPrevTarget;
     FBO *pNextTarget;
-    FBO *pFBO_Thickness;
 
-    // GL Store Textures
-    GLuint mImgParticleVisible;
-    GLuint mImgGridChain;
-    GLuint mImgGrid;
+    // Offscreen rendering (context and frame target, NULL with a window)
+    OffscreenContext *pOffscreenContext;
+    FBO              *pFBO_Offscreen;
+
+    // Reduced resolution fluid surface FBOs (see Params.fluidRenderScale)
+    FBO *pFBO_Thickness;  // Targets: 0=thickness, 1=front particles depth
+    FBO *pFBO_SmoothPing; // x=depth, y=thickness
+    FBO *pFBO_SmoothPong;
 
     GLuint mParticleProgID;
+    GLuint mParticleThicknessProgID;
+    GLuint mParticleCullProgID;
     GLuint mFluidFinalRenderProgID;
     GLuint mFluidDepthSmoothProgID;
+    GLuint mFluidSmoothFilterProgID;
+    GLuint mFluidUpsampleProgID;
     GLuint mStandardCopyProgID;
     GLuint mStandardColorProgID;
     GLuint mStandardMeshProgID;
-    GLuint mVisibleScanProgID;
-    GLuint mResetGridProgID;
-    GLuint mResetGridChainProgID;
-    GLuint mBuildGridProgID;
+
+    // Visible particles (indirect draw commands + indices, see particles_cull.cms): the LOD thinned list, then the
+    // full list at mCullListCapacity
+    GLuint mCullCommandBufferID;
+    GLuint mCullIndicesBufferID;
+    GLuint mCullListCapacity;
 
     // Projection related
     float mWidthOfNearPlane;
@@ -137,7 +168,12 @@ private:
     // System sizes
     GLuint mSystemBufferID;
 
-    Simulation *mSimulation;
+    // Rendered particles (simulation snapshot buffers, or uploaded by setParticles)
+    GLuint  mParticlesBufferID;
+    GLuint  mCellsBufferID;
+    cl_uint mParticlesCount;
+    cl_uint mParticlesCapacity;
+    ParticleCells mParticleCells;
 
     ParticleRenderType mRenderType;
 
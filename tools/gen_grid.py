@@ -1,3 +1,5 @@
+import struct
+
 name = 'dam_coarse'
 
 h = 1.0
@@ -32,6 +34,18 @@ for x in range(p_x):
 
 f.close()
 
+# Binary layout read by src/ParticlesFile.cpp: "PBFP", version, count, flags (1 = velocities follow)
+# followed by count float4 positions
+f = open(name+'.bin', 'wb')
+f.write(struct.pack('<4sIII', b'PBFP', 1, p, 0))
+
+for x in range(p_x):
+    for y in range(p_y):
+        for z in range(p_z):
+            f.write(struct.pack('<4f', min_x + x * s, min_y + y * s, min_z + z * s, 0))
+
+f.close()
+
 f = open(name+'.par', 'w')
 f.write("part_input_file       {}\n".format(name+'.in'))
 f.write("time_end              {}\n".format(1.0))